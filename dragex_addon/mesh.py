@@ -1,5 +1,6 @@
 import dataclasses
-from typing import TYPE_CHECKING, Optional, Sequence
+import functools
+from typing import TYPE_CHECKING, Any, Callable, Optional, Sequence
 
 import numpy as np
 
@@ -17,6 +18,10 @@ else:
         dragex_backend = None
 
 
+# Vertices transformed at once, bounding the size of the temporary arrays
+TRANSFORM_CHUNK_SIZE = 1 << 16
+
+
 @dataclasses.dataclass(frozen=True)
 class ImageKey:
     image: bpy.types.Image
@@ -195,27 +200,35 @@ def mesh_to_mesh_info(
     image_infos: ImageInfos,
     c_identifiers_prefix: str,
 ):
+    return mesh_to_mesh_info_deferred(
+        obj, mesh, transform, image_infos, c_identifiers_prefix
+    )()
+
+
+def mesh_to_mesh_info_deferred(
+    obj: bpy.types.Object,
+    mesh: bpy.types.Mesh,
+    transform: mathutils.Matrix,
+    image_infos: ImageInfos,
+    c_identifiers_prefix: str,
+) -> Callable[[], "dragex_backend.MeshInfo"]:
+    """Like mesh_to_mesh_info, see mesh_to_mesh_infos_general_deferred"""
     transform_per_vertex = np.zeros(len(mesh.vertices), dtype=np.uint)
     transforms = (transform,)
 
-    mesh.calc_loop_triangles()  # TODO is this costly? we call it twice
-
     submeshes = (
         SubMeshInfo(
-            tris_mask=np.ones(len(mesh.loop_triangles), dtype=bool),
+            tris_mask=None,
             c_identifiers_suffix="",
         ),
     )
 
-    buf_corners_material_index = util.new_uint_buf(len(mesh.loops))
-    buf_corners_material_index[:] = 0
-
     corner_material_infos = ()
     default_corner_material_info = dragex_backend.CornerMaterialInfo(
         limb_index=0,
     )
 
-    mesh_infos = mesh_to_mesh_infos_general(
+    create_mesh_infos = mesh_to_mesh_infos_general_deferred(
         obj,
         mesh,
         transform_per_vertex,
@@ -223,19 +236,20 @@ def mesh_to_mesh_info(
         image_infos,
         c_identifiers_prefix,
         submeshes,
-        buf_corners_material_index,
+        None,
         corner_material_infos,
         default_corner_material_info,
     )
 
-    assert len(mesh_infos) == 1, mesh_infos
+    assert len(create_mesh_infos) == 1, create_mesh_infos
 
-    return mesh_infos[0]
+    return create_mesh_infos[0]
 
 
 @dataclasses.dataclass
 class SubMeshInfo:
-    tris_mask: np.ndarray
+    # None for all the triangles
+    tris_mask: Optional[np.ndarray]
     c_identifiers_suffix: str
 
 
@@ -247,59 +261,71 @@ def mesh_to_mesh_infos_general(
     image_infos: ImageInfos,
     c_identifiers_prefix: str,
     submeshes: Sequence[SubMeshInfo],
-    buf_corners_material_index: np.ndarray,
+    # None for all zeros
+    buf_corners_material_index: Optional[np.ndarray],
     corner_material_infos: Sequence["dragex_backend.CornerMaterialInfo"],
     default_corner_material_info: "dragex_backend.CornerMaterialInfo",
 ):
+    return [
+        create_mesh_info()
+        for create_mesh_info in mesh_to_mesh_infos_general_deferred(
+            obj,
+            mesh,
+            transform_per_vertex,
+            transforms,
+            image_infos,
+            c_identifiers_prefix,
+            submeshes,
+            buf_corners_material_index,
+            corner_material_infos,
+            default_corner_material_info,
+        )
+    ]
+
+
+def mesh_to_mesh_infos_general_deferred(
+    obj: bpy.types.Object,
+    mesh: bpy.types.Mesh,
+    transform_per_vertex: np.ndarray,
+    transforms: Sequence[mathutils.Matrix],
+    image_infos: ImageInfos,
+    c_identifiers_prefix: str,
+    submeshes: Sequence[SubMeshInfo],
+    # None for all zeros
+    buf_corners_material_index: Optional[np.ndarray],
+    corner_material_infos: Sequence["dragex_backend.CornerMaterialInfo"],
+    default_corner_material_info: "dragex_backend.CornerMaterialInfo",
+) -> list[Callable[[], "dragex_backend.MeshInfo"]]:
+    """Gather the mesh data from Blender, without creating the MeshInfo objects.
+
+    Returns one callable per submesh, which creates the MeshInfo.
+    The callables don't use bpy and create_MeshInfo releases the GIL,
+    so they can run concurrently in worker threads (bpy must only be used from
+    the main thread).
+    """
     # note: if size is too small, error is undescriptive:
     # "RuntimeError: internal error setting the array"
-    buf_vertices_co = util.new_float_buf(3 * len(mesh.vertices))
-    mesh.vertices.foreach_get("co", buf_vertices_co)
     mesh.calc_loop_triangles()
-    buf_triangles_loops = util.new_uint_buf(3 * len(mesh.loop_triangles))
-    buf_triangles_loops_Nx3 = buf_triangles_loops.reshape((len(mesh.loop_triangles), 3))
-    buf_triangles_material_index = util.new_uint_buf(len(mesh.loop_triangles))
     mesh.loop_triangles[0].loops
     mesh.loop_triangles[0].material_index
-    mesh.loop_triangles.foreach_get("loops", buf_triangles_loops)
-    mesh.loop_triangles.foreach_get("material_index", buf_triangles_material_index)
     mesh.loops[0].vertex_index
     mesh.loops[0].normal
-    buf_loops_vertex_index = util.new_uint_buf(len(mesh.loops))
-    buf_loops_normal = util.new_float_buf(3 * len(mesh.loops))
-    mesh.loops.foreach_get("vertex_index", buf_loops_vertex_index)
-    mesh.loops.foreach_get("normal", buf_loops_normal)
-
-    buf_vertices_co_Nx3 = buf_vertices_co.reshape((len(mesh.vertices), 3))
-    buf_vertices_co_3xN = buf_vertices_co_Nx3.T
-
-    buf_loops_normal_3xN = buf_loops_normal.reshape((len(mesh.loops), 3)).T
 
     if not set(transform_per_vertex).issubset(range(len(transforms))):
         raise Exception("There are vertices for which no transform is provided")
 
+    transforms_np = list[tuple[np.ndarray, np.ndarray]]()
     for i_transform, transform in enumerate(transforms):
         transform = transform.to_4x4()
         if transform[3] != mathutils.Vector((0, 0, 0, 1)):
             raise Exception("Unexpected transform", i_transform, transform)
-        transform3 = transform.to_3x3()
-        transform3_np = np.array(transform3)
-        transform_translation = transform.translation
-        transform_translation_np = np.array(transform_translation)
-
-        # TODO make faster using np.matmul(out=) and np.add(out=)
-        buf_vertices_co_3xN[:, transform_per_vertex == i_transform] = (
-            (
-                transform3_np
-                @ buf_vertices_co_3xN[:, transform_per_vertex == i_transform]
-            ).T
-            + transform_translation_np
-        ).T
+        transforms_np.append(
+            (np.array(transform.to_3x3()), np.array(transform.translation))
+        )
 
     active_color_attribute = mesh.color_attributes.active_color
     if active_color_attribute is None:
-        buf_corners_color = None
-        buf_points_color = None
+        color_domain = None
     else:
         if active_color_attribute.data_type in {"FLOAT_COLOR", "BYTE_COLOR"}:
             assert isinstance(
@@ -310,25 +336,73 @@ def mesh_to_mesh_infos_general(
                 ),
             )
             # Note: for ByteColorAttribute too the color uses floats
-            if active_color_attribute.domain == "CORNER":
-                buf_corners_color = util.new_float_buf(4 * len(mesh.loops))
-                active_color_attribute.data.foreach_get("color", buf_corners_color)
-                buf_points_color = None
-            elif active_color_attribute.domain == "POINT":
-                buf_corners_color = None
-                buf_points_color = util.new_float_buf(4 * len(mesh.vertices))
-                active_color_attribute.data.foreach_get("color", buf_points_color)
-            else:
-                raise NotImplementedError(active_color_attribute.domain)
+            color_domain = active_color_attribute.domain
+            if color_domain not in {"CORNER", "POINT"}:
+                raise NotImplementedError(color_domain)
         else:
             raise NotImplementedError(active_color_attribute.data_type)
 
     active_uv_layer = mesh.uv_layers.active
-    if active_uv_layer is None:
-        buf_loops_uv = None
+
+    # The builder holds the only copy of the mesh data, which the MeshInfo
+    # objects reference. foreach_get writes each attribute straight into the
+    # builder's memory through append_view, and the vertices are transformed
+    # there chunk by chunk.
+    builder = dragex_backend.MeshInfoBuilder(
+        len(mesh.vertices),
+        len(mesh.loops),
+        len(mesh.loop_triangles),
+        color_domain == "POINT",
+        color_domain == "CORNER",
+        active_uv_layer is not None,
+    )
+
+    buf_vertices_co = np.asarray(
+        builder.append_view("vertices_co", 3 * len(mesh.vertices))
+    )
+    mesh.vertices.foreach_get("co", buf_vertices_co)
+    buf_vertices_co_Nx3 = buf_vertices_co.reshape((len(mesh.vertices), 3))
+    for start in range(0, len(mesh.vertices), TRANSFORM_CHUNK_SIZE):
+        chunk_co = buf_vertices_co_Nx3[start : start + TRANSFORM_CHUNK_SIZE]
+        chunk_transform_per_vertex = transform_per_vertex[
+            start : start + TRANSFORM_CHUNK_SIZE
+        ]
+        for i_transform, (transform3_np, transform_translation_np) in enumerate(
+            transforms_np
+        ):
+            mask = chunk_transform_per_vertex == i_transform
+            chunk_co[mask] = chunk_co[mask] @ transform3_np.T + transform_translation_np
+    del buf_vertices_co, buf_vertices_co_Nx3
+
+    attributes: list[tuple[str, Any, str, int]] = [
+        ("triangles_loops", mesh.loop_triangles, "loops", 3),
+        ("triangles_material_index", mesh.loop_triangles, "material_index", 1),
+        ("loops_vertex_index", mesh.loops, "vertex_index", 1),
+        ("loops_normal", mesh.loops, "normal", 3),
+    ]
+    if color_domain is not None:
+        attributes.append(
+            (
+                "corners_color" if color_domain == "CORNER" else "points_color",
+                active_color_attribute.data,
+                "color",
+                4,
+            )
+        )
+    if active_uv_layer is not None:
+        attributes.append(("loops_uv", active_uv_layer.uv, "vector", 2))
+    for attr_name, collection, prop, n_components in attributes:
+        buf = np.asarray(
+            builder.append_view(attr_name, n_components * len(collection))
+        )
+        collection.foreach_get(prop, buf)
+        del buf
+    buf = np.asarray(builder.append_view("corners_material_index", len(mesh.loops)))
+    if buf_corners_material_index is None:
+        buf[:] = 0
     else:
-        buf_loops_uv = util.new_float_buf(2 * len(mesh.loops))
-        active_uv_layer.uv.foreach_get("vector", buf_loops_uv)
+        buf[:] = buf_corners_material_index
+    del buf
 
     material_infos = list[dragex_backend.MaterialInfo | None]()
     for mat_index in range(len(obj.material_slots)):
@@ -458,28 +532,26 @@ def mesh_to_mesh_infos_general(
         ),
     )
 
-    mesh_infos_list: list[dragex_backend.MeshInfo] = []
+    create_mesh_infos: list[Callable[[], dragex_backend.MeshInfo]] = []
 
+    # The MeshInfo objects of the submeshes share the builder's buffers
     for submesh_info in submeshes:
-        mesh_info = dragex_backend.create_MeshInfo(
+        create_mesh_info = functools.partial(
+            builder.create_MeshInfo,
             (
                 c_identifiers_prefix
                 + util.make_c_identifier(obj.name)
                 + submesh_info.c_identifiers_suffix
             ),
-            buf_vertices_co,
-            buf_triangles_loops_Nx3[submesh_info.tris_mask, :].ravel(),
-            buf_triangles_material_index[submesh_info.tris_mask],
-            buf_loops_vertex_index,
-            buf_loops_normal,
-            buf_corners_color,
-            buf_points_color,
-            buf_loops_uv,
-            buf_corners_material_index,
+            (
+                None
+                if submesh_info.tris_mask is None
+                else np.flatnonzero(submesh_info.tris_mask).astype(np.uint32)
+            ),
             material_infos,
             default_material_info,
             corner_material_infos,
             default_corner_material_info,
         )
-        mesh_infos_list.append(mesh_info)
-    return mesh_infos_list
+        create_mesh_infos.append(create_mesh_info)
+    return create_mesh_infos
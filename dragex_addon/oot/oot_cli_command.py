@@ -54,6 +54,7 @@ class Catalog:
 def export_catalog(
     catalog: Catalog,
     repo_root_p: Optional[Path] = None,
+    profile: bool = False,
 ):
     scene = bpy.context.scene
     assert scene is not None
@@ -75,6 +76,7 @@ def export_catalog(
             export_map_entry.to,
             scene,
             decomp_repo_p,
+            profile,
         )
 
     for export_skeleton_entry in catalog.export_skeletons:
@@ -173,6 +175,7 @@ def run_oot_command(args):
     export_catalog(
         catalog,
         Path(args.repo_root) if args.repo_root is not None else None,
+        args.profile,
     )
     return 0
 
@@ -191,6 +194,11 @@ def add_subparser(subparsers):
             "Defaults to a parent folder where spec is found"
         ),
     )
+    oot_parser.add_argument(
+        "--profile",
+        action="store_true",
+        help="Print where the time was spent exporting each map",
+    )
     oot_parser.add_argument(
         "catalog",
         help="The catalog.toml file containing information on what to export",
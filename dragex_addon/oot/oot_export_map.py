@@ -1,8 +1,11 @@
 import abc
 from collections.abc import Sequence
+import concurrent.futures
 import dataclasses
+import functools
 import math
 from pathlib import Path, PurePosixPath
+import time
 from typing import TYPE_CHECKING
 
 import numpy as np
@@ -27,6 +30,17 @@ def mesh_to_OoTCollisionMesh(
     mesh: bpy.types.Mesh,
     transform: mathutils.Matrix,
 ):
+    return mesh_to_OoTCollisionMesh_deferred(obj, mesh, transform)()
+
+
+def mesh_to_OoTCollisionMesh_deferred(
+    obj: bpy.types.Object,
+    mesh: bpy.types.Mesh,
+    transform: mathutils.Matrix,
+):
+    """Gather the mesh data from Blender, and return a callable creating the
+    OoTCollisionMesh which can run in a worker thread.
+    """
     print(f"{transform=}")
     if transform[3] != mathutils.Vector((0, 0, 0, 1)):
         raise Exception("Unexpected transform", transform)
@@ -65,7 +79,8 @@ def mesh_to_OoTCollisionMesh(
 
     default_material = dragex_backend.OoTCollisionMaterial(name="DEFAULT")
 
-    collision_mesh = dragex_backend.create_OoTCollisionMesh(
+    create_collision_mesh = functools.partial(
+        dragex_backend.create_OoTCollisionMesh,
         buf_vertices_co,
         buf_triangles_loops,
         buf_triangles_material_index,
@@ -74,7 +89,7 @@ def mesh_to_OoTCollisionMesh(
         default_material,
     )
 
-    return collision_mesh
+    return create_collision_mesh
 
 
 @dataclasses.dataclass(eq=False)
@@ -137,63 +152,106 @@ def collect_map(coll_scene: bpy.types.Collection, export_options: "ExportOptions
             + ", ".join(map(str, sorted(expected_room_numbers - room_colls.keys())))
         )
 
-    rooms = list[OoTRoom]()
-
-    for i in range(n_rooms):
-        room_coll = room_colls[i]
-        room_c_identifier = util.make_c_identifier(room_coll.name)
-        room_coll_dragex = util.DRAGEX(room_coll)
-        entries_opa = list[dragex_backend.MeshInfo]()
-        entries_xlu = list[dragex_backend.MeshInfo]()
-        image_infos = mesh.ImageInfos()
-        for obj in room_coll.all_objects:
-            if obj.type == "EMPTY":
-                obj_dragex = util.DRAGEX(obj)
-                ...
+    # Blender data is only accessed from this thread, the MeshInfo and
+    # OoTCollisionMesh objects are created by the worker threads.
+    with concurrent.futures.ThreadPoolExecutor() as executor:
+        rooms_futures = list[
+            tuple[
+                str,
+                mesh.ImageInfos,
+                list[concurrent.futures.Future[dragex_backend.MeshInfo]],
+                list[concurrent.futures.Future[dragex_backend.MeshInfo]],
+            ]
+        ]()
+
+        for i in range(n_rooms):
+            room_coll = room_colls[i]
+            room_c_identifier = util.make_c_identifier(room_coll.name)
+            room_coll_dragex = util.DRAGEX(room_coll)
+            entries_opa_futures = list[
+                concurrent.futures.Future[dragex_backend.MeshInfo]
+            ]()
+            entries_xlu_futures = list[
+                concurrent.futures.Future[dragex_backend.MeshInfo]
+            ]()
+            image_infos = mesh.ImageInfos()
+            for obj in room_coll.all_objects:
+                if obj.type == "EMPTY":
+                    obj_dragex = util.DRAGEX(obj)
+                    ...
+                if obj.type == "MESH":
+                    assert isinstance(obj.data, bpy.types.Mesh)
+                    mesh_dragex = util.DRAGEX(obj.data)
+                    # TODO this is inefficient if mesh is shared between rooms
+                    create_mesh_info = mesh.mesh_to_mesh_info_deferred(
+                        obj,
+                        obj.data,
+                        # TODO test more with different matrix_world
+                        export_options.transform @ obj.matrix_world,
+                        image_infos,
+                        f"{scene_c_identifier}_{room_c_identifier}_",
+                    )
+                    mesh_info_future = executor.submit(create_mesh_info)
+                    if mesh_dragex.oot.draw_layer == "OPA":
+                        entries_opa_futures.append(mesh_info_future)
+                    else:
+                        entries_xlu_futures.append(mesh_info_future)
+
+            rooms_futures.append(
+                (
+                    room_c_identifier,
+                    image_infos,
+                    entries_opa_futures,
+                    entries_xlu_futures,
+                )
+            )
+
+        collision_meshes_futures = list[
+            concurrent.futures.Future[dragex_backend.OoTCollisionMesh]
+        ]()
+        for obj in coll_scene.all_objects:
             if obj.type == "MESH":
                 assert isinstance(obj.data, bpy.types.Mesh)
                 mesh_dragex = util.DRAGEX(obj.data)
-                # TODO this is inefficient if mesh is shared between rooms
-                mesh_info = mesh.mesh_to_mesh_info(
+                if mesh_dragex.oot.ignore_collision:
+                    continue
+                create_collision_mesh = mesh_to_OoTCollisionMesh_deferred(
                     obj,
                     obj.data,
                     # TODO test more with different matrix_world
                     export_options.transform @ obj.matrix_world,
-                    image_infos,
-                    f"{scene_c_identifier}_{room_c_identifier}_",
                 )
-                if mesh_dragex.oot.draw_layer == "OPA":
-                    entries_opa.append(mesh_info)
-                else:
-                    entries_xlu.append(mesh_info)
-
-        shape = OoTRoomShapeNormal(
-            image_infos=image_infos,
-            entries_opa=entries_opa,
-            entries_xlu=entries_xlu,
-        )
+                collision_meshes_futures.append(
+                    executor.submit(create_collision_mesh)
+                )
 
-        room = OoTRoom(
-            c_identifier=room_c_identifier,
-            shape=shape,
-        )
-        rooms.append(room)
+        rooms = list[OoTRoom]()
+
+        for (
+            room_c_identifier,
+            image_infos,
+            entries_opa_futures,
+            entries_xlu_futures,
+        ) in rooms_futures:
+            shape = OoTRoomShapeNormal(
+                image_infos=image_infos,
+                entries_opa=[_f.result() for _f in entries_opa_futures],
+                entries_xlu=[_f.result() for _f in entries_xlu_futures],
+            )
 
-    collision_meshes = list[dragex_backend.OoTCollisionMesh]()
-    for obj in coll_scene.all_objects:
-        if obj.type == "MESH":
-            assert isinstance(obj.data, bpy.types.Mesh)
-            mesh_dragex = util.DRAGEX(obj.data)
-            if mesh_dragex.oot.ignore_collision:
-                continue
-            collision_mesh = mesh_to_OoTCollisionMesh(
-                obj,
-                obj.data,
-                # TODO test more with different matrix_world
-                export_options.transform @ obj.matrix_world,
+            room = OoTRoom(
+                c_identifier=room_c_identifier,
+                shape=shape,
             )
-            collision_meshes.append(collision_mesh)
+            rooms.append(room)
+
+        collision_meshes = [_f.result() for _f in collision_meshes_futures]
+
     collision = dragex_backend.join_OoTCollisionMeshes(collision_meshes)
+    if export_options.collision_simplify_tolerance is not None:
+        collision = dragex_backend.simplify_OoTCollisionMesh(
+            collision, export_options.collision_simplify_tolerance
+        )
 
     positions = dict[str, tuple[int, int, int]]()
     rotations_yxz = dict[str, mathutils.Euler]()
@@ -249,6 +307,49 @@ def collect_map(coll_scene: bpy.types.Collection, export_options: "ExportOptions
 class ExportOptions:
     transform: mathutils.Matrix
     decomp_repo_p: Path
+    # None to not simplify the collision
+    collision_simplify_tolerance: float | None = None
+    collision_spatial_sort: bool = False
+
+
+def print_collision_subdivision_report(bounds: dragex_backend.OoTCollisionBounds):
+    stats = bounds.subdivision_stats
+    # only the candidates no other candidate beats in both memory and speed
+    pareto = [
+        st
+        for st in stats
+        if not any(
+            (other["mem_size"] <= st["mem_size"])
+            and (other["mean_polys"] <= st["mean_polys"])
+            and (other["mem_size"], other["mean_polys"])
+            != (st["mem_size"], st["mean_polys"])
+            for other in stats
+        )
+    ]
+    shown = sorted(
+        pareto
+        + [
+            st
+            for st in stats
+            if st["amount"] in (bounds.subdivision, bounds.default_subdivision)
+            and st not in pareto
+        ],
+        key=lambda st: st["mem_size"],
+    )
+    print("BgCheck subdivision amounts (polys per cell are upper bounds):")
+    print("  amount           memory   nodes  mean polys  max polys")
+    for st in shown:
+        x, y, z = st["amount"]
+        note = ""
+        if st["amount"] == bounds.subdivision:
+            note += " recommended"
+        if st["amount"] == bounds.default_subdivision:
+            note += " default"
+        print(
+            f"  {x:>3} {y:>3} {z:>3}  {st['mem_size']:>10}"
+            f"  {st['n_nodes']:>6}  {st['mean_polys']:>10.1f}"
+            f"  {st['max_polys']:>9}{note}"
+        )
 
 
 def export_coll_scene_impl(
@@ -297,12 +398,19 @@ def export_coll_scene_impl(
             col_vtx_list_name,
             col_poly_list_name,
             col_surface_types_name,
+            0,  # weld_epsilon
+            export_options.collision_spatial_sort,
         )
 
+        print_collision_subdivision_report(collision_bounds)
+
         with open(collision_inc_c_fd, "w", closefd=False) as f:
             collision_bounds_min = collision_bounds.min
             collision_bounds_max = collision_bounds.max
+            subdivision = collision_bounds.subdivision
             f.write(
+                "// Recommended BgCheck subdivision amounts:"
+                f" {{ {subdivision[0]}, {subdivision[1]}, {subdivision[2]} }}\n"
                 f"CollisionHeader {col_header_name} = "
                 "{\n"
                 "    {"
@@ -398,13 +506,32 @@ extern RoomShapeNormal {room_shape_name};
             if isinstance(room_shape, OoTRoomShapeNormal):
                 opa_dlists_names = list[str]()
                 xlu_dlists_names = list[str]()
+                # identical vertices and materials of the room's meshes are
+                # written once, and materials only change the state left by
+                # the previous one in each display list. Within opaque
+                # meshes, the order of the depth-tested opaque materials is
+                # picked to change less state. Decal and blended materials can
+                # still be on the OPA layer, and keep their order
+                vtx_pool = dragex_backend.VtxPool(
+                    f"{map_prefix_lower}_{room.c_identifier}_Vtx"
+                )
+                mat_registry = dragex_backend.MaterialRegistry()
+                dl_costs = list[tuple[str, dict[str, float]]]()
                 for mi in room_shape.entries_opa:
                     # TODO batch the fopen() inside write_c by passing a list of MeshInfo to dragex_backend instead
-                    dl_name = mi.write_c(room_fd, ())
+                    dl_name, dl_cost = mi.write_c(
+                        room_fd, (), vtx_pool, mat_registry, True, True
+                    )
                     opa_dlists_names.append(dl_name)
+                    dl_costs.append((dl_name, dl_cost))
                 for mi in room_shape.entries_xlu:
-                    dl_name = mi.write_c(room_fd, ())
+                    dl_name, dl_cost = mi.write_c(
+                        room_fd, (), vtx_pool, mat_registry, True
+                    )
                     xlu_dlists_names.append(dl_name)
+                    dl_costs.append((dl_name, dl_cost))
+                vtx_pool.write_c(room_fd)
+                print_dl_costs(room.c_identifier, dl_costs)
 
                 if len(opa_dlists_names) < len(xlu_dlists_names):
                     opa_dlists_names += ["NULL"] * (
@@ -570,12 +697,46 @@ extern RoomShapeNormal {room_shape_name};
     )
 
 
+def print_dl_costs(title: str, dl_costs: list[tuple[str, dict[str, float]]]):
+    total = dict[str, float]()
+    for _, cost in dl_costs:
+        for name, value in cost.items():
+            total[name] = total.get(name, 0) + value
+    print(f"Display lists cost estimate of {title}:")
+    for name, value in total.items():
+        print(f"  {name:<24}{value:12.0f}")
+    # the most expensive display lists, to find what to optimize
+    by_cost = sorted(dl_costs, key=lambda dc: -(dc[1]["rsp_cost"] + dc[1]["rdp_cost"]))
+    for dl_name, cost in by_cost[:5]:
+        print(
+            f"  {dl_name:<40}"
+            f" rsp {cost['rsp_cost']:10.0f} rdp {cost['rdp_cost']:10.0f}"
+        )
+
+
+def print_export_profile(title: str, wall_seconds: float):
+    stats = dragex_backend.get_export_stats()
+    stages = stats["stages"]
+    # stage times are summed over the backend threads
+    total_seconds = sum(stages.values())
+    print(f"Export profile of {title}: {wall_seconds * 1000:.1f} ms wall clock")
+    for name, seconds in sorted(stages.items(), key=lambda kv: -kv[1]):
+        share = seconds / total_seconds * 100 if total_seconds != 0 else 0
+        print(f"  {name:<24}{seconds * 1000:10.1f} ms {share:5.1f}%")
+    for name, count in stats["counters"].items():
+        print(f"  {name:<24}{count:10}")
+
+
 def export_coll_scene(
     coll_scene_to_export: bpy.types.Collection,
     export_directory: Path,
     scene: bpy.types.Scene,
     decomp_repo_p: Path,
+    profile: bool = False,
 ):
+    if profile:
+        dragex_backend.reset_export_stats()
+        start = time.perf_counter()
     export_coll_scene_impl(
         coll_scene_to_export,
         export_directory,
@@ -585,5 +746,13 @@ def export_coll_scene(
                 @ mathutils.Matrix.Scale(1 / util.DRAGEX(scene).oot.scale, 4)
             ),
             decomp_repo_p=decomp_repo_p,
+            collision_simplify_tolerance=(
+                util.DRAGEX(scene).oot.collision_simplify_tolerance
+                if util.DRAGEX(scene).oot.collision_simplify
+                else None
+            ),
+            collision_spatial_sort=util.DRAGEX(scene).oot.collision_spatial_sort,
         ),
     )
+    if profile:
+        print_export_profile(coll_scene_to_export.name, time.perf_counter() - start)
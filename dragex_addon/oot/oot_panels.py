@@ -48,6 +48,11 @@ class DragExOoTPanel(bpy.types.Panel):
         assert scene is not None
         scene_dragex = util.DRAGEX(scene)
         self.layout.prop(scene_dragex.oot, "scale")
+        self.layout.prop(scene_dragex.oot, "collision_simplify")
+        row = self.layout.row()
+        row.enabled = scene_dragex.oot.collision_simplify
+        row.prop(scene_dragex.oot, "collision_simplify_tolerance")
+        self.layout.prop(scene_dragex.oot, "collision_spatial_sort")
         self.layout.operator(oot_ops.DragExOoTExportDListOperator.bl_idname)
         self.layout.operator(oot_ops.DragExOoTNewSceneOperator.bl_idname)
         self.layout.operator(oot_ops.DragExOoTExportSceneOperator.bl_idname)
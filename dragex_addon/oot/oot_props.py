@@ -49,6 +49,31 @@ class DragExSceneOoTProperties(bpy.types.PropertyGroup):
         ),
         default=0.01,
     )
+    collision_simplify: bpy.props.BoolProperty(
+        name="Simplify Collision",
+        description=(
+            "Merge coplanar or nearly coplanar collision triangles "
+            "with the same surface type when exporting"
+        ),
+        default=False,
+    )
+    collision_simplify_tolerance: bpy.props.FloatProperty(
+        name="Tolerance",
+        description=(
+            "How far in OoT units the collision surface may move when "
+            "simplifying. 0 only merges exactly coplanar triangles"
+        ),
+        min=0,
+        default=0,
+    )
+    collision_spatial_sort: bpy.props.BoolProperty(
+        name="Sort Collision Spatially",
+        description=(
+            "Write collision triangles and vertices in an order following "
+            "their position, so nearby triangles are near each other in memory"
+        ),
+        default=False,
+    )
 
 
 def validate_export_pos_name(self, context):
@@ -1,3 +1,4 @@
+import concurrent.futures
 import dataclasses
 import math
 from pathlib import Path, PurePosixPath
@@ -138,77 +139,92 @@ def export_skeleton_impl(
     skeleton_c_identifier = util.make_c_identifier(armature_object.name)
 
     image_infos = mesh.ImageInfos()
-    mesh_infos_by_limb: dict[int, list[dragex_backend.MeshInfo]] = {}
-    for mesh_obj in mesh_objects:
-        dragex_backend.logging.debug(f"{mesh_obj}")
-        limb_index_by_group_index = {
-            _g.index: limb_index_by_bone_name[_g.name]
-            for _g in mesh_obj.vertex_groups
-            if _g.name in limb_index_by_bone_name
-        }
-        dragex_backend.logging.debug(f"{limb_index_by_group_index=}")
-        assert isinstance(mesh_obj.data, bpy.types.Mesh)
-
-        limb_index_per_vertex = np.empty(len(mesh_obj.data.vertices), dtype=np.uint)
-        for v in mesh_obj.data.vertices:
-            v_groups = sorted(
-                (_g for _g in v.groups if _g.group in limb_index_by_group_index),
-                key=lambda _g: _g.weight,
-                reverse=True,
-            )
-            is_unassigned = (
-                len(v_groups) == 0 or v_groups[0].weight < 1 - weight_epsilon
-            )
-            is_multiassigned = (
-                len(v_groups) >= 2 and v_groups[1].weight > weight_epsilon
-            )
-            assert not is_unassigned, "unassigned vertex"
-            assert not is_multiassigned, "multi-assigned vertex"
-            limb_index_per_vertex[v.index] = limb_index_by_group_index[
-                v_groups[0].group
+    # The MeshInfo objects are created by worker threads, Blender data is only
+    # accessed from this thread.
+    with concurrent.futures.ThreadPoolExecutor() as executor:
+        mesh_info_futures_by_limb: dict[
+            int, list[concurrent.futures.Future[dragex_backend.MeshInfo]]
+        ] = {}
+        for mesh_obj in mesh_objects:
+            dragex_backend.logging.debug(f"{mesh_obj}")
+            limb_index_by_group_index = {
+                _g.index: limb_index_by_bone_name[_g.name]
+                for _g in mesh_obj.vertex_groups
+                if _g.name in limb_index_by_bone_name
+            }
+            dragex_backend.logging.debug(f"{limb_index_by_group_index=}")
+            assert isinstance(mesh_obj.data, bpy.types.Mesh)
+
+            limb_index_per_vertex = np.empty(len(mesh_obj.data.vertices), dtype=np.uint)
+            for v in mesh_obj.data.vertices:
+                v_groups = sorted(
+                    (_g for _g in v.groups if _g.group in limb_index_by_group_index),
+                    key=lambda _g: _g.weight,
+                    reverse=True,
+                )
+                is_unassigned = (
+                    len(v_groups) == 0 or v_groups[0].weight < 1 - weight_epsilon
+                )
+                is_multiassigned = (
+                    len(v_groups) >= 2 and v_groups[1].weight > weight_epsilon
+                )
+                assert not is_unassigned, "unassigned vertex"
+                assert not is_multiassigned, "multi-assigned vertex"
+                limb_index_per_vertex[v.index] = limb_index_by_group_index[
+                    v_groups[0].group
+                ]
+
+            buf_corners_material_index = util.new_uint_buf(len(mesh_obj.data.loops))
+            for l in mesh_obj.data.loops:
+                buf_corners_material_index[l.index] = limb_index_per_vertex[
+                    l.vertex_index
+                ]
+
+            mesh_obj.data.calc_loop_triangles()  # TODO is this costly? we call it twice
+            submeshes_masks = [
+                np.zeros(len(mesh_obj.data.loop_triangles), dtype=bool)
+                for _bh in all_bones
+            ]
+            # TODO this probably can be written with numpy for speed:
+            for tri in mesh_obj.data.loop_triangles:
+                submeshes_masks[
+                    max(buf_corners_material_index[_l] for _l in tri.loops)
+                ][tri.index] = True
+
+            transform_per_vertex = limb_index_per_vertex
+            transforms = [
+                # TODO should mesh_obj.matrix_world be before or after _mtx ?
+                global_transform @ _mtx @ mesh_obj.matrix_world
+                for _mtx in vertex_transforms_per_limb
             ]
 
-        buf_corners_material_index = util.new_uint_buf(len(mesh_obj.data.loops))
-        for l in mesh_obj.data.loops:
-            buf_corners_material_index[l.index] = limb_index_per_vertex[l.vertex_index]
-
-        mesh_obj.data.calc_loop_triangles()  # TODO is this costly? we call it twice
-        submeshes_masks = [
-            np.zeros(len(mesh_obj.data.loop_triangles), dtype=bool) for _bh in all_bones
-        ]
-        # TODO this probably can be written with numpy for speed:
-        for tri in mesh_obj.data.loop_triangles:
-            submeshes_masks[max(buf_corners_material_index[_l] for _l in tri.loops)][
-                tri.index
-            ] = True
-
-        transform_per_vertex = limb_index_per_vertex
-        transforms = [
-            # TODO should mesh_obj.matrix_world be before or after _mtx ?
-            global_transform @ _mtx @ mesh_obj.matrix_world
-            for _mtx in vertex_transforms_per_limb
-        ]
-
-        mesh_infos_list = mesh.mesh_to_mesh_infos_general(
-            mesh_obj,
-            mesh_obj.data,
-            transform_per_vertex,
-            transforms,
-            image_infos,
-            skeleton_c_identifier + "_",
-            [
-                mesh.SubMeshInfo(
-                    submeshes_masks[_i],
-                    f"_limb_{_i}",
+            create_mesh_infos = mesh.mesh_to_mesh_infos_general_deferred(
+                mesh_obj,
+                mesh_obj.data,
+                transform_per_vertex,
+                transforms,
+                image_infos,
+                skeleton_c_identifier + "_",
+                [
+                    mesh.SubMeshInfo(
+                        submeshes_masks[_i],
+                        f"_limb_{_i}",
+                    )
+                    for _i in range(len(all_bones))
+                ],
+                buf_corners_material_index,
+                corner_material_infos,
+                default_corner_material_info,
+            )
+            for i, create_mesh_info in enumerate(create_mesh_infos):
+                mesh_info_futures_by_limb.setdefault(i, []).append(
+                    executor.submit(create_mesh_info)
                 )
-                for _i in range(len(all_bones))
-            ],
-            buf_corners_material_index,
-            corner_material_infos,
-            default_corner_material_info,
-        )
-        for i, mesh_info in enumerate(mesh_infos_list):
-            mesh_infos_by_limb.setdefault(i, []).append(mesh_info)
+
+        mesh_infos_by_limb = {
+            _limb: [_f.result() for _f in _futures]
+            for _limb, _futures in mesh_info_futures_by_limb.items()
+        }
 
     import os
 
@@ -246,6 +262,8 @@ def export_skeleton_impl(
                 )
 
         limb_dl_name_by_limb: dict[int, str] = {}
+        vtx_pool = dragex_backend.VtxPool(f"{skeleton_c_identifier}_Vtx")
+        mat_registry = dragex_backend.MaterialRegistry()
         for limb, mesh_infos in mesh_infos_by_limb.items():
             with os.fdopen(fd, "w", closefd=False) as f:
                 f.write(f"// limb {limb}\n")
@@ -254,9 +272,12 @@ def export_skeleton_impl(
                 assert (
                     limb_dl_name is None
                 ), "notimplemented: several meshes parented to armature"
-                limb_dl_name = mi.write_c(fd, limb_to_matrix_map)
+                limb_dl_name, _ = mi.write_c(
+                    fd, limb_to_matrix_map, vtx_pool, mat_registry, True
+                )
             assert limb_dl_name is not None, "no mesh parented to armature?"
             limb_dl_name_by_limb[limb] = limb_dl_name
+        vtx_pool.write_c(fd)
         limb_names = [
             (skeleton_c_identifier + "_" + util.make_c_identifier(_bh.bone.name))
             for _bh in all_bones
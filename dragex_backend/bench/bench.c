@@ -0,0 +1,436 @@
+/**
+ * Benchmark of the exporter pipeline on synthetic meshes, without Blender.
+ *
+ * Usage: dragex_bench [scale]
+ *
+ * scale (default 1) multiplies the number of triangles of every scene.
+ * Results are printed to stderr, one line per scene and stage, as
+ * tab-separated: scene, stage, time (ms), tris, tris/s, peak memory (KiB).
+ * stdout gets the backend's logging.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+#include "../src/exporter.h"
+#include "../src/text_buffer.h"
+
+static double now_seconds(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// peak resident memory of the process so far, in KiB
+static long peak_memory_kib(void) {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return -1;
+    return (long)(pmc.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // bytes
+#else
+    return usage.ru_maxrss; // KiB
+#endif
+#endif
+}
+
+static const char *cur_scene;
+static double stage_start;
+
+static void stage_begin(void) { stage_start = now_seconds(); }
+
+static void stage_end(const char *stage, unsigned long n_tris) {
+    double t = now_seconds() - stage_start;
+    fprintf(stderr, "%s\t%s\t%.3f\t%lu\t%.0f\t%ld\n", cur_scene, stage,
+            t * 1000, n_tris, t > 0 ? n_tris / t : 0.0, peak_memory_kib());
+}
+
+// synthetic meshes
+
+struct SynthMesh {
+    float *vertices_co;
+    unsigned int *triangles_loops;
+    unsigned int *triangles_material_index;
+    unsigned int *loops_vertex_index;
+    float *loops_normal;
+    float *corners_color;
+    float *loops_uv;
+    unsigned int *corners_material_index;
+    unsigned int n_verts, n_tris, n_loops;
+};
+
+static void free_SynthMesh(struct SynthMesh *m) {
+    free(m->vertices_co);
+    free(m->triangles_loops);
+    free(m->triangles_material_index);
+    free(m->loops_vertex_index);
+    free(m->loops_normal);
+    free(m->corners_color);
+    free(m->loops_uv);
+    free(m->corners_material_index);
+}
+
+/**
+ * A grid of nx*ny quads (two triangles and four loops each), laid out on a
+ * cylinder of the given radius if radius > 0 or flat otherwise.
+ * Quads get material (x / material_block + y / material_block * 3) %
+ * n_materials
+ * and corner material (limb) y * n_limbs / ny.
+ */
+static void make_grid(struct SynthMesh *m, unsigned int nx, unsigned int ny,
+                      float radius, unsigned int n_materials,
+                      unsigned int material_block, unsigned int n_limbs) {
+    unsigned int vx = nx + 1, vy = ny + 1;
+
+    m->n_verts = vx * vy;
+    m->n_tris = nx * ny * 2;
+    m->n_loops = nx * ny * 4;
+    m->vertices_co = malloc(sizeof(float) * 3 * m->n_verts);
+    m->triangles_loops = malloc(sizeof(unsigned int) * 3 * m->n_tris);
+    m->triangles_material_index = malloc(sizeof(unsigned int) * m->n_tris);
+    m->loops_vertex_index = malloc(sizeof(unsigned int) * m->n_loops);
+    m->loops_normal = malloc(sizeof(float) * 3 * m->n_loops);
+    m->corners_color = malloc(sizeof(float) * 4 * m->n_loops);
+    m->loops_uv = malloc(sizeof(float) * 2 * m->n_loops);
+    m->corners_material_index = malloc(sizeof(unsigned int) * m->n_loops);
+    if (m->vertices_co == NULL || m->triangles_loops == NULL ||
+        m->triangles_material_index == NULL || m->loops_vertex_index == NULL ||
+        m->loops_normal == NULL || m->corners_color == NULL ||
+        m->loops_uv == NULL || m->corners_material_index == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned int y = 0; y < vy; y++) {
+        for (unsigned int x = 0; x < vx; x++) {
+            float *co = &m->vertices_co[(y * vx + x) * 3];
+            if (radius > 0) {
+                float a = 2 * 3.14159265f * x / nx;
+                co[0] = radius * cosf(a);
+                co[1] = 10.0f * y;
+                co[2] = radius * sinf(a);
+            } else {
+                co[0] = 10.0f * x;
+                co[1] = (float)((x * 7 + y * 13) % 5);
+                co[2] = 10.0f * y;
+            }
+        }
+    }
+
+    uint32_t rng = 1;
+    for (unsigned int y = 0; y < ny; y++) {
+        for (unsigned int x = 0; x < nx; x++) {
+            unsigned int quad = y * nx + x;
+            unsigned int v[4] = {y * vx + x, y * vx + x + 1,
+                                 (y + 1) * vx + x + 1, (y + 1) * vx + x};
+            static const float uv[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+            unsigned int material =
+                (x / material_block + y / material_block * 3) % n_materials;
+            for (int k = 0; k < 4; k++) {
+                unsigned int loop = quad * 4 + k;
+                m->loops_vertex_index[loop] = v[k];
+                m->loops_normal[loop * 3 + 0] = 0;
+                m->loops_normal[loop * 3 + 1] = 1;
+                m->loops_normal[loop * 3 + 2] = 0;
+                for (int c = 0; c < 4; c++) {
+                    // a few distinct colors, so some vertices get merged
+                    rng = rng * 1103515245 + 12345;
+                    m->corners_color[loop * 4 + c] =
+                        (float)((rng >> 16) % 4) / 3.0f;
+                }
+                m->loops_uv[loop * 2 + 0] = uv[k][0];
+                m->loops_uv[loop * 2 + 1] = uv[k][1];
+                m->corners_material_index[loop] = y * n_limbs / ny;
+            }
+            static const int tri_corners[2][3] = {{0, 1, 2}, {0, 2, 3}};
+            for (int t = 0; t < 2; t++) {
+                for (int k = 0; k < 3; k++) {
+                    m->triangles_loops[(quad * 2 + t) * 3 + k] =
+                        quad * 4 + tri_corners[t][k];
+                }
+                m->triangles_material_index[quad * 2 + t] = material;
+            }
+        }
+    }
+}
+
+static void init_material(struct MaterialInfo *mat, char *name,
+                          bool lighting) {
+    memset(mat, 0, sizeof(*mat));
+    mat->name = name;
+    mat->uv_basis_s = 32;
+    mat->uv_basis_t = 32;
+    mat->other_modes.cycle_type = RDP_OM_CYCLE_TYPE_1CYCLE;
+    mat->other_modes.z_compare_en = true;
+    mat->other_modes.z_update_en = true;
+    for (int i = 0; i < 8; i++) {
+        mat->tiles[i].format = RDP_TILE_FORMAT_RGBA;
+        mat->tiles[i].size = RDP_TILE_SIZE_16;
+        mat->tiles[i].mask_S = mat->tiles[i].mask_T = 5;
+        mat->tiles[i].lower_right_S = mat->tiles[i].lower_right_T = 31;
+    }
+    mat->combiner.rgb_A_0 = RDP_COMBINER_RGB_A_INPUTS_0;
+    mat->combiner.rgb_B_0 = RDP_COMBINER_RGB_B_INPUTS_0;
+    mat->combiner.rgb_C_0 = RDP_COMBINER_RGB_C_INPUTS_0;
+    mat->combiner.rgb_D_0 = RDP_COMBINER_RGB_D_INPUTS_SHADE;
+    mat->combiner.rgb_A_1 = RDP_COMBINER_RGB_A_INPUTS_0;
+    mat->combiner.rgb_B_1 = RDP_COMBINER_RGB_B_INPUTS_0;
+    mat->combiner.rgb_C_1 = RDP_COMBINER_RGB_C_INPUTS_0;
+    mat->combiner.rgb_D_1 = RDP_COMBINER_RGB_D_INPUTS_COMBINED;
+    mat->geometry_mode.zbuffer = true;
+    mat->geometry_mode.lighting = lighting;
+    mat->geometry_mode.vertex_colors = !lighting;
+    mat->geometry_mode.cull_back = true;
+    mat->geometry_mode.shade_smooth = true;
+}
+
+// scenes
+
+static void bench_f3d(const char *scene, struct SynthMesh *m,
+                      unsigned int n_materials, unsigned int n_limbs) {
+    cur_scene = scene;
+
+    struct MaterialInfo *materials =
+        malloc(sizeof(struct MaterialInfo) * n_materials);
+    struct MaterialInfo **material_ptrs =
+        malloc(sizeof(struct MaterialInfo *) * n_materials);
+    char(*material_names)[16] = malloc(16 * n_materials);
+    struct CornerMaterialInfo *corner_materials =
+        malloc(sizeof(struct CornerMaterialInfo) * n_limbs);
+    struct CornerMaterialInfo **corner_material_ptrs =
+        malloc(sizeof(struct CornerMaterialInfo *) * n_limbs);
+    char(*matrix_names)[16] = malloc(16 * n_limbs);
+    const char **limb_to_matrix_map = malloc(sizeof(char *) * n_limbs);
+    if (materials == NULL || material_ptrs == NULL || material_names == NULL ||
+        corner_materials == NULL || corner_material_ptrs == NULL ||
+        matrix_names == NULL || limb_to_matrix_map == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int i = 0; i < n_materials; i++) {
+        snprintf(material_names[i], 16, "m%u", i);
+        init_material(&materials[i], material_names[i], i % 2 != 0);
+        material_ptrs[i] = &materials[i];
+    }
+    struct MaterialInfo default_material;
+    init_material(&default_material, "DEFAULT", false);
+    for (unsigned int i = 0; i < n_limbs; i++) {
+        corner_materials[i].limb_index = i;
+        corner_material_ptrs[i] = &corner_materials[i];
+        snprintf(matrix_names[i], 16, "0x%08X", 0x0D000000 + i * 0x40);
+        limb_to_matrix_map[i] = matrix_names[i];
+    }
+    // single limb meshes (rooms) don't use matrices
+    int limb_to_matrix_map_len = n_limbs > 1 ? n_limbs : 0;
+    struct CornerMaterialInfo default_corner_material = {n_limbs};
+
+    stage_begin();
+    struct MeshInfo *mesh_info = create_MeshInfo_from_buffers(
+        (char *)scene,                                           //
+        m->vertices_co, m->n_verts * 3,                          //
+        m->triangles_loops, m->n_tris * 3,                       //
+        m->triangles_material_index, m->n_tris,                  //
+        m->loops_vertex_index, m->n_loops,                       //
+        m->loops_normal, m->n_loops * 3,                         //
+        m->corners_color, m->n_loops * 4,                        //
+        NULL, 0,                                                 //
+        m->loops_uv, m->n_loops * 2,                             //
+        m->corners_material_index, m->n_loops,                   //
+        material_ptrs, n_materials,                              //
+        &default_material,                                       //
+        corner_material_ptrs, n_limbs, &default_corner_material //
+    );
+    stage_end("create_MeshInfo_from_buffers", m->n_tris);
+    if (mesh_info == NULL) {
+        fprintf(stderr, "create_MeshInfo_from_buffers failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    stage_begin();
+    struct MeshInfo **meshes = split_mesh_by_material(mesh_info);
+    stage_end("split_mesh_by_material", m->n_tris);
+    if (meshes == NULL) {
+        fprintf(stderr, "split_mesh_by_material failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned int n_meshes = mesh_info->n_materials;
+    struct f3d_mesh **f3d_meshes = malloc(sizeof(struct f3d_mesh *) * n_meshes);
+    if (f3d_meshes == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    stage_begin();
+    for (unsigned int i = 0; i < n_meshes; i++) {
+        struct MaterialInfo *mat_info = &mesh_info->materials[i];
+        f3d_meshes[i] = mesh_to_f3d_mesh(
+            meshes[i], limb_to_matrix_map, limb_to_matrix_map_len,
+            mat_info->uv_basis_s,
+            mat_info->uv_basis_t,
+            mat_info->geometry_mode.lighting ? SHADING_NORMALS
+                                             : SHADING_COLORS,
+            &f3d_ucode_f3dex2);
+        if (f3d_meshes[i] == NULL) {
+            fprintf(stderr, "mesh_to_f3d_mesh failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    stage_end("mesh_to_f3d_mesh", m->n_tris);
+
+    struct TextBuffer b;
+    text_buffer_init(&b);
+    stage_begin();
+    for (unsigned int i = 0; i < n_meshes; i++) {
+        write_f3d_mat(&b, &mesh_info->materials[i], meshes[i]->name);
+        write_f3d_mesh(&b, f3d_meshes[i], meshes[i]->name, NULL,
+                       &f3d_ucode_f3dex2, NULL);
+    }
+    stage_end("write_f3d_mesh", m->n_tris);
+    text_buffer_free(&b);
+
+    for (unsigned int i = 0; i < n_meshes; i++)
+        free_mesh_to_f3d_mesh(f3d_meshes[i]);
+    free(f3d_meshes);
+    free_split_mesh_by_material(meshes, n_meshes);
+
+    // all of the above, as done for MeshInfo.write_c
+    text_buffer_init(&b);
+    stage_begin();
+    if (write_mesh_info_to_f3d_c(mesh_info, limb_to_matrix_map,
+                                 limb_to_matrix_map_len, NULL, NULL,
+                                 &f3d_ucode_f3dex2, 0, &b, NULL, NULL) != 0) {
+        fprintf(stderr, "write_mesh_info_to_f3d_c failed\n");
+        exit(EXIT_FAILURE);
+    }
+    stage_end("write_mesh_info_to_f3d_c", m->n_tris);
+    text_buffer_free(&b);
+
+    free_create_MeshInfo_from_buffers(mesh_info);
+    free(materials);
+    free(material_ptrs);
+    free(material_names);
+    free(corner_materials);
+    free(corner_material_ptrs);
+    free(matrix_names);
+    free(limb_to_matrix_map);
+}
+
+static void bench_collision(const char *scene, struct SynthMesh *m,
+                            unsigned int n_parts) {
+    cur_scene = scene;
+
+    struct OoTCollisionMaterial materials[3] = {
+        {"GRASS"}, {"STONE"}, {"WOOD"}};
+    struct OoTCollisionMaterial *material_ptrs[3] = {
+        &materials[0], &materials[1], &materials[2]};
+    struct OoTCollisionMaterial default_material = {"DEFAULT"};
+
+    struct OoTCollisionMesh **meshes =
+        malloc(sizeof(struct OoTCollisionMesh *) * n_parts);
+    if (meshes == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the floor is split in n_parts objects, joined afterwards
+    unsigned int part_tris = m->n_tris / n_parts;
+    stage_begin();
+    for (unsigned int i = 0; i < n_parts; i++) {
+        meshes[i] = create_OoTCollisionMesh_from_buffers(
+            m->vertices_co, m->n_verts * 3,                     //
+            m->triangles_loops + i * part_tris * 3, part_tris * 3, //
+            m->triangles_material_index + i * part_tris, part_tris, //
+            m->loops_vertex_index, m->n_loops,                  //
+            material_ptrs, 3, &default_material);
+        if (meshes[i] == NULL) {
+            fprintf(stderr, "create_OoTCollisionMesh_from_buffers failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    stage_end("create_OoTCollisionMesh_from_buffers", part_tris * n_parts);
+
+    stage_begin();
+    struct OoTCollisionMesh *joined =
+        join_OoTCollisionMeshes_impl(meshes, n_parts);
+    if (joined == NULL) {
+        fprintf(stderr, "join_OoTCollisionMeshes_impl failed\n");
+        exit(EXIT_FAILURE);
+    }
+    stage_end("join_OoTCollisionMeshes", joined->n_faces);
+
+    struct TextBuffer b;
+    struct OoTCollisionBounds bounds;
+    text_buffer_init(&b);
+    stage_begin();
+    if (write_OoTCollisionMesh_to_c(joined, "BENCH", "vtx", "poly", "surf", 0,
+                                    false, &b, &bounds) != 0) {
+        fprintf(stderr, "write_OoTCollisionMesh_to_c failed\n");
+        exit(EXIT_FAILURE);
+    }
+    stage_end("write_OoTCollisionMesh_to_c", joined->n_faces);
+    text_buffer_free(&b);
+
+    free_create_OoTCollisionMesh_from_buffers(joined);
+    for (unsigned int i = 0; i < n_parts; i++)
+        free_create_OoTCollisionMesh_from_buffers(meshes[i]);
+    free(meshes);
+}
+
+int main(int argc, char *argv[]) {
+    int scale = argc > 1 ? atoi(argv[1]) : 1;
+    if (scale <= 0) {
+        fprintf(stderr, "usage: %s [scale]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    // scale multiplies the number of tris, the grids get sqrt(scale) bigger
+    unsigned int k = (unsigned int)(sqrt(scale) * 100 + 0.5);
+
+    fprintf(stderr, "scene\tstage\tms\ttris\ttris/s\tpeak_kib\n");
+
+    struct SynthMesh m;
+
+    make_grid(&m, k, k, 0, 1, 1, 1);
+    bench_f3d("grid", &m, 1, 1);
+    free_SynthMesh(&m);
+
+    make_grid(&m, 32, k * k / 32, 50.0f, 2, 16, 20);
+    bench_f3d("skinned_cylinder", &m, 2, 20);
+    free_SynthMesh(&m);
+
+    make_grid(&m, k, k, 0, 64, 4, 1);
+    bench_f3d("many_materials", &m, 64, 1);
+    free_SynthMesh(&m);
+
+    make_grid(&m, 2 * k, 2 * k, 0, 3, 8, 1);
+    bench_collision("collision_floor", &m, 16);
+    free_SynthMesh(&m);
+
+    fprintf(stderr, "peak memory: %ld KiB\n", peak_memory_kib());
+
+    return EXIT_SUCCESS;
+}
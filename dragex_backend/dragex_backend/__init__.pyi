@@ -1,9 +1,14 @@
 from collections.abc import Buffer, Sequence
 import os
-from typing import Optional
+from typing import Any, Optional
 
 def get_build_id() -> int: ...
 
+# {"stages": {name: seconds}, "counters": {name: count}}, accumulated over all
+# exports since the last reset_export_stats
+def get_export_stats() -> dict[str, dict[str, float | int]]: ...
+def reset_export_stats() -> None: ...
+
 class MaterialInfoImage:
     def __init__(
         self,
@@ -151,13 +156,45 @@ class CornerMaterialInfo:
         limb_index: int,
     ) -> None: ...
 
+# Vertices shared by the meshes written to a same file, identical vertex loads
+# point into a single Vtx array written by write_c after the meshes
+class VtxPool:
+    def __init__(self, name: str) -> None: ...
+    def write_c(self, fd: int, /) -> None: ...
+
+# Material display lists written to a same file, meshes using a material
+# identical to one already written reference its display list
+class MaterialRegistry:
+    def __init__(self) -> None: ...
+
 class MeshInfo:
+    # Returns (dl_name, cost), cost being a static estimate of drawing the
+    # display list: {"gfx_bytes", "vtx_bytes", "vertex_loads", "matrix_loads",
+    # "tex_load_bytes", "tris", "fill_area_1cycle", "fill_area_2cycle",
+    # "rsp_cost", "rdp_cost"}. The fill areas are in model units, and the
+    # rsp/rdp costs are rough cycle counts only meaningful to compare meshes.
     def write_c(
         self,
         fd: int,
         limb_to_matrix_map: Sequence[str | None],
+        vtx_pool: VtxPool | None = None,
+        mat_registry: MaterialRegistry | None = None,
+        # only write the state changes between consecutive materials
+        diff_mat_state: bool = False,
+        # reorder the submeshes to change less state, only for opaque meshes
+        optimize_draw_order: bool = False,
+        # the target microcode, "F3DEX2" or "F3DEX3" (raises ValueError otherwise)
+        ucode: str = "F3DEX2",
         /,
-    ) -> str: ...
+    ) -> tuple[str, dict[str, float]]: ...
+    # Returns (dl_name, symbols as (name, offset), relocations as (offset, symbol))
+    # The 32-bit word at each relocation offset is an addend for the symbol address
+    def write_bin(
+        self,
+        fd: int,
+        limb_to_matrix_map: Sequence[str | None],
+        /,
+    ) -> tuple[str, list[tuple[str, int]], list[tuple[int, str]]]: ...
 
 def create_MeshInfo(
     mesh_name: str,
@@ -177,12 +214,64 @@ def create_MeshInfo(
     /,
 ) -> MeshInfo: ...
 
+# Owns the per-vertex, per-loop and per-triangle data of a mesh, appended
+# attribute by attribute and chunk by chunk, for MeshInfo objects to share
+# without the caller holding the whole data at once
+class MeshInfoBuilder:
+    def __init__(
+        self,
+        n_vertices: int,
+        n_loops: int,
+        n_triangles: int,
+        has_points_color: bool,
+        has_corners_color: bool,
+        has_uv: bool,
+        /,
+    ) -> None: ...
+    def append(
+        self,
+        # "vertices_co", "points_color", "loops_vertex_index", "loops_normal",
+        # "corners_color", "loops_uv", "corners_material_index",
+        # "triangles_loops" or "triangles_material_index", with the layout of
+        # the create_MeshInfo buffer of the same name
+        attr_name: str,
+        buf: Buffer,
+        /,
+    ) -> None: ...
+    # Like append, but returns a writable memoryview of the builder's own
+    # memory for the len values, to be set (e.g. by foreach_get) in place of
+    # copying them from a temporary. The values count as appended already.
+    def append_view(
+        self,
+        attr_name: str,
+        len: int,
+        /,
+    ) -> memoryview: ...
+    # Once all attributes are complete and the views from append_view are
+    # released. The builder can't be appended to after.
+    def create_MeshInfo(
+        self,
+        mesh_name: str,
+        # indices of the triangles of the mesh, or None for all of them
+        buf_triangles: Buffer | None,
+        material_infos: Sequence[MaterialInfo | None],
+        default_material: MaterialInfo,
+        corner_material_infos: Sequence[CornerMaterialInfo | None],
+        default_corner_material: CornerMaterialInfo,
+        /,
+    ) -> MeshInfo: ...
+
 class OoTCollisionMaterial:
     def __init__(self, name: str) -> None: ...
 
 class OoTCollisionBounds:
     min: tuple[int, int, int]
     max: tuple[int, int, int]
+    # BgCheck static lookup subdivision amounts
+    subdivision: tuple[int, int, int]  # recommended
+    default_subdivision: tuple[int, int, int]
+    # keys amount, n_nodes, max_polys, mean_polys, mem_size
+    subdivision_stats: list[dict[str, Any]]
 
 class OoTCollisionMesh:
     def write_c(
@@ -192,6 +281,9 @@ class OoTCollisionMesh:
         vtx_list_name: str,
         poly_list_name: str,
         surface_types_name: str,
+        weld_epsilon: int = 0,
+        # write polys in Morton order of their centroids, near polys together
+        spatial_sort: bool = False,
         /,
     ) -> OoTCollisionBounds: ...
 
@@ -205,5 +297,10 @@ def create_OoTCollisionMesh(
     /,
 ) -> OoTCollisionMesh: ...
 def join_OoTCollisionMeshes(meshes: Sequence[OoTCollisionMesh]) -> OoTCollisionMesh: ...
+def simplify_OoTCollisionMesh(
+    mesh: OoTCollisionMesh,
+    tolerance: float,  # in OoT units, 0 to only merge coplanar faces
+    /,
+) -> OoTCollisionMesh: ...
 
 from . import logging
@@ -30,8 +30,13 @@ class CustomBuildExt(build_ext):
                     "-Wextra",
                     "-Werror",
                     "-Wno-unused-parameter",
+                    # keep a * b - c * d unfused, see
+                    # compute_OoTCollisionPlanes_batch
+                    "-ffp-contract=off",
                     "-UNDEBUG",
+                    "-pthread",
                 ]
+                ext.extra_link_args = ["-pthread"]
         super().build_extensions()
 
 
@@ -54,8 +59,16 @@ setup(
                 "src/py/mat_info_obj.c",
                 "src/py/corner_mat_info_obj.c",
                 "src/py/mesh_info_obj.c",
+                "src/py/mesh_info_builder_obj.c",
+                "src/py/vtx_pool_obj.c",
+                "src/py/mat_registry_obj.c",
                 "src/py/oot_collision_objs.c",
                 "src/exporter.c",
+                "src/text_buffer.c",
+                "src/arena.c",
+                "src/hashmap.c",
+                "src/stats.c",
+                "src/workers.c",
                 "meshoptimizer/src/indexgenerator.cpp",
                 "meshoptimizer/src/vcacheoptimizer.cpp",
             ],
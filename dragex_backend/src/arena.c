@@ -0,0 +1,61 @@
+#include "arena.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "logging/logging.h"
+
+#define ARENA_BLOCK_SIZE_MIN (64 * 1024)
+
+// for the alignment of allocations
+union arena_align {
+    long long ll;
+    long double ld;
+    void *p;
+};
+
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, capacity;
+    union arena_align data[];
+};
+
+void arena_init(struct Arena *a) {
+    a->blocks = NULL;
+    a->error = false;
+}
+
+void arena_free(struct Arena *a) {
+    struct ArenaBlock *block = a->blocks;
+    while (block != NULL) {
+        struct ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena_init(a);
+}
+
+void *arena_alloc(struct Arena *a, size_t size) {
+    const size_t align = sizeof(union arena_align);
+    size = (size + align - 1) / align * align;
+
+    struct ArenaBlock *block = a->blocks;
+    if (block == NULL || block->capacity - block->used < size) {
+        size_t capacity = size > ARENA_BLOCK_SIZE_MIN ? size
+                                                      : ARENA_BLOCK_SIZE_MIN;
+        block = malloc(sizeof(struct ArenaBlock) + capacity);
+        if (block == NULL) {
+            log_error("malloc arena block failed (capacity=%zu)", capacity);
+            a->error = true;
+            return NULL;
+        }
+        block->next = a->blocks;
+        block->used = 0;
+        block->capacity = capacity;
+        a->blocks = block;
+    }
+
+    void *p = (unsigned char *)block->data + block->used;
+    block->used += size;
+    return p;
+}
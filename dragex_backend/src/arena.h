@@ -0,0 +1,28 @@
+#ifndef DRAGEX_BACKEND_ARENA_H
+#define DRAGEX_BACKEND_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct ArenaBlock;
+
+/**
+ * Bump allocator for many small allocations sharing a lifetime.
+ * Allocations are never freed individually, arena_free frees everything.
+ */
+struct Arena {
+    struct ArenaBlock *blocks; // current block first
+    // set if an allocation failed
+    bool error;
+};
+
+void arena_init(struct Arena *a);
+void arena_free(struct Arena *a);
+
+/**
+ * Allocate size bytes, aligned for any type.
+ * Returns NULL and sets a->error on failure.
+ */
+void *arena_alloc(struct Arena *a, size_t size);
+
+#endif
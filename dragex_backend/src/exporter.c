@@ -11,9 +11,23 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define EXPORTER_SSE
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define EXPORTER_NEON
+#include <arm_neon.h>
+#endif
+
 #include "../meshoptimizer/src/meshoptimizer.h"
 
+#include "arena.h"
+#include "hashmap.h"
 #include "logging/logging.h"
+#include "stats.h"
+#include "text_buffer.h"
+#include "workers.h"
 
 #ifndef MIN
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
@@ -48,7 +62,8 @@ void copy_CornerMaterialInfo(struct CornerMaterialInfo *dest,
 void free_create_MeshInfo_from_buffers(struct MeshInfo *mesh) {
     if (mesh != NULL) {
         free(mesh->name);
-        free(mesh->verts);
+        // cast away const, the map is owned by the mesh (but not its submeshes)
+        free((unsigned int *)mesh->buffers.corner_material_index_map);
         free(mesh->faces);
         if (mesh->materials != NULL) {
             for (unsigned int i = 0; i < mesh->n_materials; i++) {
@@ -192,6 +207,8 @@ struct MeshInfo *create_MeshInfo_from_buffers(
         return NULL;
     }
 
+    double t_start = stats_now();
+
     unsigned int n_materials;
     bool use_default_material;
     unsigned int default_material_index;
@@ -217,6 +234,31 @@ struct MeshInfo *create_MeshInfo_from_buffers(
         return NULL;
     }
 
+    stats_add_stage_time(EXPORT_STAGE_MATERIAL_REMAP, t_start);
+
+    // validate the indices into the per-vertex buffers once here, so the
+    // buffers can be read without checks when converting
+
+    for (unsigned int i_loop = 0; i_loop < n_loops; i_loop++) {
+        size_t v = buf_loops_vertex_index[i_loop];
+        if (v * 3 + 2 >= buf_vertices_co_len) {
+            log_error("i_loop=%u: v=%zu out of bounds "
+                      "(buf_vertices_co_len=%zd)",
+                      i_loop, v * 3 + 2, buf_vertices_co_len);
+            free(material_index_map);
+            free(corner_material_index_map);
+            return NULL;
+        }
+        if (buf_points_color != NULL && v * 4 + 3 >= buf_points_color_len) {
+            log_error("i_loop=%u: v=%zu out of bounds "
+                      "(buf_points_color_len=%zd)",
+                      i_loop, v * 4 + 3, buf_points_color_len);
+            free(material_index_map);
+            free(corner_material_index_map);
+            return NULL;
+        }
+    }
+
     struct MeshInfo *mesh = malloc(sizeof(struct MeshInfo));
     if (mesh == NULL) {
         log_error("malloc mesh failed");
@@ -226,8 +268,19 @@ struct MeshInfo *create_MeshInfo_from_buffers(
     }
     mesh->name = strdup(mesh_name);
 
+    mesh->buffers.vertices_co = buf_vertices_co;
+    mesh->buffers.loops_vertex_index = buf_loops_vertex_index;
+    mesh->buffers.loops_normal = buf_loops_normal;
+    mesh->buffers.corners_color = buf_corners_color;
+    mesh->buffers.points_color = buf_points_color;
+    mesh->buffers.loops_uv = buf_loops_uv;
+    mesh->buffers.corners_material_index = buf_corners_material_index;
+    // the mesh takes ownership of corner_material_index_map
+    mesh->buffers.corner_material_index_map = corner_material_index_map;
+
+    mesh->loops = NULL;
+
     mesh->n_verts = n_loops;
-    mesh->verts = malloc(sizeof(struct VertexInfo) * n_loops);
 
     mesh->n_faces = n_faces;
     mesh->faces = malloc(sizeof(struct TriInfo) * n_faces);
@@ -248,64 +301,14 @@ struct MeshInfo *create_MeshInfo_from_buffers(
         }
     }
 
-    if (mesh->name == NULL || mesh->verts == NULL || mesh->faces == NULL ||
-        mesh->materials == NULL || mesh->corner_materials == NULL) {
-        log_error(
-            "malloc name, verts, faces, materials or corner_materials failed");
+    if (mesh->name == NULL || mesh->faces == NULL || mesh->materials == NULL ||
+        mesh->corner_materials == NULL) {
+        log_error("malloc name, faces, materials or corner_materials failed");
         free(material_index_map);
-        free(corner_material_index_map);
         free_create_MeshInfo_from_buffers(mesh);
         return NULL;
     }
 
-    for (unsigned int i_loop = 0; i_loop < n_loops; i_loop++) {
-        for (int j = 0; j < 3; j++) {
-            unsigned int v = buf_loops_vertex_index[i_loop] * 3 + j;
-            if (v >= buf_vertices_co_len) {
-                log_error(
-                    "i_loop=%u: v=%u out of bounds (buf_vertices_co_len=%zd)",
-                    i_loop, v, buf_vertices_co_len);
-                free(material_index_map);
-                free(corner_material_index_map);
-                free_create_MeshInfo_from_buffers(mesh);
-                return NULL;
-            }
-            mesh->verts[i_loop].coords[j] = buf_vertices_co[v];
-        }
-
-        for (int j = 0; j < 2; j++)
-            mesh->verts[i_loop].uv[j] =
-                buf_loops_uv == NULL ? 0.0f : buf_loops_uv[i_loop * 2 + j];
-
-        for (int j = 0; j < 3; j++)
-            mesh->verts[i_loop].normal[j] = buf_loops_normal[i_loop * 3 + j];
-
-        for (int j = 0; j < 4; j++) {
-            if (buf_corners_color != NULL) {
-                mesh->verts[i_loop].color[j] = (uint8_t)clampf(
-                    buf_corners_color[i_loop * 4 + j] * 255, 0, 255);
-            } else if (buf_points_color != NULL) {
-                unsigned int v = buf_loops_vertex_index[i_loop] * 4 + j;
-                if (v >= buf_points_color_len) {
-                    log_error("i_loop=%u: v=%u out of bounds "
-                              "(buf_points_color_len=%zd)",
-                              i_loop, v, buf_points_color_len);
-                    free(material_index_map);
-                    free(corner_material_index_map);
-                    free_create_MeshInfo_from_buffers(mesh);
-                    return NULL;
-                }
-                mesh->verts[i_loop].color[j] =
-                    (uint8_t)clampf(buf_points_color[v] * 255, 0, 255);
-            } else {
-                mesh->verts[i_loop].color[j] = 255;
-            }
-        }
-
-        mesh->verts[i_loop].material =
-            corner_material_index_map[buf_corners_material_index[i_loop]];
-    }
-
     for (unsigned int i = 0; i < n_faces; i++) {
         for (int j = 0; j < 3; j++) {
             unsigned int loop = buf_triangles_loops[i * 3 + j];
@@ -313,7 +316,6 @@ struct MeshInfo *create_MeshInfo_from_buffers(
                 log_error("face %u: loop=%u out of bounds (n_loops=%u)", i,
                           loop, n_loops);
                 free(material_index_map);
-                free(corner_material_index_map);
                 free_create_MeshInfo_from_buffers(mesh);
                 return NULL;
             }
@@ -359,8 +361,6 @@ struct MeshInfo *create_MeshInfo_from_buffers(
             corner_mat_info);
     }
 
-    free(corner_material_index_map);
-
     if (use_default_corner_material) {
         assert(default_corner_material_index != ~0u);
         copy_CornerMaterialInfo(
@@ -371,6 +371,208 @@ struct MeshInfo *create_MeshInfo_from_buffers(
     return mesh;
 }
 
+const struct MeshInfoBuilderAttrInfo
+    mesh_info_builder_attrs[MESH_INFO_BUILDER_N_ATTRS] = {
+        [MESH_INFO_BUILDER_VERTICES_CO] = {"vertices_co", 3,
+                                           MESH_INFO_BUILDER_DOMAIN_VERTEX,
+                                           false},
+        [MESH_INFO_BUILDER_POINTS_COLOR] = {"points_color", 4,
+                                            MESH_INFO_BUILDER_DOMAIN_VERTEX,
+                                            false},
+        [MESH_INFO_BUILDER_LOOPS_VERTEX_INDEX] = {"loops_vertex_index", 1,
+                                                  MESH_INFO_BUILDER_DOMAIN_LOOP,
+                                                  true},
+        [MESH_INFO_BUILDER_LOOPS_NORMAL] = {"loops_normal", 3,
+                                            MESH_INFO_BUILDER_DOMAIN_LOOP,
+                                            false},
+        [MESH_INFO_BUILDER_CORNERS_COLOR] = {"corners_color", 4,
+                                             MESH_INFO_BUILDER_DOMAIN_LOOP,
+                                             false},
+        [MESH_INFO_BUILDER_LOOPS_UV] = {"loops_uv", 2,
+                                        MESH_INFO_BUILDER_DOMAIN_LOOP, false},
+        [MESH_INFO_BUILDER_CORNERS_MATERIAL_INDEX] =
+            {"corners_material_index", 1, MESH_INFO_BUILDER_DOMAIN_LOOP, true},
+        [MESH_INFO_BUILDER_TRIANGLES_LOOPS] =
+            {"triangles_loops", 3, MESH_INFO_BUILDER_DOMAIN_TRIANGLE, true},
+        [MESH_INFO_BUILDER_TRIANGLES_MATERIAL_INDEX] =
+            {"triangles_material_index", 1, MESH_INFO_BUILDER_DOMAIN_TRIANGLE,
+             true},
+};
+
+/** The number of vertices, loops or triangles of the attribute */
+static size_t mesh_info_builder_n_total(struct MeshInfoBuilder *builder,
+                                        enum mesh_info_builder_attr attr) {
+    switch (mesh_info_builder_attrs[attr].domain) {
+    case MESH_INFO_BUILDER_DOMAIN_VERTEX:
+        return builder->n_vertices;
+    case MESH_INFO_BUILDER_DOMAIN_LOOP:
+        return builder->n_loops;
+    case MESH_INFO_BUILDER_DOMAIN_TRIANGLE:
+        return builder->n_triangles;
+    }
+    assert(false);
+    return 0;
+}
+
+int mesh_info_builder_init(struct MeshInfoBuilder *builder, size_t n_vertices,
+                           size_t n_loops, size_t n_triangles,
+                           bool has_points_color, bool has_corners_color,
+                           bool has_uv) {
+    builder->n_vertices = n_vertices;
+    builder->n_loops = n_loops;
+    builder->n_triangles = n_triangles;
+    for (int attr = 0; attr < MESH_INFO_BUILDER_N_ATTRS; attr++) {
+        const struct MeshInfoBuilderAttrInfo *info =
+            &mesh_info_builder_attrs[attr];
+        bool has = (attr != MESH_INFO_BUILDER_POINTS_COLOR ||
+                    has_points_color) &&
+                   (attr != MESH_INFO_BUILDER_CORNERS_COLOR ||
+                    has_corners_color) &&
+                   (attr != MESH_INFO_BUILDER_LOOPS_UV || has_uv);
+        // floats and unsigned ints are the same size
+        size_t n =
+            mesh_info_builder_n_total(builder, attr) * info->n_components;
+        builder->buffers[attr] = NULL;
+        builder->n_set[attr] = 0;
+        if (has) {
+            // + 1 to not depend on malloc(0) returning non-NULL
+            builder->buffers[attr] = malloc(sizeof(float) * n + 1);
+            if (builder->buffers[attr] == NULL) {
+                log_error("malloc %s failed", info->name);
+                mesh_info_builder_free(builder);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+void mesh_info_builder_free(struct MeshInfoBuilder *builder) {
+    for (int attr = 0; attr < MESH_INFO_BUILDER_N_ATTRS; attr++) {
+        free(builder->buffers[attr]);
+        builder->buffers[attr] = NULL;
+    }
+}
+
+void *mesh_info_builder_append_range(struct MeshInfoBuilder *builder,
+                                     enum mesh_info_builder_attr attr,
+                                     size_t len) {
+    const struct MeshInfoBuilderAttrInfo *info = &mesh_info_builder_attrs[attr];
+    size_t n_total = mesh_info_builder_n_total(builder, attr);
+    size_t n = len / info->n_components;
+
+    if (builder->buffers[attr] == NULL) {
+        log_error("the builder has no %s", info->name);
+        return NULL;
+    }
+    if (len % info->n_components != 0 ||
+        n > n_total - builder->n_set[attr]) {
+        log_error("bad %s len=%zu n_set=%zu n_total=%zu", info->name, len,
+                  builder->n_set[attr], n_total);
+        return NULL;
+    }
+    float *range = (float *)builder->buffers[attr] +
+                   builder->n_set[attr] * info->n_components;
+    builder->n_set[attr] += n;
+    return range;
+}
+
+int mesh_info_builder_append(struct MeshInfoBuilder *builder,
+                             enum mesh_info_builder_attr attr,
+                             const void *data, size_t len) {
+    void *range = mesh_info_builder_append_range(builder, attr, len);
+    if (range == NULL)
+        return -1;
+    memcpy(range, data, sizeof(float) * len);
+    return 0;
+}
+
+bool mesh_info_builder_is_complete(struct MeshInfoBuilder *builder) {
+    for (int attr = 0; attr < MESH_INFO_BUILDER_N_ATTRS; attr++) {
+        if (builder->buffers[attr] != NULL &&
+            builder->n_set[attr] != mesh_info_builder_n_total(builder, attr))
+            return false;
+    }
+    return true;
+}
+
+struct MeshInfo *mesh_info_builder_create_MeshInfo(
+    struct MeshInfoBuilder *builder, char *mesh_name,
+    unsigned int *triangles, size_t n_triangles,
+    struct MaterialInfo **material_infos, size_t n_material_infos,
+    struct MaterialInfo *default_material,
+    struct CornerMaterialInfo **corner_material_infos,
+    size_t n_corner_material_infos,
+    struct CornerMaterialInfo *default_corner_material) {
+    if (!mesh_info_builder_is_complete(builder)) {
+        log_error("incomplete builder");
+        return NULL;
+    }
+    unsigned int *all_triangles_loops =
+        builder->buffers[MESH_INFO_BUILDER_TRIANGLES_LOOPS];
+    unsigned int *all_triangles_material_index =
+        builder->buffers[MESH_INFO_BUILDER_TRIANGLES_MATERIAL_INDEX];
+
+    // gather the triangles of the mesh, which create_MeshInfo_from_buffers
+    // copies
+    unsigned int *triangles_loops = all_triangles_loops;
+    unsigned int *triangles_material_index = all_triangles_material_index;
+    if (triangles == NULL) {
+        n_triangles = builder->n_triangles;
+    } else {
+        triangles_loops = malloc(sizeof(unsigned int) * 3 * n_triangles + 1);
+        triangles_material_index =
+            malloc(sizeof(unsigned int) * n_triangles + 1);
+        if (triangles_loops == NULL || triangles_material_index == NULL) {
+            log_error("malloc triangles failed");
+            free(triangles_loops);
+            free(triangles_material_index);
+            return NULL;
+        }
+        for (size_t i = 0; i < n_triangles; i++) {
+            size_t tri = triangles[i];
+            if (tri >= builder->n_triangles) {
+                log_error("triangle %zu out of bounds (n_triangles=%zu)", tri,
+                          builder->n_triangles);
+                free(triangles_loops);
+                free(triangles_material_index);
+                return NULL;
+            }
+            memcpy(&triangles_loops[i * 3], &all_triangles_loops[tri * 3],
+                   sizeof(unsigned int) * 3);
+            triangles_material_index[i] = all_triangles_material_index[tri];
+        }
+    }
+
+    size_t n_vertices = builder->n_vertices, n_loops = builder->n_loops;
+    float *points_color = builder->buffers[MESH_INFO_BUILDER_POINTS_COLOR];
+    float *corners_color = builder->buffers[MESH_INFO_BUILDER_CORNERS_COLOR];
+    float *loops_uv = builder->buffers[MESH_INFO_BUILDER_LOOPS_UV];
+    struct MeshInfo *mesh = create_MeshInfo_from_buffers(
+        mesh_name,                                                         //
+        builder->buffers[MESH_INFO_BUILDER_VERTICES_CO], n_vertices * 3,   //
+        triangles_loops, n_triangles * 3,                                  //
+        triangles_material_index, n_triangles,                             //
+        builder->buffers[MESH_INFO_BUILDER_LOOPS_VERTEX_INDEX], n_loops,   //
+        builder->buffers[MESH_INFO_BUILDER_LOOPS_NORMAL], n_loops * 3,     //
+        corners_color, corners_color != NULL ? n_loops * 4 : 0,            //
+        points_color, points_color != NULL ? n_vertices * 4 : 0,           //
+        loops_uv, loops_uv != NULL ? n_loops * 2 : 0,                      //
+        builder->buffers[MESH_INFO_BUILDER_CORNERS_MATERIAL_INDEX],        //
+        n_loops,                                                           //
+        material_infos, n_material_infos,                                  //
+        default_material,                                                  //
+        corner_material_infos, n_corner_material_infos,                    //
+        default_corner_material                                            //
+    );
+
+    if (triangles_loops != all_triangles_loops) {
+        free(triangles_loops);
+        free(triangles_material_index);
+    }
+    return mesh;
+}
+
 void free_split_mesh_by_material(struct MeshInfo **meshes, int n_meshes) {
     if (meshes != NULL) {
         for (int i = 0; i < n_meshes; i++) {
@@ -378,7 +580,7 @@ void free_split_mesh_by_material(struct MeshInfo **meshes, int n_meshes) {
 
             if (m != NULL) {
                 free(m->name);
-                free(m->verts);
+                free(m->loops);
                 free(m->faces);
                 if (m->materials != NULL) {
                     free(m->materials[0].name);
@@ -393,72 +595,127 @@ void free_split_mesh_by_material(struct MeshInfo **meshes, int n_meshes) {
 }
 
 /**
+ * Split a mesh into one mesh per material.
+ * The submeshes reference the buffers of the input mesh, which must outlive
+ * them.
+ *
+ * Faces are bucketed by material with a counting sort, then each bucket is
+ * walked once to build the submesh vertices. The per-vertex scratch buffers are
+ * shared by all materials: a vertex "belongs" to the current material if its
+ * stamp is the current material index, so they never need clearing.
+ *
  * @return An array of n_materials pointers
  */
 struct MeshInfo **split_mesh_by_material(struct MeshInfo *in_mesh) {
+    unsigned int n_materials = in_mesh->n_materials;
+    unsigned int n_verts = in_mesh->n_verts;
+    unsigned int n_faces = in_mesh->n_faces;
     struct MeshInfo **out_meshes;
 
     // Use calloc for zero'd memory,
     // needed if free_split_mesh_by_material is called below in failure cases
-    out_meshes = calloc(in_mesh->n_materials, sizeof(struct MeshInfo *));
+    out_meshes = calloc(n_materials, sizeof(struct MeshInfo *));
     if (out_meshes == NULL) {
         log_error("malloc out_meshes failed");
         return NULL;
     }
 
-    for (unsigned int i_mat = 0; i_mat < in_mesh->n_materials; i_mat++) {
+    // bucket faces by material
+
+    unsigned int *material_faces_start =
+        calloc(n_materials + 1, sizeof(unsigned int));
+    unsigned int *sorted_faces = malloc(sizeof(unsigned int) * n_faces);
+    // vertex_stamp, vertex_remap and vertex_order, n_verts each
+    unsigned int *scratch = malloc(sizeof(unsigned int) * n_verts * 3);
+    if (material_faces_start == NULL ||
+        (n_faces != 0 && sorted_faces == NULL) ||
+        (n_verts != 0 && scratch == NULL)) {
+        log_error("malloc material_faces_start, sorted_faces or scratch "
+                  "failed");
+        free(material_faces_start);
+        free(sorted_faces);
+        free(scratch);
+        free_split_mesh_by_material(out_meshes, n_materials);
+        return NULL;
+    }
+
+    for (unsigned int i_face = 0; i_face < n_faces; i_face++) {
+        assert(in_mesh->faces[i_face].material < n_materials);
+        material_faces_start[in_mesh->faces[i_face].material + 1]++;
+    }
+    for (unsigned int i_mat = 0; i_mat < n_materials; i_mat++) {
+        material_faces_start[i_mat + 1] += material_faces_start[i_mat];
+    }
+    // Fill the buckets in face order, so faces keep their relative order.
+    // material_faces_start[i_mat] is used as the insertion cursor and ends up
+    // at the start of bucket i_mat + 1, shift it back afterwards.
+    for (unsigned int i_face = 0; i_face < n_faces; i_face++) {
+        unsigned int mat = in_mesh->faces[i_face].material;
+        sorted_faces[material_faces_start[mat]++] = i_face;
+    }
+    for (unsigned int i_mat = n_materials; i_mat > 0; i_mat--) {
+        material_faces_start[i_mat] = material_faces_start[i_mat - 1];
+    }
+    material_faces_start[0] = 0;
+
+    unsigned int *vertex_stamp = scratch;
+    unsigned int *vertex_remap = scratch + n_verts;
+    unsigned int *vertex_order = scratch + n_verts * 2;
+    for (unsigned int i_vert = 0; i_vert < n_verts; i_vert++) {
+        vertex_stamp[i_vert] = ~0u;
+    }
+
+    for (unsigned int i_mat = 0; i_mat < n_materials; i_mat++) {
         struct MeshInfo *m = malloc(sizeof(struct MeshInfo));
         if (m == NULL) {
             log_error("malloc m failed");
-            free_split_mesh_by_material(out_meshes, in_mesh->n_materials);
+            free(material_faces_start);
+            free(sorted_faces);
+            free(scratch);
+            free_split_mesh_by_material(out_meshes, n_materials);
             return NULL;
         }
         out_meshes[i_mat] = m;
 
-        int n_faces_used = 0;
-        uint8_t *vertices_used = calloc(in_mesh->n_verts, sizeof(uint8_t));
-
-        if (vertices_used == NULL) {
-            log_error("calloc vertices_used failed");
-            m->name = NULL;
-            m->verts = NULL;
-            m->faces = NULL;
-            m->materials = NULL;
-            m->corner_materials = NULL;
-            free_split_mesh_by_material(out_meshes, in_mesh->n_materials);
-            return NULL;
-        }
+        unsigned int *mat_faces = sorted_faces + material_faces_start[i_mat];
+        unsigned int n_faces_used =
+            material_faces_start[i_mat + 1] - material_faces_start[i_mat];
 
-        for (unsigned int i_face = 0; i_face < in_mesh->n_faces; i_face++) {
-            struct TriInfo *f = &in_mesh->faces[i_face];
-
-            if (f->material == i_mat) {
-                n_faces_used++;
-                for (int i = 0; i < 3; i++) {
-                    vertices_used[f->verts[i]] = 1;
+        // collect the vertices used by the material, in order of first use
+        unsigned int n_vertices_used = 0;
+        for (unsigned int i = 0; i < n_faces_used; i++) {
+            struct TriInfo *f = &in_mesh->faces[mat_faces[i]];
+            for (int j = 0; j < 3; j++) {
+                unsigned int v = f->verts[j];
+                if (vertex_stamp[v] != i_mat) {
+                    vertex_stamp[v] = i_mat;
+                    vertex_remap[v] = n_vertices_used;
+                    vertex_order[n_vertices_used] = v;
+                    n_vertices_used++;
                 }
             }
         }
 
-        int n_vertices_used = 0;
-        for (unsigned int i_vert = 0; i_vert < in_mesh->n_verts; i_vert++) {
-            n_vertices_used += vertices_used[i_vert];
-        }
-
         size_t new_name_len = strlen(in_mesh->name) + strlen("_") +
                               strlen(in_mesh->materials[i_mat].name) + 1;
         m->name = malloc(new_name_len);
-        m->verts = malloc(sizeof(struct VertexInfo) * n_vertices_used);
+        m->loops = malloc(sizeof(unsigned int) * n_vertices_used);
         m->faces = malloc(sizeof(struct TriInfo) * n_faces_used);
         m->materials = malloc(sizeof(struct MaterialInfo[1]));
         m->corner_materials = malloc(sizeof(struct CornerMaterialInfo) *
                                      in_mesh->n_corner_materials);
-        if (m->name == NULL || m->verts == NULL || m->faces == NULL ||
+        if (m->name == NULL || m->loops == NULL || m->faces == NULL ||
             m->materials == NULL || m->corner_materials == NULL) {
-            log_error("malloc name, verts, faces, materials or "
+            log_error("malloc name, loops, faces, materials or "
                       "corner_materials failed");
-            free(vertices_used);
-            free_split_mesh_by_material(out_meshes, in_mesh->n_materials);
+            if (m->materials != NULL) {
+                // for free_split_mesh_by_material
+                m->materials[0].name = NULL;
+            }
+            free(material_faces_start);
+            free(sorted_faces);
+            free(scratch);
+            free_split_mesh_by_material(out_meshes, n_materials);
             return NULL;
         }
 
@@ -470,45 +727,25 @@ struct MeshInfo **split_mesh_by_material(struct MeshInfo *in_mesh) {
         m->n_materials = 1;
         m->n_corner_materials = in_mesh->n_corner_materials;
 
-        unsigned int i_face_new = 0;
-        unsigned int i_vert_new = 0;
-        memset(vertices_used, 0, in_mesh->n_verts);
-
-        unsigned int *verts_remap =
-            malloc(sizeof(unsigned int) * in_mesh->n_verts);
-        if (verts_remap == NULL) {
-            log_error("malloc verts_remap failed");
-            free(vertices_used);
-            free_split_mesh_by_material(out_meshes, in_mesh->n_materials);
-            return NULL;
+        // submeshes share the buffers of the input mesh and only reference
+        // the loops they use
+        m->buffers = in_mesh->buffers;
+        for (unsigned int i = 0; i < n_vertices_used; i++) {
+            m->loops[i] = in_mesh->loops == NULL
+                              ? vertex_order[i]
+                              : in_mesh->loops[vertex_order[i]];
         }
 
-        for (unsigned int i_face = 0; i_face < in_mesh->n_faces; i_face++) {
-            struct TriInfo *f = &in_mesh->faces[i_face];
-
-            if (f->material == i_mat) {
-                struct TriInfo *f_new = &m->faces[i_face_new];
-                *f_new = *f;
-                i_face_new++;
-                for (int i = 0; i < 3; i++) {
-                    int v = f->verts[i];
-
-                    if (!vertices_used[v]) {
-                        m->verts[i_vert_new] = in_mesh->verts[v];
-                        verts_remap[v] = i_vert_new;
-                        i_vert_new++;
-                        vertices_used[v] = 1;
-                    }
-
-                    f_new->verts[i] = verts_remap[v];
-                    assert(f_new->verts[i] < m->n_verts);
-                }
+        for (unsigned int i = 0; i < n_faces_used; i++) {
+            struct TriInfo *f = &in_mesh->faces[mat_faces[i]];
+            struct TriInfo *f_new = &m->faces[i];
+            *f_new = *f;
+            for (int j = 0; j < 3; j++) {
+                f_new->verts[j] = vertex_remap[f->verts[j]];
+                assert(f_new->verts[j] < m->n_verts);
             }
         }
 
-        free(verts_remap);
-        free(vertices_used);
-
         copy_MaterialInfo(&m->materials[0], &in_mesh->materials[i_mat]);
 
         for (unsigned int i = 0; i < in_mesh->n_corner_materials; i++) {
@@ -517,9 +754,40 @@ struct MeshInfo **split_mesh_by_material(struct MeshInfo *in_mesh) {
         }
     }
 
+    free(material_faces_start);
+    free(sorted_faces);
+    free(scratch);
+
     return out_meshes;
 }
 
+const struct F3DUcodeProfile f3d_ucode_f3dex2 = {
+    .name = "F3DEX2",
+    .vertex_cache_size = 32,
+    .tri_cmds = F3D_TRI_CMD_1TRIANGLE | F3D_TRI_CMD_2TRIANGLES,
+    .packed_normals = false,
+};
+
+const struct F3DUcodeProfile f3d_ucode_f3dex3 = {
+    .name = "F3DEX3",
+    .vertex_cache_size = 56,
+    .tri_cmds = F3D_TRI_CMD_1TRIANGLE | F3D_TRI_CMD_2TRIANGLES |
+                F3D_TRI_CMD_STRIP_FAN,
+    .packed_normals = true,
+};
+
+const struct F3DUcodeProfile *f3d_ucode_profile_by_name(const char *name) {
+    static const struct F3DUcodeProfile *profiles[] = {
+        &f3d_ucode_f3dex2,
+        &f3d_ucode_f3dex3,
+    };
+    for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+        if (strcmp(profiles[i]->name, name) == 0)
+            return profiles[i];
+    }
+    return NULL;
+}
+
 void free_mesh_to_f3d_mesh(struct f3d_mesh *mesh) {
     if (mesh != NULL) {
         for (int i = 0; i < mesh->n_corner_materials; i++) {
@@ -527,20 +795,9 @@ void free_mesh_to_f3d_mesh(struct f3d_mesh *mesh) {
         }
         free(mesh->corner_materials);
         free(mesh->vertices);
-        if (mesh->entries != NULL) {
-            for (int i = 0; i < mesh->n_entries; i++) {
-                switch (mesh->entries[i]->type) {
-                case F3D_MESH_ENTRY_VERTICES:
-                    break;
-                case F3D_MESH_ENTRY_TRIANGLES:
-                    free(((struct f3d_mesh_entry_triangles *)mesh->entries[i])
-                             ->tris);
-                    break;
-                }
-                free(mesh->entries[i]);
-            }
-            free(mesh->entries);
-        }
+        free(mesh->entries);
+        // the entries and their triangles
+        arena_free(&mesh->arena);
         free(mesh);
     }
 }
@@ -563,19 +820,60 @@ int sort_f3d_vertices_by_corner_material_compare_fn(const void *_a,
     }
 }
 
+/**
+ * F3DEX3 packed normal (G_PACKED_NORMALS), written in the Vtx flag field:
+ * octahedral encoding with x in bits 15..11 and y in bits 10..6, each a 5-bit
+ * signed value.
+ */
+static uint16_t f3d_pack_normal(const float *normal) {
+    float x = normal[0], y = normal[1], z = normal[2];
+    float l1 = fabsf(x) + fabsf(y) + fabsf(z);
+    if (l1 == 0.0f)
+        return 0;
+    x /= l1;
+    y /= l1;
+    if (z < 0.0f) {
+        // fold the lower hemisphere over the diagonals
+        float fx = (1.0f - fabsf(y)) * (x < 0.0f ? -1.0f : 1.0f);
+        float fy = (1.0f - fabsf(x)) * (y < 0.0f ? -1.0f : 1.0f);
+        x = fx;
+        y = fy;
+    }
+    int ix = (int)roundf(clampf(x * 15, -15, 15));
+    int iy = (int)roundf(clampf(y * 15, -15, 15));
+    return (uint16_t)(((ix & 0x1F) << 11) | ((iy & 0x1F) << 6));
+}
+
+static double f3d_tri_area(struct f3d_vertex *a, struct f3d_vertex *b,
+                           struct f3d_vertex *c) {
+    double u[3], v[3];
+    for (int i = 0; i < 3; i++) {
+        u[i] = (double)b->coords[i] - a->coords[i];
+        v[i] = (double)c->coords[i] - a->coords[i];
+    }
+    double n[3] = {
+        u[1] * v[2] - u[2] * v[1],
+        u[2] * v[0] - u[0] * v[2],
+        u[0] * v[1] - u[1] * v[0],
+    };
+    return sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]) / 2;
+}
+
+// n_vertices is at most F3D_VERTEX_CACHE_MAX (the vertices of a batch, loaded
+// at v0)
+// Triangle indices outside of v0..v0+n_vertices are left as is, and ids (the
+// vertex cache entries of the batch) is reordered along with vertices.
 bool sort_f3d_vertices_by_corner_material(
-    struct f3d_vertex *vertices, unsigned int n_vertices,
-    struct f3d_mesh_entry_triangles_triangle *tris, unsigned int n_tris) {
-    struct sort_f3d_vertices_by_corner_material_elem *indices = malloc(
-        sizeof(struct sort_f3d_vertices_by_corner_material_elem) * n_vertices);
-    struct f3d_vertex *vertices_copy =
-        malloc(sizeof(struct f3d_vertex) * n_vertices);
-    unsigned int *remap = malloc(sizeof(unsigned int) * n_vertices);
-    if (indices == NULL || vertices_copy == NULL || remap == NULL) {
-        log_error("malloc indices, vertices_copy or remap failed");
-        free(indices);
-        free(vertices_copy);
-        free(remap);
+    struct f3d_vertex *vertices, unsigned int n_vertices, unsigned int v0,
+    unsigned int *ids, struct f3d_mesh_entry_triangles_triangle *tris,
+    unsigned int n_tris) {
+    struct sort_f3d_vertices_by_corner_material_elem
+        indices[F3D_VERTEX_CACHE_MAX];
+    struct f3d_vertex vertices_copy[F3D_VERTEX_CACHE_MAX];
+    unsigned int ids_copy[F3D_VERTEX_CACHE_MAX];
+    unsigned int remap[F3D_VERTEX_CACHE_MAX];
+    if (n_vertices > F3D_VERTEX_CACHE_MAX) {
+        log_error("too many vertices n_vertices=%u", n_vertices);
         return false;
     }
     for (unsigned int i = 0; i < n_vertices; i++) {
@@ -586,28 +884,88 @@ bool sort_f3d_vertices_by_corner_material(
           sizeof(struct sort_f3d_vertices_by_corner_material_elem),
           sort_f3d_vertices_by_corner_material_compare_fn);
     memcpy(vertices_copy, vertices, sizeof(struct f3d_vertex) * n_vertices);
+    memcpy(ids_copy, ids, sizeof(unsigned int) * n_vertices);
     for (unsigned int i = 0; i < n_vertices; i++) {
         vertices[i] = vertices_copy[indices[i].orig_index];
+        ids[i] = ids_copy[indices[i].orig_index];
         remap[indices[i].orig_index] = i;
     }
     for (unsigned int i = 0; i < n_tris; i++) {
         for (unsigned int j = 0; j < 3; j++) {
-            tris[i].indices[j] = remap[tris[i].indices[j]];
+            unsigned int index = tris[i].indices[j];
+            if (index >= v0 && index < v0 + n_vertices)
+                tris[i].indices[j] = v0 + remap[index - v0];
         }
     }
-    free(indices);
-    free(vertices_copy);
-    free(remap);
     return true;
 }
 
-enum shading_type { SHADING_NULL, SHADING_COLORS, SHADING_NORMALS };
+// Triangles are taken in the order from meshopt_optimizeVertexCache, but
+// looking ahead for the not yet batched triangle that needs the fewest
+// vertices not already in the cache. This packs more triangles per batch,
+// so less gsSPVertex loads.
+#define BATCH_LOOKAHEAD 64
+// evicting a vertex still needed by the next triangles costs reloading it
+#define EVICT_LIVE_VERTEX_COST 3
+// each gsSPVertex also has a fixed cost, so batches are kept large
+// (at least half the vertex cache)
+#define MIN_VERTEX_CACHE_WINDOW_DIVISOR 2
+
+/**
+ * Pick the contiguous slots the next batch loads its vertices into, as the
+ * window with the most free slots and the least vertices still used by the
+ * next BATCH_LOOKAHEAD triangles. The vertices outside it are kept for the
+ * next batch to use. Larger windows win ties, so less batches are needed.
+ */
+static void pick_vertex_cache_window(int cache_size, int *vertex_cache_slot,
+                                     unsigned int *indices, bool *tri_done,
+                                     unsigned int i_first_tri,
+                                     unsigned int n_tris, uint8_t *v0,
+                                     uint8_t *end) {
+    bool live[F3D_VERTEX_CACHE_MAX] = {0};
+    unsigned int n_lookahead = 0;
+    for (unsigned int j = i_first_tri;
+         j < n_tris && n_lookahead < BATCH_LOOKAHEAD; j++) {
+        if (tri_done[j])
+            continue;
+        n_lookahead++;
+        for (int i = 0; i < 3; i++) {
+            int slot = vertex_cache_slot[indices[j * 3 + i]];
+            if (slot >= 0)
+                live[slot] = true;
+        }
+    }
+
+    int best_score = 0, best_a = 0, best_b = cache_size;
+    bool found = false;
+    for (int a = 0; a < cache_size; a++) {
+        int score = 0;
+        for (int b = a + 1; b <= cache_size; b++) {
+            score += live[b - 1] ? -EVICT_LIVE_VERTEX_COST : 1;
+            if (b - a < cache_size / MIN_VERTEX_CACHE_WINDOW_DIVISOR)
+                continue;
+            if (!found || score > best_score ||
+                (score == best_score && b - a > best_b - best_a)) {
+                found = true;
+                best_score = score;
+                best_a = a;
+                best_b = b;
+            }
+        }
+    }
+    *v0 = best_a;
+    *end = best_b;
+}
 
 struct f3d_mesh *mesh_to_f3d_mesh(struct MeshInfo *mesh,
                                   const char **limb_to_matrix_map,
                                   int limb_to_matrix_map_len, int uv_basis_s,
                                   int uv_basis_t,
-                                  enum shading_type shading_type) {
+                                  enum shading_type shading_type,
+                                  const struct F3DUcodeProfile *ucode) {
+    int cache_size = ucode->vertex_cache_size;
+    assert(cache_size <= F3D_VERTEX_CACHE_MAX);
+
     // convert corner materials
 
     struct f3d_mesh_corner_material *f3d_corner_materials = malloc(
@@ -636,7 +994,7 @@ struct f3d_mesh *mesh_to_f3d_mesh(struct MeshInfo *mesh,
         }
     }
 
-    // convert vertices from VertexInfo to f3d_vertex
+    // convert vertices from the mesh buffers to f3d_vertex
 
     struct f3d_vertex *mesh_verts_f3d =
         malloc(sizeof(struct f3d_vertex) * mesh->n_verts);
@@ -651,28 +1009,54 @@ struct f3d_mesh *mesh_to_f3d_mesh(struct MeshInfo *mesh,
         return NULL;
     }
 
+    const struct MeshInfoBuffers *bufs = &mesh->buffers;
+
     for (unsigned int i = 0; i < mesh->n_verts; i++) {
-        struct VertexInfo *vi = &mesh->verts[i];
+        unsigned int loop = mesh->loops == NULL ? i : mesh->loops[i];
+        unsigned int vert = bufs->loops_vertex_index[loop];
         struct f3d_vertex *f3d_v = &mesh_verts_f3d[i];
-        f3d_v->coords[0] = (int16_t)vi->coords[0];
-        f3d_v->coords[1] = (int16_t)vi->coords[1];
-        f3d_v->coords[2] = (int16_t)vi->coords[2];
+
+        const float *co = &bufs->vertices_co[vert * 3];
+        f3d_v->coords[0] = (int16_t)co[0];
+        f3d_v->coords[1] = (int16_t)co[1];
+        f3d_v->coords[2] = (int16_t)co[2];
 
         // TODO uv -> st conversion
         // (this seems correct for basic UVing and clamping)
-        f3d_v->st[0] = (int16_t)(int)(vi->uv[0] * uv_basis_s * (1 << 5));
-        f3d_v->st[1] =
-            (int16_t)(int)((1.0f - vi->uv[1]) * uv_basis_t * (1 << 5));
+        float u = 0.0f, v = 0.0f;
+        if (bufs->loops_uv != NULL) {
+            u = bufs->loops_uv[loop * 2 + 0];
+            v = bufs->loops_uv[loop * 2 + 1];
+        }
+        f3d_v->st[0] = (int16_t)(int)(u * uv_basis_s * (1 << 5));
+        f3d_v->st[1] = (int16_t)(int)((1.0f - v) * uv_basis_t * (1 << 5));
+
+        const float *color = NULL;
+        if (bufs->corners_color != NULL) {
+            color = &bufs->corners_color[loop * 4];
+        } else if (bufs->points_color != NULL) {
+            color = &bufs->points_color[vert * 4];
+        }
 
         switch (shading_type) {
         case SHADING_COLORS:
-            for (int j = 0; j < 3; j++)
-                f3d_v->cn[j] = vi->color[j];
+            for (int j = 0; j < 3; j++) {
+                f3d_v->cn[j] = color == NULL
+                                   ? 255
+                                   : (uint8_t)clampf(color[j] * 255, 0, 255);
+            }
             break;
         case SHADING_NORMALS:
             for (int j = 0; j < 3; j++) {
-                f3d_v->cn[j] =
-                    (uint8_t)(int)clampf(vi->normal[j] * 0x7F, -0x7F, 0x7F);
+                f3d_v->cn[j] = (uint8_t)(int)clampf(
+                    bufs->loops_normal[loop * 3 + j] * 0x7F, -0x7F, 0x7F);
+            }
+            break;
+        case SHADING_COLORS_AND_NORMALS:
+            for (int j = 0; j < 3; j++) {
+                f3d_v->cn[j] = color == NULL
+                                   ? 255
+                                   : (uint8_t)clampf(color[j] * 255, 0, 255);
             }
             break;
         case SHADING_NULL:
@@ -680,9 +1064,15 @@ struct f3d_mesh *mesh_to_f3d_mesh(struct MeshInfo *mesh,
             f3d_v->cn[0] = f3d_v->cn[1] = f3d_v->cn[2] = 0;
             break;
         }
-        f3d_v->alpha = vi->color[3];
-
-        f3d_v->material = vi->material;
+        f3d_v->flag =
+            shading_type == SHADING_COLORS_AND_NORMALS
+                ? f3d_pack_normal(&bufs->loops_normal[loop * 3])
+                : 0;
+        f3d_v->alpha =
+            color == NULL ? 255 : (uint8_t)clampf(color[3] * 255, 0, 255);
+
+        f3d_v->material =
+            bufs->corner_material_index_map[bufs->corners_material_index[loop]];
     }
 
     // remap vertices (merge identical ones)
@@ -702,6 +1092,8 @@ struct f3d_mesh *mesh_to_f3d_mesh(struct MeshInfo *mesh,
         return NULL;
     }
 
+    double t_vertex_remap = stats_now();
+
     for (unsigned int i_face = 0; i_face < mesh->n_faces; i_face++) {
         for (int j = 0; j < 3; j++) {
             indices[i_face * 3 + j] = mesh->faces[i_face].verts[j];
@@ -733,68 +1125,125 @@ struct f3d_mesh *mesh_to_f3d_mesh(struct MeshInfo *mesh,
     free(mesh_verts_f3d);
     free(remap);
 
+    stats_add_stage_time(EXPORT_STAGE_VERTEX_REMAP, t_vertex_remap);
+    stats_add_counter(EXPORT_COUNTER_VERTICES_IN, mesh->n_verts);
+    stats_add_counter(EXPORT_COUNTER_VERTICES_OUT, n_unique_verts);
+
+    double t_optimize = stats_now();
     meshopt_optimizeVertexCache(indices, indices, mesh->n_faces * 3,
                                 n_unique_verts);
+    stats_add_stage_time(EXPORT_STAGE_OPTIMIZE_VERTEX_CACHE, t_optimize);
 
-    // TODO check malloc results
+    double t_batching = stats_now();
+
+    // The entries and their triangles are allocated from an arena owned by
+    // the f3d_mesh, freed all at once by free_mesh_to_f3d_mesh.
+    // Any allocation failure below sets failed and stops the conversion.
+    struct Arena arena;
+    arena_init(&arena);
+    bool failed = false;
 
     size_t vertices_buf_len = n_unique_verts * 2;
     struct f3d_vertex *vertices_buf =
         malloc(sizeof(struct f3d_vertex) * vertices_buf_len);
-#define VERTEX_CACHE 32
-    size_t f3d_entries_buf_len = 2 + 2 * mesh->n_faces / VERTEX_CACHE;
+    size_t f3d_entries_buf_len = 2 + 2 * mesh->n_faces / cache_size;
     struct f3d_mesh_entry_base **f3d_entries =
         malloc(sizeof(void *) * f3d_entries_buf_len);
     size_t i_vertices_buf = 0;
     size_t next_i_f3d_entry = 0;
-    size_t cur_batch_tris_buf_len = VERTEX_CACHE;
+    bool *tri_done = calloc(mesh->n_faces, sizeof(bool));
+    // Vertices stay in the RSP vertex cache after their batch, so each batch
+    // only loads the vertices it is missing, into a window of slots picked by
+    // pick_vertex_cache_window. Triangles can use any slot.
+    // index into vertex_cache for each unique vertex, or -1 if not in the cache
+    int *vertex_cache_slot = malloc(sizeof(int) * n_unique_verts);
+    // the triangles of the batch being built, copied to the arena on flush
+    size_t cur_batch_tris_buf_len = cache_size;
     struct f3d_mesh_entry_triangles_triangle *cur_batch_tris =
         malloc(sizeof(struct f3d_mesh_entry_triangles_triangle) *
                cur_batch_tris_buf_len);
+    if (vertices_buf == NULL || f3d_entries == NULL ||
+        (tri_done == NULL && mesh->n_faces != 0) ||
+        (vertex_cache_slot == NULL && n_unique_verts != 0) ||
+        cur_batch_tris == NULL) {
+        log_error("malloc batching buffers failed");
+        failed = true;
+    } else {
+        for (size_t i = 0; i < n_unique_verts; i++)
+            vertex_cache_slot[i] = -1;
+    }
+    // all triangles before i_first_tri are done
+    unsigned int i_first_tri = 0;
+    unsigned int n_tris_done = 0;
+    int n_vertex_loads = 0;
     int cur_batch_buffer_i = 0;
     uint8_t cur_batch_n = 0;
     uint8_t cur_batch_v0 = 0;
+    // the batch's vertices are loaded to slots cur_batch_v0..cur_batch_end
+    uint8_t cur_batch_end = cache_size;
     unsigned int cur_batch_n_tris = 0;
-    unsigned int vertex_cache[VERTEX_CACHE];
+    // the unique vertex in each slot, or ~0u
+    unsigned int vertex_cache[F3D_VERTEX_CACHE_MAX];
+    for (int i = 0; i < cache_size; i++)
+        vertex_cache[i] = ~0u;
     int i_vertex_cache_next = 0;
-    unsigned int i_tri = 0;
-    while (i_tri < mesh->n_faces) {
-        // count vertices in tri already in cache
-        int in_vertex_cache[3] = {0};
-        int cache_index[3];
-        for (int i = 0; i < 3; i++) {
-            for (int j = 0; j < i_vertex_cache_next; j++) {
-                if (indices[i_tri * 3 + i] == vertex_cache[j]) {
-                    in_vertex_cache[i] = 1;
-                    cache_index[i] = j;
+    while (!failed && n_tris_done < mesh->n_faces) {
+        while (tri_done[i_first_tri])
+            i_first_tri++;
+
+        // pick the triangle with the least vertices not in cache
+        unsigned int i_tri = i_first_tri;
+        int n_not_in_vertex_cache = 4;
+        unsigned int n_lookahead = 0;
+        for (unsigned int j = i_first_tri;
+             j < mesh->n_faces && n_lookahead < BATCH_LOOKAHEAD; j++) {
+            if (tri_done[j])
+                continue;
+            n_lookahead++;
+            int n = 0;
+            for (int i = 0; i < 3; i++) {
+                if (vertex_cache_slot[indices[j * 3 + i]] < 0)
+                    n++;
+            }
+            if (n < n_not_in_vertex_cache) {
+                n_not_in_vertex_cache = n;
+                i_tri = j;
+                if (n == 0)
                     break;
-                }
             }
         }
-        int n_in_vertex_cache =
-            in_vertex_cache[0] + in_vertex_cache[1] + in_vertex_cache[2];
+
         bool tri_verts_fit_in_cache =
-            cur_batch_v0 + cur_batch_n + 3 - n_in_vertex_cache <= VERTEX_CACHE;
+            cur_batch_v0 + cur_batch_n + n_not_in_vertex_cache <= cur_batch_end;
         // if the vertices in the tri not in cache fit in the cache, add them
         if (tri_verts_fit_in_cache) {
+            int cache_index[3];
             for (int i = 0; i < 3; i++) {
-                if (!in_vertex_cache[i]) {
+                // (checked for each vertex so that a vertex used twice by a
+                // degenerate triangle is only added once)
+                if (vertex_cache_slot[indices[i_tri * 3 + i]] >= 0) {
+                    cache_index[i] = vertex_cache_slot[indices[i_tri * 3 + i]];
+                } else {
                     // update cache
                     cache_index[i] = i_vertex_cache_next;
                     vertex_cache[i_vertex_cache_next] = indices[i_tri * 3 + i];
+                    vertex_cache_slot[indices[i_tri * 3 + i]] =
+                        i_vertex_cache_next;
                     cur_batch_n++;
                     i_vertex_cache_next++;
 
                     // append vertex to vertices_buf
                     if (i_vertices_buf >= vertices_buf_len) {
-                        vertices_buf_len *= 2;
                         void *tmp =
                             realloc(vertices_buf, sizeof(struct f3d_vertex) *
-                                                      vertices_buf_len);
+                                                      vertices_buf_len * 2);
                         if (tmp == NULL) {
-                            // TODO
+                            log_error("realloc vertices_buf failed");
+                            failed = true;
+                            break;
                         }
                         vertices_buf = tmp;
+                        vertices_buf_len *= 2;
                     }
                     assert(i_vertices_buf < vertices_buf_len);
                     vertices_buf[i_vertices_buf] =
@@ -803,41 +1252,48 @@ struct f3d_mesh *mesh_to_f3d_mesh(struct MeshInfo *mesh,
                 }
             }
 
+            if (failed)
+                break;
+
             // append tri to tris
             if (cur_batch_n_tris >= cur_batch_tris_buf_len) {
-                cur_batch_tris_buf_len *= 2;
                 void *tmp =
                     realloc(cur_batch_tris,
                             sizeof(struct f3d_mesh_entry_triangles_triangle) *
-                                cur_batch_tris_buf_len);
+                                cur_batch_tris_buf_len * 2);
                 if (tmp == NULL) {
-                    // TODO
+                    log_error("realloc cur_batch_tris failed");
+                    failed = true;
+                    break;
                 }
                 cur_batch_tris = tmp;
+                cur_batch_tris_buf_len *= 2;
             }
             for (int i = 0; i < 3; i++) {
                 cur_batch_tris[cur_batch_n_tris].indices[i] = cache_index[i];
             }
             cur_batch_n_tris++;
 
-            i_tri++;
+            tri_done[i_tri] = true;
+            n_tris_done++;
         }
         // otherwise push the entries
         // (and also push the entries if there are no more tris after)
-        // Note i_tri has already been incremented above if the triangle has
-        // been accepted into the batch, hence comparing to n_faces and not
-        // n_faces - 1
-        bool is_last_tri = i_tri == mesh->n_faces;
+        bool is_last_tri = n_tris_done == mesh->n_faces;
         if (!tri_verts_fit_in_cache || is_last_tri) {
             // sort vertices_buf[cur_batch_buffer_i:][:cur_batch_n] by (corner)
             // material, making sure to remap cur_batch_tris[:cur_batch_n_tris]
             // too
             if (!sort_f3d_vertices_by_corner_material(
                     vertices_buf + cur_batch_buffer_i, cur_batch_n,
-                    cur_batch_tris, cur_batch_n_tris)) {
+                    cur_batch_v0, vertex_cache + cur_batch_v0, cur_batch_tris,
+                    cur_batch_n_tris)) {
                 log_error("sort_f3d_vertices_by_corner_material failed");
-                // TODO
+                failed = true;
+                break;
             }
+            for (int i = cur_batch_v0; i < cur_batch_v0 + cur_batch_n; i++)
+                vertex_cache_slot[vertex_cache[i]] = i;
 
             // Count how many vertices entries (SPVertex) we need to push
 
@@ -867,7 +1323,9 @@ struct f3d_mesh *mesh_to_f3d_mesh(struct MeshInfo *mesh,
                 void *tmp =
                     realloc(f3d_entries, sizeof(void *) * f3d_entries_buf_len);
                 if (tmp == NULL) {
-                    // TODO
+                    log_error("realloc f3d_entries failed");
+                    failed = true;
+                    break;
                 }
                 f3d_entries = tmp;
             }
@@ -880,9 +1338,12 @@ struct f3d_mesh *mesh_to_f3d_mesh(struct MeshInfo *mesh,
                     // Push a vertices entry referencing just this vertex (for
                     // now). The entry may grow in subsequent iterations until
                     // the corner material changes
-                    cur_vertices_entry =
-                        malloc(sizeof(struct f3d_mesh_entry_vertices));
-                    // TODO check malloc
+                    cur_vertices_entry = arena_alloc(
+                        &arena, sizeof(struct f3d_mesh_entry_vertices));
+                    if (cur_vertices_entry == NULL) {
+                        failed = true;
+                        break;
+                    }
                     cur_vertices_entry->base.type = F3D_MESH_ENTRY_VERTICES;
                     cur_vertices_entry->corner_material_index =
                         vertices_buf[cur_batch_buffer_i + i].material;
@@ -892,6 +1353,7 @@ struct f3d_mesh *mesh_to_f3d_mesh(struct MeshInfo *mesh,
 
                     f3d_entries[next_i_f3d_entry] = &cur_vertices_entry->base;
                     next_i_f3d_entry++;
+                    n_vertex_loads++;
 
                     cur_corner_material =
                         cur_vertices_entry->corner_material_index;
@@ -905,56 +1367,326 @@ struct f3d_mesh *mesh_to_f3d_mesh(struct MeshInfo *mesh,
                 }
             }
 
+            if (failed)
+                break;
+
             struct f3d_mesh_entry_triangles *triangles_entry =
-                malloc(sizeof(struct f3d_mesh_entry_triangles));
+                arena_alloc(&arena, sizeof(struct f3d_mesh_entry_triangles));
+            struct f3d_mesh_entry_triangles_triangle *tris =
+                arena_alloc(&arena,
+                            sizeof(struct f3d_mesh_entry_triangles_triangle) *
+                                cur_batch_n_tris);
+            if (triangles_entry == NULL || tris == NULL) {
+                failed = true;
+                break;
+            }
+            memcpy(tris, cur_batch_tris,
+                   sizeof(struct f3d_mesh_entry_triangles_triangle) *
+                       cur_batch_n_tris);
             triangles_entry->base.type = F3D_MESH_ENTRY_TRIANGLES;
-            triangles_entry->tris = cur_batch_tris;
+            triangles_entry->tris = tris;
             triangles_entry->n_tris = cur_batch_n_tris;
             f3d_entries[next_i_f3d_entry] = &triangles_entry->base;
             next_i_f3d_entry++;
 
-            cur_batch_tris_buf_len = VERTEX_CACHE;
-            cur_batch_tris =
-                malloc(sizeof(struct f3d_mesh_entry_triangles_triangle) *
-                       cur_batch_tris_buf_len);
-            // TODO check malloc
             cur_batch_buffer_i = i_vertices_buf;
             cur_batch_n = 0;
-            cur_batch_v0 = 0;
             cur_batch_n_tris = 0;
 
-            // reset the cache state
-            i_vertex_cache_next = 0;
+            // evict the vertices in the next batch's window
+            pick_vertex_cache_window(cache_size, vertex_cache_slot, indices,
+                                     tri_done, i_first_tri, mesh->n_faces,
+                                     &cur_batch_v0, &cur_batch_end);
+            for (int i = cur_batch_v0; i < cur_batch_end; i++) {
+                if (vertex_cache[i] != ~0u)
+                    vertex_cache_slot[vertex_cache[i]] = -1;
+                vertex_cache[i] = ~0u;
+            }
+            i_vertex_cache_next = cur_batch_v0;
 
-            // Note: don't increment i_tri,
-            // process the same tri next iteration with the new state
+            // Note: if the tri was not added, it is picked again next
+            // iteration with the new state
         }
     }
 
-    // cur_batch_tris is allocated in advance, it's simpler to just free the
-    // extra unused one at the end
-    free(cur_batch_tris);
+    // for the fill estimate of the display list cost
+    double area = 0;
+    for (unsigned int i_face = 0; i_face < mesh->n_faces; i_face++) {
+        area += f3d_tri_area(&vertices[indices[i_face * 3 + 0]],
+                             &vertices[indices[i_face * 3 + 1]],
+                             &vertices[indices[i_face * 3 + 2]]);
+    }
 
+    free(tri_done);
+    free(vertex_cache_slot);
+    free(cur_batch_tris);
     free(vertices);
     free(indices);
 
-    struct f3d_mesh *f3d_mesh = malloc(sizeof(struct f3d_mesh));
-    // TODO check malloc
+    struct f3d_mesh *f3d_mesh = NULL;
+    if (!failed) {
+        f3d_mesh = malloc(sizeof(struct f3d_mesh));
+        if (f3d_mesh == NULL)
+            log_error("malloc f3d_mesh failed");
+    }
+    if (f3d_mesh == NULL) {
+        for (unsigned int i = 0; i < mesh->n_corner_materials; i++) {
+            free(f3d_corner_materials[i].matrix);
+        }
+        free(f3d_corner_materials);
+        free(vertices_buf);
+        free(f3d_entries);
+        arena_free(&arena);
+        return NULL;
+    }
+
+    stats_add_stage_time(EXPORT_STAGE_BATCHING, t_batching);
+    stats_add_counter(EXPORT_COUNTER_VERTEX_LOADS, n_vertex_loads);
+    stats_add_counter(EXPORT_COUNTER_TRIANGLES, mesh->n_faces);
+
+    log_debug(
+        "%s: %u tris, %zu vertices loaded by %d gsSPVertex "
+        "(%.3f vertices/tri, %.3f loads/tri)",
+        mesh->name, mesh->n_faces, i_vertices_buf, n_vertex_loads,
+        mesh->n_faces == 0 ? 0.0 : (double)i_vertices_buf / mesh->n_faces,
+        mesh->n_faces == 0 ? 0.0 : (double)n_vertex_loads / mesh->n_faces);
+
+    f3d_mesh->arena = arena;
     f3d_mesh->corner_materials = f3d_corner_materials;
     f3d_mesh->vertices = vertices_buf;
     f3d_mesh->entries = f3d_entries;
     f3d_mesh->n_corner_materials = mesh->n_corner_materials;
     f3d_mesh->n_vertices = i_vertices_buf;
     f3d_mesh->n_entries = next_i_f3d_entry;
+    f3d_mesh->n_tris = mesh->n_faces;
+    f3d_mesh->n_vertex_loads = n_vertex_loads;
+    f3d_mesh->area = area;
     return f3d_mesh;
 }
 
-int write_f3d_mat(FILE *f, struct MaterialInfo *mat_info, const char *name) {
-    struct MaterialInfoOtherModes *om = &mat_info->other_modes;
+void f3d_mat_state_init(struct F3DMatState *state) {
+    for (int i = 0; i < F3D_MAT_STATE_PART_COUNT; i++) {
+        state->cmds[i] = NULL;
+        state->cmds_len[i] = 0;
+    }
+    state->n_loads = 0;
+}
+
+void f3d_mat_state_free(struct F3DMatState *state) {
+    for (int i = 0; i < F3D_MAT_STATE_PART_COUNT; i++) {
+        free(state->cmds[i]);
+        state->cmds[i] = NULL;
+    }
+    for (int i = 0; i < state->n_loads; i++)
+        free(state->loads[i].cmd);
+    state->n_loads = 0;
+}
+
+static bool f3d_mat_state_cmd_equal(const char *a, size_t a_len,
+                                    struct TextBuffer *cmd) {
+    return a != NULL && a_len == cmd->len && memcmp(a, cmd->data, a_len) == 0;
+}
+
+static char *f3d_mat_state_copy_cmd(struct TextBuffer *cmd) {
+    char *copy = malloc(cmd->len + 1);
+    if (copy == NULL) {
+        log_error("malloc copy failed");
+        return NULL;
+    }
+    memcpy(copy, cmd->data, cmd->len);
+    copy[cmd->len] = '\0';
+    return copy;
+}
+
+/** Forgetting a part is always correct, its commands will be written again */
+static void f3d_mat_state_set(struct F3DMatState *state,
+                              enum f3d_mat_state_part part,
+                              struct TextBuffer *cmd) {
+    free(state->cmds[part]);
+    state->cmds[part] = cmd == NULL ? NULL : f3d_mat_state_copy_cmd(cmd);
+    state->cmds_len[part] = cmd == NULL ? 0 : cmd->len;
+}
+
+/**
+ * Move the commands in cmd to out, unless state says they are already in
+ * effect. Returns true if they were written.
+ */
+static bool f3d_mat_state_emit(struct TextBuffer *out,
+                               struct F3DMatState *state,
+                               enum f3d_mat_state_part part,
+                               struct TextBuffer *cmd) {
+    bool emit = true;
+    if (state != NULL) {
+        if (f3d_mat_state_cmd_equal(state->cmds[part], state->cmds_len[part],
+                                    cmd))
+            emit = false;
+        else
+            f3d_mat_state_set(state, part, cmd);
+    }
+    if (emit)
+        text_buffer_append(out, cmd->data, cmd->len);
+    cmd->len = 0;
+    return emit;
+}
+
+/**
+ * Same as f3d_mat_state_emit for a texture load to tile i_tile, which also
+ * fills TMEM from tmem_start to tmem_end (in bytes) and uses the load tile.
+ * The load is skipped if the same texture is still resident at the same
+ * address and the tile descriptor was left as the load sets it.
+ */
+static bool f3d_mat_state_emit_load(struct TextBuffer *out,
+                                    struct F3DMatState *state, int i_tile,
+                                    struct TextBuffer *cmd,
+                                    unsigned int tmem_start,
+                                    unsigned int tmem_end) {
+    if (state == NULL)
+        return f3d_mat_state_emit(out, state, F3D_MAT_STATE_TILE_0 + i_tile,
+                                  cmd);
+
+    bool resident = false;
+    for (int i = 0; i < state->n_loads; i++) {
+        struct F3DMatStateLoad *load = &state->loads[i];
+        if (f3d_mat_state_cmd_equal(load->cmd, load->cmd_len, cmd))
+            resident = true;
+    }
+    if (resident &&
+        f3d_mat_state_cmd_equal(state->cmds[F3D_MAT_STATE_TILE_0 + i_tile],
+                                state->cmds_len[F3D_MAT_STATE_TILE_0 + i_tile],
+                                cmd)) {
+        cmd->len = 0;
+        return false;
+    }
+
+    // forget the loads overwritten by this one
+    int n_loads = 0;
+    for (int i = 0; i < state->n_loads; i++) {
+        struct F3DMatStateLoad *load = &state->loads[i];
+        if (load->tmem_start < tmem_end && tmem_start < load->tmem_end)
+            free(load->cmd);
+        else
+            state->loads[n_loads++] = *load;
+    }
+    state->n_loads = n_loads;
+    if (state->n_loads == F3D_MAT_STATE_MAX_LOADS) {
+        free(state->loads[0].cmd);
+        memmove(&state->loads[0], &state->loads[1],
+                sizeof(struct F3DMatStateLoad) * (state->n_loads - 1));
+        state->n_loads--;
+    }
+    char *load_cmd = f3d_mat_state_copy_cmd(cmd);
+    if (load_cmd != NULL) {
+        struct F3DMatStateLoad *load = &state->loads[state->n_loads++];
+        load->cmd = load_cmd;
+        load->cmd_len = cmd->len;
+        load->tmem_start = tmem_start;
+        load->tmem_end = tmem_end;
+    }
+
+    // the load goes through G_TX_LOADTILE (7) before setting i_tile
+    f3d_mat_state_set(state, F3D_MAT_STATE_TILE_0 + 7, NULL);
+    f3d_mat_state_set(state, F3D_MAT_STATE_TILE_0 + i_tile, cmd);
+
+    text_buffer_append(out, cmd->data, cmd->len);
+    cmd->len = 0;
+    return true;
+}
+
+/** End (in bytes) of the TMEM filled by loading image to tile */
+static unsigned int tmem_load_end(struct MaterialInfoTile *tile,
+                                  struct MaterialInfoImage *image) {
+    // 32-bit texels are split across both halves of TMEM
+    if (tile->size == RDP_TILE_SIZE_32)
+        return 4096;
+    static const unsigned int bits[] = {
+        [RDP_TILE_SIZE_4] = 4,
+        [RDP_TILE_SIZE_8] = 8,
+        [RDP_TILE_SIZE_16] = 16,
+    };
+    unsigned int n_bits =
+        (unsigned int)(image->width * image->height) * bits[tile->size];
+    // TMEM is filled in 64-bit words
+    unsigned int n_bytes = (n_bits + 63) / 64 * 8;
+    return (unsigned int)tile->address * 8 + n_bytes;
+}
+
+// Rough per-item cycle counts, from the usual F3DEX2 figures.
+// RSP: fetching and dispatching a command, transforming (and lighting) a
+// vertex, setting up a triangle, loading a matrix
+#define RSP_CYCLES_PER_GFX 10
+#define RSP_CYCLES_PER_VERTEX 20
+#define RSP_CYCLES_PER_TRI 60
+#define RSP_CYCLES_PER_MATRIX 100
+// RDP: loads write TMEM 8 bytes per cycle, 1-cycle mode fills a pixel per
+// cycle and 2-cycle mode a pixel every two cycles
+#define RDP_TMEM_BYTES_PER_CYCLE 8
+
+void f3d_dl_cost_add(struct F3DDLCost *to, const struct F3DDLCost *cost) {
+    to->n_gfx += cost->n_gfx;
+    to->vtx_bytes += cost->vtx_bytes;
+    to->n_vertex_loads += cost->n_vertex_loads;
+    to->n_matrix_loads += cost->n_matrix_loads;
+    to->tex_load_bytes += cost->tex_load_bytes;
+    to->n_tris += cost->n_tris;
+    to->fill_area_1cycle += cost->fill_area_1cycle;
+    to->fill_area_2cycle += cost->fill_area_2cycle;
+}
+
+double f3d_dl_cost_rsp(const struct F3DDLCost *cost) {
+    // Vtx are 16 bytes
+    return (double)cost->n_gfx * RSP_CYCLES_PER_GFX +
+           (double)(cost->vtx_bytes / 16) * RSP_CYCLES_PER_VERTEX +
+           (double)cost->n_tris * RSP_CYCLES_PER_TRI +
+           (double)cost->n_matrix_loads * RSP_CYCLES_PER_MATRIX;
+}
+
+double f3d_dl_cost_rdp(const struct F3DDLCost *cost) {
+    return (double)cost->tex_load_bytes / RDP_TMEM_BYTES_PER_CYCLE +
+           cost->fill_area_1cycle + 2 * cost->fill_area_2cycle;
+}
+
+int write_f3d_mat(struct TextBuffer *b, struct MaterialInfo *mat_info,
+                  const char *name) {
+    return write_f3d_mat_diff(b, mat_info, name, &f3d_ucode_f3dex2, NULL,
+                              NULL);
+}
+
+/**
+ * Count the commands of display list text as written by write_f3d_mat_diff,
+ * one per macro except for the texture loads.
+ */
+static unsigned int f3d_count_gfx(const char *text, size_t len) {
+    static const char load_block[] = "    gsDPLoadMultiBlock";
+    unsigned int n_gfx = 0;
+    size_t i = 0;
+    while (i < len) {
+        size_t line_len = 0;
+        while (i + line_len < len && text[i + line_len] != '\n')
+            line_len++;
+        if (line_len >= strlen(load_block) &&
+            memcmp(&text[i], load_block, strlen(load_block)) == 0) {
+            // SetTextureImage, SetTile, LoadSync, LoadBlock, PipeSync,
+            // SetTile, SetTileSize
+            n_gfx += 7;
+        } else if (line_len >= 6 && memcmp(&text[i], "    gs", 6) == 0) {
+            n_gfx++;
+        }
+        i += line_len + 1;
+    }
+    return n_gfx;
+}
 
-    fprintf(f, "Gfx %s_mat_dl[] = {\n", name);
+int write_f3d_mat_diff(struct TextBuffer *b, struct MaterialInfo *mat_info,
+                       const char *name, const struct F3DUcodeProfile *ucode,
+                       struct F3DMatState *state, struct F3DDLCost *cost) {
+    struct MaterialInfoOtherModes *om = &mat_info->other_modes;
 
-    fprintf(f, "    gsDPPipeSync(),\n");
+    // the commands after gsDPPipeSync, which is only needed if they change
+    // some RDP state
+    struct TextBuffer body, cmd;
+    text_buffer_init(&body);
+    text_buffer_init(&cmd);
+    bool rdp_changed = false;
 
     static const char *cycle_type_names[] = {
         [RDP_OM_CYCLE_TYPE_1CYCLE] = "G_CYC_1CYCLE",
@@ -1019,8 +1751,8 @@ int write_f3d_mat(FILE *f, struct MaterialInfo *mat_info, const char *name) {
         [RDP_OM_CVG_DEST_SAVE] = "CVG_DST_SAVE",
     };
 
-    fprintf(
-        f,
+    bprintf(
+        &cmd,
         "    gsDPSetOtherMode(\n"
         "        %s\n"
         "      | %s\n"
@@ -1082,6 +1814,8 @@ int write_f3d_mat(FILE *f, struct MaterialInfo *mat_info, const char *name) {
         om->alpha_compare_en
             ? om->dither_alpha_en ? "G_AC_DITHER" : "G_AC_THRESHOLD"
             : "G_AC_NONE");
+    rdp_changed |=
+        f3d_mat_state_emit(&body, state, F3D_MAT_STATE_OTHER_MODE, &cmd);
 
     static const char *tile_format_names[] = {
         [RDP_TILE_FORMAT_RGBA] = "G_IM_FMT_RGBA",
@@ -1117,8 +1851,8 @@ int write_f3d_mat(FILE *f, struct MaterialInfo *mat_info, const char *name) {
 
             if (!address_already_used) {
                 // TODO use gsDPLoadMultiTile for textures with line%8!=0 ?
-                fprintf(
-                    f,
+                bprintf(
+                    &cmd,
                     "    %s("
                     "%s, 0x%03X, %d, "
                     "%s, %s%s"
@@ -1145,6 +1879,14 @@ int write_f3d_mat(FILE *f, struct MaterialInfo *mat_info, const char *name) {
 
                     tile->mask_S, tile->mask_T, tile->shift_S, tile->shift_T);
 
+                unsigned int tmem_start = tile->address * 8;
+                unsigned int tmem_end = tmem_load_end(tile, image);
+                bool loaded = f3d_mat_state_emit_load(
+                    &body, state, i_tile, &cmd, tmem_start, tmem_end);
+                rdp_changed |= loaded;
+                if (loaded && cost != NULL)
+                    cost->tex_load_bytes += tmem_end - tmem_start;
+
                 is_tile_set[i_tile] = true;
             }
         }
@@ -1160,7 +1902,7 @@ int write_f3d_mat(FILE *f, struct MaterialInfo *mat_info, const char *name) {
         if (!om->tex_lod_en && i_tile >= 2)
             continue;
 
-        fprintf(f,
+        bprintf(&cmd,
                 "    gsDPSetTile("
                 "%s, %s, 0x%X, 0x%03X, %d, %d, "
                 "%s | %s, %d, %d, "
@@ -1175,13 +1917,15 @@ int write_f3d_mat(FILE *f, struct MaterialInfo *mat_info, const char *name) {
                 tile->mirror_S ? "G_TX_MIRROR" : "G_TX_NOMIRROR",
                 tile->clamp_S ? "G_TX_CLAMP" : "G_TX_WRAP", tile->mask_S,
                 tile->shift_S);
-        fprintf(f,
+        bprintf(&cmd,
                 "    gsDPSetTileSize("
                 "%d, "
                 "(int)(%.2f * 4), (int)(%.2f * 4), "
                 "(int)(%.2f * 4), (int)(%.2f * 4)),\n",
                 i_tile, tile->upper_left_S, tile->upper_left_T,
                 tile->lower_right_S, tile->lower_right_T);
+        rdp_changed |= f3d_mat_state_emit(&body, state,
+                                          F3D_MAT_STATE_TILE_0 + i_tile, &cmd);
     }
 
     static const char *combiner_rgb_A_names[] = {
@@ -1279,7 +2023,7 @@ int write_f3d_mat(FILE *f, struct MaterialInfo *mat_info, const char *name) {
 
     struct MaterialInfoCombiner *comb = &mat_info->combiner;
 
-    fprintf(f,
+    bprintf(&cmd,
             "    gsDPSetCombineLERP("
             "%s, %s, %s, %s, "
             "%s, %s, %s, %s, "
@@ -1302,42 +2046,56 @@ int write_f3d_mat(FILE *f, struct MaterialInfo *mat_info, const char *name) {
             combiner_alpha_B_names[comb->alpha_B_1],
             combiner_alpha_C_names[comb->alpha_C_1],
             combiner_alpha_D_names[comb->alpha_D_1]);
+    rdp_changed |=
+        f3d_mat_state_emit(&body, state, F3D_MAT_STATE_COMBINE, &cmd);
 
     struct MaterialInfoVals *vals = &mat_info->vals;
 
-    fprintf(f, "    gsDPSetPrimDepth(%d, %d),\n", vals->primitive_depth_z,
+    bprintf(&cmd, "    gsDPSetPrimDepth(%d, %d),\n", vals->primitive_depth_z,
             vals->primitive_depth_dz);
+    rdp_changed |=
+        f3d_mat_state_emit(&body, state, F3D_MAT_STATE_PRIM_DEPTH, &cmd);
 
     struct rgbau8 fog_color = rgbaf_to_rgbau8(&vals->fog_color);
-    fprintf(f,
+    bprintf(&cmd,
             "    gsDPSetFogColor(%" PRId8 ", %" PRId8 ", %" PRId8 ", %" PRId8
             "),\n",
             fog_color.r, fog_color.g, fog_color.b, fog_color.a);
+    rdp_changed |=
+        f3d_mat_state_emit(&body, state, F3D_MAT_STATE_FOG_COLOR, &cmd);
 
     struct rgbau8 blend_color = rgbaf_to_rgbau8(&vals->blend_color);
-    fprintf(f,
+    bprintf(&cmd,
             "    gsDPSetBlendColor(%" PRId8 ", %" PRId8 ", %" PRId8 ", %" PRId8
             "),\n",
             blend_color.r, blend_color.g, blend_color.b, blend_color.a);
+    rdp_changed |=
+        f3d_mat_state_emit(&body, state, F3D_MAT_STATE_BLEND_COLOR, &cmd);
 
     struct rgbau8 primitive_color = rgbaf_to_rgbau8(&vals->primitive_color);
-    fprintf(f,
+    bprintf(&cmd,
             "    gsDPSetPrimColor(%d, %d, %" PRId8 ", %" PRId8 ", %" PRId8
             ", %" PRId8 "),\n",
             vals->min_level, vals->prim_lod_frac, primitive_color.r,
             primitive_color.g, primitive_color.b, primitive_color.a);
+    rdp_changed |=
+        f3d_mat_state_emit(&body, state, F3D_MAT_STATE_PRIM_COLOR, &cmd);
 
     struct rgbau8 environment_color = rgbaf_to_rgbau8(&vals->environment_color);
-    fprintf(f,
+    bprintf(&cmd,
             "    gsDPSetEnvColor(%" PRId8 ", %" PRId8 ", %" PRId8 ", %" PRId8
             "),\n",
             environment_color.r, environment_color.g, environment_color.b,
             environment_color.a);
+    rdp_changed |=
+        f3d_mat_state_emit(&body, state, F3D_MAT_STATE_ENV_COLOR, &cmd);
 
     // TODO props for gsSPTexture arguments
-    fprintf(f, "    gsSPTexture(0xFFFF, 0xFFFF, 0, G_TX_RENDERTILE, G_ON),\n");
+    bprintf(&cmd,
+            "    gsSPTexture(0xFFFF, 0xFFFF, 0, G_TX_RENDERTILE, G_ON),\n");
+    f3d_mat_state_emit(&body, state, F3D_MAT_STATE_TEXTURE, &cmd);
 
-#define N_GEOMETRY_MODES_MAX 9
+#define N_GEOMETRY_MODES_MAX 10
     const char *clear_geometry_mode[N_GEOMETRY_MODES_MAX];
     int len_clear_geometry_mode = 0;
     const char *set_geometry_mode[N_GEOMETRY_MODES_MAX];
@@ -1373,6 +2131,11 @@ int write_f3d_mat(FILE *f, struct MaterialInfo *mat_info, const char *name) {
                       "G_SHADE");
 
     ADD_GEOMETRY_MODE(mat_info->geometry_mode.lighting, "G_LIGHTING");
+    // vertices have both colors and normals (SHADING_COLORS_AND_NORMALS)
+    if (ucode->packed_normals)
+        ADD_GEOMETRY_MODE(mat_info->geometry_mode.lighting &&
+                              mat_info->geometry_mode.vertex_colors,
+                          "G_PACKED_NORMALS");
     ADD_GEOMETRY_MODE(mat_info->geometry_mode.cull_front, "G_CULL_FRONT");
     ADD_GEOMETRY_MODE(mat_info->geometry_mode.cull_back, "G_CULL_BACK");
     ADD_GEOMETRY_MODE(mat_info->geometry_mode.fog, "G_FOG");
@@ -1390,52 +2153,455 @@ int write_f3d_mat(FILE *f, struct MaterialInfo *mat_info, const char *name) {
 
     ADD_GEOMETRY_MODE(mat_info->geometry_mode.shade_smooth, "G_SHADING_SMOOTH");
 
-    fprintf(f, "    gsSPGeometryMode(\n");
+    bprintf(&cmd, "    gsSPGeometryMode(\n");
     if (len_clear_geometry_mode == 0) {
-        fprintf(f, "        0\n");
+        bprintf(&cmd, "        0\n");
     } else {
-        fprintf(f, "        %s\n", clear_geometry_mode[0]);
+        bprintf(&cmd, "        %s\n", clear_geometry_mode[0]);
         for (int i = 1; i < len_clear_geometry_mode; i++) {
-            fprintf(f, "      | %s\n", clear_geometry_mode[i]);
+            bprintf(&cmd, "      | %s\n", clear_geometry_mode[i]);
         }
     }
-    fprintf(f, "        ,\n");
+    bprintf(&cmd, "        ,\n");
     if (len_set_geometry_mode == 0) {
-        fprintf(f, "        0\n");
+        bprintf(&cmd, "        0\n");
     } else {
-        fprintf(f, "        %s\n", set_geometry_mode[0]);
+        bprintf(&cmd, "        %s\n", set_geometry_mode[0]);
         for (int i = 1; i < len_set_geometry_mode; i++) {
-            fprintf(f, "      | %s\n", set_geometry_mode[i]);
+            bprintf(&cmd, "      | %s\n", set_geometry_mode[i]);
         }
     }
-    fprintf(f, "    ),\n");
-
-    fprintf(f, "    gsSPEndDisplayList(),\n");
-    fprintf(f, "};\n");
+    bprintf(&cmd, "    ),\n");
+    f3d_mat_state_emit(&body, state, F3D_MAT_STATE_GEOMETRY_MODE, &cmd);
+
+    bprintf(b, "Gfx %s_mat_dl[] = {\n", name);
+    if (state == NULL || rdp_changed)
+        bprintf(b, "    gsDPPipeSync(),\n");
+    if (body.len != 0)
+        text_buffer_append(b, body.data, body.len);
+    bprintf(b, "    gsSPEndDisplayList(),\n");
+    bprintf(b, "};\n");
+
+    if (cost != NULL) {
+        cost->n_gfx += (state == NULL || rdp_changed ? 1 : 0) +
+                       f3d_count_gfx(body.data, body.len) + 1;
+    }
 
-    return 0;
+    bool error = body.error || cmd.error;
+    text_buffer_free(&body);
+    text_buffer_free(&cmd);
+    if (error) {
+        b->error = true;
+        return -1;
+    }
+    return 0;
 }
 
-int write_f3d_mesh(FILE *f, struct f3d_mesh *mesh, const char *name) {
-    fprintf(f, "Vtx %s_mesh_vtx[] = {\n", name);
-    for (int i = 0; i < mesh->n_vertices; i++) {
-        struct f3d_vertex *v = &mesh->vertices[i];
+static void bput_f3d_vertex(struct TextBuffer *b, struct f3d_vertex *v) {
+    // "    {{ { %d, %d, %d }, %u, { %d, %d }, { 0x%X, 0x%X, 0x%X, %u } }},"
+    bputs(b, "    {{ { ");
+    bput_int(b, v->coords[0]);
+    bputs(b, ", ");
+    bput_int(b, v->coords[1]);
+    bputs(b, ", ");
+    bput_int(b, v->coords[2]);
+    bputs(b, " }, ");
+    bput_uint(b, v->flag);
+    bputs(b, ", { ");
+    bput_int(b, v->st[0]);
+    bputs(b, ", ");
+    bput_int(b, v->st[1]);
+    bputs(b, " }, { 0x");
+    bput_hex(b, v->cn[0], 1);
+    bputs(b, ", 0x");
+    bput_hex(b, v->cn[1], 1);
+    bputs(b, ", 0x");
+    bput_hex(b, v->cn[2], 1);
+    bputs(b, ", ");
+    bput_uint(b, v->alpha);
+    bputs(b, " } }},\n");
+}
+
+// f3d_vertex.material is not part of the Vtx, vertices only differing by it
+// are the same once written
+static bool f3d_vertex_vtx_equal(struct f3d_vertex *a, struct f3d_vertex *b) {
+    return a->coords[0] == b->coords[0] && a->coords[1] == b->coords[1] &&
+           a->coords[2] == b->coords[2] && a->st[0] == b->st[0] &&
+           a->st[1] == b->st[1] && a->cn[0] == b->cn[0] &&
+           a->cn[1] == b->cn[1] && a->cn[2] == b->cn[2] &&
+           a->alpha == b->alpha && a->flag == b->flag;
+}
+
+static uint32_t f3d_vertex_run_hash(struct f3d_vertex *vertices,
+                                    unsigned int n) {
+    // the fields compared by f3d_vertex_vtx_equal, without padding
+    uint8_t packed[F3D_VERTEX_CACHE_MAX * 16];
+    assert(n <= F3D_VERTEX_CACHE_MAX);
+    for (unsigned int i = 0; i < n; i++) {
+        struct f3d_vertex *v = &vertices[i];
+        uint8_t *p = &packed[i * 16];
+        memcpy(p, v->coords, 6);
+        memcpy(p + 6, v->st, 4);
+        memcpy(p + 10, v->cn, 3);
+        p[13] = v->alpha;
+        memcpy(p + 14, &v->flag, 2);
+    }
+    return hash_bytes(packed, n * 16);
+}
+
+int f3d_vtx_pool_init(struct F3DVtxPool *pool, const char *name) {
+    pool->name = strdup(name);
+    pool->vertices = NULL;
+    pool->n_vertices = pool->cap_vertices = 0;
+    pool->runs = NULL;
+    pool->n_runs = pool->cap_runs = 0;
+    pool->declared = false;
+    pool->error = false;
+    if (pool->name == NULL) {
+        log_error("strdup name failed");
+        return -1;
+    }
+    if (index_hash_map_init(&pool->runs_map, 0) != 0) {
+        log_error("index_hash_map_init failed");
+        free(pool->name);
+        return -1;
+    }
+    return 0;
+}
+
+void f3d_vtx_pool_free(struct F3DVtxPool *pool) {
+    free(pool->name);
+    free(pool->vertices);
+    free(pool->runs);
+    index_hash_map_free(&pool->runs_map);
+}
+
+struct f3d_vtx_pool_run_eq_arg {
+    struct F3DVtxPool *pool;
+    struct f3d_vertex *vertices;
+    unsigned int n;
+};
+
+static bool f3d_vtx_pool_run_eq(void *_arg, uint32_t index) {
+    struct f3d_vtx_pool_run_eq_arg *arg = _arg;
+    struct F3DVtxPoolRun *run = &arg->pool->runs[index];
+    if (run->n != arg->n)
+        return false;
+    for (unsigned int i = 0; i < arg->n; i++) {
+        if (!f3d_vertex_vtx_equal(&arg->pool->vertices[run->start + i],
+                                  &arg->vertices[i]))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Returns the index in the pool of a run of vertices identical to the n
+ * vertices, adding them if there is none.
+ * Sets pool->error and returns 0 on failure.
+ */
+static size_t f3d_vtx_pool_add(struct F3DVtxPool *pool,
+                               struct f3d_vertex *vertices, unsigned int n) {
+    uint32_t hash = f3d_vertex_run_hash(vertices, n);
+    struct f3d_vtx_pool_run_eq_arg arg = {pool, vertices, n};
+    uint32_t found =
+        index_hash_map_find(&pool->runs_map, hash, f3d_vtx_pool_run_eq, &arg);
+    if (found != ~0u)
+        return pool->runs[found].start;
+
+    if (pool->n_vertices + n > pool->cap_vertices) {
+        size_t new_cap = pool->cap_vertices * 2 + n;
+        void *tmp =
+            realloc(pool->vertices, sizeof(struct f3d_vertex) * new_cap);
+        if (tmp == NULL) {
+            log_error("realloc vertices failed");
+            pool->error = true;
+            return 0;
+        }
+        pool->vertices = tmp;
+        pool->cap_vertices = new_cap;
+    }
+    if (pool->n_runs == pool->cap_runs) {
+        size_t new_cap = pool->cap_runs * 2 + 16;
+        void *tmp = realloc(pool->runs, sizeof(struct F3DVtxPoolRun) * new_cap);
+        if (tmp == NULL) {
+            log_error("realloc runs failed");
+            pool->error = true;
+            return 0;
+        }
+        pool->runs = tmp;
+        pool->cap_runs = new_cap;
+    }
+    if (index_hash_map_insert(&pool->runs_map, hash, pool->n_runs) != 0) {
+        log_error("index_hash_map_insert failed");
+        pool->error = true;
+        return 0;
+    }
+
+    size_t start = pool->n_vertices;
+    memcpy(&pool->vertices[start], vertices, sizeof(struct f3d_vertex) * n);
+    pool->n_vertices += n;
+    pool->runs[pool->n_runs].start = start;
+    pool->runs[pool->n_runs].n = n;
+    pool->n_runs++;
+    return start;
+}
+
+int f3d_vtx_pool_add_mesh(struct F3DVtxPool *pool, struct f3d_mesh *mesh) {
+    for (int i = 0; i < mesh->n_entries; i++) {
+        if (mesh->entries[i]->type != F3D_MESH_ENTRY_VERTICES)
+            continue;
+        struct f3d_mesh_entry_vertices *e =
+            (struct f3d_mesh_entry_vertices *)mesh->entries[i];
+        e->pool_i = f3d_vtx_pool_add(pool, &mesh->vertices[e->buffer_i], e->n);
+    }
+    return pool->error ? -1 : 0;
+}
+
+int write_f3d_vtx_pool(struct TextBuffer *b, struct F3DVtxPool *pool) {
+    if (pool->error)
+        return -1;
+    // no mesh used the pool, and a zero-length array would not compile
+    if (pool->n_vertices == 0)
+        return 0;
+    bprintf(b, "Vtx %s[] = {\n", pool->name);
+    for (size_t i = 0; i < pool->n_vertices; i++)
+        bput_f3d_vertex(b, &pool->vertices[i]);
+    bputs(b, "};\n");
+    return b->error ? -2 : 0;
+}
+
+int f3d_mat_registry_init(struct F3DMatRegistry *reg) {
+    reg->entries = NULL;
+    reg->n_entries = reg->cap_entries = 0;
+    if (index_hash_map_init(&reg->entries_map, 0) != 0) {
+        log_error("index_hash_map_init failed");
+        return -1;
+    }
+    return 0;
+}
+
+void f3d_mat_registry_free(struct F3DMatRegistry *reg) {
+    for (size_t i = 0; i < reg->n_entries; i++) {
+        free(reg->entries[i].body);
+        free(reg->entries[i].dl_name);
+    }
+    free(reg->entries);
+    index_hash_map_free(&reg->entries_map);
+}
+
+struct f3d_mat_registry_eq_arg {
+    struct F3DMatRegistry *reg;
+    const char *body;
+    size_t body_len;
+};
+
+static bool f3d_mat_registry_eq(void *_arg, uint32_t index) {
+    struct f3d_mat_registry_eq_arg *arg = _arg;
+    struct F3DMatRegistryEntry *e = &arg->reg->entries[index];
+    return e->body_len == arg->body_len &&
+           memcmp(e->body, arg->body, arg->body_len) == 0;
+}
+
+/**
+ * Look up the material display list mat_dl, as written by write_f3d_mat.
+ * If it is not in the registry, it is added as %s_mat_dl with name.
+ *
+ * @param is_new Set to whether mat_dl was added, and should be written
+ * @return The name of the display list to use, owned by the registry, or NULL
+ *  on failure
+ */
+static const char *f3d_mat_registry_add(struct F3DMatRegistry *reg,
+                                        struct TextBuffer *mat_dl,
+                                        const char *name, bool *is_new) {
+    const char *body = memchr(mat_dl->data, '\n', mat_dl->len);
+    assert(body != NULL);
+    body++;
+    size_t body_len = mat_dl->len - (body - mat_dl->data);
+
+    uint32_t hash = hash_bytes(body, body_len);
+    struct f3d_mat_registry_eq_arg arg = {reg, body, body_len};
+    uint32_t found =
+        index_hash_map_find(&reg->entries_map, hash, f3d_mat_registry_eq, &arg);
+    if (found != ~0u) {
+        *is_new = false;
+        return reg->entries[found].dl_name;
+    }
+
+    if (reg->n_entries == reg->cap_entries) {
+        size_t new_cap = reg->cap_entries * 2 + 16;
+        void *tmp =
+            realloc(reg->entries, sizeof(struct F3DMatRegistryEntry) * new_cap);
+        if (tmp == NULL) {
+            log_error("realloc entries failed");
+            return NULL;
+        }
+        reg->entries = tmp;
+        reg->cap_entries = new_cap;
+    }
+    struct F3DMatRegistryEntry *e = &reg->entries[reg->n_entries];
+    size_t dl_name_len = strlen(name) + strlen("_mat_dl") + 1;
+    e->body = malloc(body_len);
+    e->body_len = body_len;
+    e->dl_name = malloc(dl_name_len);
+    if (e->body == NULL || e->dl_name == NULL ||
+        index_hash_map_insert(&reg->entries_map, hash, reg->n_entries) != 0) {
+        log_error("adding the material failed");
+        free(e->body);
+        free(e->dl_name);
+        return NULL;
+    }
+    memcpy(e->body, body, body_len);
+    snprintf(e->dl_name, dl_name_len, "%s_mat_dl", name);
+    reg->n_entries++;
+    *is_new = true;
+    return e->dl_name;
+}
+
+static void bput_f3d_1triangle(struct TextBuffer *b,
+                               struct f3d_mesh_entry_triangles_triangle *tri) {
+    bputs(b, "    gsSP1Triangle(");
+    for (int k = 0; k < 3; k++) {
+        bput_uint(b, tri->indices[k]);
+        bputs(b, ", ");
+    }
+    bputs(b, "0),\n");
+}
+
+// gsSPTriStrip and gsSPTriFan draw up to 5 triangles from 7 vertices
+#define STRIP_FAN_MAX_TRIS 5
+// two triangles are as well drawn by gsSP2Triangles
+#define STRIP_FAN_MIN_TRIS 3
+
+/**
+ * Find a triangle not used yet with the edge p->q (in its winding order).
+ * Returns its index and sets *r to its third vertex, or returns -1.
+ */
+static int find_tri_with_edge(struct f3d_mesh_entry_triangles *e, bool *used,
+                              uint8_t p, uint8_t q, uint8_t *r) {
+    for (int j = 0; j < e->n_tris; j++) {
+        if (used[j])
+            continue;
+        uint8_t *v = e->tris[j].indices;
+        for (int k = 0; k < 3; k++) {
+            if (v[k] == p && v[(k + 1) % 3] == q) {
+                *r = v[(k + 2) % 3];
+                return j;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Grow a strip or fan starting with triangle i_tri, its vertices rotated by
+ * rot. Sets verts and tris (the triangles used) and returns the number of
+ * triangles. used is left as it was.
+ *
+ * Strip triangle k is (s[k], s[k+1], s[k+2]), with the first two swapped if k
+ * is odd to keep the winding. Fan triangle k is (s[0], s[k+1], s[k+2]).
+ */
+static int grow_strip_fan(struct f3d_mesh_entry_triangles *e, bool *used,
+                          int i_tri, int rot, bool is_fan,
+                          uint8_t verts[STRIP_FAN_MAX_TRIS + 2],
+                          int tris[STRIP_FAN_MAX_TRIS]) {
+    for (int k = 0; k < 3; k++)
+        verts[k] = e->tris[i_tri].indices[(rot + k) % 3];
+    tris[0] = i_tri;
+    used[i_tri] = true;
+    int n = 1;
+    while (n < STRIP_FAN_MAX_TRIS) {
+        uint8_t p, q;
+        if (is_fan) {
+            p = verts[0];
+            q = verts[n + 1];
+        } else if (n % 2 == 0) {
+            p = verts[n];
+            q = verts[n + 1];
+        } else {
+            p = verts[n + 1];
+            q = verts[n];
+        }
+        int j = find_tri_with_edge(e, used, p, q, &verts[n + 2]);
+        if (j < 0)
+            break;
+        tris[n] = j;
+        used[j] = true;
+        n++;
+    }
+    for (int k = 0; k < n; k++)
+        used[tris[k]] = false;
+    return n;
+}
+
+/**
+ * Write gsSPTriStrip and gsSPTriFan commands for the triangles of e that can
+ * be grouped at least STRIP_FAN_MIN_TRIS at a time, marking them in used.
+ * Greedy: from each triangle not used yet, the longest strip or fan is taken.
+ * Returns the number of commands written.
+ */
+static int bput_f3d_strips_fans(struct TextBuffer *b,
+                                struct f3d_mesh_entry_triangles *e,
+                                bool *used) {
+    int n_gfx = 0;
+    for (int i_tri = 0; i_tri < e->n_tris; i_tri++) {
+        if (used[i_tri])
+            continue;
+
+        uint8_t best_verts[STRIP_FAN_MAX_TRIS + 2];
+        int best_tris[STRIP_FAN_MAX_TRIS];
+        int best_n = 0;
+        bool best_is_fan = false;
+        for (int i_kind = 0; i_kind < 2; i_kind++) {
+            for (int rot = 0; rot < 3; rot++) {
+                uint8_t verts[STRIP_FAN_MAX_TRIS + 2];
+                int tris[STRIP_FAN_MAX_TRIS];
+                int n = grow_strip_fan(e, used, i_tri, rot, i_kind == 1, verts,
+                                       tris);
+                if (n > best_n) {
+                    best_n = n;
+                    best_is_fan = i_kind == 1;
+                    memcpy(best_verts, verts, sizeof(verts));
+                    memcpy(best_tris, tris, sizeof(tris));
+                }
+            }
+        }
+        if (best_n < STRIP_FAN_MIN_TRIS)
+            continue;
+
+        for (int k = 0; k < best_n; k++)
+            used[best_tris[k]] = true;
+        bputs(b, best_is_fan ? "    gsSPTriFan(" : "    gsSPTriStrip(");
+        for (int k = 0; k < STRIP_FAN_MAX_TRIS + 2; k++) {
+            if (k != 0)
+                bputs(b, ", ");
+            // -1 for the unused vertices ends the strip or fan early
+            if (k < best_n + 2)
+                bput_uint(b, best_verts[k]);
+            else
+                bputs(b, "-1");
+        }
+        bputs(b, "),\n");
+        n_gfx++;
+    }
+    return n_gfx;
+}
 
-        fprintf(f,
-                "    {{ "
-                "{ %" PRId16 ", %" PRId16 ", %" PRId16 " }, "
-                "0, "
-                "{ %" PRId16 ", %" PRId16 " }, "
-                "{ 0x%" PRIX8 ", 0x%" PRIX8 ", 0x%" PRIX8 ", %" PRIu8 " }"
-                " }},\n",
-                v->coords[0], v->coords[1], v->coords[2], v->st[0], v->st[1],
-                v->cn[0], v->cn[1], v->cn[2], v->alpha);
+int write_f3d_mesh(struct TextBuffer *b, struct f3d_mesh *mesh,
+                   const char *name, struct F3DVtxPool *vtx_pool,
+                   const struct F3DUcodeProfile *ucode,
+                   struct F3DDLCost *cost) {
+    struct F3DDLCost mesh_cost = {0};
+    if (vtx_pool == NULL) {
+        bprintf(b, "Vtx %s_mesh_vtx[] = {\n", name);
+        for (int i = 0; i < mesh->n_vertices; i++)
+            bput_f3d_vertex(b, &mesh->vertices[i]);
+        bprintf(b, "};\n");
     }
-    fprintf(f, "};\n");
 
     unsigned int cur_corner_material = ~0u;
 
-    fprintf(f, "Gfx %s_mesh_dl[] = {\n", name);
+    bprintf(b, "Gfx %s_mesh_dl[] = {\n", name);
     for (int i = 0; i < mesh->n_entries; i++) {
         switch (mesh->entries[i]->type) {
         case F3D_MESH_ENTRY_VERTICES: {
@@ -1452,76 +2618,576 @@ int write_f3d_mesh(FILE *f, struct f3d_mesh *mesh, const char *name) {
                         : mesh->corner_materials[cur_corner_material].matrix);
                 if (mesh->corner_materials[cur_corner_material].matrix !=
                     NULL) {
-                    fprintf(f,
+                    bprintf(b,
                             "    gsSPMatrix(%s, "
                             "G_MTX_NOPUSH | G_MTX_LOAD | G_MTX_MODELVIEW),\n",
                             mesh->corner_materials[cur_corner_material].matrix);
+                    mesh_cost.n_gfx++;
+                    mesh_cost.n_matrix_loads++;
                 }
             }
-            fprintf(f,
-                    "    gsSPVertex("
-                    "&%s_mesh_vtx[%d], %" PRIu8 ", %" PRIu8 "),\n",
-                    name, e->buffer_i, e->n, e->v0);
+            bputs(b, "    gsSPVertex(&");
+            if (vtx_pool == NULL) {
+                bputs(b, name);
+                bputs(b, "_mesh_vtx[");
+                bput_int(b, e->buffer_i);
+            } else {
+                bputs(b, vtx_pool->name);
+                bputs(b, "[");
+                bput_uint(b, e->pool_i);
+            }
+            bputs(b, "], ");
+            bput_uint(b, e->n);
+            bputs(b, ", ");
+            bput_uint(b, e->v0);
+            bputs(b, "),\n");
+            mesh_cost.n_gfx++;
+            mesh_cost.n_vertex_loads++;
+            mesh_cost.vtx_bytes += 16 * e->n;
         } break;
 
         case F3D_MESH_ENTRY_TRIANGLES: {
             struct f3d_mesh_entry_triangles *e =
                 (struct f3d_mesh_entry_triangles *)mesh->entries[i];
-            for (int j = 0; j + 1 < e->n_tris; j += 2) {
-                struct f3d_mesh_entry_triangles_triangle *tri1 = &e->tris[j];
-                struct f3d_mesh_entry_triangles_triangle *tri2 =
-                    &e->tris[j + 1];
-
-                fprintf(f,
-                        "    gsSP2Triangles("
-                        "%" PRIu8 ", %" PRIu8 ", %" PRIu8 ", 0, "
-                        "%" PRIu8 ", %" PRIu8 ", %" PRIu8 ", 0),\n",
-                        tri1->indices[0], tri1->indices[1], tri1->indices[2],
-                        tri2->indices[0], tri2->indices[1], tri2->indices[2]);
+            // the triangles already drawn by strips and fans
+            bool *used = NULL;
+            if (ucode->tri_cmds & F3D_TRI_CMD_STRIP_FAN) {
+                used = calloc(e->n_tris, sizeof(bool));
+                if (used == NULL) {
+                    log_error("calloc used failed");
+                    return -1;
+                }
+                mesh_cost.n_gfx += bput_f3d_strips_fans(b, e, used);
             }
 
-            if (e->n_tris % 2 != 0) {
-                struct f3d_mesh_entry_triangles_triangle *tri =
-                    &e->tris[e->n_tris - 1];
-
-                fprintf(f,
-                        "    gsSP1Triangle("
-                        "%" PRIu8 ", %" PRIu8 ", %" PRIu8 ", 0),\n",
-                        tri->indices[0], tri->indices[1], tri->indices[2]);
+            // the other triangles, two at a time if possible
+            struct f3d_mesh_entry_triangles_triangle *pending = NULL;
+            for (int j = 0; j < e->n_tris; j++) {
+                struct f3d_mesh_entry_triangles_triangle *tri = &e->tris[j];
+                if (used != NULL && used[j])
+                    continue;
+                if (pending == NULL &&
+                    (ucode->tri_cmds & F3D_TRI_CMD_2TRIANGLES)) {
+                    pending = tri;
+                } else if (pending != NULL) {
+                    bputs(b, "    gsSP2Triangles(");
+                    for (int k = 0; k < 3; k++) {
+                        bput_uint(b, pending->indices[k]);
+                        bputs(b, ", ");
+                    }
+                    bputs(b, "0, ");
+                    for (int k = 0; k < 3; k++) {
+                        bput_uint(b, tri->indices[k]);
+                        bputs(b, ", ");
+                    }
+                    bputs(b, "0),\n");
+                    pending = NULL;
+                    mesh_cost.n_gfx++;
+                } else {
+                    bput_f3d_1triangle(b, tri);
+                    mesh_cost.n_gfx++;
+                }
+            }
+            if (pending != NULL) {
+                bput_f3d_1triangle(b, pending);
+                mesh_cost.n_gfx++;
             }
+            free(used);
+            mesh_cost.n_tris += e->n_tris;
         } break;
         }
     }
-    fprintf(f, "    gsSPEndDisplayList(),\n");
-    fprintf(f, "};\n");
+    bprintf(b, "    gsSPEndDisplayList(),\n");
+    bprintf(b, "};\n");
+    mesh_cost.n_gfx++;
+
+    if (cost != NULL)
+        f3d_dl_cost_add(cost, &mesh_cost);
+
+    return 0;
+}
+
+static enum shading_type
+get_shading_type(struct MaterialInfo *mat_info,
+                 const struct F3DUcodeProfile *ucode) {
+    if (mat_info->geometry_mode.lighting &&
+        mat_info->geometry_mode.vertex_colors && ucode->packed_normals)
+        return SHADING_COLORS_AND_NORMALS;
+    // TODO error or something if lighting && vertex_colors
+    return mat_info->geometry_mode.lighting        ? SHADING_NORMALS
+           : mat_info->geometry_mode.vertex_colors ? SHADING_COLORS
+                                                   : SHADING_NULL;
+}
+
+/**
+ * Rough relative costs of changing each part of the state, texture loads
+ * aside. Other modes and combiner changes stall the RDP pipeline, geometry
+ * mode changes only cost RSP time.
+ */
+static const int draw_order_part_costs[F3D_MAT_STATE_PART_COUNT] = {
+    [F3D_MAT_STATE_OTHER_MODE] = 4,
+    [F3D_MAT_STATE_TILE_0 + 0] = 1,
+    [F3D_MAT_STATE_TILE_0 + 1] = 1,
+    [F3D_MAT_STATE_TILE_0 + 2] = 1,
+    [F3D_MAT_STATE_TILE_0 + 3] = 1,
+    [F3D_MAT_STATE_TILE_0 + 4] = 1,
+    [F3D_MAT_STATE_TILE_0 + 5] = 1,
+    [F3D_MAT_STATE_TILE_0 + 6] = 1,
+    [F3D_MAT_STATE_TILE_0 + 7] = 1,
+    [F3D_MAT_STATE_COMBINE] = 4,
+    [F3D_MAT_STATE_PRIM_DEPTH] = 1,
+    [F3D_MAT_STATE_FOG_COLOR] = 1,
+    [F3D_MAT_STATE_BLEND_COLOR] = 1,
+    [F3D_MAT_STATE_PRIM_COLOR] = 1,
+    [F3D_MAT_STATE_ENV_COLOR] = 1,
+    [F3D_MAT_STATE_TEXTURE] = 1,
+    [F3D_MAT_STATE_GEOMETRY_MODE] = 2,
+};
+// a texture load also costs one per DRAW_ORDER_LOAD_BYTES_PER_COST of TMEM
+#define DRAW_ORDER_LOAD_COST 8
+#define DRAW_ORDER_LOAD_BYTES_PER_COST 128
+// 2-opt is cubic in the number of submeshes, only use it for small meshes
+#define DRAW_ORDER_MAX_2OPT 64
+
+/** Cost of drawing a material after another, given their state from scratch */
+static int draw_order_transition_cost(struct F3DMatState *from,
+                                      struct F3DMatState *to) {
+    int cost = 0;
+    for (int part = 0; part < F3D_MAT_STATE_PART_COUNT; part++) {
+        if (to->cmds[part] == NULL)
+            continue;
+        if (from->cmds[part] != NULL &&
+            from->cmds_len[part] == to->cmds_len[part] &&
+            memcmp(from->cmds[part], to->cmds[part], to->cmds_len[part]) == 0)
+            continue;
+        int part_cost = draw_order_part_costs[part];
+        for (int i = 0; i < to->n_loads; i++) {
+            struct F3DMatStateLoad *load = &to->loads[i];
+            if (load->cmd_len == to->cmds_len[part] &&
+                memcmp(load->cmd, to->cmds[part], load->cmd_len) == 0)
+                part_cost = DRAW_ORDER_LOAD_COST +
+                            (int)((load->tmem_end - load->tmem_start) /
+                                  DRAW_ORDER_LOAD_BYTES_PER_COST);
+        }
+        cost += part_cost;
+    }
+    return cost;
+}
+
+/**
+ * Whether the material draws the same image wherever it is in the draw order:
+ * opaque and depth tested. Decals and blended materials depend on what is
+ * drawn before them.
+ */
+static bool draw_order_is_free(struct MaterialInfo *mat_info) {
+    struct MaterialInfoOtherModes *om = &mat_info->other_modes;
+    return (om->z_mode == RDP_OM_Z_MODE_OPAQUE ||
+            om->z_mode == RDP_OM_Z_MODE_INTERPENETRATING) &&
+           !om->force_blend && om->z_compare_en;
+}
+
+/**
+ * Cost of drawing the m materials of order after material from, then material
+ * to. from is n for the unknown state before the first submesh, to is n if
+ * nothing follows.
+ */
+static int draw_order_path_cost(int *costs, unsigned int n, unsigned int from,
+                                unsigned int to, unsigned int *order,
+                                unsigned int m) {
+    // row n is the cost from the unknown state
+    int total = costs[from * n + order[0]];
+    for (unsigned int i = 1; i < m; i++)
+        total += costs[order[i - 1] * n + order[i]];
+    if (to != n)
+        total += costs[order[m - 1] * n + to];
+    return total;
+}
+
+/**
+ * Reorder the m materials of order, drawn between from and to (see
+ * draw_order_path_cost), to minimize the state changes.
+ * This is a shortest open path through the materials: greedy nearest neighbor
+ * from each starting material, then 2-opt. Ties keep the order.
+ * run, path and visited are scratch arrays of m elements.
+ */
+static void optimize_draw_order_run(int *costs, unsigned int n,
+                                    unsigned int from, unsigned int to,
+                                    unsigned int *order, unsigned int m,
+                                    unsigned int *run, unsigned int *path,
+                                    bool *visited) {
+    int best_cost = draw_order_path_cost(costs, n, from, to, order, m);
+    // the materials of the run in their original order
+    memcpy(run, order, sizeof(unsigned int) * m);
+    for (unsigned int start = 0; start < m; start++) {
+        for (unsigned int i = 0; i < m; i++)
+            visited[i] = false;
+        path[0] = run[start];
+        visited[start] = true;
+        for (unsigned int i = 1; i < m; i++) {
+            unsigned int prev = path[i - 1];
+            unsigned int next = m;
+            for (unsigned int j = 0; j < m; j++) {
+                if (!visited[j] &&
+                    (next == m || costs[prev * n + run[j]] <
+                                      costs[prev * n + run[next]]))
+                    next = j;
+            }
+            path[i] = run[next];
+            visited[next] = true;
+        }
+        int cost = draw_order_path_cost(costs, n, from, to, path, m);
+        if (cost < best_cost) {
+            best_cost = cost;
+            memcpy(order, path, sizeof(unsigned int) * m);
+        }
+    }
+
+    // costs are not symmetric (e.g. texture loads), so the path cost is
+    // computed again for each reversed segment
+    bool improved = m <= DRAW_ORDER_MAX_2OPT;
+    while (improved) {
+        improved = false;
+        for (unsigned int i = 0; i + 1 < m; i++) {
+            for (unsigned int j = i + 1; j < m; j++) {
+                memcpy(path, order, sizeof(unsigned int) * m);
+                for (unsigned int a = i, b = j; a < b; a++, b--) {
+                    path[a] = order[b];
+                    path[b] = order[a];
+                }
+                int cost = draw_order_path_cost(costs, n, from, to, path, m);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    memcpy(order, path, sizeof(unsigned int) * m);
+                    improved = true;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Reorder the submeshes (order, initially the identity) to minimize the
+ * state changes between consecutive materials. Only the runs of consecutive
+ * materials for which draw_order_is_free are reordered, within each run, so
+ * every other material keeps its place relative to all the others. Meshes
+ * with interchangeable materials are unchanged.
+ */
+static int optimize_draw_order(struct MeshInfo *mesh_info,
+                               const struct F3DUcodeProfile *ucode,
+                               unsigned int *order) {
+    unsigned int n = mesh_info->n_materials;
+    if (n < 2)
+        return 0;
+
+    // the state each material leaves when written from scratch
+    struct F3DMatState *states = malloc(sizeof(struct F3DMatState) * (n + 1));
+    int *costs = malloc(sizeof(int) * (n + 1) * n);
+    unsigned int *run = malloc(sizeof(unsigned int) * n);
+    unsigned int *path = malloc(sizeof(unsigned int) * n);
+    bool *visited = malloc(sizeof(bool) * n);
+    if (states == NULL || costs == NULL || run == NULL || path == NULL ||
+        visited == NULL) {
+        log_error("malloc states, costs, run, path or visited failed");
+        free(states);
+        free(costs);
+        free(run);
+        free(path);
+        free(visited);
+        return -1;
+    }
+
+    struct TextBuffer scratch;
+    text_buffer_init(&scratch);
+    for (unsigned int i = 0; i <= n; i++) {
+        f3d_mat_state_init(&states[i]);
+        if (i < n) {
+            write_f3d_mat_diff(&scratch, &mesh_info->materials[i], "", ucode,
+                               &states[i], NULL);
+            scratch.len = 0;
+        }
+    }
+    text_buffer_free(&scratch);
+    // states[n] stays unknown
+    for (unsigned int from = 0; from <= n; from++) {
+        for (unsigned int to = 0; to < n; to++)
+            costs[from * n + to] =
+                draw_order_transition_cost(&states[from], &states[to]);
+    }
+    for (unsigned int i = 0; i <= n; i++)
+        f3d_mat_state_free(&states[i]);
+    free(states);
+
+    unsigned int start = 0;
+    while (start < n) {
+        if (!draw_order_is_free(&mesh_info->materials[order[start]])) {
+            start++;
+            continue;
+        }
+        unsigned int end = start + 1;
+        while (end < n && draw_order_is_free(&mesh_info->materials[order[end]]))
+            end++;
+        if (end - start >= 2)
+            optimize_draw_order_run(costs, n, start == 0 ? n : order[start - 1],
+                                    end == n ? n : order[end], order + start,
+                                    end - start, run, path, visited);
+        start = end;
+    }
 
+    free(costs);
+    free(run);
+    free(path);
+    free(visited);
     return 0;
 }
 
+struct write_submesh_f3d_c_jobs {
+    struct MeshInfo *mesh_info;
+    struct MeshInfo **meshes;
+    const char **limb_to_matrix_map;
+    int limb_to_matrix_map_len;
+    struct F3DVtxPool *vtx_pool;
+    struct F3DMatRegistry *mat_registry;
+    const struct F3DUcodeProfile *ucode;
+    unsigned int options;
+    // per submesh
+    struct TextBuffer *outputs;
+    // only used with mat_registry or F3D_C_DIFF_MAT_STATE, the material display
+    // lists to look up or append
+    struct TextBuffer *mat_outputs;
+    // only used with vtx_pool, the meshes left to write once their vertices
+    // are in the pool
+    struct f3d_mesh **f3d_meshes;
+    // of the material and mesh display lists
+    struct F3DDLCost *costs;
+    int *results;
+};
+
+static void write_submesh_f3d_c_job(void *arg, size_t i_mesh) {
+    struct write_submesh_f3d_c_jobs *jobs = arg;
+    struct MaterialInfo *mat_info = &jobs->mesh_info->materials[i_mesh];
+    struct MeshInfo *mesh = jobs->meshes[i_mesh];
+    struct TextBuffer *b = &jobs->outputs[i_mesh];
+    struct F3DDLCost *cost = &jobs->costs[i_mesh];
+
+    // diffed materials depend on the previous one, they are written after
+    if (!(jobs->options & F3D_C_DIFF_MAT_STATE)) {
+        double t_mat = stats_now();
+        write_f3d_mat_diff(
+            jobs->mat_registry != NULL ? &jobs->mat_outputs[i_mesh] : b,
+            mat_info, mesh->name, jobs->ucode, NULL, cost);
+        stats_add_stage_time(EXPORT_STAGE_TEXT_EMISSION, t_mat);
+    }
+    struct f3d_mesh *f3d_mesh = mesh_to_f3d_mesh(
+        mesh, jobs->limb_to_matrix_map, jobs->limb_to_matrix_map_len,
+        mat_info->uv_basis_s, mat_info->uv_basis_t,
+        get_shading_type(mat_info, jobs->ucode), jobs->ucode);
+    if (f3d_mesh == NULL) {
+        log_error("mesh_to_f3d_mesh failed for %s", mesh->name);
+        jobs->results[i_mesh] = -1;
+        return;
+    }
+    if (mat_info->other_modes.cycle_type == RDP_OM_CYCLE_TYPE_2CYCLE)
+        cost->fill_area_2cycle += f3d_mesh->area;
+    else
+        cost->fill_area_1cycle += f3d_mesh->area;
+    if (jobs->vtx_pool != NULL) {
+        // the pool is shared, the vertices are added in material order
+        // after the jobs, then the meshes are written by
+        // write_submesh_f3d_c_pool_job
+        jobs->f3d_meshes[i_mesh] = f3d_mesh;
+    } else {
+        double t_mesh = stats_now();
+        write_f3d_mesh(b, f3d_mesh, mesh->name, NULL, jobs->ucode, cost);
+        stats_add_stage_time(EXPORT_STAGE_TEXT_EMISSION, t_mesh);
+        free_mesh_to_f3d_mesh(f3d_mesh);
+    }
+
+    jobs->results[i_mesh] = b->error ? -2 : 0;
+}
+
+static void write_submesh_f3d_c_pool_job(void *arg, size_t i_mesh) {
+    struct write_submesh_f3d_c_jobs *jobs = arg;
+    struct f3d_mesh *f3d_mesh = jobs->f3d_meshes[i_mesh];
+    struct TextBuffer *b = &jobs->outputs[i_mesh];
+
+    if (jobs->results[i_mesh] != 0 || f3d_mesh == NULL)
+        return;
+    double t_mesh = stats_now();
+    if (write_f3d_mesh(b, f3d_mesh, jobs->meshes[i_mesh]->name, jobs->vtx_pool,
+                       jobs->ucode, &jobs->costs[i_mesh]) != 0)
+        jobs->results[i_mesh] = -7;
+    else
+        jobs->results[i_mesh] = b->error ? -2 : 0;
+    stats_add_stage_time(EXPORT_STAGE_TEXT_EMISSION, t_mesh);
+}
+
+/**
+ * The per-material submeshes are independent, so they are converted and
+ * printed to memory concurrently (see workers_run), then appended to b in
+ * material order. The output is the same as converting them one by one.
+ * With a vtx_pool, the converted meshes' vertices are added to the pool in
+ * material order between the conversions and printing the mesh display
+ * lists, so the pool offsets are stable.
+ * Likewise materials are looked up in mat_registry in material order, and
+ * with F3D_C_DIFF_MAT_STATE printed in material order since each depends on
+ * the previous one.
+ * With F3D_C_OPTIMIZE_DRAW_ORDER, "material order" is the order picked by
+ * optimize_draw_order instead of the material indices.
+ */
 int write_mesh_info_to_f3d_c(struct MeshInfo *mesh_info,
                              const char **limb_to_matrix_map,
-                             int limb_to_matrix_map_len, FILE *f,
-                             char **dl_name) {
-    fprintf(f, "// Hi from write_mesh_info_to_f3d_c\n");
+                             int limb_to_matrix_map_len,
+                             struct F3DVtxPool *vtx_pool,
+                             struct F3DMatRegistry *mat_registry,
+                             const struct F3DUcodeProfile *ucode,
+                             unsigned int options, struct TextBuffer *b,
+                             char **dl_name, struct F3DDLCost *cost) {
+    bool diff_mat_state = options & F3D_C_DIFF_MAT_STATE;
+    bputs(b, "// Hi from write_mesh_info_to_f3d_c\n");
+    if (vtx_pool != NULL && !vtx_pool->declared) {
+        // the pool's array is written after the meshes using it
+        bprintf(b, "extern Vtx %s[];\n", vtx_pool->name);
+        vtx_pool->declared = true;
+    }
+    double t_split = stats_now();
     struct MeshInfo **meshes = split_mesh_by_material(mesh_info);
     if (meshes == NULL) {
         log_error("malloc meshes failed");
         return -2;
     }
-    for (unsigned int i_mesh = 0; i_mesh < mesh_info->n_materials; i_mesh++) {
-        struct MaterialInfo *mat_info = &mesh_info->materials[i_mesh];
-        struct MeshInfo *mesh = meshes[i_mesh];
-        write_f3d_mat(f, mat_info, mesh->name);
-        // TODO error or something if lighting && vertex_colors
-        enum shading_type shading_type =
-            mat_info->geometry_mode.lighting        ? SHADING_NORMALS
-            : mat_info->geometry_mode.vertex_colors ? SHADING_COLORS
-                                                    : SHADING_NULL;
-        struct f3d_mesh *f3d_mesh = mesh_to_f3d_mesh(
-            mesh, limb_to_matrix_map, limb_to_matrix_map_len,
-            mat_info->uv_basis_s, mat_info->uv_basis_t, shading_type);
-        write_f3d_mesh(f, f3d_mesh, mesh->name);
-        free_mesh_to_f3d_mesh(f3d_mesh);
+    stats_add_stage_time(EXPORT_STAGE_SPLIT, t_split);
+
+    unsigned int n_meshes = mesh_info->n_materials;
+    struct write_submesh_f3d_c_jobs jobs;
+    jobs.mesh_info = mesh_info;
+    jobs.meshes = meshes;
+    jobs.limb_to_matrix_map = limb_to_matrix_map;
+    jobs.limb_to_matrix_map_len = limb_to_matrix_map_len;
+    jobs.vtx_pool = vtx_pool;
+    jobs.mat_registry = mat_registry;
+    jobs.ucode = ucode;
+    jobs.options = options;
+    jobs.outputs = malloc(sizeof(struct TextBuffer) * n_meshes);
+    jobs.mat_outputs = malloc(sizeof(struct TextBuffer) * n_meshes);
+    jobs.f3d_meshes = calloc(n_meshes, sizeof(struct f3d_mesh *));
+    jobs.costs = calloc(n_meshes, sizeof(struct F3DDLCost));
+    jobs.results = malloc(sizeof(int) * n_meshes);
+    // the name of each submesh's material display list, NULL for the default
+    // %s_mat_dl (owned by mat_registry)
+    const char **mat_dl_names = calloc(n_meshes, sizeof(char *));
+    // the submeshes in draw order
+    unsigned int *order = malloc(sizeof(unsigned int) * n_meshes);
+    if (jobs.outputs == NULL || jobs.mat_outputs == NULL ||
+        jobs.f3d_meshes == NULL || jobs.costs == NULL ||
+        jobs.results == NULL || mat_dl_names == NULL || order == NULL) {
+        log_error("malloc outputs, mat_outputs, f3d_meshes, costs, results, "
+                  "mat_dl_names or order failed");
+        free(jobs.outputs);
+        free(jobs.mat_outputs);
+        free(jobs.f3d_meshes);
+        free(jobs.costs);
+        free(jobs.results);
+        free(mat_dl_names);
+        free(order);
+        free_split_mesh_by_material(meshes, n_meshes);
+        return -2;
+    }
+    for (unsigned int i_mesh = 0; i_mesh < n_meshes; i_mesh++) {
+        text_buffer_init(&jobs.outputs[i_mesh]);
+        text_buffer_init(&jobs.mat_outputs[i_mesh]);
+        order[i_mesh] = i_mesh;
+    }
+
+    if (options & F3D_C_OPTIMIZE_DRAW_ORDER) {
+        double t_order = stats_now();
+        // keeping the material order is fine if this fails
+        optimize_draw_order(mesh_info, ucode, order);
+        stats_add_stage_time(EXPORT_STAGE_DRAW_ORDER, t_order);
+    }
+
+    workers_run(n_meshes, write_submesh_f3d_c_job, &jobs);
+
+    if (vtx_pool != NULL) {
+        double t_pool = stats_now();
+        for (unsigned int i_order = 0; i_order < n_meshes; i_order++) {
+            unsigned int i_mesh = order[i_order];
+            if (jobs.results[i_mesh] == 0 &&
+                f3d_vtx_pool_add_mesh(vtx_pool, jobs.f3d_meshes[i_mesh]) != 0)
+                jobs.results[i_mesh] = -7;
+        }
+        stats_add_stage_time(EXPORT_STAGE_TEXT_EMISSION, t_pool);
+        workers_run(n_meshes, write_submesh_f3d_c_pool_job, &jobs);
+    }
+
+    // the state is only known within this display list, the first material
+    // is written in full
+    struct F3DMatState mat_state;
+    f3d_mat_state_init(&mat_state);
+
+    int res = 0;
+    for (unsigned int i_order = 0; i_order < n_meshes; i_order++) {
+        unsigned int i_mesh = order[i_order];
+        struct TextBuffer *mat_dl = &jobs.mat_outputs[i_mesh];
+        if (res == 0 && jobs.results[i_mesh] != 0) {
+            log_error("converting %s failed (%d)", meshes[i_mesh]->name,
+                      jobs.results[i_mesh]);
+            res = -4;
+        }
+        if (res == 0 && diff_mat_state) {
+            double t_mat = stats_now();
+            write_f3d_mat_diff(mat_dl, &mesh_info->materials[i_mesh],
+                               meshes[i_mesh]->name, ucode, &mat_state,
+                               &jobs.costs[i_mesh]);
+            stats_add_stage_time(EXPORT_STAGE_TEXT_EMISSION, t_mat);
+        }
+        if (res == 0 && mat_registry != NULL) {
+            bool is_new;
+            if (mat_dl->error) {
+                res = -5;
+            } else {
+                mat_dl_names[i_mesh] = f3d_mat_registry_add(
+                    mat_registry, mat_dl, meshes[i_mesh]->name, &is_new);
+                if (mat_dl_names[i_mesh] == NULL)
+                    res = -8;
+                else if (is_new)
+                    text_buffer_append(b, mat_dl->data, mat_dl->len);
+            }
+        } else if (res == 0 && diff_mat_state) {
+            if (mat_dl->error)
+                res = -5;
+            else
+                text_buffer_append(b, mat_dl->data, mat_dl->len);
+        }
+        text_buffer_free(&jobs.mat_outputs[i_mesh]);
+        if (jobs.f3d_meshes[i_mesh] != NULL)
+            free_mesh_to_f3d_mesh(jobs.f3d_meshes[i_mesh]);
+        if (res == 0 && jobs.outputs[i_mesh].error) {
+            res = -5;
+        }
+        if (res == 0) {
+            text_buffer_append(b, jobs.outputs[i_mesh].data,
+                               jobs.outputs[i_mesh].len);
+        }
+        text_buffer_free(&jobs.outputs[i_mesh]);
+    }
+    f3d_mat_state_free(&mat_state);
+    if (cost != NULL) {
+        // each submesh is two gsSPDisplayList in %s_dl, plus its end
+        *cost = (struct F3DDLCost){.n_gfx = 2 * n_meshes + 1};
+        for (unsigned int i_mesh = 0; i_mesh < n_meshes; i_mesh++)
+            f3d_dl_cost_add(cost, &jobs.costs[i_mesh]);
+    }
+    free(jobs.outputs);
+    free(jobs.mat_outputs);
+    free(jobs.f3d_meshes);
+    free(jobs.costs);
+    free(jobs.results);
+
+    if (res != 0) {
+        free(mat_dl_names);
+        free(order);
+        free_split_mesh_by_material(meshes, n_meshes);
+        return res;
     }
 
     if (dl_name != NULL) {
@@ -1529,282 +3195,2238 @@ int write_mesh_info_to_f3d_c(struct MeshInfo *mesh_info,
         *dl_name = malloc(dl_name_len);
         if (*dl_name == NULL) {
             log_error("malloc dl_name failed");
+            free(mat_dl_names);
+            free(order);
+            free_split_mesh_by_material(meshes, n_meshes);
             return -3;
         }
         snprintf(*dl_name, dl_name_len, "%s_dl", mesh_info->name);
     }
 
-    fprintf(f, "Gfx %s_dl[] = {\n", mesh_info->name);
-    for (unsigned int i_mesh = 0; i_mesh < mesh_info->n_materials; i_mesh++) {
+    bprintf(b, "Gfx %s_dl[] = {\n", mesh_info->name);
+    for (unsigned int i_order = 0; i_order < n_meshes; i_order++) {
+        unsigned int i_mesh = order[i_order];
         struct MeshInfo *mesh = meshes[i_mesh];
-        fprintf(f, "    gsSPDisplayList(%s_mat_dl),\n", mesh->name);
-        fprintf(f, "    gsSPDisplayList(%s_mesh_dl),\n", mesh->name);
+        if (mat_dl_names[i_mesh] != NULL)
+            bprintf(b, "    gsSPDisplayList(%s),\n", mat_dl_names[i_mesh]);
+        else
+            bprintf(b, "    gsSPDisplayList(%s_mat_dl),\n", mesh->name);
+        bprintf(b, "    gsSPDisplayList(%s_mesh_dl),\n", mesh->name);
     }
-    fprintf(f, "    gsSPEndDisplayList(),\n");
-    fprintf(f, "};\n");
+    bputs(b, "    gsSPEndDisplayList(),\n");
+    bputs(b, "};\n");
 
-    free_split_mesh_by_material(meshes, mesh_info->n_materials);
+    free(mat_dl_names);
+    free(order);
+    free_split_mesh_by_material(meshes, n_meshes);
 
-    return 0;
+    return b->error ? -6 : 0;
 }
 
-void copy_OoTCollisionMaterial(struct OoTCollisionMaterial *dst,
-                               struct OoTCollisionMaterial *src) {
-    dst->name = strdup(src->name);
+// f3d binary output
+
+void f3d_bin_init(struct F3DBin *bin) {
+    text_buffer_init(&bin->data);
+    bin->symbols = NULL;
+    bin->n_symbols = 0;
+    bin->cap_symbols = 0;
+    bin->relocations = NULL;
+    bin->n_relocations = 0;
+    bin->cap_relocations = 0;
+    bin->error = false;
 }
 
-// TODO this is also a free for the result of join_OoTCollisionMeshes_impl
-void free_create_OoTCollisionMesh_from_buffers(struct OoTCollisionMesh *mesh) {
-    free(mesh->verts);
-    free(mesh->faces);
-    for (unsigned int i = 0; i < mesh->n_materials; i++) {
-        free(mesh->materials[i].name);
+void f3d_bin_free(struct F3DBin *bin) {
+    text_buffer_free(&bin->data);
+    for (size_t i = 0; i < bin->n_symbols; i++)
+        free(bin->symbols[i].name);
+    free(bin->symbols);
+    for (size_t i = 0; i < bin->n_relocations; i++)
+        free(bin->relocations[i].symbol);
+    free(bin->relocations);
+    f3d_bin_init(bin);
+}
+
+// Concatenate name and suffix into a new string
+static char *f3d_bin_strcat(struct F3DBin *bin, const char *name,
+                            const char *suffix) {
+    size_t len = strlen(name) + strlen(suffix) + 1;
+    char *s = malloc(len);
+    if (s == NULL) {
+        log_error("malloc failed");
+        bin->error = true;
+        return NULL;
     }
-    free(mesh->materials);
-    free(mesh);
+    snprintf(s, len, "%s%s", name, suffix);
+    return s;
 }
 
-struct OoTCollisionMesh *create_OoTCollisionMesh_from_buffers(
-    float *buf_vertices_co, size_t buf_vertices_co_len,                //
-    unsigned int *buf_triangles_loops, size_t buf_triangles_loops_len, //
-    unsigned int *buf_triangles_material_index,
-    size_t buf_triangles_material_index_len,                                 //
-    unsigned int *buf_loops_vertex_index, size_t buf_loops_vertex_index_len, //
-    struct OoTCollisionMaterial **materials, size_t n_materials,             //
-    struct OoTCollisionMaterial *default_material) {
+static void f3d_bin_add_symbol(struct F3DBin *bin, size_t offset,
+                               const char *name, const char *suffix) {
+    if (bin->n_symbols == bin->cap_symbols) {
+        size_t new_cap = bin->cap_symbols == 0 ? 16 : bin->cap_symbols * 2;
+        struct F3DBinSymbol *new_symbols =
+            realloc(bin->symbols, sizeof(struct F3DBinSymbol) * new_cap);
+        if (new_symbols == NULL) {
+            log_error("realloc symbols failed");
+            bin->error = true;
+            return;
+        }
+        bin->symbols = new_symbols;
+        bin->cap_symbols = new_cap;
+    }
+    char *s = f3d_bin_strcat(bin, name, suffix);
+    if (s == NULL)
+        return;
+    bin->symbols[bin->n_symbols].name = s;
+    bin->symbols[bin->n_symbols].offset = offset;
+    bin->n_symbols++;
+}
+
+static void f3d_bin_add_relocation(struct F3DBin *bin, size_t offset,
+                                   const char *symbol, const char *suffix) {
+    if (bin->n_relocations == bin->cap_relocations) {
+        size_t new_cap =
+            bin->cap_relocations == 0 ? 16 : bin->cap_relocations * 2;
+        struct F3DBinRelocation *new_relocations = realloc(
+            bin->relocations, sizeof(struct F3DBinRelocation) * new_cap);
+        if (new_relocations == NULL) {
+            log_error("realloc relocations failed");
+            bin->error = true;
+            return;
+        }
+        bin->relocations = new_relocations;
+        bin->cap_relocations = new_cap;
+    }
+    char *s = f3d_bin_strcat(bin, symbol, suffix);
+    if (s == NULL)
+        return;
+    bin->relocations[bin->n_relocations].offset = offset;
+    bin->relocations[bin->n_relocations].symbol = s;
+    bin->n_relocations++;
+}
+
+static void f3d_bin_put_u32(struct F3DBin *bin, uint32_t v) {
+    char bytes[4] = {
+        (char)(v >> 24),
+        (char)(v >> 16),
+        (char)(v >> 8),
+        (char)v,
+    };
+    text_buffer_append(&bin->data, bytes, 4);
+}
+
+static void f3d_bin_put_u16(struct F3DBin *bin, uint16_t v) {
+    char bytes[2] = {(char)(v >> 8), (char)v};
+    text_buffer_append(&bin->data, bytes, 2);
+}
+
+static void f3d_bin_gfx(struct F3DBin *bin, uint32_t w0, uint32_t w1) {
+    f3d_bin_put_u32(bin, w0);
+    f3d_bin_put_u32(bin, w1);
+}
+
+/**
+ * Write a command whose second word is an address, symbol + suffix + addend.
+ * The address is left to be relocated and addend is written in its place.
+ */
+static void f3d_bin_gfx_reloc(struct F3DBin *bin, uint32_t w0,
+                              const char *symbol, const char *suffix,
+                              uint32_t addend) {
+    f3d_bin_add_relocation(bin, bin->data.len + 4, symbol, suffix);
+    f3d_bin_gfx(bin, w0, addend);
+}
+
+// Append src to dst, moving the offsets of symbols and relocations
+static void f3d_bin_append(struct F3DBin *dst, struct F3DBin *src) {
+    size_t base = dst->data.len;
+    if (src->error || src->data.error) {
+        dst->error = true;
+        return;
+    }
+    text_buffer_append(&dst->data, src->data.data, src->data.len);
+    for (size_t i = 0; i < src->n_symbols; i++)
+        f3d_bin_add_symbol(dst, base + src->symbols[i].offset,
+                           src->symbols[i].name, "");
+    for (size_t i = 0; i < src->n_relocations; i++)
+        f3d_bin_add_relocation(dst, base + src->relocations[i].offset,
+                               src->relocations[i].symbol, "");
+}
+
+// F3DEX2 opcodes
+#define F3DEX2_G_VTX 0x01
+#define F3DEX2_G_TRI1 0x05
+#define F3DEX2_G_TRI2 0x06
+#define F3DEX2_G_TEXTURE 0xD7
+#define F3DEX2_G_GEOMETRYMODE 0xD9
+#define F3DEX2_G_MTX 0xDA
+#define F3DEX2_G_DL 0xDE
+#define F3DEX2_G_ENDDL 0xDF
+#define F3DEX2_G_RDPLOADSYNC 0xE6
+#define F3DEX2_G_RDPPIPESYNC 0xE7
+#define F3DEX2_G_SETPRIMDEPTH 0xEE
+#define F3DEX2_G_RDPSETOTHERMODE 0xEF
+#define F3DEX2_G_SETTILESIZE 0xF2
+#define F3DEX2_G_LOADBLOCK 0xF3
+#define F3DEX2_G_SETTILE 0xF5
+#define F3DEX2_G_SETFOGCOLOR 0xF8
+#define F3DEX2_G_SETBLENDCOLOR 0xF9
+#define F3DEX2_G_SETPRIMCOLOR 0xFA
+#define F3DEX2_G_SETENVCOLOR 0xFB
+#define F3DEX2_G_SETCOMBINE 0xFC
+#define F3DEX2_G_SETTIMG 0xFD
+
+#define SHIFTL(v, s, w) (((uint32_t)(v) & ((1u << (w)) - 1)) << (s))
+
+#define G_TX_LOADTILE 7
+#define G_TX_LDBLK_MAX_TXL 2047
+#define G_TX_DXT_FRAC 11
+
+static uint32_t f3d_bin_settile_w0(enum rdp_tile_format fmt,
+                                   enum rdp_tile_size siz, int line,
+                                   int tmem) {
+    return SHIFTL(F3DEX2_G_SETTILE, 24, 8) | SHIFTL(fmt, 21, 3) |
+           SHIFTL(siz, 19, 2) | SHIFTL(line, 9, 9) | SHIFTL(tmem, 0, 9);
+}
+
+static uint32_t f3d_bin_settile_w1(struct MaterialInfoTile *tile, int i_tile,
+                                   int palette) {
+    // G_TX_MIRROR = 1, G_TX_CLAMP = 2
+    int cmt = (tile->mirror_T ? 1 : 0) | (tile->clamp_T ? 2 : 0);
+    int cms = (tile->mirror_S ? 1 : 0) | (tile->clamp_S ? 2 : 0);
+    return SHIFTL(i_tile, 24, 3) | SHIFTL(palette, 20, 4) |
+           SHIFTL(cmt, 18, 2) | SHIFTL(tile->mask_T, 14, 4) |
+           SHIFTL(tile->shift_T, 10, 4) | SHIFTL(cms, 8, 2) |
+           SHIFTL(tile->mask_S, 4, 4) | SHIFTL(tile->shift_S, 0, 4);
+}
+
+static void f3d_bin_settilesize(struct F3DBin *bin, int i_tile, int uls,
+                                int ult, int lrs, int lrt) {
+    f3d_bin_gfx(bin,
+                SHIFTL(F3DEX2_G_SETTILESIZE, 24, 8) | SHIFTL(uls, 12, 12) |
+                    SHIFTL(ult, 0, 12),
+                SHIFTL(i_tile, 24, 3) | SHIFTL(lrs, 12, 12) |
+                    SHIFTL(lrt, 0, 12));
+}
+
+/**
+ * Same as the "(int)(%.2f * 4)" expressions written by write_f3d_mat, as
+ * evaluated by a C compiler.
+ */
+static int f3d_bin_tile_coord(float v) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.2f", v);
+    return (int)(strtod(buf, NULL) * 4);
+}
+
+static uint32_t f3d_bin_color(struct rgbaf *color) {
+    struct rgbau8 c = rgbaf_to_rgbau8(color);
+    return SHIFTL(c.r, 24, 8) | SHIFTL(c.g, 16, 8) | SHIFTL(c.b, 8, 8) |
+           SHIFTL(c.a, 0, 8);
+}
+
+/** Binary counterpart of write_f3d_mat */
+int write_f3d_mat_bin(struct F3DBin *bin, struct MaterialInfo *mat_info,
+                      const char *name) {
+    struct MaterialInfoOtherModes *om = &mat_info->other_modes;
+
+    f3d_bin_add_symbol(bin, bin->data.len, name, "_mat_dl");
+
+    f3d_bin_gfx(bin, SHIFTL(F3DEX2_G_RDPPIPESYNC, 24, 8), 0);
+
+    uint32_t om_h = 0;
+    om_h |= om->atomic_prim ? 1u << 23 : 0;
+    om_h |= SHIFTL(om->cycle_type, 20, 2);
+    om_h |= om->persp_tex_en ? 1u << 19 : 0;
+    om_h |= om->detail_tex_en    ? 2u << 17
+            : om->sharpen_tex_en ? 1u << 17
+                                 : 0;
+    om_h |= om->tex_lod_en ? 1u << 16 : 0;
+    om_h |= om->tlut_en ? (om->tlut_type ? 3u << 14 : 2u << 14) : 0;
+    om_h |= om->sample_type ? (om->mid_texel ? 3u << 12 : 2u << 12) : 0;
+    // Note: this is approximate, same as write_f3d_mat
+    if (om->bi_lerp_0 && om->bi_lerp_1)
+        om_h |= 6u << 9; // G_TC_FILT
+    else if (om->bi_lerp_0 && om->convert_one)
+        om_h |= 5u << 9; // G_TC_FILTCONV
+    om_h |= om->key_en ? 1u << 8 : 0;
+    om_h |= SHIFTL(om->rgb_dither_sel, 6, 2);
+    om_h |= SHIFTL(om->alpha_dither_sel, 4, 2);
+
+    uint32_t om_l = 0;
+    om_l |= om->antialias_en ? 0x8 : 0;
+    om_l |= om->z_compare_en ? 0x10 : 0;
+    om_l |= om->z_update_en ? 0x20 : 0;
+    om_l |= om->image_read_en ? 0x40 : 0;
+    om_l |= om->color_on_cvg ? 0x80 : 0;
+    om_l |= SHIFTL(om->cvg_dest, 8, 2);
+    om_l |= SHIFTL(om->z_mode, 10, 2);
+    om_l |= om->cvg_x_alpha ? 0x1000 : 0;
+    om_l |= om->alpha_cvg_select ? 0x2000 : 0;
+    om_l |= om->force_blend ? 0x4000 : 0;
+    // GBL_c1
+    om_l |= SHIFTL(om->bl_m1a_0, 30, 2) | SHIFTL(om->bl_m1b_0, 26, 2) |
+            SHIFTL(om->bl_m2a_0, 22, 2) | SHIFTL(om->bl_m2b_0, 18, 2);
+    // GBL_c2
+    om_l |= SHIFTL(om->bl_m1a_1, 28, 2) | SHIFTL(om->bl_m1b_1, 24, 2) |
+            SHIFTL(om->bl_m2a_1, 20, 2) | SHIFTL(om->bl_m2b_1, 16, 2);
+    om_l |= om->z_source_sel ? 1u << 2 : 0;
+    om_l |= om->alpha_compare_en ? (om->dither_alpha_en ? 3 : 1) : 0;
+
+    f3d_bin_gfx(bin,
+                SHIFTL(F3DEX2_G_RDPSETOTHERMODE, 24, 8) | (om_h & 0xFFFFFF),
+                om_l);
+
+    // (line, shift, incr, bytes) per tile size, the LOAD_BLOCK size is 32b
+    // for 32b and 16b otherwise
+    static const struct {
+        int line_bytes, shift, incr, bytes;
+    } siz_info[] = {
+        [RDP_TILE_SIZE_4] = {0, 2, 3, 0},
+        [RDP_TILE_SIZE_8] = {1, 1, 1, 1},
+        [RDP_TILE_SIZE_16] = {2, 0, 0, 2},
+        [RDP_TILE_SIZE_32] = {2, 0, 0, 4},
+    };
+
+    bool is_tile_set[8] = {0};
+
+    for (int i_tile = 0; i_tile < 8; i_tile++) {
+        struct MaterialInfoTile *tile = &mat_info->tiles[i_tile];
+
+        struct MaterialInfoImage *image = tile->image;
+        if (image != NULL) {
+            // see write_f3d_mat
+            bool address_already_used = false;
+            for (int j = 0; j < i_tile; j++) {
+                if (tile->address == mat_info->tiles[j].address) {
+                    address_already_used = true;
+                }
+            }
+
+            if (!address_already_used) {
+                // gsDPLoadMultiBlock / gsDPLoadMultiBlock_4b
+                int width = image->width, height = image->height;
+                enum rdp_tile_size load_siz = tile->size == RDP_TILE_SIZE_32
+                                                  ? RDP_TILE_SIZE_32
+                                                  : RDP_TILE_SIZE_16;
+                int words, line;
+                if (tile->size == RDP_TILE_SIZE_4) {
+                    words = MAX(1, width / 16);
+                    line = ((width >> 1) + 7) >> 3;
+                } else {
+                    words = MAX(1, width * siz_info[tile->size].bytes / 8);
+                    line = (width * siz_info[tile->size].line_bytes + 7) >> 3;
+                }
+                int dxt = ((1 << G_TX_DXT_FRAC) + words - 1) / words;
+                int lrs = ((width * height + siz_info[tile->size].incr) >>
+                           siz_info[tile->size].shift) -
+                          1;
+
+                f3d_bin_gfx_reloc(bin,
+                                  SHIFTL(F3DEX2_G_SETTIMG, 24, 8) |
+                                      SHIFTL(tile->format, 21, 3) |
+                                      SHIFTL(load_siz, 19, 2) |
+                                      SHIFTL(1 - 1, 0, 12),
+                                  image->c_identifier, "", 0);
+                f3d_bin_gfx(
+                    bin,
+                    f3d_bin_settile_w0(tile->format, load_siz, 0,
+                                       tile->address),
+                    f3d_bin_settile_w1(tile, G_TX_LOADTILE, 0));
+                f3d_bin_gfx(bin, SHIFTL(F3DEX2_G_RDPLOADSYNC, 24, 8), 0);
+                f3d_bin_gfx(bin, SHIFTL(F3DEX2_G_LOADBLOCK, 24, 8),
+                            SHIFTL(G_TX_LOADTILE, 24, 3) |
+                                SHIFTL(MIN(lrs, G_TX_LDBLK_MAX_TXL), 12, 12) |
+                                SHIFTL(dxt, 0, 12));
+                f3d_bin_gfx(bin, SHIFTL(F3DEX2_G_RDPPIPESYNC, 24, 8), 0);
+                f3d_bin_gfx(bin,
+                            f3d_bin_settile_w0(tile->format, tile->size, line,
+                                               tile->address),
+                            f3d_bin_settile_w1(tile, i_tile, tile->palette));
+                f3d_bin_settilesize(bin, i_tile, 0, 0, (width - 1) << 2,
+                                    (height - 1) << 2);
+
+                is_tile_set[i_tile] = true;
+            }
+        }
+    }
+
+    for (int i_tile = 0; i_tile < 8; i_tile++) {
+        struct MaterialInfoTile *tile = &mat_info->tiles[i_tile];
+
+        if (is_tile_set[i_tile])
+            continue;
+
+        // if not mipmapping we only use tiles 0 and 1 at most
+        if (!om->tex_lod_en && i_tile >= 2)
+            continue;
+
+        f3d_bin_gfx(bin,
+                    f3d_bin_settile_w0(tile->format, tile->size, tile->line,
+                                       tile->address),
+                    f3d_bin_settile_w1(tile, i_tile, tile->palette));
+        f3d_bin_settilesize(bin, i_tile, f3d_bin_tile_coord(tile->upper_left_S),
+                            f3d_bin_tile_coord(tile->upper_left_T),
+                            f3d_bin_tile_coord(tile->lower_right_S),
+                            f3d_bin_tile_coord(tile->lower_right_T));
+    }
+
+    // G_CCMUX_* and G_ACMUX_* values
+    static const uint8_t combiner_rgb_A_values[] = {
+        [RDP_COMBINER_RGB_A_INPUTS_COMBINED] = 0,
+        [RDP_COMBINER_RGB_A_INPUTS_TEX0] = 1,
+        [RDP_COMBINER_RGB_A_INPUTS_TEX1] = 2,
+        [RDP_COMBINER_RGB_A_INPUTS_PRIMITIVE] = 3,
+        [RDP_COMBINER_RGB_A_INPUTS_SHADE] = 4,
+        [RDP_COMBINER_RGB_A_INPUTS_ENVIRONMENT] = 5,
+        [RDP_COMBINER_RGB_A_INPUTS_1] = 6,
+        [RDP_COMBINER_RGB_A_INPUTS_NOISE] = 7,
+        [RDP_COMBINER_RGB_A_INPUTS_0] = 31,
+    };
+    static const uint8_t combiner_rgb_B_values[] = {
+        [RDP_COMBINER_RGB_B_INPUTS_COMBINED] = 0,
+        [RDP_COMBINER_RGB_B_INPUTS_TEX0] = 1,
+        [RDP_COMBINER_RGB_B_INPUTS_TEX1] = 2,
+        [RDP_COMBINER_RGB_B_INPUTS_PRIMITIVE] = 3,
+        [RDP_COMBINER_RGB_B_INPUTS_SHADE] = 4,
+        [RDP_COMBINER_RGB_B_INPUTS_ENVIRONMENT] = 5,
+        [RDP_COMBINER_RGB_B_INPUTS_CENTER] = 6,
+        [RDP_COMBINER_RGB_B_INPUTS_K4] = 7,
+        [RDP_COMBINER_RGB_B_INPUTS_0] = 31,
+    };
+    static const uint8_t combiner_rgb_C_values[] = {
+        [RDP_COMBINER_RGB_C_INPUTS_COMBINED] = 0,
+        [RDP_COMBINER_RGB_C_INPUTS_TEX0] = 1,
+        [RDP_COMBINER_RGB_C_INPUTS_TEX1] = 2,
+        [RDP_COMBINER_RGB_C_INPUTS_PRIMITIVE] = 3,
+        [RDP_COMBINER_RGB_C_INPUTS_SHADE] = 4,
+        [RDP_COMBINER_RGB_C_INPUTS_ENVIRONMENT] = 5,
+        [RDP_COMBINER_RGB_C_INPUTS_SCALE] = 6,
+        [RDP_COMBINER_RGB_C_INPUTS_COMBINED_ALPHA] = 7,
+        [RDP_COMBINER_RGB_C_INPUTS_TEX0_ALPHA] = 8,
+        [RDP_COMBINER_RGB_C_INPUTS_TEX1_ALPHA] = 9,
+        [RDP_COMBINER_RGB_C_INPUTS_PRIMITIVE_ALPHA] = 10,
+        [RDP_COMBINER_RGB_C_INPUTS_SHADE_ALPHA] = 11,
+        [RDP_COMBINER_RGB_C_INPUTS_ENVIRONMENT_ALPHA] = 12,
+        [RDP_COMBINER_RGB_C_INPUTS_LOD_FRACTION] = 13,
+        [RDP_COMBINER_RGB_C_INPUTS_PRIM_LOD_FRAC] = 14,
+        [RDP_COMBINER_RGB_C_INPUTS_K5] = 15,
+        [RDP_COMBINER_RGB_C_INPUTS_0] = 31,
+    };
+    static const uint8_t combiner_rgb_D_values[] = {
+        [RDP_COMBINER_RGB_D_INPUTS_COMBINED] = 0,
+        [RDP_COMBINER_RGB_D_INPUTS_TEX0] = 1,
+        [RDP_COMBINER_RGB_D_INPUTS_TEX1] = 2,
+        [RDP_COMBINER_RGB_D_INPUTS_PRIMITIVE] = 3,
+        [RDP_COMBINER_RGB_D_INPUTS_SHADE] = 4,
+        [RDP_COMBINER_RGB_D_INPUTS_ENVIRONMENT] = 5,
+        [RDP_COMBINER_RGB_D_INPUTS_1] = 6,
+        [RDP_COMBINER_RGB_D_INPUTS_0] = 31,
+    };
+    // the alpha inputs enums are in G_ACMUX_* order
+    // (LOD_FRACTION is 0 for the C input)
+
+    struct MaterialInfoCombiner *comb = &mat_info->combiner;
+
+    uint32_t comb_w0 =
+        SHIFTL(combiner_rgb_A_values[comb->rgb_A_0], 20, 4) |
+        SHIFTL(combiner_rgb_C_values[comb->rgb_C_0], 15, 5) |
+        SHIFTL(comb->alpha_A_0, 12, 3) | SHIFTL(comb->alpha_C_0, 9, 3) |
+        SHIFTL(combiner_rgb_A_values[comb->rgb_A_1], 5, 4) |
+        SHIFTL(combiner_rgb_C_values[comb->rgb_C_1], 0, 5);
+    uint32_t comb_w1 =
+        SHIFTL(combiner_rgb_B_values[comb->rgb_B_0], 28, 4) |
+        SHIFTL(combiner_rgb_D_values[comb->rgb_D_0], 15, 3) |
+        SHIFTL(comb->alpha_B_0, 12, 3) | SHIFTL(comb->alpha_D_0, 9, 3) |
+        SHIFTL(combiner_rgb_B_values[comb->rgb_B_1], 24, 4) |
+        SHIFTL(comb->alpha_A_1, 21, 3) | SHIFTL(comb->alpha_C_1, 18, 3) |
+        SHIFTL(combiner_rgb_D_values[comb->rgb_D_1], 6, 3) |
+        SHIFTL(comb->alpha_B_1, 3, 3) | SHIFTL(comb->alpha_D_1, 0, 3);
+    f3d_bin_gfx(bin, SHIFTL(F3DEX2_G_SETCOMBINE, 24, 8) | comb_w0, comb_w1);
+
+    struct MaterialInfoVals *vals = &mat_info->vals;
+
+    f3d_bin_gfx(bin, SHIFTL(F3DEX2_G_SETPRIMDEPTH, 24, 8),
+                SHIFTL(vals->primitive_depth_z, 16, 16) |
+                    SHIFTL(vals->primitive_depth_dz, 0, 16));
+    f3d_bin_gfx(bin, SHIFTL(F3DEX2_G_SETFOGCOLOR, 24, 8),
+                f3d_bin_color(&vals->fog_color));
+    f3d_bin_gfx(bin, SHIFTL(F3DEX2_G_SETBLENDCOLOR, 24, 8),
+                f3d_bin_color(&vals->blend_color));
+    f3d_bin_gfx(bin,
+                SHIFTL(F3DEX2_G_SETPRIMCOLOR, 24, 8) |
+                    SHIFTL(vals->min_level, 8, 8) |
+                    SHIFTL(vals->prim_lod_frac, 0, 8),
+                f3d_bin_color(&vals->primitive_color));
+    f3d_bin_gfx(bin, SHIFTL(F3DEX2_G_SETENVCOLOR, 24, 8),
+                f3d_bin_color(&vals->environment_color));
+
+    // gsSPTexture(0xFFFF, 0xFFFF, 0, G_TX_RENDERTILE, G_ON)
+    f3d_bin_gfx(bin, SHIFTL(F3DEX2_G_TEXTURE, 24, 8) | SHIFTL(1, 1, 7),
+                0xFFFFFFFF);
+
+    // F3DEX2 geometry mode flags
+    enum {
+        G_ZBUFFER = 0x00000001,
+        G_SHADE = 0x00000004,
+        G_CULL_FRONT = 0x00000200,
+        G_CULL_BACK = 0x00000400,
+        G_FOG = 0x00010000,
+        G_LIGHTING = 0x00020000,
+        G_TEXTURE_GEN = 0x00040000,
+        G_TEXTURE_GEN_LINEAR = 0x00080000,
+        G_SHADING_SMOOTH = 0x00200000,
+    };
+    struct MaterialInfoGeometryMode *gm = &mat_info->geometry_mode;
+    uint32_t set_geometry_mode = 0;
+    set_geometry_mode |= gm->zbuffer ? G_ZBUFFER : 0;
+    set_geometry_mode |= gm->lighting || gm->vertex_colors ? G_SHADE : 0;
+    set_geometry_mode |= gm->lighting ? G_LIGHTING : 0;
+    set_geometry_mode |= gm->cull_front ? G_CULL_FRONT : 0;
+    set_geometry_mode |= gm->cull_back ? G_CULL_BACK : 0;
+    set_geometry_mode |= gm->fog ? G_FOG : 0;
+    if (gm->uv_gen_spherical)
+        set_geometry_mode |= G_TEXTURE_GEN;
+    else if (gm->uv_gen_linear)
+        set_geometry_mode |= G_TEXTURE_GEN | G_TEXTURE_GEN_LINEAR;
+    set_geometry_mode |= gm->shade_smooth ? G_SHADING_SMOOTH : 0;
+    // everything not set is cleared, like in write_f3d_mat
+    uint32_t clear_geometry_mode =
+        (G_ZBUFFER | G_SHADE | G_LIGHTING | G_CULL_FRONT | G_CULL_BACK | G_FOG |
+         G_TEXTURE_GEN | G_SHADING_SMOOTH) &
+        ~set_geometry_mode;
+    if (gm->uv_gen_spherical)
+        clear_geometry_mode |= G_TEXTURE_GEN_LINEAR;
+    f3d_bin_gfx(bin,
+                SHIFTL(F3DEX2_G_GEOMETRYMODE, 24, 8) |
+                    SHIFTL(~clear_geometry_mode, 0, 24),
+                set_geometry_mode);
+
+    f3d_bin_gfx(bin, SHIFTL(F3DEX2_G_ENDDL, 24, 8), 0);
+
+    return 0;
+}
+
+static uint32_t f3d_bin_tri_w1f(struct f3d_mesh_entry_triangles_triangle *tri) {
+    return SHIFTL(tri->indices[0] * 2, 16, 8) |
+           SHIFTL(tri->indices[1] * 2, 8, 8) |
+           SHIFTL(tri->indices[2] * 2, 0, 8);
+}
+
+/** Binary counterpart of write_f3d_mesh */
+int write_f3d_mesh_bin(struct F3DBin *bin, struct f3d_mesh *mesh,
+                       const char *name) {
+    f3d_bin_add_symbol(bin, bin->data.len, name, "_mesh_vtx");
+    for (int i = 0; i < mesh->n_vertices; i++) {
+        struct f3d_vertex *v = &mesh->vertices[i];
+
+        // Vtx_t
+        f3d_bin_put_u16(bin, (uint16_t)v->coords[0]);
+        f3d_bin_put_u16(bin, (uint16_t)v->coords[1]);
+        f3d_bin_put_u16(bin, (uint16_t)v->coords[2]);
+        f3d_bin_put_u16(bin, v->flag);
+        f3d_bin_put_u16(bin, (uint16_t)v->st[0]);
+        f3d_bin_put_u16(bin, (uint16_t)v->st[1]);
+        f3d_bin_put_u32(bin, SHIFTL(v->cn[0], 24, 8) | SHIFTL(v->cn[1], 16, 8) |
+                                 SHIFTL(v->cn[2], 8, 8) |
+                                 SHIFTL(v->alpha, 0, 8));
+    }
+
+    unsigned int cur_corner_material = ~0u;
+
+    f3d_bin_add_symbol(bin, bin->data.len, name, "_mesh_dl");
+    for (int i = 0; i < mesh->n_entries; i++) {
+        switch (mesh->entries[i]->type) {
+        case F3D_MESH_ENTRY_VERTICES: {
+            struct f3d_mesh_entry_vertices *e =
+                (struct f3d_mesh_entry_vertices *)mesh->entries[i];
+            if (e->corner_material_index != cur_corner_material) {
+                cur_corner_material = e->corner_material_index;
+                const char *matrix =
+                    mesh->corner_materials[cur_corner_material].matrix;
+                if (matrix != NULL) {
+                    // gsSPMatrix(matrix,
+                    //            G_MTX_NOPUSH | G_MTX_LOAD | G_MTX_MODELVIEW)
+                    uint32_t w0 = SHIFTL(F3DEX2_G_MTX, 24, 8) |
+                                  SHIFTL((64 - 1) / 8, 19, 5) |
+                                  SHIFTL(0x02 ^ 0x01, 0, 8);
+                    // the matrix is usually a segmented address literal,
+                    // otherwise it is taken as a symbol
+                    char *end;
+                    unsigned long address = strtoul(matrix, &end, 0);
+                    if (*matrix != '\0' && *end == '\0') {
+                        f3d_bin_gfx(bin, w0, (uint32_t)address);
+                    } else {
+                        f3d_bin_gfx_reloc(bin, w0, matrix, "", 0);
+                    }
+                }
+            }
+            f3d_bin_gfx_reloc(bin,
+                              SHIFTL(F3DEX2_G_VTX, 24, 8) |
+                                  SHIFTL(e->n, 12, 8) |
+                                  SHIFTL(e->v0 + e->n, 1, 7),
+                              name, "_mesh_vtx", e->buffer_i * 16);
+        } break;
+
+        case F3D_MESH_ENTRY_TRIANGLES: {
+            struct f3d_mesh_entry_triangles *e =
+                (struct f3d_mesh_entry_triangles *)mesh->entries[i];
+            for (int j = 0; j + 1 < e->n_tris; j += 2) {
+                f3d_bin_gfx(bin,
+                            SHIFTL(F3DEX2_G_TRI2, 24, 8) |
+                                f3d_bin_tri_w1f(&e->tris[j]),
+                            f3d_bin_tri_w1f(&e->tris[j + 1]));
+            }
+
+            if (e->n_tris % 2 != 0) {
+                f3d_bin_gfx(bin,
+                            SHIFTL(F3DEX2_G_TRI1, 24, 8) |
+                                f3d_bin_tri_w1f(&e->tris[e->n_tris - 1]),
+                            0);
+            }
+        } break;
+        }
+    }
+    f3d_bin_gfx(bin, SHIFTL(F3DEX2_G_ENDDL, 24, 8), 0);
+
+    return 0;
+}
+
+struct write_submesh_f3d_bin_jobs {
+    struct MeshInfo *mesh_info;
+    struct MeshInfo **meshes;
+    const char **limb_to_matrix_map;
+    int limb_to_matrix_map_len;
+    // per submesh
+    struct F3DBin *outputs;
+    int *results;
+};
+
+static void write_submesh_f3d_bin_job(void *arg, size_t i_mesh) {
+    struct write_submesh_f3d_bin_jobs *jobs = arg;
+    struct MaterialInfo *mat_info = &jobs->mesh_info->materials[i_mesh];
+    struct MeshInfo *mesh = jobs->meshes[i_mesh];
+    struct F3DBin *bin = &jobs->outputs[i_mesh];
+
+    double t_mat = stats_now();
+    write_f3d_mat_bin(bin, mat_info, mesh->name);
+    stats_add_stage_time(EXPORT_STAGE_TEXT_EMISSION, t_mat);
+    struct f3d_mesh *f3d_mesh = mesh_to_f3d_mesh(
+        mesh, jobs->limb_to_matrix_map, jobs->limb_to_matrix_map_len,
+        mat_info->uv_basis_s, mat_info->uv_basis_t,
+        get_shading_type(mat_info, &f3d_ucode_f3dex2), &f3d_ucode_f3dex2);
+    if (f3d_mesh == NULL) {
+        log_error("mesh_to_f3d_mesh failed for %s", mesh->name);
+        jobs->results[i_mesh] = -1;
+        return;
+    }
+    double t_mesh = stats_now();
+    write_f3d_mesh_bin(bin, f3d_mesh, mesh->name);
+    stats_add_stage_time(EXPORT_STAGE_TEXT_EMISSION, t_mesh);
+    free_mesh_to_f3d_mesh(f3d_mesh);
+
+    jobs->results[i_mesh] = bin->error || bin->data.error ? -2 : 0;
+}
+
+/**
+ * Binary counterpart of write_mesh_info_to_f3d_c, encoding the same display
+ * lists and vertices as big-endian F3DEX2 data.
+ */
+int write_mesh_info_to_f3d_bin(struct MeshInfo *mesh_info,
+                               const char **limb_to_matrix_map,
+                               int limb_to_matrix_map_len, struct F3DBin *bin,
+                               char **dl_name) {
+    double t_split = stats_now();
+    struct MeshInfo **meshes = split_mesh_by_material(mesh_info);
+    if (meshes == NULL) {
+        log_error("malloc meshes failed");
+        return -2;
+    }
+    stats_add_stage_time(EXPORT_STAGE_SPLIT, t_split);
+
+    unsigned int n_meshes = mesh_info->n_materials;
+    struct write_submesh_f3d_bin_jobs jobs;
+    jobs.mesh_info = mesh_info;
+    jobs.meshes = meshes;
+    jobs.limb_to_matrix_map = limb_to_matrix_map;
+    jobs.limb_to_matrix_map_len = limb_to_matrix_map_len;
+    jobs.outputs = malloc(sizeof(struct F3DBin) * n_meshes);
+    jobs.results = malloc(sizeof(int) * n_meshes);
+    if (jobs.outputs == NULL || jobs.results == NULL) {
+        log_error("malloc outputs or results failed");
+        free(jobs.outputs);
+        free(jobs.results);
+        free_split_mesh_by_material(meshes, n_meshes);
+        return -2;
+    }
+    for (unsigned int i_mesh = 0; i_mesh < n_meshes; i_mesh++)
+        f3d_bin_init(&jobs.outputs[i_mesh]);
+
+    workers_run(n_meshes, write_submesh_f3d_bin_job, &jobs);
+
+    int res = 0;
+    for (unsigned int i_mesh = 0; i_mesh < n_meshes; i_mesh++) {
+        if (res == 0 && jobs.results[i_mesh] != 0) {
+            log_error("converting %s failed (%d)", meshes[i_mesh]->name,
+                      jobs.results[i_mesh]);
+            res = -4;
+        }
+        if (res == 0)
+            f3d_bin_append(bin, &jobs.outputs[i_mesh]);
+        f3d_bin_free(&jobs.outputs[i_mesh]);
+    }
+    free(jobs.outputs);
+    free(jobs.results);
+
+    if (res != 0) {
+        free_split_mesh_by_material(meshes, n_meshes);
+        return res;
+    }
+
+    if (dl_name != NULL) {
+        size_t dl_name_len = strlen(mesh_info->name) + strlen("_dl") + 1;
+        *dl_name = malloc(dl_name_len);
+        if (*dl_name == NULL) {
+            log_error("malloc dl_name failed");
+            free_split_mesh_by_material(meshes, n_meshes);
+            return -3;
+        }
+        snprintf(*dl_name, dl_name_len, "%s_dl", mesh_info->name);
+    }
+
+    f3d_bin_add_symbol(bin, bin->data.len, mesh_info->name, "_dl");
+    for (unsigned int i_mesh = 0; i_mesh < n_meshes; i_mesh++) {
+        struct MeshInfo *mesh = meshes[i_mesh];
+        // gsSPDisplayList
+        f3d_bin_gfx_reloc(bin, SHIFTL(F3DEX2_G_DL, 24, 8), mesh->name,
+                          "_mat_dl", 0);
+        f3d_bin_gfx_reloc(bin, SHIFTL(F3DEX2_G_DL, 24, 8), mesh->name,
+                          "_mesh_dl", 0);
+    }
+    f3d_bin_gfx(bin, SHIFTL(F3DEX2_G_ENDDL, 24, 8), 0);
+
+    free_split_mesh_by_material(meshes, n_meshes);
+
+    return bin->error || bin->data.error ? -6 : 0;
+}
+
+void copy_OoTCollisionMaterial(struct OoTCollisionMaterial *dst,
+                               struct OoTCollisionMaterial *src) {
+    dst->name = strdup(src->name);
+}
+
+// TODO this is also a free for the result of join_OoTCollisionMeshes_impl
+void free_create_OoTCollisionMesh_from_buffers(struct OoTCollisionMesh *mesh) {
+    free(mesh->verts);
+    free(mesh->faces);
+    for (unsigned int i = 0; i < mesh->n_materials; i++) {
+        free(mesh->materials[i].name);
+    }
+    free(mesh->materials);
+    free(mesh);
+}
+
+struct OoTCollisionMesh *create_OoTCollisionMesh_from_buffers(
+    float *buf_vertices_co, size_t buf_vertices_co_len,                //
+    unsigned int *buf_triangles_loops, size_t buf_triangles_loops_len, //
+    unsigned int *buf_triangles_material_index,
+    size_t buf_triangles_material_index_len,                                 //
+    unsigned int *buf_loops_vertex_index, size_t buf_loops_vertex_index_len, //
+    struct OoTCollisionMaterial **materials, size_t n_materials,             //
+    struct OoTCollisionMaterial *default_material) {
+    double t_start = stats_now();
+
+    unsigned int n_loops = buf_loops_vertex_index_len;
+
+    unsigned int n_faces = (unsigned int)(buf_triangles_loops_len / 3);
+    if (buf_triangles_material_index_len != n_faces) {
+        log_error(
+            "buf_triangles_material_index_len=%zd and n_faces=%u mismatch",
+            buf_triangles_material_index_len, n_faces);
+        return NULL;
+    }
+
+    unsigned int n_materials_used;
+    bool use_default_material;
+    unsigned int default_material_index;
+    unsigned int *material_index_map = remap_materials(
+        buf_triangles_material_index, n_faces, (void **)materials, n_materials,
+        &n_materials_used, &use_default_material, &default_material_index);
+    if (material_index_map == NULL) {
+        log_error("remap_materials failed");
+        return NULL;
+    }
+
+    struct OoTCollisionMesh *mesh = malloc(sizeof(struct OoTCollisionMesh));
+    if (mesh == NULL) {
+        log_error("malloc mesh failed");
+        return NULL;
+    }
+
+    mesh->n_verts = n_loops;
+    mesh->verts = malloc(sizeof(struct OoTCollisionVertex) * n_loops);
+
+    mesh->n_faces = n_faces;
+    mesh->faces = malloc(sizeof(struct OoTCollisionTri) * n_faces);
+
+    mesh->n_materials = n_materials_used;
+    mesh->materials =
+        malloc(sizeof(struct OoTCollisionMaterial) * n_materials_used);
+
+    if (mesh->materials != NULL) {
+        // for free_create_OoTCollisionMesh_from_buffers
+        for (unsigned int i = 0; i < n_materials_used; i++) {
+            mesh->materials[i].name = NULL;
+        }
+    }
+
+    if (mesh->verts == NULL || mesh->faces == NULL || mesh->materials == NULL) {
+        log_error("malloc verts, faces or materials failed");
+        free_create_OoTCollisionMesh_from_buffers(mesh);
+        return NULL;
+    }
+
+    for (unsigned int i_loop = 0; i_loop < n_loops; i_loop++) {
+        for (int j = 0; j < 3; j++) {
+            unsigned int v = buf_loops_vertex_index[i_loop] * 3 + j;
+            if (v >= buf_vertices_co_len) {
+                log_error(
+                    "i_loop=%u: v=%u out of bounds (buf_vertices_co_len=%zd)",
+                    i_loop, v, buf_vertices_co_len);
+                free_create_OoTCollisionMesh_from_buffers(mesh);
+                return NULL;
+            }
+            mesh->verts[i_loop].coords[j] = buf_vertices_co[v];
+        }
+    }
+
+    for (unsigned int i = 0; i < n_faces; i++) {
+        for (int j = 0; j < 3; j++) {
+            unsigned int loop = buf_triangles_loops[i * 3 + j];
+            if (loop >= n_loops) {
+                log_error("face %u: loop=%u out of bounds (n_loops=%u)", i,
+                          loop, n_loops);
+                free_create_OoTCollisionMesh_from_buffers(mesh);
+                return NULL;
+            }
+            mesh->faces[i].verts[j] = loop;
+        }
+        mesh->faces[i].material =
+            material_index_map[buf_triangles_material_index[i]];
+    }
+
+    for (unsigned int i = 0; i < n_materials; i++) {
+        if (material_index_map[i] == ~0u ||
+            (use_default_material &&
+             material_index_map[i] == default_material_index))
+            continue;
+        struct OoTCollisionMaterial *mat = materials[i];
+
+        // because material_index_map[i] != default_material_index
+        assert(mat != NULL);
+
+        copy_OoTCollisionMaterial(&mesh->materials[material_index_map[i]], mat);
+    }
+
+    free(material_index_map);
+
+    if (use_default_material) {
+        assert(default_material_index != ~0u);
+        copy_OoTCollisionMaterial(&mesh->materials[default_material_index],
+                                  default_material);
+    }
+
+    stats_add_stage_time(EXPORT_STAGE_COLLISION_BUILD, t_start);
+
+    return mesh;
+}
+
+struct join_OoTCollisionMeshes_material_eq_arg {
+    struct OoTCollisionMaterial *materials;
+    const char *name;
+};
+
+static bool join_OoTCollisionMeshes_material_eq(void *_arg, uint32_t index) {
+    struct join_OoTCollisionMeshes_material_eq_arg *arg = _arg;
+    return strcmp(arg->materials[index].name, arg->name) == 0;
+}
+
+struct OoTCollisionMesh *
+join_OoTCollisionMeshes_impl(struct OoTCollisionMesh **meshes,
+                             size_t n_meshes) {
+    double t_start = stats_now();
+    unsigned int n_verts = 0, n_faces = 0, n_materials = 0;
+    unsigned int max_mesh_n_materials = 0;
+    for (size_t i = 0; i < n_meshes; i++) {
+        struct OoTCollisionMesh *m = meshes[i];
+        n_verts += m->n_verts;
+        n_faces += m->n_faces;
+        n_materials += m->n_materials;
+        max_mesh_n_materials = MAX(max_mesh_n_materials, m->n_materials);
+    }
+    struct OoTCollisionMesh *joined_mesh =
+        malloc(sizeof(struct OoTCollisionMesh));
+    if (joined_mesh == NULL) {
+        log_error("malloc mesh failed");
+        return NULL;
+    }
+
+    joined_mesh->n_verts = n_verts;
+    joined_mesh->verts = malloc(sizeof(struct OoTCollisionVertex) * n_verts);
+
+    joined_mesh->n_faces = n_faces;
+    joined_mesh->faces = malloc(sizeof(struct OoTCollisionTri) * n_faces);
+
+    joined_mesh->n_materials = n_materials;
+    joined_mesh->materials =
+        malloc(sizeof(struct OoTCollisionMaterial) * n_materials);
+
+    if (joined_mesh->materials != NULL) {
+        // for free_create_OoTCollisionMesh_from_buffers
+        for (unsigned int i = 0; i < n_materials; i++) {
+            joined_mesh->materials[i].name = NULL;
+        }
+    }
+
+    // materials are interned by name, so the joined mesh has one per polytype
+    // however many meshes use it
+    unsigned int *material_remap =
+        malloc(sizeof(unsigned int) * MAX(max_mesh_n_materials, 1));
+    struct IndexHashMap materials_map;
+    bool materials_map_ok = index_hash_map_init(&materials_map, 0) == 0;
+
+    if (joined_mesh->verts == NULL || joined_mesh->faces == NULL ||
+        joined_mesh->materials == NULL || material_remap == NULL ||
+        !materials_map_ok) {
+        log_error("malloc verts, faces, materials or materials map failed");
+        free(material_remap);
+        if (materials_map_ok)
+            index_hash_map_free(&materials_map);
+        joined_mesh->n_materials = 0;
+        free_create_OoTCollisionMesh_from_buffers(joined_mesh);
+        return NULL;
+    }
+
+    unsigned int off_verts = 0, off_faces = 0, n_joined_materials = 0;
+    for (size_t i_mesh = 0; i_mesh < n_meshes; i_mesh++) {
+        struct OoTCollisionMesh *m = meshes[i_mesh];
+        for (unsigned int i_mat = 0; i_mat < m->n_materials; i_mat++) {
+            struct join_OoTCollisionMeshes_material_eq_arg arg = {
+                joined_mesh->materials, m->materials[i_mat].name};
+            uint32_t hash = hash_bytes(arg.name, strlen(arg.name));
+            uint32_t found = index_hash_map_find(
+                &materials_map, hash, join_OoTCollisionMeshes_material_eq,
+                &arg);
+            if (found == ~0u) {
+                found = n_joined_materials;
+                copy_OoTCollisionMaterial(&joined_mesh->materials[found],
+                                          &m->materials[i_mat]);
+                n_joined_materials++;
+                if (joined_mesh->materials[found].name == NULL ||
+                    index_hash_map_insert(&materials_map, hash, found) != 0) {
+                    log_error("copying material or inserting it failed");
+                    free(material_remap);
+                    index_hash_map_free(&materials_map);
+                    free_create_OoTCollisionMesh_from_buffers(joined_mesh);
+                    return NULL;
+                }
+            }
+            material_remap[i_mat] = found;
+        }
+
+        memcpy(&joined_mesh->verts[off_verts], m->verts,
+               sizeof(struct OoTCollisionVertex) * m->n_verts);
+        for (unsigned int i_face = 0; i_face < m->n_faces; i_face++) {
+            for (int j = 0; j < 3; j++) {
+                joined_mesh->faces[off_faces + i_face].verts[j] =
+                    off_verts + m->faces[i_face].verts[j];
+            }
+            joined_mesh->faces[off_faces + i_face].material =
+                material_remap[m->faces[i_face].material];
+        }
+        off_verts += m->n_verts;
+        off_faces += m->n_faces;
+    }
+
+    free(material_remap);
+    index_hash_map_free(&materials_map);
+
+    log_debug("joined %u materials into %u", n_materials, n_joined_materials);
+    // the names past n_joined_materials are all NULL
+    joined_mesh->n_materials = n_joined_materials;
+
+    stats_add_stage_time(EXPORT_STAGE_COLLISION_BUILD, t_start);
+
+    return joined_mesh;
+}
+
+struct weld_OoTCollisionVertices_eq_arg {
+    int16_t (*welded)[3];
+    int16_t *q;
+    int epsilon;
+};
+
+static bool weld_OoTCollisionVertices_eq(void *_arg, uint32_t index) {
+    struct weld_OoTCollisionVertices_eq_arg *arg = _arg;
+    for (int j = 0; j < 3; j++) {
+        int d = arg->welded[index][j] - arg->q[j];
+        if (d < -arg->epsilon || d > arg->epsilon)
+            return false;
+    }
+    return true;
+}
+
+static uint32_t weld_OoTCollisionVertices_cell_hash(int32_t cell[3]) {
+    return hash_bytes(cell, sizeof(int32_t) * 3);
+}
+
+/**
+ * Quantize the vertices used by the faces to the int16_t coordinates the game
+ * uses, then merge vertices whose quantized coordinates are within epsilon of
+ * each other on every axis (so only identical ones if epsilon is 0).
+ *
+ * Vertices are bucketed in a hash table by cells of size epsilon + 1, so a
+ * match can only be in the same or a neighboring cell.
+ * A vertex is merged into the first welded vertex found close enough, welded
+ * vertices are in order of first use by the faces.
+ *
+ * @param welded Output, at most n_verts welded vertices
+ * @param remap Output, n_verts entries mapping vertices to welded vertices
+ *  (~0u for vertices not used by any face)
+ * @return The number of welded vertices, or -1 on failure
+ */
+static long weld_OoTCollisionVertices(struct OoTCollisionMesh *mesh,
+                                      int epsilon, int16_t (*welded)[3],
+                                      unsigned int *remap) {
+    assert(epsilon >= 0 && epsilon <= OOT_COLLISION_WELD_EPSILON_MAX);
+
+    struct IndexHashMap map;
+    if (index_hash_map_init(&map, mesh->n_verts) != 0) {
+        log_error("index_hash_map_init failed");
+        return -1;
+    }
+
+    int cell_size = epsilon + 1;
+    // the cells to look in around a vertex's cell
+    int cell_range = epsilon == 0 ? 0 : 1;
+    int cells_side = 2 * cell_range + 1;
+    int n_cells = cells_side * cells_side * cells_side;
+    uint32_t n_welded = 0;
+
+    for (unsigned int i = 0; i < mesh->n_verts; i++)
+        remap[i] = ~0u;
+
+    for (unsigned int i_face = 0; i_face < mesh->n_faces; i_face++) {
+        for (int j = 0; j < 3; j++) {
+            unsigned int v = mesh->faces[i_face].verts[j];
+            assert(v < mesh->n_verts);
+            if (remap[v] != ~0u)
+                continue;
+
+            int16_t q[3];
+            int32_t cell[3];
+            for (int k = 0; k < 3; k++) {
+                float c = mesh->verts[v].coords[k];
+                // also rejects NaN
+                if (!(c > INT16_MIN - 1.0f && c < INT16_MAX + 1.0f)) {
+                    log_error("vertex %u coordinate %f does not fit in int16_t",
+                              v, c);
+                    index_hash_map_free(&map);
+                    return -1;
+                }
+                q[k] = (int16_t)c;
+                // offset to positive values to divide rounding down
+                cell[k] = (q[k] - INT16_MIN) / cell_size;
+            }
+
+            struct weld_OoTCollisionVertices_eq_arg arg = {welded, q, epsilon};
+            uint32_t found = ~0u;
+            for (int i_cell = 0; i_cell < n_cells && found == ~0u; i_cell++) {
+                int32_t neighbor[3] = {
+                    cell[0] + i_cell % cells_side - cell_range,
+                    cell[1] + i_cell / cells_side % cells_side - cell_range,
+                    cell[2] + i_cell / (cells_side * cells_side) - cell_range,
+                };
+                found = index_hash_map_find(
+                    &map, weld_OoTCollisionVertices_cell_hash(neighbor),
+                    weld_OoTCollisionVertices_eq, &arg);
+            }
+
+            if (found == ~0u) {
+                if (index_hash_map_insert(
+                        &map, weld_OoTCollisionVertices_cell_hash(cell),
+                        n_welded) != 0) {
+                    log_error("index_hash_map_insert failed");
+                    index_hash_map_free(&map);
+                    return -1;
+                }
+                welded[n_welded][0] = q[0];
+                welded[n_welded][1] = q[1];
+                welded[n_welded][2] = q[2];
+                found = n_welded;
+                n_welded++;
+            }
+            remap[v] = found;
+        }
+    }
+
+    index_hash_map_free(&map);
+    return n_welded;
+}
+
+/** How BgCheck classifies polys, from their normal's y */
+enum oot_collision_poly_class {
+    OOT_COLLISION_POLY_FLOOR,
+    OOT_COLLISION_POLY_WALL,
+    OOT_COLLISION_POLY_CEILING,
+};
+
+static enum oot_collision_poly_class oot_collision_poly_class(double ny) {
+    return ny > 0.5    ? OOT_COLLISION_POLY_FLOOR
+           : ny < -0.8 ? OOT_COLLISION_POLY_CEILING
+                       : OOT_COLLISION_POLY_WALL;
+}
+
+// how far the normal of a face may turn from its original normal, as a cosine
+#define COLLISION_SIMPLIFY_MIN_NORMAL_DOT 0.99
+// faces whose cross product is shorter (twice their area, in OoT units
+// squared) are not created, and left untouched if they exist already
+#define COLLISION_SIMPLIFY_MIN_CROSS 1.0
+// squared distance below which collapses count as exact, for tolerance 0
+#define COLLISION_SIMPLIFY_EPSILON2 1e-6
+#define COLLISION_SIMPLIFY_MAX_PASSES 32
+
+/**
+ * Symmetric 4x4 matrix summing the squared distances to planes
+ * (Garland-Heckbert quadric): xx xy xz xd yy yz yd zz zd dd
+ */
+typedef double collision_quadric[10];
+
+static void collision_quadric_add_plane(collision_quadric q, const double n[3],
+                                        double d) {
+    q[0] += n[0] * n[0];
+    q[1] += n[0] * n[1];
+    q[2] += n[0] * n[2];
+    q[3] += n[0] * d;
+    q[4] += n[1] * n[1];
+    q[5] += n[1] * n[2];
+    q[6] += n[1] * d;
+    q[7] += n[2] * n[2];
+    q[8] += n[2] * d;
+    q[9] += d * d;
+}
+
+/** The sum of squared distances from p to the planes of a and b */
+static double collision_quadric_eval(const collision_quadric a,
+                                     const collision_quadric b,
+                                     const double p[3]) {
+    double q[10];
+    for (int i = 0; i < 10; i++)
+        q[i] = a[i] + b[i];
+    double x = p[0], y = p[1], z = p[2];
+    return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x +
+           q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y + q[7] * z * z +
+           2 * q[8] * z + q[9];
+}
+
+/** Returns the length of the cross product (v1-v0)x(v2-v0), put in cross */
+static double collision_face_cross(double (*pos)[3], const unsigned int v[3],
+                                   double cross[3]) {
+    const double *p0 = pos[v[0]], *p1 = pos[v[1]], *p2 = pos[v[2]];
+    double u[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+    double w[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+    cross[0] = u[1] * w[2] - u[2] * w[1];
+    cross[1] = u[2] * w[0] - u[0] * w[2];
+    cross[2] = u[0] * w[1] - u[1] * w[0];
+    return sqrt(cross[0] * cross[0] + cross[1] * cross[1] +
+                cross[2] * cross[2]);
+}
+
+struct CollisionSimplify {
+    unsigned int n_verts, n_faces;
+    double (*pos)[3];
+    collision_quadric *quadrics;
+    // welded vertex -> a vertex of the input mesh at that position
+    unsigned int *rep;
+
+    unsigned int (*faces)[3];
+    unsigned int *material;
+    // faces with the same group may merge: material * 3 + class,
+    // or ~0u for degenerate faces which are left untouched
+    unsigned int *group;
+    double (*normal)[3]; // original unit normal
+    bool *alive;
+
+    // vertex -> live faces, rebuilt every pass
+    unsigned int *fan_start; // n_verts + 1
+    unsigned int *fan;
+    // scratch for neighbor sets
+    unsigned int *stamp;
+    unsigned int stamp_value;
+    bool *dirty;
+};
+
+struct collision_simplify_collapse {
+    double cost;
+    unsigned int from, to;
+};
+
+static int collision_simplify_collapse_compare_fn(const void *_a,
+                                                  const void *_b) {
+    const struct collision_simplify_collapse *a = _a, *b = _b;
+    if (a->cost != b->cost)
+        return a->cost < b->cost ? -1 : 1;
+    // stable order for identical costs
+    return a->from < b->from ? -1 : a->from > b->from;
+}
+
+static void collision_simplify_build_fans(struct CollisionSimplify *s) {
+    memset(s->fan_start, 0, sizeof(unsigned int) * (s->n_verts + 1));
+    for (unsigned int f = 0; f < s->n_faces; f++) {
+        if (!s->alive[f])
+            continue;
+        for (int j = 0; j < 3; j++)
+            s->fan_start[s->faces[f][j] + 1]++;
+    }
+    for (unsigned int v = 0; v < s->n_verts; v++)
+        s->fan_start[v + 1] += s->fan_start[v];
+    // fan_start[v] is advanced to the end of fan v, the start of fan v + 1
+    for (unsigned int f = 0; f < s->n_faces; f++) {
+        if (!s->alive[f])
+            continue;
+        for (int j = 0; j < 3; j++)
+            s->fan[s->fan_start[s->faces[f][j]]++] = f;
+    }
+    for (unsigned int v = s->n_verts; v > 0; v--)
+        s->fan_start[v] = s->fan_start[v - 1];
+    s->fan_start[0] = 0;
+}
+
+static bool collision_face_has(const unsigned int face[3], unsigned int v) {
+    return face[0] == v || face[1] == v || face[2] == v;
+}
+
+/**
+ * Find which edges around u are boundaries: open (one face), between faces
+ * of different groups, or shared by more than two faces.
+ *
+ * @param neighbors Output, the neighbors of u
+ * @param boundary Output, the neighbors across a boundary edge from u
+ * @return false if u must not move (degenerate or non-manifold faces around
+ *  it, or other than 0 or 2 boundary edges)
+ */
+static bool collision_simplify_vertex_edges(struct CollisionSimplify *s,
+                                            unsigned int u,
+                                            unsigned int *neighbors,
+                                            unsigned int *n_neighbors,
+                                            unsigned int boundary[2],
+                                            unsigned int *n_boundary) {
+    unsigned int *fan = &s->fan[s->fan_start[u]];
+    unsigned int n_fan = s->fan_start[u + 1] - s->fan_start[u];
+    *n_neighbors = 0;
+    *n_boundary = 0;
+    if (n_fan == 0)
+        return false;
+    s->stamp_value++;
+    for (unsigned int i = 0; i < n_fan; i++) {
+        if (s->group[fan[i]] == ~0u)
+            return false;
+        for (int j = 0; j < 3; j++) {
+            unsigned int w = s->faces[fan[i]][j];
+            if (w != u && s->stamp[w] != s->stamp_value) {
+                s->stamp[w] = s->stamp_value;
+                neighbors[(*n_neighbors)++] = w;
+            }
+        }
+    }
+    for (unsigned int i = 0; i < *n_neighbors; i++) {
+        unsigned int w = neighbors[i];
+        unsigned int n_shared = 0, groups[2];
+        for (unsigned int k = 0; k < n_fan; k++) {
+            if (collision_face_has(s->faces[fan[k]], w)) {
+                if (n_shared == 2)
+                    return false;
+                groups[n_shared++] = s->group[fan[k]];
+            }
+        }
+        if (n_shared == 1 || groups[0] != groups[1]) {
+            if (*n_boundary == 2)
+                return false;
+            boundary[(*n_boundary)++] = w;
+        }
+    }
+    return *n_boundary == 0 || *n_boundary == 2;
+}
+
+/**
+ * Check collapsing u into its neighbor w keeps the mesh manifold and the
+ * faces around u valid, i.e. not degenerate or turned from their original
+ * normal or class.
+ */
+static bool collision_simplify_can_collapse(struct CollisionSimplify *s,
+                                            unsigned int u, unsigned int w) {
+    unsigned int *fan_u = &s->fan[s->fan_start[u]];
+    unsigned int n_fan_u = s->fan_start[u + 1] - s->fan_start[u];
+    unsigned int *fan_w = &s->fan[s->fan_start[w]];
+    unsigned int n_fan_w = s->fan_start[w + 1] - s->fan_start[w];
+
+    // link condition: the common neighbors of u and w must be exactly the
+    // third vertices of the faces of edge u-w
+    s->stamp_value++;
+    for (unsigned int i = 0; i < n_fan_w; i++)
+        for (int j = 0; j < 3; j++)
+            s->stamp[s->faces[fan_w[i]][j]] = s->stamp_value;
+    unsigned int n_shared_faces = 0, n_common = 0;
+    for (unsigned int i = 0; i < n_fan_u; i++) {
+        unsigned int *face = s->faces[fan_u[i]];
+        if (collision_face_has(face, w)) {
+            n_shared_faces++;
+            continue;
+        }
+        double cross[3];
+        unsigned int new_face[3];
+        for (int j = 0; j < 3; j++)
+            new_face[j] = face[j] == u ? w : face[j];
+        double len = collision_face_cross(s->pos, new_face, cross);
+        if (len < COLLISION_SIMPLIFY_MIN_CROSS)
+            return false;
+        const double *n = s->normal[fan_u[i]];
+        if ((cross[0] * n[0] + cross[1] * n[1] + cross[2] * n[2]) / len <
+            COLLISION_SIMPLIFY_MIN_NORMAL_DOT)
+            return false;
+        if (oot_collision_poly_class(cross[1] / len) !=
+            oot_collision_poly_class(n[1]))
+            return false;
+    }
+    // count each common neighbor once
+    for (unsigned int i = 0; i < n_fan_u; i++) {
+        for (int j = 0; j < 3; j++) {
+            unsigned int v = s->faces[fan_u[i]][j];
+            if (v != u && v != w && s->stamp[v] == s->stamp_value) {
+                s->stamp[v] = s->stamp_value - 1;
+                n_common++;
+            }
+        }
+    }
+    return n_shared_faces != 0 && n_common == n_shared_faces;
+}
+
+static void collision_simplify_free(struct CollisionSimplify *s) {
+    free(s->pos);
+    free(s->quadrics);
+    free(s->rep);
+    free(s->faces);
+    free(s->material);
+    free(s->group);
+    free(s->normal);
+    free(s->alive);
+    free(s->fan_start);
+    free(s->fan);
+    free(s->stamp);
+    free(s->dirty);
+}
+
+/** Weld the mesh's vertices and set up the faces and quadrics */
+static int collision_simplify_init(struct CollisionSimplify *s,
+                                   struct OoTCollisionMesh *mesh) {
+    memset(s, 0, sizeof(*s));
+    int16_t(*welded)[3] = malloc(sizeof(int16_t[3]) * mesh->n_verts + 1);
+    unsigned int *remap = malloc(sizeof(unsigned int) * mesh->n_verts + 1);
+    long n_welded = -1;
+    if (welded != NULL && remap != NULL)
+        n_welded = weld_OoTCollisionVertices(mesh, 0, welded, remap);
+    if (n_welded < 0) {
+        log_error("welding failed");
+        free(welded);
+        free(remap);
+        return -1;
+    }
+
+    unsigned int n_verts = n_welded, n_faces = mesh->n_faces;
+    s->n_verts = n_verts;
+    s->n_faces = n_faces;
+    // + 1 to not depend on malloc(0) returning non-NULL
+    s->pos = malloc(sizeof(double[3]) * n_verts + 1);
+    s->quadrics = calloc(n_verts + 1, sizeof(collision_quadric));
+    s->rep = malloc(sizeof(unsigned int) * n_verts + 1);
+    s->faces = malloc(sizeof(unsigned int[3]) * n_faces + 1);
+    s->material = malloc(sizeof(unsigned int) * n_faces + 1);
+    s->group = malloc(sizeof(unsigned int) * n_faces + 1);
+    s->normal = malloc(sizeof(double[3]) * n_faces + 1);
+    s->alive = malloc(sizeof(bool) * n_faces + 1);
+    s->fan_start = malloc(sizeof(unsigned int) * (n_verts + 1));
+    s->fan = malloc(sizeof(unsigned int) * 3 * n_faces + 1);
+    s->stamp = calloc(n_verts + 1, sizeof(unsigned int));
+    s->dirty = malloc(sizeof(bool) * n_verts + 1);
+    if (s->pos == NULL || s->quadrics == NULL || s->rep == NULL ||
+        s->faces == NULL || s->material == NULL || s->group == NULL ||
+        s->normal == NULL || s->alive == NULL || s->fan_start == NULL ||
+        s->fan == NULL || s->stamp == NULL || s->dirty == NULL) {
+        log_error("malloc failed");
+        free(welded);
+        free(remap);
+        collision_simplify_free(s);
+        return -1;
+    }
+
+    // work on the coordinates as written, rounded like the welded vertices
+    for (unsigned int v = 0; v < n_verts; v++) {
+        s->rep[v] = ~0u;
+        for (int k = 0; k < 3; k++)
+            s->pos[v][k] = welded[v][k];
+    }
+    for (unsigned int v = 0; v < mesh->n_verts; v++) {
+        if (remap[v] != ~0u && s->rep[remap[v]] == ~0u)
+            s->rep[remap[v]] = v;
+    }
+    free(welded);
+
+    for (unsigned int f = 0; f < n_faces; f++) {
+        for (int j = 0; j < 3; j++)
+            s->faces[f][j] = remap[mesh->faces[f].verts[j]];
+        s->material[f] = mesh->faces[f].material;
+        s->alive[f] = true;
+        double cross[3];
+        double len = collision_face_cross(s->pos, s->faces[f], cross);
+        if (len < COLLISION_SIMPLIFY_MIN_CROSS) {
+            s->group[f] = ~0u;
+            s->normal[f][0] = s->normal[f][1] = s->normal[f][2] = 0.0;
+            continue;
+        }
+        for (int k = 0; k < 3; k++)
+            s->normal[f][k] = cross[k] / len;
+        s->group[f] =
+            s->material[f] * 3 + oot_collision_poly_class(s->normal[f][1]);
+        const double *p0 = s->pos[s->faces[f][0]];
+        double d = -(s->normal[f][0] * p0[0] + s->normal[f][1] * p0[1] +
+                     s->normal[f][2] * p0[2]);
+        for (int j = 0; j < 3; j++)
+            collision_quadric_add_plane(s->quadrics[s->faces[f][j]],
+                                        s->normal[f], d);
+    }
+    free(remap);
+
+    // Constrain boundary vertices to their boundary lines, with the planes
+    // through each boundary edge perpendicular to its faces
+    collision_simplify_build_fans(s);
+    for (unsigned int f = 0; f < n_faces; f++) {
+        if (s->group[f] == ~0u)
+            continue;
+        for (int j = 0; j < 3; j++) {
+            unsigned int a = s->faces[f][j], b = s->faces[f][(j + 1) % 3];
+            bool is_boundary = true;
+            for (unsigned int i = s->fan_start[a]; i < s->fan_start[a + 1];
+                 i++) {
+                unsigned int g = s->fan[i];
+                if (g != f && collision_face_has(s->faces[g], b) &&
+                    s->group[g] == s->group[f])
+                    is_boundary = false;
+            }
+            if (!is_boundary)
+                continue;
+            const double *pa = s->pos[a], *pb = s->pos[b];
+            const double *n = s->normal[f];
+            double e[3] = {pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2]};
+            double m[3] = {e[1] * n[2] - e[2] * n[1], e[2] * n[0] - e[0] * n[2],
+                           e[0] * n[1] - e[1] * n[0]};
+            double len = sqrt(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+            if (len == 0.0)
+                continue;
+            for (int k = 0; k < 3; k++)
+                m[k] /= len;
+            double d = -(m[0] * pa[0] + m[1] * pa[1] + m[2] * pa[2]);
+            collision_quadric_add_plane(s->quadrics[a], m, d);
+            collision_quadric_add_plane(s->quadrics[b], m, d);
+        }
+    }
+    return 0;
+}
+
+/** Returns the number of collapses done, or -1 on failure */
+static long collision_simplify_pass(struct CollisionSimplify *s,
+                                    double max_cost) {
+    collision_simplify_build_fans(s);
+
+    unsigned int max_fan = 0;
+    for (unsigned int v = 0; v < s->n_verts; v++)
+        max_fan = MAX(max_fan, s->fan_start[v + 1] - s->fan_start[v]);
+    unsigned int *neighbors = malloc(sizeof(unsigned int) * 2 * max_fan + 1);
+    struct collision_simplify_collapse *collapses =
+        malloc(sizeof(struct collision_simplify_collapse) * s->n_verts + 1);
+    if (neighbors == NULL || collapses == NULL) {
+        log_error("malloc neighbors or collapses failed");
+        free(neighbors);
+        free(collapses);
+        return -1;
+    }
+
+    unsigned int n_collapses = 0;
+    for (unsigned int u = 0; u < s->n_verts; u++) {
+        unsigned int n_neighbors, boundary[2], n_boundary;
+        if (!collision_simplify_vertex_edges(s, u, neighbors, &n_neighbors,
+                                             boundary, &n_boundary))
+            continue;
+        // boundary vertices only move along their boundary
+        unsigned int *targets = n_boundary == 0 ? neighbors : boundary;
+        unsigned int n_targets = n_boundary == 0 ? n_neighbors : n_boundary;
+        struct collision_simplify_collapse best = {max_cost, ~0u, ~0u};
+        for (unsigned int i = 0; i < n_targets; i++) {
+            unsigned int w = targets[i];
+            double cost = collision_quadric_eval(s->quadrics[u],
+                                                 s->quadrics[w], s->pos[w]);
+            if (cost <= best.cost && collision_simplify_can_collapse(s, u, w))
+                best = (struct collision_simplify_collapse){cost, u, w};
+        }
+        if (best.from != ~0u)
+            collapses[n_collapses++] = best;
+    }
+
+    qsort(collapses, n_collapses, sizeof(struct collision_simplify_collapse),
+          collision_simplify_collapse_compare_fn);
+
+    // Collapses are checked against the mesh at the start of the pass, so
+    // only those not touching the fans changed by a previous one are done.
+    memset(s->dirty, 0, sizeof(bool) * s->n_verts);
+    long n_done = 0;
+    for (unsigned int i = 0; i < n_collapses; i++) {
+        unsigned int u = collapses[i].from, w = collapses[i].to;
+        if (s->dirty[u] || s->dirty[w])
+            continue;
+        for (unsigned int k = s->fan_start[u]; k < s->fan_start[u + 1]; k++) {
+            unsigned int *face = s->faces[s->fan[k]];
+            // the third vertex of a killed face may be in no other face of
+            // the fan, so all the vertices are marked dirty here too
+            bool killed = collision_face_has(face, w);
+            if (killed)
+                s->alive[s->fan[k]] = false;
+            for (int j = 0; j < 3; j++) {
+                s->dirty[face[j]] = true;
+                if (!killed && face[j] == u)
+                    face[j] = w;
+            }
+        }
+        for (int k = 0; k < 10; k++)
+            s->quadrics[w][k] += s->quadrics[u][k];
+        s->dirty[u] = s->dirty[w] = true;
+        n_done++;
+    }
 
-    unsigned int n_loops = buf_loops_vertex_index_len;
+    free(neighbors);
+    free(collapses);
+    return n_done;
+}
 
-    unsigned int n_faces = (unsigned int)(buf_triangles_loops_len / 3);
-    if (buf_triangles_material_index_len != n_faces) {
-        log_error(
-            "buf_triangles_material_index_len=%zd and n_faces=%u mismatch",
-            buf_triangles_material_index_len, n_faces);
+struct OoTCollisionMesh *
+simplify_OoTCollisionMesh_impl(struct OoTCollisionMesh *mesh,
+                               float tolerance) {
+    double t_start = stats_now();
+
+    if (!(tolerance >= 0.0f)) {
+        log_error("tolerance=%f must not be negative", tolerance);
         return NULL;
     }
 
-    unsigned int n_materials_used;
-    bool use_default_material;
-    unsigned int default_material_index;
-    unsigned int *material_index_map = remap_materials(
-        buf_triangles_material_index, n_faces, (void **)materials, n_materials,
-        &n_materials_used, &use_default_material, &default_material_index);
-    if (material_index_map == NULL) {
-        log_error("remap_materials failed");
+    struct CollisionSimplify s;
+    if (collision_simplify_init(&s, mesh) != 0) {
+        log_error("collision_simplify_init failed");
         return NULL;
     }
 
-    struct OoTCollisionMesh *mesh = malloc(sizeof(struct OoTCollisionMesh));
-    if (mesh == NULL) {
+    double max_cost =
+        (double)tolerance * tolerance + COLLISION_SIMPLIFY_EPSILON2;
+    for (int pass = 0; pass < COLLISION_SIMPLIFY_MAX_PASSES; pass++) {
+        long n_done = collision_simplify_pass(&s, max_cost);
+        if (n_done < 0) {
+            log_error("collision_simplify_pass failed");
+            collision_simplify_free(&s);
+            return NULL;
+        }
+        if (n_done == 0)
+            break;
+    }
+
+    struct OoTCollisionMesh *out = malloc(sizeof(struct OoTCollisionMesh));
+    if (out == NULL) {
         log_error("malloc mesh failed");
+        collision_simplify_free(&s);
         return NULL;
     }
+    unsigned int n_faces = 0;
+    for (unsigned int f = 0; f < s.n_faces; f++)
+        n_faces += s.alive[f];
+    // reuse stamp as the map from welded vertices to output vertices
+    for (unsigned int v = 0; v < s.n_verts; v++)
+        s.stamp[v] = ~0u;
+    unsigned int n_verts = 0;
+    for (unsigned int f = 0; f < s.n_faces; f++) {
+        if (!s.alive[f])
+            continue;
+        for (int j = 0; j < 3; j++) {
+            unsigned int v = s.faces[f][j];
+            if (s.stamp[v] == ~0u)
+                s.stamp[v] = n_verts++;
+        }
+    }
 
-    mesh->n_verts = n_loops;
-    mesh->verts = malloc(sizeof(struct OoTCollisionVertex) * n_loops);
+    out->n_verts = n_verts;
+    out->verts = malloc(sizeof(struct OoTCollisionVertex) * n_verts + 1);
+    out->n_faces = n_faces;
+    out->faces = malloc(sizeof(struct OoTCollisionTri) * n_faces + 1);
+    out->n_materials = mesh->n_materials;
+    out->materials = calloc(mesh->n_materials + 1,
+                            sizeof(struct OoTCollisionMaterial));
+    if (out->verts == NULL || out->faces == NULL || out->materials == NULL) {
+        log_error("malloc verts, faces or materials failed");
+        out->n_materials = 0;
+        free_create_OoTCollisionMesh_from_buffers(out);
+        collision_simplify_free(&s);
+        return NULL;
+    }
 
-    mesh->n_faces = n_faces;
-    mesh->faces = malloc(sizeof(struct OoTCollisionTri) * n_faces);
+    for (unsigned int v = 0; v < s.n_verts; v++) {
+        if (s.stamp[v] != ~0u)
+            out->verts[s.stamp[v]] = mesh->verts[s.rep[v]];
+    }
+    for (unsigned int f = 0, i = 0; f < s.n_faces; f++) {
+        if (!s.alive[f])
+            continue;
+        for (int j = 0; j < 3; j++)
+            out->faces[i].verts[j] = s.stamp[s.faces[f][j]];
+        out->faces[i].material = s.material[f];
+        i++;
+    }
+    for (unsigned int i = 0; i < mesh->n_materials; i++) {
+        copy_OoTCollisionMaterial(&out->materials[i], &mesh->materials[i]);
+        if (out->materials[i].name == NULL) {
+            log_error("copy_OoTCollisionMaterial failed");
+            free_create_OoTCollisionMesh_from_buffers(out);
+            collision_simplify_free(&s);
+            return NULL;
+        }
+    }
 
-    mesh->n_materials = n_materials_used;
-    mesh->materials =
-        malloc(sizeof(struct OoTCollisionMaterial) * n_materials_used);
+    log_info("simplified collision from %u to %u faces (tolerance=%f)",
+             mesh->n_faces, n_faces, tolerance);
 
-    if (mesh->materials != NULL) {
-        // for free_create_OoTCollisionMesh_from_buffers
-        for (unsigned int i = 0; i < n_materials_used; i++) {
-            mesh->materials[i].name = NULL;
+    collision_simplify_free(&s);
+
+    stats_add_stage_time(EXPORT_STAGE_COLLISION_BUILD, t_start);
+
+    return out;
+}
+
+/**
+ * The planes of the faces of a collision mesh, computed before writing.
+ * Structure of arrays, n_faces entries each.
+ */
+struct OoTCollisionPlanes {
+    // the number of faces kept, faces degenerate after welding are dropped
+    unsigned int n_faces;
+    // the mesh face each plane is for
+    unsigned int *faces;
+    // the face's welded vertices, cycled so the first one has the lowest y
+    unsigned int (*verts)[3];
+    // unit normal
+    float *nx, *ny, *nz;
+    int16_t *dist;
+};
+
+static void free_OoTCollisionPlanes(struct OoTCollisionPlanes *planes) {
+    free(planes->faces);
+    free(planes->verts);
+    free(planes->nx);
+    free(planes->ny);
+    free(planes->nz);
+    free(planes->dist);
+}
+
+// faces gathered at once into the SoA arrays of compute_OoTCollisionPlanes
+#define COLLISION_PLANES_BATCH 256
+
+struct OoTCollisionPlanesBatch {
+    // [axis][face] for the faces of the batch
+    float p[3][COLLISION_PLANES_BATCH]; // first vertex
+    float u[3][COLLISION_PLANES_BATCH]; // second vertex - first vertex
+    float v[3][COLLISION_PLANES_BATCH]; // third vertex - first vertex
+    float d[COLLISION_PLANES_BATCH];
+};
+
+/**
+ * n = normalized(u x v) and d = -(n . p) for the first n faces of batch.
+ * The vector paths do the same IEEE operations in the same order as the
+ * scalar one, so the results don't depend on the path taken. This relies on
+ * building with -ffp-contract=off: GCC and Clang otherwise fuse the scalar
+ * (and even the NEON intrinsic) multiply-subtracts into fmsub/fmls on
+ * AArch64, rounding once instead of twice.
+ */
+static void compute_OoTCollisionPlanes_batch(
+    struct OoTCollisionPlanesBatch *batch, int n, float *nx, float *ny,
+    float *nz) {
+    float(*p)[COLLISION_PLANES_BATCH] = batch->p;
+    float(*u)[COLLISION_PLANES_BATCH] = batch->u;
+    float(*v)[COLLISION_PLANES_BATCH] = batch->v;
+    int i = 0;
+
+#if defined(EXPORTER_SSE)
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    for (; i + 4 <= n; i += 4) {
+        __m128 ux = _mm_loadu_ps(&u[0][i]), uy = _mm_loadu_ps(&u[1][i]),
+               uz = _mm_loadu_ps(&u[2][i]);
+        __m128 vx = _mm_loadu_ps(&v[0][i]), vy = _mm_loadu_ps(&v[1][i]),
+               vz = _mm_loadu_ps(&v[2][i]);
+        __m128 cx = _mm_sub_ps(_mm_mul_ps(uy, vz), _mm_mul_ps(uz, vy));
+        __m128 cy = _mm_sub_ps(_mm_mul_ps(uz, vx), _mm_mul_ps(ux, vz));
+        __m128 cz = _mm_sub_ps(_mm_mul_ps(ux, vy), _mm_mul_ps(uy, vx));
+        __m128 nn = _mm_sqrt_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, cx), _mm_mul_ps(cy, cy)),
+                       _mm_mul_ps(cz, cz)));
+        __m128 degenerate = _mm_cmpeq_ps(nn, zero);
+        cx = _mm_or_ps(_mm_and_ps(degenerate, one),
+                       _mm_andnot_ps(degenerate, _mm_div_ps(cx, nn)));
+        cy = _mm_andnot_ps(degenerate, _mm_div_ps(cy, nn));
+        cz = _mm_andnot_ps(degenerate, _mm_div_ps(cz, nn));
+        __m128 d = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(cx, _mm_loadu_ps(&p[0][i])),
+                       _mm_mul_ps(cy, _mm_loadu_ps(&p[1][i]))),
+            _mm_mul_ps(cz, _mm_loadu_ps(&p[2][i])));
+        _mm_storeu_ps(&nx[i], cx);
+        _mm_storeu_ps(&ny[i], cy);
+        _mm_storeu_ps(&nz[i], cz);
+        _mm_storeu_ps(&batch->d[i], _mm_xor_ps(d, sign));
+    }
+#elif defined(EXPORTER_NEON)
+    const float32x4_t zero = vdupq_n_f32(0.0f), one = vdupq_n_f32(1.0f);
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t ux = vld1q_f32(&u[0][i]), uy = vld1q_f32(&u[1][i]),
+                    uz = vld1q_f32(&u[2][i]);
+        float32x4_t vx = vld1q_f32(&v[0][i]), vy = vld1q_f32(&v[1][i]),
+                    vz = vld1q_f32(&v[2][i]);
+        // separate multiplies and subtracts, not fused like vfmsq_f32
+        // (needs -ffp-contract=off, see above)
+        float32x4_t cx = vsubq_f32(vmulq_f32(uy, vz), vmulq_f32(uz, vy));
+        float32x4_t cy = vsubq_f32(vmulq_f32(uz, vx), vmulq_f32(ux, vz));
+        float32x4_t cz = vsubq_f32(vmulq_f32(ux, vy), vmulq_f32(uy, vx));
+        float32x4_t nn = vsqrtq_f32(
+            vaddq_f32(vaddq_f32(vmulq_f32(cx, cx), vmulq_f32(cy, cy)),
+                      vmulq_f32(cz, cz)));
+        uint32x4_t degenerate = vceqq_f32(nn, zero);
+        cx = vbslq_f32(degenerate, one, vdivq_f32(cx, nn));
+        cy = vbslq_f32(degenerate, zero, vdivq_f32(cy, nn));
+        cz = vbslq_f32(degenerate, zero, vdivq_f32(cz, nn));
+        float32x4_t d =
+            vaddq_f32(vaddq_f32(vmulq_f32(cx, vld1q_f32(&p[0][i])),
+                                vmulq_f32(cy, vld1q_f32(&p[1][i]))),
+                      vmulq_f32(cz, vld1q_f32(&p[2][i])));
+        vst1q_f32(&nx[i], cx);
+        vst1q_f32(&ny[i], cy);
+        vst1q_f32(&nz[i], cz);
+        vst1q_f32(&batch->d[i], vnegq_f32(d));
+    }
+#endif
+
+    for (; i < n; i++) {
+        // n = u x v
+        float cx = u[1][i] * v[2][i] - u[2][i] * v[1][i];
+        float cy = u[2][i] * v[0][i] - u[0][i] * v[2][i];
+        float cz = u[0][i] * v[1][i] - u[1][i] * v[0][i];
+        float nn = sqrtf(cx * cx + cy * cy + cz * cz);
+        if (nn == 0.0f) {
+            // degenerate faces are dropped before, but keep a unit normal
+            cx = 1.0f;
+            cy = 0.0f;
+            cz = 0.0f;
+        } else {
+            cx /= nn;
+            cy /= nn;
+            cz /= nn;
         }
+        nx[i] = cx;
+        ny[i] = cy;
+        nz[i] = cz;
+        batch->d[i] = -(cx * p[0][i] + cy * p[1][i] + cz * p[2][i]);
     }
+}
 
-    if (mesh->verts == NULL || mesh->faces == NULL || mesh->materials == NULL) {
-        log_error("malloc verts, faces or materials failed");
-        free_create_OoTCollisionMesh_from_buffers(mesh);
-        return NULL;
+/**
+ * Compute the planes of the faces that are not degenerate after welding,
+ * gathering the faces in batches for compute_OoTCollisionPlanes_batch.
+ *
+ * @param vertices The welded vertices
+ * @param remap Mapping vertices to welded vertices
+ * Returns 0 on success, non-zero on failure.
+ */
+static int compute_OoTCollisionPlanes(struct OoTCollisionMesh *mesh,
+                                      int16_t (*vertices)[3],
+                                      unsigned int *remap,
+                                      struct OoTCollisionPlanes *planes) {
+    unsigned int n_faces = mesh->n_faces;
+    planes->n_faces = 0;
+    planes->faces = malloc(sizeof(unsigned int) * n_faces);
+    planes->verts = malloc(sizeof(unsigned int[3]) * n_faces);
+    planes->nx = malloc(sizeof(float) * n_faces);
+    planes->ny = malloc(sizeof(float) * n_faces);
+    planes->nz = malloc(sizeof(float) * n_faces);
+    planes->dist = malloc(sizeof(int16_t) * n_faces);
+    struct OoTCollisionPlanesBatch *batch =
+        malloc(sizeof(struct OoTCollisionPlanesBatch));
+    if (batch == NULL ||
+        (n_faces != 0 &&
+         (planes->faces == NULL || planes->verts == NULL ||
+          planes->nx == NULL || planes->ny == NULL || planes->nz == NULL ||
+          planes->dist == NULL))) {
+        log_error("malloc planes failed");
+        free_OoTCollisionPlanes(planes);
+        free(batch);
+        return -1;
     }
 
-    for (unsigned int i_loop = 0; i_loop < n_loops; i_loop++) {
-        for (int j = 0; j < 3; j++) {
-            unsigned int v = buf_loops_vertex_index[i_loop] * 3 + j;
-            if (v >= buf_vertices_co_len) {
-                log_error(
-                    "i_loop=%u: v=%u out of bounds (buf_vertices_co_len=%zd)",
-                    i_loop, v, buf_vertices_co_len);
-                free_create_OoTCollisionMesh_from_buffers(mesh);
-                return NULL;
+    unsigned int i_face = 0;
+    while (i_face < n_faces) {
+        unsigned int start = planes->n_faces;
+        int n = 0;
+        for (; i_face < n_faces && n < COLLISION_PLANES_BATCH; i_face++) {
+            struct OoTCollisionTri *t = &mesh->faces[i_face];
+            unsigned int w[3];
+            for (int j = 0; j < 3; j++)
+                w[j] = remap[t->verts[j]];
+
+            // exact cross product of the welded vertices, zero for faces
+            // collapsed to an edge or a point
+            int64_t e1[3], e2[3];
+            for (int k = 0; k < 3; k++) {
+                e1[k] = vertices[w[1]][k] - vertices[w[0]][k];
+                e2[k] = vertices[w[2]][k] - vertices[w[0]][k];
             }
-            mesh->verts[i_loop].coords[j] = buf_vertices_co[v];
+            if (e1[1] * e2[2] - e1[2] * e2[1] == 0 &&
+                e1[2] * e2[0] - e1[0] * e2[2] == 0 &&
+                e1[0] * e2[1] - e1[1] * e2[0] == 0)
+                continue;
+
+            int16_t y0 = vertices[w[0]][1];
+            int16_t y1 = vertices[w[1]][1];
+            int16_t y2 = vertices[w[2]][1];
+            // cycle v0,v1,v2 such that v0 has the lowest y
+            // Circumvents a bug in CollisionPoly_GetMinY
+            int first = 0;
+            if (y1 < y0 && y1 < y2)
+                first = 1;
+            else if (y2 < y0 && y2 < y1)
+                first = 2;
+            unsigned int *verts = planes->verts[start + n];
+            for (int j = 0; j < 3; j++)
+                verts[j] = w[(first + j) % 3];
+            planes->faces[start + n] = i_face;
+
+            int16_t *c0 = vertices[verts[0]];
+            int16_t *c1 = vertices[verts[1]];
+            int16_t *c2 = vertices[verts[2]];
+            for (int k = 0; k < 3; k++) {
+                batch->p[k][n] = c0[k];
+                batch->u[k][n] = c1[k] - c0[k];
+                batch->v[k][n] = c2[k] - c0[k];
+            }
+            n++;
         }
-    }
 
-    for (unsigned int i = 0; i < n_faces; i++) {
-        for (int j = 0; j < 3; j++) {
-            unsigned int loop = buf_triangles_loops[i * 3 + j];
-            if (loop >= n_loops) {
-                log_error("face %u: loop=%u out of bounds (n_loops=%u)", i,
-                          loop, n_loops);
-                free_create_OoTCollisionMesh_from_buffers(mesh);
-                return NULL;
+        compute_OoTCollisionPlanes_batch(batch, n, &planes->nx[start],
+                                         &planes->ny[start],
+                                         &planes->nz[start]);
+
+        for (int i = 0; i < n; i++) {
+            float d = roundf(batch->d[i]);
+            // also rejects NaN
+            if (!(d >= INT16_MIN && d <= INT16_MAX)) {
+                log_error("face %u plane distance %f does not fit in int16_t",
+                          planes->faces[start + i], batch->d[i]);
+                free_OoTCollisionPlanes(planes);
+                free(batch);
+                return -1;
             }
-            mesh->faces[i].verts[j] = loop;
+            planes->dist[start + i] = (int16_t)d;
         }
-        mesh->faces[i].material =
-            material_index_map[buf_triangles_material_index[i]];
+        planes->n_faces += n;
     }
 
-    for (unsigned int i = 0; i < n_materials; i++) {
-        if (material_index_map[i] == ~0u ||
-            (use_default_material &&
-             material_index_map[i] == default_material_index))
+    free(batch);
+    return 0;
+}
+
+/**
+ * Drop the welded vertices no plane uses, keeping the others in order.
+ *
+ * @param n_vertices In/out, the number of welded vertices
+ * Returns 0 on success, non-zero on failure.
+ */
+static int compact_OoTCollisionVertices(int16_t (*vertices)[3],
+                                        long *n_vertices,
+                                        struct OoTCollisionPlanes *planes) {
+    unsigned int *new_index = malloc(sizeof(unsigned int) * *n_vertices);
+    if (*n_vertices != 0 && new_index == NULL) {
+        log_error("malloc new_index failed");
+        return -1;
+    }
+    for (long i = 0; i < *n_vertices; i++)
+        new_index[i] = ~0u;
+    for (unsigned int i = 0; i < planes->n_faces; i++)
+        for (int j = 0; j < 3; j++)
+            new_index[planes->verts[i][j]] = 0;
+    unsigned int n_used = 0;
+    for (long i = 0; i < *n_vertices; i++) {
+        if (new_index[i] == ~0u)
             continue;
-        struct OoTCollisionMaterial *mat = materials[i];
+        memmove(vertices[n_used], vertices[i], sizeof(int16_t[3]));
+        new_index[i] = n_used++;
+    }
+    for (unsigned int i = 0; i < planes->n_faces; i++)
+        for (int j = 0; j < 3; j++)
+            planes->verts[i][j] = new_index[planes->verts[i][j]];
+    *n_vertices = n_used;
+    free(new_index);
+    return 0;
+}
 
-        // because material_index_map[i] != default_material_index
-        assert(mat != NULL);
+// BgCheck's BGCHECK_SUBDIV_MIN and BGCHECK_SUBDIV_OVERLAP
+#define OOT_COLLISION_SUBDIV_MIN_LENGTH 150
+#define OOT_COLLISION_SUBDIV_OVERLAP 50
+// sizeof(StaticLookup) and sizeof(SSNode) on the N64
+#define OOT_COLLISION_STATIC_LOOKUP_SIZE 6
+#define OOT_COLLISION_SS_NODE_SIZE 4
+// the subdivision amounts BgCheck uses for scenes not in its list
+static const int oot_collision_default_subdivision[3] = {16, 4, 16};
+// recommend the smallest memory among candidates at most this much worse
+// than the best mean polys per cell
+#define OOT_COLLISION_SUBDIV_MEAN_SLACK 1.25f
+
+static const int oot_collision_subdivision_xz_candidates[] = {4,  8,  12,
+                                                              16, 24, 32};
+static const int oot_collision_subdivision_y_candidates[] = {1, 2, 4, 8};
 
-        copy_OoTCollisionMaterial(&mesh->materials[material_index_map[i]], mat);
+/**
+ * Like BgCheck_GetSubdivisionMinBounds and BgCheck_GetSubdivisionMaxBounds,
+ * the range of cells along one axis a bounding box is in.
+ */
+static void oot_collision_subdivision_range(int bounds_min, int length,
+                                            int amount, int box_min,
+                                            int box_max, int *out_first,
+                                            int *out_last) {
+    int d_min = box_min - bounds_min;
+    int first = d_min / length;
+    if (d_min % length < OOT_COLLISION_SUBDIV_OVERLAP && first > 0)
+        first--;
+    int d_max = box_max - bounds_min;
+    int last = d_max / length;
+    if (length - OOT_COLLISION_SUBDIV_OVERLAP < d_max % length &&
+        last < amount - 1)
+        last++;
+    *out_first = MIN(first, amount - 1);
+    *out_last = MIN(last, amount - 1);
+}
+
+/**
+ * Fill bounds->subdivisions with the stats of every candidate subdivision
+ * amount, and pick one to recommend.
+ *
+ * @param boxes The bounding box of each face, min then max
+ * Returns 0 on success, non-zero on failure.
+ */
+static int
+compute_OoTCollisionSubdivisionStats(unsigned int n_faces,
+                                     int16_t (*boxes)[2][3],
+                                     struct OoTCollisionBounds *bounds) {
+    const int n_xz = sizeof(oot_collision_subdivision_xz_candidates) /
+                     sizeof(oot_collision_subdivision_xz_candidates[0]);
+    const int n_y = sizeof(oot_collision_subdivision_y_candidates) /
+                    sizeof(oot_collision_subdivision_y_candidates[0]);
+    assert(n_xz * n_y * n_xz == OOT_COLLISION_SUBDIVISION_N_CANDIDATES);
+
+    int max_xz = oot_collision_subdivision_xz_candidates[n_xz - 1];
+    int max_y = oot_collision_subdivision_y_candidates[n_y - 1];
+    unsigned int *counts =
+        malloc(sizeof(unsigned int) * max_xz * max_y * max_xz);
+    if (counts == NULL) {
+        log_error("malloc counts failed");
+        return -1;
     }
 
-    free(material_index_map);
+    bounds->n_subdivisions = 0;
+    bounds->default_subdivision = -1;
+    for (int i = 0; i < OOT_COLLISION_SUBDIVISION_N_CANDIDATES; i++) {
+        int amount[3] = {
+            oot_collision_subdivision_xz_candidates[i / (n_y * n_xz)],
+            oot_collision_subdivision_y_candidates[i / n_xz % n_y],
+            oot_collision_subdivision_xz_candidates[i % n_xz],
+        };
+        // BgCheck_SetSubdivisionDimension
+        int length[3];
+        for (int k = 0; k < 3; k++) {
+            length[k] = (bounds->max[k] - bounds->min[k]) / amount[k] + 1;
+            length[k] = MAX(length[k], OOT_COLLISION_SUBDIV_MIN_LENGTH);
+        }
 
-    if (use_default_material) {
-        assert(default_material_index != ~0u);
-        copy_OoTCollisionMaterial(&mesh->materials[default_material_index],
-                                  default_material);
-    }
+        unsigned int n_cells = amount[0] * amount[1] * amount[2];
+        memset(counts, 0, sizeof(unsigned int) * n_cells);
+        unsigned int n_nodes = 0;
+        for (unsigned int f = 0; f < n_faces; f++) {
+            int first[3], last[3];
+            for (int k = 0; k < 3; k++)
+                oot_collision_subdivision_range(
+                    bounds->min[k], length[k], amount[k], boxes[f][0][k],
+                    boxes[f][1][k], &first[k], &last[k]);
+            for (int z = first[2]; z <= last[2]; z++)
+                for (int y = first[1]; y <= last[1]; y++)
+                    for (int x = first[0]; x <= last[0]; x++)
+                        counts[(z * amount[1] + y) * amount[0] + x]++;
+            n_nodes += (unsigned int)(last[0] - first[0] + 1) *
+                       (last[1] - first[1] + 1) * (last[2] - first[2] + 1);
+        }
 
-    return mesh;
-}
+        unsigned int max_polys = 0, n_nonempty = 0;
+        for (unsigned int c = 0; c < n_cells; c++) {
+            max_polys = MAX(max_polys, counts[c]);
+            n_nonempty += counts[c] != 0;
+        }
 
-struct OoTCollisionMesh *
-join_OoTCollisionMeshes_impl(struct OoTCollisionMesh **meshes,
-                             size_t n_meshes) {
-    unsigned int n_verts = 0, n_faces = 0, n_materials = 0;
-    for (size_t i = 0; i < n_meshes; i++) {
-        struct OoTCollisionMesh *m = meshes[i];
-        n_verts += m->n_verts;
-        n_faces += m->n_faces;
-        n_materials += m->n_materials;
+        struct OoTCollisionSubdivisionStats *stats =
+            &bounds->subdivisions[bounds->n_subdivisions];
+        for (int k = 0; k < 3; k++)
+            stats->amount[k] = amount[k];
+        stats->n_nodes = n_nodes;
+        stats->max_polys = max_polys;
+        stats->mean_polys =
+            n_nonempty == 0 ? 0.0f : (float)n_nodes / n_nonempty;
+        stats->mem_size = n_cells * OOT_COLLISION_STATIC_LOOKUP_SIZE +
+                          n_nodes * OOT_COLLISION_SS_NODE_SIZE;
+        if (memcmp(amount, oot_collision_default_subdivision,
+                   sizeof(amount)) == 0)
+            bounds->default_subdivision = bounds->n_subdivisions;
+        bounds->n_subdivisions++;
     }
-    struct OoTCollisionMesh *joined_mesh =
-        malloc(sizeof(struct OoTCollisionMesh));
-    if (joined_mesh == NULL) {
-        log_error("malloc mesh failed");
-        return NULL;
+    assert(bounds->default_subdivision >= 0);
+
+    free(counts);
+
+    float best_mean = bounds->subdivisions[0].mean_polys;
+    for (int i = 1; i < bounds->n_subdivisions; i++)
+        best_mean = MIN(best_mean, bounds->subdivisions[i].mean_polys);
+    int recommended = -1;
+    for (int i = 0; i < bounds->n_subdivisions; i++) {
+        struct OoTCollisionSubdivisionStats *stats = &bounds->subdivisions[i];
+        if (stats->mean_polys > best_mean * OOT_COLLISION_SUBDIV_MEAN_SLACK)
+            continue;
+        if (recommended < 0 ||
+            stats->mem_size < bounds->subdivisions[recommended].mem_size)
+            recommended = i;
     }
+    bounds->recommended_subdivision = recommended;
 
-    joined_mesh->n_verts = n_verts;
-    joined_mesh->verts = malloc(sizeof(struct OoTCollisionVertex) * n_verts);
+    return 0;
+}
 
-    joined_mesh->n_faces = n_faces;
-    joined_mesh->faces = malloc(sizeof(struct OoTCollisionTri) * n_faces);
+/** Spread the low 10 bits of v to every third bit */
+static uint32_t morton_expand_bits(uint32_t v) {
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
 
-    joined_mesh->n_materials = n_materials;
-    joined_mesh->materials =
-        malloc(sizeof(struct OoTCollisionMaterial) * n_materials);
+struct morton_sort_entry {
+    uint32_t code;
+    unsigned int index;
+};
 
-    if (joined_mesh->materials != NULL) {
-        // for free_create_OoTCollisionMesh_from_buffers
-        for (unsigned int i = 0; i < n_materials; i++) {
-            joined_mesh->materials[i].name = NULL;
-        }
+static int morton_sort_entry_compare_fn(const void *_a, const void *_b) {
+    const struct morton_sort_entry *a = _a, *b = _b;
+    if (a->code != b->code)
+        return a->code < b->code ? -1 : 1;
+    // keep the mesh order for identical codes
+    return a->index < b->index ? -1 : a->index > b->index;
+}
+
+/**
+ * Order the planes along a Morton curve over their centroids, and renumber the
+ * welded vertices in order of first use by the planes in that order.
+ *
+ * @param vertices The welded vertices, permuted in place
+ * @param planes Their verts are updated to the permuted welded vertices
+ * @param out_order Output, planes->n_faces indices in planes
+ * Returns 0 on success, non-zero on failure.
+ */
+static int sort_OoTCollisionPlanes_spatially(int16_t (*vertices)[3],
+                                             long n_vertices,
+                                             struct OoTCollisionPlanes *planes,
+                                             unsigned int *out_order) {
+    unsigned int n_faces = planes->n_faces;
+    struct morton_sort_entry *entries =
+        malloc(sizeof(struct morton_sort_entry) * n_faces);
+    unsigned int *vertex_order = malloc(sizeof(unsigned int) * n_vertices);
+    int16_t(*sorted_vertices)[3] = malloc(sizeof(int16_t[3]) * n_vertices);
+    if ((n_faces != 0 && entries == NULL) ||
+        (n_vertices != 0 && (vertex_order == NULL || sorted_vertices == NULL))) {
+        log_error("malloc entries, vertex_order or sorted_vertices failed");
+        free(entries);
+        free(vertex_order);
+        free(sorted_vertices);
+        return -1;
     }
 
-    if (joined_mesh->verts == NULL || joined_mesh->faces == NULL ||
-        joined_mesh->materials == NULL) {
-        log_error("malloc verts, faces or materials failed");
-        free_create_OoTCollisionMesh_from_buffers(joined_mesh);
-        return NULL;
+    int32_t min[3] = {0, 0, 0}, max[3] = {0, 0, 0};
+    for (long i = 0; i < n_vertices; i++) {
+        for (int k = 0; k < 3; k++) {
+            if (i == 0 || vertices[i][k] < min[k])
+                min[k] = vertices[i][k];
+            if (i == 0 || vertices[i][k] > max[k])
+                max[k] = vertices[i][k];
+        }
     }
 
-    // TODO dedupe materials somehow?
+    for (unsigned int i = 0; i < n_faces; i++) {
+        uint32_t code = 0;
+        for (int k = 0; k < 3; k++) {
+            // three times the centroid, relative to the bounds
+            int32_t c = 0;
+            for (int j = 0; j < 3; j++)
+                c += vertices[planes->verts[i][j]][k] - min[k];
+            int32_t extent = 3 * (max[k] - min[k]);
+            uint32_t q =
+                extent == 0 ? 0 : (uint32_t)((int64_t)c * 1023 / extent);
+            code |= morton_expand_bits(q) << k;
+        }
+        entries[i].code = code;
+        entries[i].index = i;
+    }
+    qsort(entries, n_faces, sizeof(struct morton_sort_entry),
+          morton_sort_entry_compare_fn);
 
-    unsigned int off_verts = 0, off_faces = 0, off_materials = 0;
-    for (size_t i_mesh = 0; i_mesh < n_meshes; i_mesh++) {
-        struct OoTCollisionMesh *m = meshes[i_mesh];
-        memcpy(&joined_mesh->verts[off_verts], m->verts,
-               sizeof(struct OoTCollisionVertex) * m->n_verts);
-        for (unsigned int i_face = 0; i_face < m->n_faces; i_face++) {
-            for (int j = 0; j < 3; j++) {
-                joined_mesh->faces[off_faces + i_face].verts[j] =
-                    off_verts + m->faces[i_face].verts[j];
+    for (long i = 0; i < n_vertices; i++)
+        vertex_order[i] = ~0u;
+    unsigned int n_ordered = 0;
+    for (unsigned int i = 0; i < n_faces; i++) {
+        unsigned int i_face = entries[i].index;
+        out_order[i] = i_face;
+        for (int j = 0; j < 3; j++) {
+            unsigned int v = planes->verts[i_face][j];
+            if (vertex_order[v] == ~0u) {
+                vertex_order[v] = n_ordered;
+                memcpy(sorted_vertices[n_ordered], vertices[v],
+                       sizeof(int16_t[3]));
+                n_ordered++;
             }
-            joined_mesh->faces[off_faces + i_face].material =
-                off_materials + m->faces[i_face].material;
-        }
-        for (unsigned int i_mat = 0; i_mat < m->n_materials; i_mat++) {
-            copy_OoTCollisionMaterial(
-                &joined_mesh->materials[off_materials + i_mat],
-                &m->materials[i_mat]);
         }
-        off_verts += m->n_verts;
-        off_faces += m->n_faces;
-        off_materials += m->n_materials;
     }
+    // every welded vertex is used by a plane
+    assert((long)n_ordered == n_vertices);
 
-    return joined_mesh;
+    memcpy(vertices, sorted_vertices, sizeof(int16_t[3]) * n_vertices);
+    for (unsigned int i = 0; i < n_faces; i++)
+        for (int j = 0; j < 3; j++)
+            planes->verts[i][j] = vertex_order[planes->verts[i][j]];
+
+    free(entries);
+    free(vertex_order);
+    free(sorted_vertices);
+    return 0;
 }
 
 int write_OoTCollisionMesh_to_c(struct OoTCollisionMesh *mesh,
                                 const char *map_prefix_upper,
                                 const char *vtx_list_name,
                                 const char *poly_list_name,
-                                const char *surface_types_name, FILE *f,
+                                const char *surface_types_name,
+                                int weld_epsilon, bool spatial_sort,
+                                struct TextBuffer *b,
                                 struct OoTCollisionBounds *out_bounds) {
-    unsigned int *indices = malloc(sizeof(unsigned int) * mesh->n_faces * 3);
+    double t_build = stats_now();
+
+    if (weld_epsilon < 0 || weld_epsilon > OOT_COLLISION_WELD_EPSILON_MAX) {
+        log_error("weld_epsilon=%d must be in 0..%d", weld_epsilon,
+                  OOT_COLLISION_WELD_EPSILON_MAX);
+        return -1;
+    }
+
+    int16_t(*vertices)[3] = malloc(sizeof(int16_t[3]) * mesh->n_verts);
     unsigned int *remap = malloc(sizeof(unsigned int) * mesh->n_verts);
 
-    if (indices == NULL || remap == NULL) {
-        log_error("malloc indices or remap failed");
-        free(indices);
+    if (mesh->n_verts != 0 && (vertices == NULL || remap == NULL)) {
+        log_error("malloc vertices or remap failed");
+        free(vertices);
         free(remap);
         return -1;
     }
 
-    for (unsigned int i_face = 0; i_face < mesh->n_faces; i_face++) {
-        for (int j = 0; j < 3; j++) {
-            indices[i_face * 3 + j] = mesh->faces[i_face].verts[j];
-            assert(indices[i_face * 3 + j] < mesh->n_verts);
-        }
+    long n_unique_verts =
+        weld_OoTCollisionVertices(mesh, weld_epsilon, vertices, remap);
+    if (n_unique_verts < 0) {
+        log_error("weld_OoTCollisionVertices failed");
+        free(vertices);
+        free(remap);
+        return -2;
     }
 
-    // TODO convert vertex coords to int16_t somewhere before doing the remap
-
-    size_t n_unique_verts = meshopt_generateVertexRemap(
-        remap, indices, mesh->n_faces * 3, mesh->verts, mesh->n_verts,
-        sizeof(struct OoTCollisionVertex));
+    struct OoTCollisionPlanes planes;
+    int res = compute_OoTCollisionPlanes(mesh, vertices, remap, &planes);
+    free(remap);
+    if (res != 0) {
+        log_error("compute_OoTCollisionPlanes failed");
+        free(vertices);
+        return -1;
+    }
 
-    free(indices);
+    if (planes.n_faces != mesh->n_faces) {
+        log_debug("dropped %u faces degenerate after welding",
+                  mesh->n_faces - planes.n_faces);
+        if (compact_OoTCollisionVertices(vertices, &n_unique_verts, &planes) !=
+            0) {
+            log_error("compact_OoTCollisionVertices failed");
+            free(vertices);
+            free_OoTCollisionPlanes(&planes);
+            return -1;
+        }
+    }
 
-    struct OoTCollisionVertex *vertices =
-        malloc(sizeof(struct OoTCollisionVertex) * n_unique_verts);
-    if (vertices == NULL) {
-        log_error("malloc vertices failed");
-        free(remap);
-        return -2;
+    unsigned int *face_order = NULL;
+    if (spatial_sort) {
+        face_order = malloc(sizeof(unsigned int) * planes.n_faces);
+        if ((planes.n_faces != 0 && face_order == NULL) ||
+            sort_OoTCollisionPlanes_spatially(vertices, n_unique_verts, &planes,
+                                              face_order) != 0) {
+            log_error("sort_OoTCollisionPlanes_spatially failed");
+            free(face_order);
+            free(vertices);
+            free_OoTCollisionPlanes(&planes);
+            return -1;
+        }
     }
-    meshopt_remapVertexBuffer(vertices, mesh->verts, mesh->n_verts,
-                              sizeof(struct OoTCollisionVertex), remap);
 
-    fprintf(f, "// Hi from write_OoTCollisionMesh_to_c\n");
+    stats_add_stage_time(EXPORT_STAGE_COLLISION_BUILD, t_build);
+    double t_text = stats_now();
+
+    bputs(b, "// Hi from write_OoTCollisionMesh_to_c\n");
 
     int16_t minX = 0, maxX = 0, minY = 0, maxY = 0, minZ = 0, maxZ = 0;
 
     if (n_unique_verts != 0) {
-        minX = maxX = (int16_t)vertices[0].coords[0];
-        minY = maxY = (int16_t)vertices[0].coords[1];
-        minZ = maxZ = (int16_t)vertices[0].coords[2];
+        minX = maxX = vertices[0][0];
+        minY = maxY = vertices[0][1];
+        minZ = maxZ = vertices[0][2];
     }
 
-    fprintf(f, "Vec3s %s[] = {\n", vtx_list_name);
-    for (size_t i = 0; i < n_unique_verts; i++) {
-        struct OoTCollisionVertex *v = &vertices[i];
-        // TODO check coords range for int16_t
+    bprintf(b, "Vec3s %s[] = {\n", vtx_list_name);
+    for (long i = 0; i < n_unique_verts; i++) {
         int16_t x, y, z;
-        x = (int16_t)v->coords[0];
-        y = (int16_t)v->coords[1];
-        z = (int16_t)v->coords[2];
-        fprintf(f, "    { %" PRId16 ", %" PRId16 ", %" PRId16 " },\n", x, y, z);
+        x = vertices[i][0];
+        y = vertices[i][1];
+        z = vertices[i][2];
+        bputs(b, "    { ");
+        bput_int(b, x);
+        bputs(b, ", ");
+        bput_int(b, y);
+        bputs(b, ", ");
+        bput_int(b, z);
+        bputs(b, " },\n");
         minX = MIN(minX, x);
         maxX = MAX(maxX, x);
         minY = MIN(minY, y);
@@ -1812,116 +5434,98 @@ int write_OoTCollisionMesh_to_c(struct OoTCollisionMesh *mesh,
         minZ = MIN(minZ, z);
         maxZ = MAX(maxZ, z);
     }
-    fprintf(f, "};\n");
-
-    free(vertices);
+    bputs(b, "};\n");
+
+    bprintf(b, "CollisionPoly %s[] = {\n", poly_list_name);
+    for (unsigned int i_order = 0; i_order < planes.n_faces; i_order++) {
+        unsigned int i = face_order != NULL ? face_order[i_order] : i_order;
+        struct OoTCollisionTri *t = &mesh->faces[planes.faces[i]];
+        unsigned int v0 = planes.verts[i][0], v1 = planes.verts[i][1],
+                     v2 = planes.verts[i][2];
+
+        const char *mat_name = mesh->materials[t->material].name;
+        bputs(b, "    {\n        ");
+        bputs(b, map_prefix_upper);
+        bputs(b, "_SURFACETYPE_");
+        bputs(b, mat_name);
+        bputs(b, ",\n        {\n");
+        bputs(b, "            COLPOLY_VTX(");
+        bput_uint(b, v0);
+        bputs(b, ", ");
+        bputs(b, map_prefix_upper);
+        bputs(b, "_COL_");
+        bputs(b, mat_name);
+        bputs(b, "_FLAGS_A),\n");
+        bputs(b, "            COLPOLY_VTX(");
+        bput_uint(b, v1);
+        bputs(b, ", ");
+        bputs(b, map_prefix_upper);
+        bputs(b, "_COL_");
+        bputs(b, mat_name);
+        bputs(b, "_FLAGS_B),\n");
+        bputs(b, "            COLPOLY_VTX(");
+        bput_uint(b, v2);
+        bputs(b, ", 0),\n");
+        bputs(b, "        },\n");
+        // floats are left to printf
+        bprintf(b,
+                "        {\n"
+                "            COLPOLY_SNORMAL(%f),\n"
+                "            COLPOLY_SNORMAL(%f),\n"
+                "            COLPOLY_SNORMAL(%f),\n"
+                "        },\n",
+                planes.nx[i], planes.ny[i], planes.nz[i]);
+        bputs(b, "        ");
+        bput_int(b, planes.dist[i]);
+        bputs(b, ",\n    },\n");
+    }
+    bputs(b, "};\n");
 
-    fprintf(f, "CollisionPoly %s[] = {\n", poly_list_name);
-    for (unsigned int i = 0; i < mesh->n_faces; i++) {
-        struct OoTCollisionTri *t = &mesh->faces[i];
-        unsigned int v0, v1, v2;
-        v0 = t->verts[0];
-        v1 = t->verts[1];
-        v2 = t->verts[2];
-        float x0, y0, z0, x1, y1, z1, x2, y2, z2;
-
-        y0 = mesh->verts[v0].coords[1];
-        y1 = mesh->verts[v1].coords[1];
-        y2 = mesh->verts[v2].coords[1];
-        // cycle v0,v1,v2 such that v0 has the lowest y
-        // Circumvents a bug in CollisionPoly_GetMinY
-        if (y1 < y0 && y1 < y2) {
-            v0 = t->verts[1];
-            v1 = t->verts[2];
-            v2 = t->verts[0];
-        } else if (y2 < y0 && y2 < y1) {
-            v0 = t->verts[2];
-            v1 = t->verts[0];
-            v2 = t->verts[1];
-        }
-
-        x0 = mesh->verts[v0].coords[0];
-        y0 = mesh->verts[v0].coords[1];
-        z0 = mesh->verts[v0].coords[2];
-        x1 = mesh->verts[v1].coords[0];
-        y1 = mesh->verts[v1].coords[1];
-        z1 = mesh->verts[v1].coords[2];
-        x2 = mesh->verts[v2].coords[0];
-        y2 = mesh->verts[v2].coords[1];
-        z2 = mesh->verts[v2].coords[2];
-        float nx, ny, nz;
-        // n = normalized((v1-v0)x(v2-v0))
-        float ux, uy, uz, vx, vy, vz;
-        // u = v1-v0  v = v2-v0
-        ux = x1 - x0;
-        uy = y1 - y0;
-        uz = z1 - z0;
-        vx = x2 - x0;
-        vy = y2 - y0;
-        vz = z2 - z0;
-        // n = u x v
-        nx = uy * vz - uz * vy;
-        ny = uz * vx - ux * vz;
-        nz = ux * vy - uy * vx;
-        // n = normalized(n)
-        float nn = sqrtf(nx * nx + ny * ny + nz * nz);
-        fprintf(f, "/*\n");
-        fprintf(f, "  0 = %f %f %f\n", x0, y0, z0);
-        fprintf(f, "  1 = %f %f %f\n", x1, y1, z1);
-        fprintf(f, "  2 = %f %f %f\n", x2, y2, z2);
-        fprintf(f, "  u = %f %f %f\n", ux, uy, uz);
-        fprintf(f, "  v = %f %f %f\n", vx, vy, vz);
-        fprintf(f, "  n = %f %f %f\n", nx, ny, nz);
-        fprintf(f, "  nn = %f\n", nn);
-        fprintf(f, " */\n");
-        if (nn == 0.0f) {
-            // TODO probably skip writing triangle instead
-            nx = 1.0f;
-            ny = 0.0f;
-            nz = 0.0f;
-        } else {
-            nx /= nn;
-            ny /= nn;
-            nz /= nn;
-        }
-        int16_t dist;
-        // TODO check float -> int16 conversion
-        dist = -(nx * x0 + ny * y0 + nz * z0);
-
-        fprintf(
-            f,
-            "    {\n"
-            "        %s_SURFACETYPE_%s,\n"
-            "        {\n"
-            "            COLPOLY_VTX(%u, %s_COL_%s_FLAGS_A),\n"
-            "            COLPOLY_VTX(%u, %s_COL_%s_FLAGS_B),\n"
-            "            COLPOLY_VTX(%u, 0),\n"
-            "        },\n"
-            "        {\n"
-            "            COLPOLY_SNORMAL(%f),\n"
-            "            COLPOLY_SNORMAL(%f),\n"
-            "            COLPOLY_SNORMAL(%f),\n"
-            "        },\n"
-            "        %" PRId16 ",\n"
-            "    },\n",
-            map_prefix_upper, mesh->materials[t->material].name,            //
-            remap[v0], map_prefix_upper, mesh->materials[t->material].name, //
-            remap[v1], map_prefix_upper, mesh->materials[t->material].name, //
-            remap[v2],                                                      //
-            nx, ny, nz, dist);
-    }
-    fprintf(f, "};\n");
+    free(face_order);
 
-    free(remap);
+    stats_add_stage_time(EXPORT_STAGE_TEXT_EMISSION, t_text);
 
     if (out_bounds != NULL) {
+        double t_subdivision = stats_now();
+
         out_bounds->min[0] = minX;
         out_bounds->min[1] = minY;
         out_bounds->min[2] = minZ;
         out_bounds->max[0] = maxX;
         out_bounds->max[1] = maxY;
         out_bounds->max[2] = maxZ;
+
+        int16_t(*boxes)[2][3] = malloc(sizeof(int16_t[2][3]) * planes.n_faces);
+        if (planes.n_faces != 0 && boxes == NULL) {
+            log_error("malloc boxes failed");
+            free(vertices);
+            free_OoTCollisionPlanes(&planes);
+            return -1;
+        }
+        for (unsigned int i = 0; i < planes.n_faces; i++) {
+            for (int k = 0; k < 3; k++) {
+                int16_t c0 = vertices[planes.verts[i][0]][k];
+                int16_t c1 = vertices[planes.verts[i][1]][k];
+                int16_t c2 = vertices[planes.verts[i][2]][k];
+                boxes[i][0][k] = MIN(c0, MIN(c1, c2));
+                boxes[i][1][k] = MAX(c0, MAX(c1, c2));
+            }
+        }
+        res = compute_OoTCollisionSubdivisionStats(planes.n_faces, boxes,
+                                                   out_bounds);
+        free(boxes);
+        if (res != 0) {
+            log_error("compute_OoTCollisionSubdivisionStats failed");
+            free(vertices);
+            free_OoTCollisionPlanes(&planes);
+            return -1;
+        }
+
+        stats_add_stage_time(EXPORT_STAGE_COLLISION_BUILD, t_subdivision);
     }
 
-    return 0;
+    free(vertices);
+    free_OoTCollisionPlanes(&planes);
+
+    return b->error ? -3 : 0;
 }
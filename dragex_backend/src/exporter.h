@@ -4,17 +4,12 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
 
-// info
+#include "arena.h"
+#include "hashmap.h"
+#include "text_buffer.h"
 
-struct VertexInfo {
-    float coords[3];
-    float uv[2];
-    float normal[3];
-    uint8_t color[4]; // RGBA
-    unsigned int material;
-};
+// info
 
 struct TriInfo {
     unsigned int verts[3];
@@ -324,9 +319,32 @@ struct CornerMaterialInfo {
     int limb_index;
 };
 
+/**
+ * Per-vertex and per-loop data of a mesh, in structure-of-arrays layout.
+ *
+ * The arrays are not owned by the MeshInfo: they point into the buffers passed
+ * to create_MeshInfo_from_buffers, which must outlive the MeshInfo and its
+ * submeshes. Values are only converted (to f3d_vertex) when the mesh is
+ * converted to F3D, and only those the material needs.
+ */
+struct MeshInfoBuffers {
+    const float *vertices_co; // xyz per vertex
+    const unsigned int *loops_vertex_index;
+    const float *loops_normal;  // xyz per loop
+    const float *corners_color; // RGBA per loop, or NULL
+    const float *points_color;  // RGBA per vertex, or NULL
+    const float *loops_uv;      // uv per loop, or NULL
+    const unsigned int *corners_material_index;
+    // maps corners_material_index values to MeshInfo corner_materials indices
+    const unsigned int *corner_material_index_map;
+};
+
 struct MeshInfo {
     char *name;
-    struct VertexInfo *verts;
+    struct MeshInfoBuffers buffers;
+    // For each vertex of the mesh, the loop index in buffers it comes from.
+    // NULL if vertex i is loop i (meshes from create_MeshInfo_from_buffers).
+    unsigned int *loops;
     struct TriInfo *faces;
     struct MaterialInfo *materials;
     struct CornerMaterialInfo *corner_materials;
@@ -355,8 +373,127 @@ struct MeshInfo *create_MeshInfo_from_buffers(
     struct CornerMaterialInfo *default_corner_material //
 );
 
+/**
+ * The per-vertex, per-loop and per-triangle buffers of
+ * create_MeshInfo_from_buffers, which a MeshInfoBuilder fills independently
+ * and chunk by chunk.
+ */
+enum mesh_info_builder_attr {
+    MESH_INFO_BUILDER_VERTICES_CO,
+    MESH_INFO_BUILDER_POINTS_COLOR, // optional
+    MESH_INFO_BUILDER_LOOPS_VERTEX_INDEX,
+    MESH_INFO_BUILDER_LOOPS_NORMAL,
+    MESH_INFO_BUILDER_CORNERS_COLOR, // optional
+    MESH_INFO_BUILDER_LOOPS_UV,      // optional
+    MESH_INFO_BUILDER_CORNERS_MATERIAL_INDEX,
+    MESH_INFO_BUILDER_TRIANGLES_LOOPS,
+    MESH_INFO_BUILDER_TRIANGLES_MATERIAL_INDEX,
+    MESH_INFO_BUILDER_N_ATTRS
+};
+
+enum mesh_info_builder_domain {
+    MESH_INFO_BUILDER_DOMAIN_VERTEX,
+    MESH_INFO_BUILDER_DOMAIN_LOOP,
+    MESH_INFO_BUILDER_DOMAIN_TRIANGLE,
+};
+
+struct MeshInfoBuilderAttrInfo {
+    const char *name;
+    // floats (or unsigned ints) per vertex (or loop, or triangle)
+    int n_components;
+    enum mesh_info_builder_domain domain;
+    bool is_uint;
+};
+
+extern const struct MeshInfoBuilderAttrInfo
+    mesh_info_builder_attrs[MESH_INFO_BUILDER_N_ATTRS];
+
+/**
+ * Owns the buffers of meshes, so the caller only needs to hold a chunk of one
+ * attribute at a time instead of the whole mesh data, or can have the data
+ * written directly into the buffers (see mesh_info_builder_append_range).
+ * Meshes created from the builder reference its per-vertex and per-loop
+ * buffers, so it must outlive them and is not appended to after the first one.
+ */
+struct MeshInfoBuilder {
+    // NULL for the optional attributes the mesh doesn't have
+    void *buffers[MESH_INFO_BUILDER_N_ATTRS];
+    size_t n_vertices, n_loops, n_triangles;
+    // how many vertices, loops or triangles of each attribute have been
+    // appended
+    size_t n_set[MESH_INFO_BUILDER_N_ATTRS];
+};
+
+/** Returns 0 on success, non-zero if allocating failed */
+int mesh_info_builder_init(struct MeshInfoBuilder *builder, size_t n_vertices,
+                           size_t n_loops, size_t n_triangles,
+                           bool has_points_color, bool has_corners_color,
+                           bool has_uv);
+void mesh_info_builder_free(struct MeshInfoBuilder *builder);
+
+/**
+ * Append the next len values of an attribute without setting them: returns
+ * where the caller writes them, or NULL if the builder doesn't have the
+ * attribute or len is not a whole number of remaining elements.
+ */
+void *mesh_info_builder_append_range(struct MeshInfoBuilder *builder,
+                                     enum mesh_info_builder_attr attr,
+                                     size_t len);
+/**
+ * Append the next values of an attribute, len being the number of floats (or
+ * unsigned ints). Returns 0 on success, non-zero on the errors of
+ * mesh_info_builder_append_range.
+ */
+int mesh_info_builder_append(struct MeshInfoBuilder *builder,
+                             enum mesh_info_builder_attr attr,
+                             const void *data, size_t len);
+/** Whether all attributes have been appended completely */
+bool mesh_info_builder_is_complete(struct MeshInfoBuilder *builder);
+
+/**
+ * create_MeshInfo_from_buffers with the builder's buffers, which must be
+ * complete. The mesh is made of the n_triangles triangles of the builder
+ * listed in triangles, or of all of them if triangles is NULL.
+ */
+struct MeshInfo *mesh_info_builder_create_MeshInfo(
+    struct MeshInfoBuilder *builder, char *mesh_name,
+    unsigned int *triangles, size_t n_triangles,
+    struct MaterialInfo **material_infos, size_t n_material_infos,
+    struct MaterialInfo *default_material,
+    struct CornerMaterialInfo **corner_material_infos,
+    size_t n_corner_material_infos,
+    struct CornerMaterialInfo *default_corner_material);
+
 // f3d
 
+/**
+ * What the target microcode supports, the display list writers specialize on
+ * it. Only microcodes drawing triangles have a profile (not S2DEX).
+ */
+enum f3d_tri_cmds {
+    F3D_TRI_CMD_1TRIANGLE = 1 << 0,
+    F3D_TRI_CMD_2TRIANGLES = 1 << 1,
+    // gsSPTriStrip and gsSPTriFan (F3DEX3)
+    F3D_TRI_CMD_STRIP_FAN = 1 << 2,
+};
+
+// the largest vertex_cache_size of the profiles
+#define F3D_VERTEX_CACHE_MAX 56
+
+struct F3DUcodeProfile {
+    const char *name;
+    int vertex_cache_size;
+    unsigned int tri_cmds; // enum f3d_tri_cmds
+    // vertices can have both a color and a normal (G_PACKED_NORMALS)
+    bool packed_normals;
+};
+
+extern const struct F3DUcodeProfile f3d_ucode_f3dex2;
+extern const struct F3DUcodeProfile f3d_ucode_f3dex3;
+
+/** Returns NULL if there is no profile with that name */
+const struct F3DUcodeProfile *f3d_ucode_profile_by_name(const char *name);
+
 struct f3d_mesh_corner_material {
     char *matrix;
 };
@@ -366,6 +503,7 @@ struct f3d_vertex {
     int16_t st[2];
     uint8_t cn[3]; // color/normal
     uint8_t alpha;
+    uint16_t flag; // the packed normal with SHADING_COLORS_AND_NORMALS
     unsigned int material;
 };
 
@@ -380,6 +518,8 @@ struct f3d_mesh_entry_vertices {
     unsigned int corner_material_index;
     int buffer_i;  // index into vertex buffer to load from
     uint8_t n, v0; // arguments to SPVertex
+    // index into the F3DVtxPool to load from, see f3d_vtx_pool_add_mesh
+    size_t pool_i;
 };
 
 struct f3d_mesh_entry_triangles_triangle {
@@ -393,20 +533,248 @@ struct f3d_mesh_entry_triangles {
 };
 
 struct f3d_mesh {
+    // allocates the entries and their tris
+    struct Arena arena;
     struct f3d_mesh_corner_material *corner_materials;
     struct f3d_vertex *vertices;
     struct f3d_mesh_entry_base **entries;
     int n_corner_materials;
     int n_vertices;
     int n_entries;
+    int n_tris;
+    int n_vertex_loads; // number of F3D_MESH_ENTRY_VERTICES entries
+    double area;        // of the triangles, in model units
+};
+
+// stages of write_mesh_info_to_f3d_c
+
+struct MeshInfo **split_mesh_by_material(struct MeshInfo *in_mesh);
+void free_split_mesh_by_material(struct MeshInfo **meshes, int n_meshes);
+
+enum shading_type {
+    SHADING_NULL,
+    SHADING_COLORS,
+    SHADING_NORMALS,
+    // only with ucode->packed_normals
+    SHADING_COLORS_AND_NORMALS
 };
 
+struct f3d_mesh *mesh_to_f3d_mesh(struct MeshInfo *mesh,
+                                  const char **limb_to_matrix_map,
+                                  int limb_to_matrix_map_len, int uv_basis_s,
+                                  int uv_basis_t,
+                                  enum shading_type shading_type,
+                                  const struct F3DUcodeProfile *ucode);
+void free_mesh_to_f3d_mesh(struct f3d_mesh *mesh);
+
+/**
+ * Vertices shared by the meshes written to a same file. Each run of vertices
+ * loaded by a gsSPVertex is only added once, identical runs (e.g. from meshes
+ * repeated in a room) then point into the same array.
+ */
+struct F3DVtxPoolRun {
+    size_t start; // index into vertices
+    unsigned int n;
+};
+
+struct F3DVtxPool {
+    char *name; // of the Vtx array
+    struct f3d_vertex *vertices;
+    size_t n_vertices, cap_vertices;
+    struct F3DVtxPoolRun *runs;
+    size_t n_runs, cap_runs;
+    struct IndexHashMap runs_map; // indices into runs
+    // set once the array has been declared in the output
+    bool declared;
+    // set if an allocation failed
+    bool error;
+};
+
+/** Returns 0 on success, non-zero if allocating failed */
+int f3d_vtx_pool_init(struct F3DVtxPool *pool, const char *name);
+void f3d_vtx_pool_free(struct F3DVtxPool *pool);
+/**
+ * Add the vertices loaded by the mesh to the pool, setting the pool_i of its
+ * vertices entries.
+ * Returns 0 on success, non-zero if allocating failed.
+ */
+int f3d_vtx_pool_add_mesh(struct F3DVtxPool *pool, struct f3d_mesh *mesh);
+/** Write the pool's Vtx array, after all meshes using the pool */
+int write_f3d_vtx_pool(struct TextBuffer *b, struct F3DVtxPool *pool);
+
+/**
+ * Material display lists already written to a same file, so meshes using the
+ * same material reference a single %s_mat_dl.
+ * Materials are keyed on the display list they produce, which is printed from
+ * the other modes, tiles, combiner, vals and geometry mode.
+ */
+struct F3DMatRegistryEntry {
+    char *body; // the display list without its first line (with the name)
+    size_t body_len;
+    char *dl_name;
+};
+
+struct F3DMatRegistry {
+    struct F3DMatRegistryEntry *entries;
+    size_t n_entries, cap_entries;
+    struct IndexHashMap entries_map; // indices into entries
+};
+
+/** Returns 0 on success, non-zero if allocating failed */
+int f3d_mat_registry_init(struct F3DMatRegistry *reg);
+void f3d_mat_registry_free(struct F3DMatRegistry *reg);
+
+/**
+ * Static estimate of what drawing a display list costs, counted by the writers
+ * as they write commands. Display lists called several times (e.g. shared
+ * materials) are counted each time.
+ */
+struct F3DDLCost {
+    unsigned long long n_gfx; // commands, 8 bytes each
+    unsigned long long vtx_bytes;
+    unsigned long long n_vertex_loads;
+    unsigned long long n_matrix_loads;
+    unsigned long long tex_load_bytes; // TMEM bytes
+    unsigned long long n_tris;
+    // area of the triangles in model units, by cycle type (copy and fill
+    // count as 1-cycle). Screen area is not known statically, so this assumes
+    // one model unit per pixel.
+    double fill_area_1cycle;
+    double fill_area_2cycle;
+};
+
+void f3d_dl_cost_add(struct F3DDLCost *to, const struct F3DDLCost *cost);
+/** Rough RSP cycles, only meaningful to compare display lists */
+double f3d_dl_cost_rsp(const struct F3DDLCost *cost);
+/** Rough RDP cycles, only meaningful to compare display lists */
+double f3d_dl_cost_rdp(const struct F3DDLCost *cost);
+
+/**
+ * The RDP/RSP state left by the material display lists written so far, so
+ * write_f3d_mat_diff only writes the commands that change it.
+ * Each part is tracked as the text of the command(s) last written for it.
+ */
+enum f3d_mat_state_part {
+    F3D_MAT_STATE_OTHER_MODE,
+    // tile descriptors, from gsDPSetTile+gsDPSetTileSize or a texture load
+    F3D_MAT_STATE_TILE_0,
+    F3D_MAT_STATE_COMBINE = F3D_MAT_STATE_TILE_0 + 8,
+    F3D_MAT_STATE_PRIM_DEPTH,
+    F3D_MAT_STATE_FOG_COLOR,
+    F3D_MAT_STATE_BLEND_COLOR,
+    F3D_MAT_STATE_PRIM_COLOR,
+    F3D_MAT_STATE_ENV_COLOR,
+    F3D_MAT_STATE_TEXTURE,
+    F3D_MAT_STATE_GEOMETRY_MODE,
+    F3D_MAT_STATE_PART_COUNT
+};
+
+struct F3DMatStateLoad {
+    char *cmd;
+    size_t cmd_len;
+    unsigned int tmem_start, tmem_end; // in bytes
+};
+
+#define F3D_MAT_STATE_MAX_LOADS 16
+
+struct F3DMatState {
+    // NULL if unknown
+    char *cmds[F3D_MAT_STATE_PART_COUNT];
+    size_t cmds_len[F3D_MAT_STATE_PART_COUNT];
+    // texture loads whose TMEM contents are still resident, oldest first
+    struct F3DMatStateLoad loads[F3D_MAT_STATE_MAX_LOADS];
+    int n_loads;
+};
+
+void f3d_mat_state_init(struct F3DMatState *state);
+void f3d_mat_state_free(struct F3DMatState *state);
+
+/** For F3DEX2, see write_f3d_mat_diff */
+int write_f3d_mat(struct TextBuffer *b, struct MaterialInfo *mat_info,
+                  const char *name);
+/**
+ * Writes all the state of the material if state is NULL. Otherwise only the
+ * commands that change state are written (and state is updated), texture
+ * loads already resident in TMEM are skipped, and gsDPPipeSync is only written
+ * if some RDP state changes.
+ */
+int write_f3d_mat_diff(struct TextBuffer *b, struct MaterialInfo *mat_info,
+                       const char *name, const struct F3DUcodeProfile *ucode,
+                       struct F3DMatState *state, struct F3DDLCost *cost);
+/**
+ * If vtx_pool is NULL the mesh gets its own %s_mesh_vtx array, otherwise it
+ * loads from the pool at the offsets set by f3d_vtx_pool_add_mesh, and the
+ * pool's array must be declared before. The pool is only read from, so meshes
+ * can be written concurrently.
+ * The commands written are added to cost if not NULL (the fill area is left to
+ * the caller, which knows the material).
+ */
+int write_f3d_mesh(struct TextBuffer *b, struct f3d_mesh *mesh,
+                   const char *name, struct F3DVtxPool *vtx_pool,
+                   const struct F3DUcodeProfile *ucode,
+                   struct F3DDLCost *cost);
+
 //
 
+enum f3d_c_options {
+    // each material display list after the first only changes the state left
+    // by the previous one (see write_f3d_mat_diff), so the %s_dl must be
+    // drawn as a whole
+    F3D_C_DIFF_MAT_STATE = 1 << 0,
+    // draw the submeshes in the order that changes the least state instead of
+    // in material order, only for layers where the order does not matter
+    // (e.g. opaque)
+    F3D_C_OPTIMIZE_DRAW_ORDER = 1 << 1,
+};
+
+/**
+ * vtx_pool is optional, see write_f3d_mesh.
+ * mat_registry is optional, if set material display lists already in it are
+ * referenced instead of written again.
+ * options is a combination of enum f3d_c_options.
+ * cost is optional, set to the estimate for drawing %s_dl.
+ */
 int write_mesh_info_to_f3d_c(struct MeshInfo *mesh_info,
                              const char **limb_to_matrix_map,
-                             int limb_to_matrix_map_len, FILE *f,
-                             char **dl_name);
+                             int limb_to_matrix_map_len,
+                             struct F3DVtxPool *vtx_pool,
+                             struct F3DMatRegistry *mat_registry,
+                             const struct F3DUcodeProfile *ucode,
+                             unsigned int options, struct TextBuffer *b,
+                             char **dl_name, struct F3DDLCost *cost);
+
+/**
+ * Big-endian F3DEX2 display lists and vertices, with the addresses left to be
+ * relocated.
+ */
+struct F3DBinSymbol {
+    char *name;
+    size_t offset; // offset of the symbol in data
+};
+
+struct F3DBinRelocation {
+    // offset in data of a big-endian 32-bit word, holding an addend to which
+    // the address of symbol must be added
+    size_t offset;
+    char *symbol;
+};
+
+struct F3DBin {
+    struct TextBuffer data;
+    struct F3DBinSymbol *symbols;
+    size_t n_symbols, cap_symbols;
+    struct F3DBinRelocation *relocations;
+    size_t n_relocations, cap_relocations;
+    bool error;
+};
+
+void f3d_bin_init(struct F3DBin *bin);
+void f3d_bin_free(struct F3DBin *bin);
+
+int write_mesh_info_to_f3d_bin(struct MeshInfo *mesh_info,
+                               const char **limb_to_matrix_map,
+                               int limb_to_matrix_map_len, struct F3DBin *bin,
+                               char **dl_name);
 
 //
 
@@ -444,16 +812,66 @@ struct OoTCollisionMesh *create_OoTCollisionMesh_from_buffers(
 struct OoTCollisionMesh *
 join_OoTCollisionMeshes_impl(struct OoTCollisionMesh **meshes, size_t n_meshes);
 
+/**
+ * Merge adjacent faces with the same material into fewer, larger ones by
+ * collapsing edges, as long as the surface moves by at most about tolerance
+ * (in OoT units). With a tolerance of 0 only coplanar faces are merged.
+ * Material boundaries, open edges and the edges between floors, walls and
+ * ceilings only move along themselves, and faces keep their floor, wall or
+ * ceiling class. Vertices are welded first, as by write_OoTCollisionMesh_to_c.
+ */
+struct OoTCollisionMesh *
+simplify_OoTCollisionMesh_impl(struct OoTCollisionMesh *mesh, float tolerance);
+
+/**
+ * How the polys would spread in BgCheck's static lookup grid for some
+ * subdivision amounts. Polys are counted in every cell their bounding box
+ * overlaps, so the counts are upper bounds of what the game stores.
+ */
+struct OoTCollisionSubdivisionStats {
+    int amount[3];
+    // polys times the cells they are in, that is the SSNode count
+    unsigned int n_nodes;
+    unsigned int max_polys;  // in one cell
+    float mean_polys;        // per non-empty cell
+    unsigned int mem_size;   // lookup table and nodes, in bytes
+};
+
+// 6 amounts for x and z, 4 for y
+#define OOT_COLLISION_SUBDIVISION_N_CANDIDATES 144
+
 struct OoTCollisionBounds {
     int16_t min[3];
     int16_t max[3];
-};
 
+    struct OoTCollisionSubdivisionStats
+        subdivisions[OOT_COLLISION_SUBDIVISION_N_CANDIDATES];
+    int n_subdivisions;
+    // indices in subdivisions
+    int recommended_subdivision, default_subdivision;
+};
+
+// more than the whole int16_t range, welding every vertex together
+#define OOT_COLLISION_WELD_EPSILON_MAX 0xFFFF
+
+/**
+ * Vertices are quantized to int16_t before being deduplicated, then welded if
+ * their coordinates are within weld_epsilon of each other on every axis.
+ * Coordinates out of the int16_t range fail the write. Faces collapsed to an
+ * edge or a point by welding are dropped, the planes of the others are
+ * computed from the welded vertices.
+ * With spatial_sort, polys are written in Morton order of their centroids and
+ * vertices in order of first use by them, instead of the mesh's order.
+ * out_bounds also receives statistics for choosing the scene's BgCheck
+ * subdivision amounts.
+ */
 int write_OoTCollisionMesh_to_c(struct OoTCollisionMesh *mesh,
                                 const char *map_prefix_upper,
                                 const char *vtx_list_name,
                                 const char *poly_list_name,
-                                const char *surface_types_name, FILE *f,
+                                const char *surface_types_name,
+                                int weld_epsilon, bool spatial_sort,
+                                struct TextBuffer *b,
                                 struct OoTCollisionBounds *out_bounds);
 
 #endif
@@ -0,0 +1,87 @@
+#include "hashmap.h"
+
+#include <stdlib.h>
+
+#include "logging/logging.h"
+
+#define INDEX_HASH_MAP_MIN_CAPACITY 16
+
+static int index_hash_map_alloc(struct IndexHashMap *m, size_t capacity) {
+    m->slots = calloc(capacity, sizeof(uint32_t));
+    m->hashes = malloc(sizeof(uint32_t) * capacity);
+    if (m->slots == NULL || m->hashes == NULL) {
+        log_error("malloc slots or hashes failed");
+        free(m->slots);
+        free(m->hashes);
+        m->slots = NULL;
+        m->hashes = NULL;
+        return -1;
+    }
+    m->capacity = capacity;
+    m->count = 0;
+    return 0;
+}
+
+int index_hash_map_init(struct IndexHashMap *m, size_t expected_count) {
+    // keep the load factor under 1/2
+    size_t capacity = INDEX_HASH_MAP_MIN_CAPACITY;
+    while (capacity < expected_count * 2)
+        capacity *= 2;
+    return index_hash_map_alloc(m, capacity);
+}
+
+void index_hash_map_free(struct IndexHashMap *m) {
+    free(m->slots);
+    free(m->hashes);
+    m->slots = NULL;
+    m->hashes = NULL;
+}
+
+uint32_t index_hash_map_find(struct IndexHashMap *m, uint32_t hash,
+                             index_hash_map_eq_fn eq, void *arg) {
+    size_t mask = m->capacity - 1;
+    for (size_t i = hash & mask; m->slots[i] != 0; i = (i + 1) & mask) {
+        if (m->hashes[i] == hash && eq(arg, m->slots[i] - 1))
+            return m->slots[i] - 1;
+    }
+    return ~0u;
+}
+
+static void index_hash_map_put(struct IndexHashMap *m, uint32_t hash,
+                               uint32_t index) {
+    size_t mask = m->capacity - 1;
+    size_t i = hash & mask;
+    while (m->slots[i] != 0)
+        i = (i + 1) & mask;
+    m->slots[i] = index + 1;
+    m->hashes[i] = hash;
+    m->count++;
+}
+
+int index_hash_map_insert(struct IndexHashMap *m, uint32_t hash,
+                          uint32_t index) {
+    if ((m->count + 1) * 2 > m->capacity) {
+        struct IndexHashMap old = *m;
+        if (index_hash_map_alloc(m, old.capacity * 2) != 0) {
+            *m = old;
+            return -1;
+        }
+        for (size_t i = 0; i < old.capacity; i++) {
+            if (old.slots[i] != 0)
+                index_hash_map_put(m, old.hashes[i], old.slots[i] - 1);
+        }
+        index_hash_map_free(&old);
+    }
+    index_hash_map_put(m, hash, index);
+    return 0;
+}
+
+uint32_t hash_bytes(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
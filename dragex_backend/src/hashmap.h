@@ -0,0 +1,43 @@
+#ifndef DRAGEX_BACKEND_HASHMAP_H
+#define DRAGEX_BACKEND_HASHMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Open addressing hash table of indices into a caller-owned array of items.
+ *
+ * The table only stores the indices and the hashes of the items, the caller
+ * computes the hashes and compares items (see index_hash_map_find). Several
+ * indices may be inserted with the same hash, e.g. to bucket items that are
+ * only "close enough" to each other.
+ */
+struct IndexHashMap {
+    uint32_t *slots; // item index + 1, or 0 for empty slots
+    uint32_t *hashes;
+    size_t capacity; // power of two
+    size_t count;
+};
+
+/** Returns 0 on success, non-zero if allocating failed */
+int index_hash_map_init(struct IndexHashMap *m, size_t expected_count);
+void index_hash_map_free(struct IndexHashMap *m);
+
+typedef bool (*index_hash_map_eq_fn)(void *arg, uint32_t index);
+
+/**
+ * Look for an index with the given hash for which eq(arg, index) is true.
+ * Returns the index, or ~0u if there is none.
+ */
+uint32_t index_hash_map_find(struct IndexHashMap *m, uint32_t hash,
+                             index_hash_map_eq_fn eq, void *arg);
+
+/** Returns 0 on success, non-zero if growing the table failed */
+int index_hash_map_insert(struct IndexHashMap *m, uint32_t hash,
+                          uint32_t index);
+
+/** FNV-1a */
+uint32_t hash_bytes(const void *data, size_t len);
+
+#endif
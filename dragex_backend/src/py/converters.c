@@ -47,6 +47,15 @@ int converter_contiguous_float_buffer(PyObject *obj, void *result) {
     return converter_contiguous_buffer_impl(obj, result, "f", sizeof(float));
 }
 
+int converter_contiguous_uint_buffer_optional(PyObject *obj, void *result) {
+    if (obj == Py_None) {
+        ((Py_buffer *)result)->buf = NULL;
+        return 1;
+    }
+    return converter_contiguous_buffer_impl(obj, result, "I",
+                                            sizeof(unsigned int));
+}
+
 int converter_contiguous_float_buffer_optional(PyObject *obj, void *result) {
     if (obj == Py_None) {
         ((Py_buffer *)result)->buf = NULL;
@@ -10,6 +10,8 @@ int converter_contiguous_uint_buffer(PyObject *obj, void *result);
 
 int converter_contiguous_float_buffer(PyObject *obj, void *result);
 
+int converter_contiguous_uint_buffer_optional(PyObject *obj, void *result);
+
 int converter_contiguous_float_buffer_optional(PyObject *obj, void *result);
 
 //
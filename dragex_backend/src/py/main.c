@@ -9,6 +9,7 @@
 
 #include "../logging/logging.h"
 #include "../logging/py_logging.h"
+#include "../stats.h"
 
 #include "../../build_id.h"
 
@@ -16,6 +17,49 @@ static PyObject *get_build_id(PyObject *self, PyObject *args) {
     return PyLong_FromLong(BUILD_ID);
 }
 
+static PyObject *get_export_stats(PyObject *self, PyObject *args) {
+    struct ExportStats stats;
+    stats_get(&stats);
+
+    PyObject *stages = PyDict_New();
+    PyObject *counters = PyDict_New();
+    if (stages == NULL || counters == NULL) {
+        Py_XDECREF(stages);
+        Py_XDECREF(counters);
+        return NULL;
+    }
+    for (int i = 0; i < EXPORT_STAGE_COUNT; i++) {
+        PyObject *v = PyFloat_FromDouble(stats.stage_seconds[i]);
+        if (v == NULL ||
+            PyDict_SetItemString(stages, export_stage_names[i], v) < 0) {
+            Py_XDECREF(v);
+            Py_DECREF(stages);
+            Py_DECREF(counters);
+            return NULL;
+        }
+        Py_DECREF(v);
+    }
+    for (int i = 0; i < EXPORT_COUNTER_COUNT; i++) {
+        PyObject *v = PyLong_FromUnsignedLongLong(stats.counters[i]);
+        if (v == NULL ||
+            PyDict_SetItemString(counters, export_counter_names[i], v) < 0) {
+            Py_XDECREF(v);
+            Py_DECREF(stages);
+            Py_DECREF(counters);
+            return NULL;
+        }
+        Py_DECREF(v);
+    }
+
+    // "N" steals the references, also on failure
+    return Py_BuildValue("{sNsN}", "stages", stages, "counters", counters);
+}
+
+static PyObject *reset_export_stats(PyObject *self, PyObject *args) {
+    stats_reset();
+    Py_RETURN_NONE;
+}
+
 static int dragex_backend_exec(PyObject *m) {
     if (PyType_Ready(&MaterialInfoImageType) < 0) {
         return -1;
@@ -88,6 +132,29 @@ static int dragex_backend_exec(PyObject *m) {
         return -1;
     }
 
+    if (PyType_Ready(&MeshInfoBuilderType) < 0) {
+        return -1;
+    }
+    if (PyModule_AddObjectRef(m, "MeshInfoBuilder",
+                              (PyObject *)&MeshInfoBuilderType) < 0) {
+        return -1;
+    }
+
+    if (PyType_Ready(&VtxPoolType) < 0) {
+        return -1;
+    }
+    if (PyModule_AddObjectRef(m, "VtxPool", (PyObject *)&VtxPoolType) < 0) {
+        return -1;
+    }
+
+    if (PyType_Ready(&MaterialRegistryType) < 0) {
+        return -1;
+    }
+    if (PyModule_AddObjectRef(m, "MaterialRegistry",
+                              (PyObject *)&MaterialRegistryType) < 0) {
+        return -1;
+    }
+
     if (PyType_Ready(&OoTCollisionMaterialType) < 0) {
         return -1;
     }
@@ -137,12 +204,18 @@ static PyModuleDef_Slot dragex_backend_slots[] = {
 
 static PyMethodDef dragex_backend_methods[] = {
     {"get_build_id", get_build_id, METH_NOARGS, "get build_id"},
+    {"get_export_stats", get_export_stats, METH_NOARGS,
+     "get stage timings and counters accumulated since the last reset"},
+    {"reset_export_stats", reset_export_stats, METH_NOARGS,
+     "reset the export stage timings and counters"},
     {"create_MeshInfo", create_MeshInfo, METH_VARARGS,
      "create MeshInfo from buffers"},
     {"create_OoTCollisionMesh", create_OoTCollisionMesh, METH_VARARGS,
      "create OoTCollisionMesh from buffers"},
     {"join_OoTCollisionMeshes", join_OoTCollisionMeshes, METH_VARARGS,
      "join several OoTCollisionMesh together"},
+    {"simplify_OoTCollisionMesh", simplify_OoTCollisionMesh, METH_VARARGS,
+     "merge coplanar or nearly coplanar faces of an OoTCollisionMesh"},
     {NULL, NULL, 0, NULL} /* Sentinel */
 };
 
@@ -0,0 +1,101 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "objs.h"
+
+#include "../logging/logging.h"
+
+#include "../exporter.h"
+
+static void MaterialRegistry_dealloc(PyObject *_self) {
+    struct MaterialRegistryObject *self =
+        (struct MaterialRegistryObject *)_self;
+
+    log_trace("entry");
+
+    if (self->reg != NULL) {
+        f3d_mat_registry_free(self->reg);
+        free(self->reg);
+    }
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *MaterialRegistry_new(PyTypeObject *type, PyObject *args,
+                                      PyObject *kwds) {
+    struct MaterialRegistryObject *self;
+    self = (struct MaterialRegistryObject *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->reg = NULL;
+        self->in_use = false;
+    }
+    return (PyObject *)self;
+}
+
+static int MaterialRegistry_init(PyObject *_self, PyObject *args,
+                                 PyObject *kwds) {
+    struct MaterialRegistryObject *self =
+        (struct MaterialRegistryObject *)_self;
+    static char *kwlist[] = {
+        NULL,
+    };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+        return -1;
+
+    if (self->in_use) {
+        PyErr_SetString(PyExc_RuntimeError, "MaterialRegistry is in use");
+        return -1;
+    }
+
+    struct F3DMatRegistry *reg = malloc(sizeof(struct F3DMatRegistry));
+    if (reg == NULL || f3d_mat_registry_init(reg) != 0) {
+        free(reg);
+        PyErr_SetString(PyExc_MemoryError, "f3d_mat_registry_init failed");
+        return -1;
+    }
+
+    if (self->reg != NULL) {
+        f3d_mat_registry_free(self->reg);
+        free(self->reg);
+    }
+    self->reg = reg;
+
+    return 0;
+}
+
+struct F3DMatRegistry *
+MaterialRegistry_acquire(struct MaterialRegistryObject *self) {
+    if (self->reg == NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "MaterialRegistry is not initialized");
+        return NULL;
+    }
+    if (self->in_use) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "MaterialRegistry is in use by another thread");
+        return NULL;
+    }
+    self->in_use = true;
+    return self->reg;
+}
+
+void MaterialRegistry_release(struct MaterialRegistryObject *self) {
+    self->in_use = false;
+}
+
+PyTypeObject MaterialRegistryType = {
+    .ob_base = PyVarObject_HEAD_INIT(NULL, 0)
+
+                   .tp_name = "dragex_backend.MaterialRegistry",
+    .tp_doc = PyDoc_STR("material display lists written to a file"),
+    .tp_basicsize = sizeof(struct MaterialRegistryObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = MaterialRegistry_new,
+    .tp_init = MaterialRegistry_init,
+    .tp_dealloc = MaterialRegistry_dealloc,
+};
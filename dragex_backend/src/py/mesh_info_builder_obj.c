@@ -0,0 +1,256 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "converters.h"
+#include "objs.h"
+
+#include "../logging/logging.h"
+
+#include "../exporter.h"
+
+static void MeshInfoBuilder_dealloc(PyObject *_self) {
+    struct MeshInfoBuilderObject *self = (struct MeshInfoBuilderObject *)_self;
+
+    log_trace("entry");
+
+    // MeshInfo objects referencing the buffers hold a reference to self
+    if (self->initialized)
+        mesh_info_builder_free(&self->builder);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *MeshInfoBuilder_new(PyTypeObject *type, PyObject *args,
+                                     PyObject *kwds) {
+    struct MeshInfoBuilderObject *self;
+    self = (struct MeshInfoBuilderObject *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->initialized = false;
+        self->frozen = false;
+        self->pending_buf = NULL;
+        self->n_exports = 0;
+    }
+    return (PyObject *)self;
+}
+
+static int MeshInfoBuilder_init(PyObject *_self, PyObject *args,
+                                PyObject *kwds) {
+    struct MeshInfoBuilderObject *self = (struct MeshInfoBuilderObject *)_self;
+    Py_ssize_t n_vertices, n_loops, n_triangles;
+    int has_points_color, has_corners_color, has_uv;
+
+    if (!PyArg_ParseTuple(args, "nnnppp", &n_vertices, &n_loops, &n_triangles,
+                          &has_points_color, &has_corners_color, &has_uv))
+        return -1;
+
+    if (n_vertices < 0 || n_loops < 0 || n_triangles < 0) {
+        PyErr_SetString(PyExc_ValueError, "Negative count");
+        return -1;
+    }
+    if (self->frozen) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "MeshInfoBuilder is in use by a MeshInfo");
+        return -1;
+    }
+    if (self->n_exports != 0) {
+        PyErr_SetString(PyExc_BufferError,
+                        "MeshInfoBuilder has views from append_view");
+        return -1;
+    }
+
+    struct MeshInfoBuilder builder;
+    if (mesh_info_builder_init(&builder, n_vertices, n_loops, n_triangles,
+                               has_points_color, has_corners_color,
+                               has_uv) != 0) {
+        PyErr_SetString(PyExc_MemoryError, "mesh_info_builder_init failed");
+        return -1;
+    }
+
+    if (self->initialized)
+        mesh_info_builder_free(&self->builder);
+    self->builder = builder;
+    self->initialized = true;
+
+    return 0;
+}
+
+/**
+ * The attribute named attr_name of an initialized builder which is not in use
+ * by a MeshInfo, or -1 with an exception set.
+ */
+static int MeshInfoBuilder_appendable_attr(struct MeshInfoBuilderObject *self,
+                                           const char *attr_name) {
+    int attr;
+    for (attr = 0; attr < MESH_INFO_BUILDER_N_ATTRS; attr++) {
+        if (strcmp(attr_name, mesh_info_builder_attrs[attr].name) == 0)
+            break;
+    }
+    if (attr == MESH_INFO_BUILDER_N_ATTRS) {
+        PyErr_Format(PyExc_ValueError, "Unknown attribute %s", attr_name);
+        return -1;
+    }
+
+    if (!self->initialized) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "MeshInfoBuilder is not initialized");
+        return -1;
+    }
+    if (self->frozen) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "MeshInfoBuilder is in use by a MeshInfo");
+        return -1;
+    }
+    return attr;
+}
+
+static PyObject *MeshInfoBuilder_append(PyObject *_self, PyObject *args) {
+    struct MeshInfoBuilderObject *self = (struct MeshInfoBuilderObject *)_self;
+    const char *attr_name;
+    PyObject *buf;
+
+    if (!PyArg_ParseTuple(args, "sO", &attr_name, &buf))
+        return NULL;
+
+    int attr = MeshInfoBuilder_appendable_attr(self, attr_name);
+    if (attr < 0)
+        return NULL;
+
+    Py_buffer view;
+    int res = mesh_info_builder_attrs[attr].is_uint
+                  ? converter_contiguous_uint_buffer(buf, &view)
+                  : converter_contiguous_float_buffer(buf, &view);
+    if (res == 0)
+        return NULL;
+
+    Py_ssize_t len = view.shape[0];
+    res = mesh_info_builder_append(&self->builder, attr, view.buf, len);
+    PyBuffer_Release(&view);
+
+    if (res != 0) {
+        PyErr_Format(PyExc_ValueError,
+                     "Cannot append %zd values to %s, see logs", len,
+                     attr_name);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *MeshInfoBuilder_append_view(PyObject *_self, PyObject *args) {
+    struct MeshInfoBuilderObject *self = (struct MeshInfoBuilderObject *)_self;
+    const char *attr_name;
+    Py_ssize_t len;
+
+    if (!PyArg_ParseTuple(args, "sn", &attr_name, &len))
+        return NULL;
+
+    int attr = MeshInfoBuilder_appendable_attr(self, attr_name);
+    if (attr < 0)
+        return NULL;
+    if (len < 0) {
+        PyErr_SetString(PyExc_ValueError, "Negative len");
+        return NULL;
+    }
+
+    void *range = mesh_info_builder_append_range(&self->builder, attr, len);
+    if (range == NULL) {
+        PyErr_Format(PyExc_ValueError,
+                     "Cannot append %zd values to %s, see logs", len,
+                     attr_name);
+        return NULL;
+    }
+
+    // PyMemoryView_FromObject gets the buffer of the range from
+    // MeshInfoBuilder_getbuffer, and the memoryview keeps self alive
+    self->pending_buf = range;
+    self->pending_len = len;
+    self->pending_is_uint = mesh_info_builder_attrs[attr].is_uint;
+    PyObject *view = PyMemoryView_FromObject(_self);
+    self->pending_buf = NULL;
+    return view;
+}
+
+/**
+ * Only for append_view: exports the range it appended, as a one-dimensional
+ * writable buffer of floats or unsigned ints.
+ */
+static int MeshInfoBuilder_getbuffer(PyObject *_self, Py_buffer *view,
+                                     int flags) {
+    struct MeshInfoBuilderObject *self = (struct MeshInfoBuilderObject *)_self;
+
+    if (self->pending_buf == NULL) {
+        PyErr_SetString(PyExc_BufferError,
+                        "MeshInfoBuilder buffers are only available from "
+                        "append_view");
+        view->obj = NULL;
+        return -1;
+    }
+
+    // the shape is read from view->internal, freed by
+    // MeshInfoBuilder_releasebuffer
+    Py_ssize_t *shape = PyMem_Malloc(sizeof(Py_ssize_t));
+    if (shape == NULL) {
+        PyErr_NoMemory();
+        view->obj = NULL;
+        return -1;
+    }
+    *shape = self->pending_len;
+
+    view->buf = self->pending_buf;
+    Py_INCREF(_self);
+    view->obj = _self;
+    view->len = self->pending_len * sizeof(float);
+    view->readonly = 0;
+    view->itemsize = sizeof(float);
+    view->format = NULL;
+    if (flags & PyBUF_FORMAT)
+        view->format = self->pending_is_uint ? "I" : "f";
+    view->ndim = 1;
+    view->shape = shape;
+    view->strides = NULL;
+    view->suboffsets = NULL;
+    view->internal = shape;
+
+    self->n_exports++;
+    return 0;
+}
+
+static void MeshInfoBuilder_releasebuffer(PyObject *_self, Py_buffer *view) {
+    struct MeshInfoBuilderObject *self = (struct MeshInfoBuilderObject *)_self;
+
+    PyMem_Free(view->internal);
+    self->n_exports--;
+}
+
+static PyBufferProcs MeshInfoBuilder_as_buffer = {
+    .bf_getbuffer = MeshInfoBuilder_getbuffer,
+    .bf_releasebuffer = MeshInfoBuilder_releasebuffer,
+};
+
+static PyMethodDef MeshInfoBuilder_methods[] = {
+    {"append", MeshInfoBuilder_append, METH_VARARGS,
+     "Append the next values of an attribute"},
+    {"append_view", MeshInfoBuilder_append_view, METH_VARARGS,
+     "Append the next values of an attribute, returning a memoryview to set "
+     "them"},
+    {"create_MeshInfo", MeshInfoBuilder_create_MeshInfo, METH_VARARGS,
+     "Create a MeshInfo from the appended data and some of the triangles"},
+    {NULL} /* Sentinel */
+};
+
+PyTypeObject MeshInfoBuilderType = {
+    .ob_base = PyVarObject_HEAD_INIT(NULL, 0)
+
+                   .tp_name = "dragex_backend.MeshInfoBuilder",
+    .tp_doc = PyDoc_STR("mesh data appended in chunks, shared by MeshInfos"),
+    .tp_basicsize = sizeof(struct MeshInfoBuilderObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = MeshInfoBuilder_new,
+    .tp_init = MeshInfoBuilder_init,
+    .tp_dealloc = MeshInfoBuilder_dealloc,
+    .tp_methods = MeshInfoBuilder_methods,
+    .tp_as_buffer = &MeshInfoBuilder_as_buffer,
+};
@@ -2,9 +2,9 @@
 #include <Python.h>
 
 #include <assert.h>
-#include <errno.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "converters.h"
 #include "objs.h"
@@ -13,6 +13,21 @@
 
 #include "../exporter.h"
 
+static void release_MeshInfoBufferViews(struct MeshInfoBufferViews *views) {
+    Py_buffer *all_views[] = {
+        &views->vertices_co,   &views->loops_vertex_index,
+        &views->loops_normal,  &views->corners_color,
+        &views->points_color,  &views->loops_uv,
+        &views->corners_material_index,
+    };
+    for (size_t i = 0; i < sizeof(all_views) / sizeof(all_views[0]); i++) {
+        if (all_views[i]->buf != NULL) {
+            PyBuffer_Release(all_views[i]);
+            all_views[i]->buf = NULL;
+        }
+    }
+}
+
 static void MeshInfo_dealloc(PyObject *_self) {
     struct MeshInfoObject *self = (struct MeshInfoObject *)_self;
 
@@ -29,6 +44,10 @@ static void MeshInfo_dealloc(PyObject *_self) {
         free_create_MeshInfo_from_buffers(self->mesh);
     }
 
+    // after freeing the mesh, which references the buffers
+    release_MeshInfoBufferViews(&self->views);
+    Py_XDECREF(self->builder);
+
     Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
@@ -41,73 +60,266 @@ static PyObject *MeshInfo_new(PyTypeObject *type, PyObject *args,
     self = (struct MeshInfoObject *)type->tp_alloc(type, 0);
     if (self != NULL) {
         self->image_objects = NULL;
+        // views are zeroed by tp_alloc, so .buf is NULL
+        self->builder = NULL;
         self->mesh = NULL;
     }
     return (PyObject *)self;
 }
 
+/**
+ * The returned strings are owned by limb_to_matrix_map_string_objects.
+ * Sets an exception and frees limb_to_matrix_map_string_objects on failure.
+ */
+static const char **make_limb_to_matrix_map(
+    struct StringSequenceInfo *limb_to_matrix_map_string_objects) {
+    const char **limb_to_matrix_map =
+        malloc(sizeof(char *) * limb_to_matrix_map_string_objects->len);
+    if (limb_to_matrix_map == NULL) {
+        PyErr_SetString(PyExc_Exception, "malloc limb_to_matrix_map failed");
+        free_StringSequenceInfo(limb_to_matrix_map_string_objects);
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < limb_to_matrix_map_string_objects->len; i++) {
+        if (limb_to_matrix_map_string_objects->buffer[i] != NULL) {
+            limb_to_matrix_map[i] = PyUnicode_AsUTF8AndSize(
+                limb_to_matrix_map_string_objects->buffer[i], NULL);
+        } else {
+            limb_to_matrix_map[i] = NULL;
+        }
+    }
+    return limb_to_matrix_map;
+}
+
 static PyObject *MeshInfo_write_c(PyObject *_self, PyObject *args) {
     struct MeshInfoObject *self = (struct MeshInfoObject *)_self;
     int fd;
     struct StringSequenceInfo limb_to_matrix_map_string_objects;
+    PyObject *vtx_pool_obj = Py_None, *mat_registry_obj = Py_None;
+    int diff_mat_state = 0, optimize_draw_order = 0;
+    const char *ucode_name = "F3DEX2";
+
+    if (!PyArg_ParseTuple(args, "iO&|OOpps", &fd,
+                          converter_string_or_None_sequence,
+                          &limb_to_matrix_map_string_objects, &vtx_pool_obj,
+                          &mat_registry_obj, &diff_mat_state,
+                          &optimize_draw_order, &ucode_name))
+        return NULL;
 
-    if (!PyArg_ParseTuple(args, "iO&", &fd, converter_string_or_None_sequence,
-                          &limb_to_matrix_map_string_objects))
+    const struct F3DUcodeProfile *ucode = f3d_ucode_profile_by_name(ucode_name);
+    if (ucode == NULL) {
+        PyErr_Format(PyExc_ValueError, "Unknown microcode %s", ucode_name);
+        free_StringSequenceInfo(&limb_to_matrix_map_string_objects);
         return NULL;
+    }
+
+    unsigned int options = 0;
+    if (diff_mat_state)
+        options |= F3D_C_DIFF_MAT_STATE;
+    if (optimize_draw_order)
+        options |= F3D_C_OPTIMIZE_DRAW_ORDER;
 
-    FILE *f = fdopen(dup(fd), "w");
-    if (f == NULL) {
+    if (vtx_pool_obj != Py_None &&
+        !PyObject_TypeCheck(vtx_pool_obj, &VtxPoolType)) {
+        PyErr_Format(PyExc_TypeError, "vtx_pool is not None or a %s",
+                     VtxPoolType.tp_name);
+        free_StringSequenceInfo(&limb_to_matrix_map_string_objects);
+        return NULL;
+    }
+    if (mat_registry_obj != Py_None &&
+        !PyObject_TypeCheck(mat_registry_obj, &MaterialRegistryType)) {
+        PyErr_Format(PyExc_TypeError, "mat_registry is not None or a %s",
+                     MaterialRegistryType.tp_name);
         free_StringSequenceInfo(&limb_to_matrix_map_string_objects);
-        PyErr_Format(PyExc_IOError, "Failed to open fd for writing. fdopen: %s",
-                     strerror(errno));
         return NULL;
     }
 
+    struct F3DVtxPool *vtx_pool = NULL;
+    struct F3DMatRegistry *mat_registry = NULL;
+    if (vtx_pool_obj != Py_None) {
+        vtx_pool = VtxPool_acquire((struct VtxPoolObject *)vtx_pool_obj);
+        if (vtx_pool == NULL) {
+            free_StringSequenceInfo(&limb_to_matrix_map_string_objects);
+            return NULL;
+        }
+    }
+    if (mat_registry_obj != Py_None) {
+        mat_registry = MaterialRegistry_acquire(
+            (struct MaterialRegistryObject *)mat_registry_obj);
+        if (mat_registry == NULL) {
+            if (vtx_pool != NULL)
+                VtxPool_release((struct VtxPoolObject *)vtx_pool_obj);
+            free_StringSequenceInfo(&limb_to_matrix_map_string_objects);
+            return NULL;
+        }
+    }
+
     const char **limb_to_matrix_map =
-        malloc(sizeof(char *) * limb_to_matrix_map_string_objects.len);
+        make_limb_to_matrix_map(&limb_to_matrix_map_string_objects);
     if (limb_to_matrix_map == NULL) {
-        PyErr_SetString(PyExc_Exception, "malloc limb_to_matrix_map failed");
-        free_StringSequenceInfo(&limb_to_matrix_map_string_objects);
-        fclose(f);
+        if (vtx_pool != NULL)
+            VtxPool_release((struct VtxPoolObject *)vtx_pool_obj);
+        if (mat_registry != NULL)
+            MaterialRegistry_release(
+                (struct MaterialRegistryObject *)mat_registry_obj);
         return NULL;
     }
-    for (Py_ssize_t i = 0; i < limb_to_matrix_map_string_objects.len; i++) {
-        if (limb_to_matrix_map_string_objects.buffer[i] != NULL) {
-            limb_to_matrix_map[i] = PyUnicode_AsUTF8AndSize(
-                limb_to_matrix_map_string_objects.buffer[i], NULL);
-        } else {
-            limb_to_matrix_map[i] = NULL;
+
+    char *dl_name = NULL;
+    struct F3DDLCost cost;
+    struct TextBuffer b;
+    int res, write_res = 0;
+
+    text_buffer_init(&b);
+
+    // The strings in limb_to_matrix_map are kept alive by
+    // limb_to_matrix_map_string_objects, and the mesh is only read from.
+    // vtx_pool_obj and mat_registry_obj are kept alive by args, and marked in
+    // use.
+    Py_BEGIN_ALLOW_THREADS;
+    res = write_mesh_info_to_f3d_c(self->mesh, limb_to_matrix_map,
+                                   limb_to_matrix_map_string_objects.len,
+                                   vtx_pool, mat_registry, ucode, options,
+                                   &b, &dl_name, &cost);
+    if (res == 0)
+        write_res = text_buffer_write_to_fd(&b, fd);
+    Py_END_ALLOW_THREADS;
+
+    if (vtx_pool != NULL)
+        VtxPool_release((struct VtxPoolObject *)vtx_pool_obj);
+    if (mat_registry != NULL)
+        MaterialRegistry_release(
+            (struct MaterialRegistryObject *)mat_registry_obj);
+    text_buffer_free(&b);
+    free_StringSequenceInfo(&limb_to_matrix_map_string_objects);
+    free(limb_to_matrix_map);
+
+    if (res != 0) {
+        PyErr_SetString(PyExc_Exception, "write_mesh_info_to_f3d_c failed");
+        free(dl_name);
+        return NULL;
+    }
+    if (write_res != 0) {
+        PyErr_SetString(PyExc_IOError, "Failed to write to fd");
+        free(dl_name);
+        return NULL;
+    }
+
+    PyObject *res_obj = Py_BuildValue(
+        "(s{sKsKsKsKsKsKsdsdsdsd})", dl_name, "gfx_bytes", cost.n_gfx * 8,
+        "vtx_bytes", cost.vtx_bytes, "vertex_loads", cost.n_vertex_loads,
+        "matrix_loads", cost.n_matrix_loads, "tex_load_bytes",
+        cost.tex_load_bytes, "tris", cost.n_tris, "fill_area_1cycle",
+        cost.fill_area_1cycle, "fill_area_2cycle", cost.fill_area_2cycle,
+        "rsp_cost", f3d_dl_cost_rsp(&cost), "rdp_cost",
+        f3d_dl_cost_rdp(&cost));
+
+    free(dl_name);
+
+    return res_obj;
+}
+
+static PyObject *F3DBin_symbols_to_list(struct F3DBin *bin) {
+    PyObject *list = PyList_New(bin->n_symbols);
+    if (list == NULL)
+        return NULL;
+    for (size_t i = 0; i < bin->n_symbols; i++) {
+        PyObject *item = Py_BuildValue("(sn)", bin->symbols[i].name,
+                                       (Py_ssize_t)bin->symbols[i].offset);
+        if (item == NULL) {
+            Py_DECREF(list);
+            return NULL;
         }
+        PyList_SET_ITEM(list, i, item);
     }
+    return list;
+}
+
+static PyObject *F3DBin_relocations_to_list(struct F3DBin *bin) {
+    PyObject *list = PyList_New(bin->n_relocations);
+    if (list == NULL)
+        return NULL;
+    for (size_t i = 0; i < bin->n_relocations; i++) {
+        PyObject *item = Py_BuildValue("(ns)",
+                                       (Py_ssize_t)bin->relocations[i].offset,
+                                       bin->relocations[i].symbol);
+        if (item == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+}
+
+static PyObject *MeshInfo_write_bin(PyObject *_self, PyObject *args) {
+    struct MeshInfoObject *self = (struct MeshInfoObject *)_self;
+    int fd;
+    struct StringSequenceInfo limb_to_matrix_map_string_objects;
+
+    if (!PyArg_ParseTuple(args, "iO&", &fd, converter_string_or_None_sequence,
+                          &limb_to_matrix_map_string_objects))
+        return NULL;
+
+    const char **limb_to_matrix_map =
+        make_limb_to_matrix_map(&limb_to_matrix_map_string_objects);
+    if (limb_to_matrix_map == NULL)
+        return NULL;
 
     char *dl_name = NULL;
-    int res = write_mesh_info_to_f3d_c(self->mesh, limb_to_matrix_map,
-                                       limb_to_matrix_map_string_objects.len, f,
-                                       &dl_name);
+    struct F3DBin bin;
+    int res, write_res = 0;
+
+    f3d_bin_init(&bin);
+
+    // see MeshInfo_write_c
+    Py_BEGIN_ALLOW_THREADS;
+    res = write_mesh_info_to_f3d_bin(self->mesh, limb_to_matrix_map,
+                                     limb_to_matrix_map_string_objects.len,
+                                     &bin, &dl_name);
+    if (res == 0)
+        write_res = text_buffer_write_to_fd(&bin.data, fd);
+    Py_END_ALLOW_THREADS;
 
     free_StringSequenceInfo(&limb_to_matrix_map_string_objects);
     free(limb_to_matrix_map);
-    fclose(f);
 
     if (res != 0) {
-        PyErr_SetString(PyExc_Exception, "write_mesh_info_to_f3d_c failed");
+        PyErr_SetString(PyExc_Exception, "write_mesh_info_to_f3d_bin failed");
+        f3d_bin_free(&bin);
+        free(dl_name);
+        return NULL;
+    }
+    if (write_res != 0) {
+        PyErr_SetString(PyExc_IOError, "Failed to write to fd");
+        f3d_bin_free(&bin);
         free(dl_name);
         return NULL;
     }
 
-    PyObject *dl_name_obj = PyUnicode_FromString(dl_name);
+    PyObject *symbols = F3DBin_symbols_to_list(&bin);
+    PyObject *relocations =
+        symbols == NULL ? NULL : F3DBin_relocations_to_list(&bin);
 
-    free(dl_name);
+    f3d_bin_free(&bin);
 
-    if (dl_name_obj == NULL) {
+    if (relocations == NULL) {
+        Py_XDECREF(symbols);
+        free(dl_name);
         return NULL;
     }
 
-    return dl_name_obj;
+    PyObject *ret = Py_BuildValue("(sNN)", dl_name, symbols, relocations);
+
+    free(dl_name);
+
+    return ret;
 }
 
 static PyMethodDef MeshInfo_methods[] = {
     {"write_c", MeshInfo_write_c, METH_VARARGS, "Write mesh to a .c file"},
+    {"write_bin", MeshInfo_write_bin, METH_VARARGS,
+     "Write mesh as binary F3DEX2 display lists"},
     {NULL} /* Sentinel */
 };
 
@@ -179,42 +391,22 @@ int converter_CornerMaterialInfoObject_or_None_sequence(PyObject *obj,
     return res;
 }
 
-PyObject *create_MeshInfo(PyObject *self, PyObject *args) {
-    char *mesh_name;
-    Py_buffer buf_vertices_co_view, buf_triangles_loops_view,
-        buf_triangles_material_index_view, buf_loops_vertex_index_view,
-        buf_loops_normal_view, buf_corners_color_view, buf_points_color_view,
-        buf_loops_uv_view, buf_corners_material_index_view;
-    struct MaterialInfoObjectSequenceInfo material_info_objects;
-    PyObject *_default_material_info;
-    struct CornerMaterialInfoObjectSequenceInfo corner_material_info_objects;
-    PyObject *_default_corner_material_info;
-
-    if (!PyArg_ParseTuple(
-            args, "sO&O&O&O&O&O&O&O&O&O&O!O&O!",                         //
-            &mesh_name,                                                  //
-            converter_contiguous_float_buffer, &buf_vertices_co_view,    //
-            converter_contiguous_uint_buffer, &buf_triangles_loops_view, //
-            converter_contiguous_uint_buffer,
-            &buf_triangles_material_index_view,
-            converter_contiguous_uint_buffer, &buf_loops_vertex_index_view, //
-            converter_contiguous_float_buffer, &buf_loops_normal_view,      //
-            converter_contiguous_float_buffer_optional,
-            &buf_corners_color_view, //
-            converter_contiguous_float_buffer_optional,
-            &buf_points_color_view,                                         //
-            converter_contiguous_float_buffer_optional, &buf_loops_uv_view, //
-            converter_contiguous_uint_buffer,
-            &buf_corners_material_index_view, //
-            converter_MaterialInfoObject_or_None_sequence,
-            &material_info_objects,                     //
-            &MaterialInfoType, &_default_material_info, //
-            converter_CornerMaterialInfoObject_or_None_sequence,
-            &corner_material_info_objects,                          //
-            &CornerMaterialInfoType, &_default_corner_material_info //
-            ))
-        return NULL;
-
+/**
+ * Shared by create_MeshInfo and MeshInfoBuilder.create_MeshInfo. The mesh
+ * buffers are read from builder_object if it is not NULL, the triangles being
+ * those listed in buf_triangles_view (or all if its buf is NULL). Or else they
+ * are read from views and the two triangle views. Takes ownership of the views
+ * and sequence infos.
+ */
+static PyObject *new_MeshInfoObject(
+    char *mesh_name, struct MeshInfoBufferViews views,
+    struct MeshInfoBuilderObject *builder_object, Py_buffer buf_triangles_view,
+    Py_buffer buf_triangles_loops_view,
+    Py_buffer buf_triangles_material_index_view,
+    struct MaterialInfoObjectSequenceInfo material_info_objects,
+    PyObject *_default_material_info,
+    struct CornerMaterialInfoObjectSequenceInfo corner_material_info_objects,
+    PyObject *_default_corner_material_info) {
     struct MaterialInfoObject *default_material_info =
         (struct MaterialInfoObject *)_default_material_info;
 
@@ -250,18 +442,6 @@ PyObject *create_MeshInfo(PyObject *self, PyObject *args) {
             default_material_info->image_objects[j];
     }
 
-    // This decreases the reference counts of the MaterialInfoObject instances,
-    // which hold the MaterialInfo data as a substruct. This is fine because
-    // 1) the MaterialInfoObject are still referenced elsewhere due to being
-    // passed as arguments, so they are not immediately deleted
-    // 2) create_MeshInfo_from_buffers copies the MaterialInfo data, so we don't
-    // actually need to keep references
-    //
-    // This also decreases the reference counts of the image_objects before we
-    // increase it below, but that's fine as the objects are still referenced
-    // elsewhere due to being passed as arguments.
-    free_MaterialInfoSequenceInfo(&material_info_objects);
-
     struct CornerMaterialInfoObject *default_corner_material_info =
         (struct CornerMaterialInfoObject *)_default_corner_material_info;
 
@@ -279,55 +459,75 @@ PyObject *create_MeshInfo(PyObject *self, PyObject *args) {
                 : &corner_material_info_objects.buffer[i]->corner_mat_info;
     }
 
-    // Same comment as on free_MaterialInfoSequenceInfo above: reference counts
-    // are decreased but the objects are still referenced elsewhere and we copy
-    // the data before the function returns.
-    free_CornerMaterialInfoSequenceInfo(&corner_material_info_objects);
-
     struct MeshInfo *mesh;
 
-    mesh = create_MeshInfo_from_buffers(
-        mesh_name,                                                       //
-        buf_vertices_co_view.buf, buf_vertices_co_view.shape[0],         //
-        buf_triangles_loops_view.buf, buf_triangles_loops_view.shape[0], //
-        buf_triangles_material_index_view.buf,
-        buf_triangles_material_index_view.shape[0], //
-        buf_loops_vertex_index_view.buf,
-        buf_loops_vertex_index_view.shape[0],                      //
-        buf_loops_normal_view.buf, buf_loops_normal_view.shape[0], //
-        buf_corners_color_view.buf,
-        buf_corners_color_view.buf == NULL ? 0
-                                           : buf_corners_color_view.shape[0], //
-        buf_points_color_view.buf,
-        buf_points_color_view.buf == NULL ? 0
-                                          : buf_points_color_view.shape[0], //
-        buf_loops_uv_view.buf,
-        buf_loops_uv_view.buf == NULL ? 0 : buf_loops_uv_view.shape[0], //
-        buf_corners_material_index_view.buf,
-        buf_corners_material_index_view.shape[0],       //
-        material_infos, n_material_infos,               //
-        &default_material_info->mat_info,               //
-        corner_material_infos, n_corner_material_infos, //
-        &default_corner_material_info->corner_mat_info  //
-    );
-
-    PyBuffer_Release(&buf_vertices_co_view);
-    PyBuffer_Release(&buf_triangles_loops_view);
-    PyBuffer_Release(&buf_triangles_material_index_view);
-    PyBuffer_Release(&buf_loops_vertex_index_view);
-    PyBuffer_Release(&buf_loops_normal_view);
-    if (buf_corners_color_view.buf != NULL)
-        PyBuffer_Release(&buf_corners_color_view);
-    if (buf_points_color_view.buf != NULL)
-        PyBuffer_Release(&buf_points_color_view);
-    if (buf_loops_uv_view.buf != NULL)
-        PyBuffer_Release(&buf_loops_uv_view);
+    // The GIL is released while building the mesh, so other threads can build
+    // other meshes. Everything used below is either C-owned or kept alive by
+    // the references held by material_info_objects,
+    // corner_material_info_objects and the buffer views or builder_object.
+    Py_BEGIN_ALLOW_THREADS;
+    if (builder_object != NULL)
+        mesh = mesh_info_builder_create_MeshInfo(
+            &builder_object->builder, mesh_name, //
+            buf_triangles_view.buf,
+            buf_triangles_view.buf == NULL ? 0
+                                           : buf_triangles_view.shape[0], //
+            material_infos, n_material_infos,               //
+            &default_material_info->mat_info,               //
+            corner_material_infos, n_corner_material_infos, //
+            &default_corner_material_info->corner_mat_info  //
+        );
+    else
+        mesh = create_MeshInfo_from_buffers(
+            mesh_name,                                                       //
+            views.vertices_co.buf, views.vertices_co.shape[0],               //
+            buf_triangles_loops_view.buf, buf_triangles_loops_view.shape[0], //
+            buf_triangles_material_index_view.buf,
+            buf_triangles_material_index_view.shape[0],                     //
+            views.loops_vertex_index.buf, views.loops_vertex_index.shape[0], //
+            views.loops_normal.buf, views.loops_normal.shape[0],             //
+            views.corners_color.buf,
+            views.corners_color.buf == NULL ? 0
+                                            : views.corners_color.shape[0], //
+            views.points_color.buf,
+            views.points_color.buf == NULL ? 0 : views.points_color.shape[0], //
+            views.loops_uv.buf,
+            views.loops_uv.buf == NULL ? 0 : views.loops_uv.shape[0], //
+            views.corners_material_index.buf,
+            views.corners_material_index.shape[0],          //
+            material_infos, n_material_infos,               //
+            &default_material_info->mat_info,               //
+            corner_material_infos, n_corner_material_infos, //
+            &default_corner_material_info->corner_mat_info  //
+        );
+    Py_END_ALLOW_THREADS;
+
+    // This decreases the reference counts of the MaterialInfoObject instances,
+    // which hold the MaterialInfo data as a substruct. This is fine because
+    // create_MeshInfo_from_buffers copied the MaterialInfo data, so we don't
+    // need to keep references.
+    //
+    // This also decreases the reference counts of the image_objects before we
+    // increase it below, but that's fine as the objects are still referenced
+    // elsewhere due to being passed as arguments.
+    free_MaterialInfoSequenceInfo(&material_info_objects);
+    free_CornerMaterialInfoSequenceInfo(&corner_material_info_objects);
+
+    // the triangles are copied by create_MeshInfo_from_buffers
+    if (builder_object != NULL) {
+        if (buf_triangles_view.buf != NULL)
+            PyBuffer_Release(&buf_triangles_view);
+    } else {
+        PyBuffer_Release(&buf_triangles_loops_view);
+        PyBuffer_Release(&buf_triangles_material_index_view);
+    }
     free(material_infos);
     free(corner_material_infos);
 
     if (mesh == NULL) {
         PyErr_SetString(PyExc_MemoryError,
                         "create_MeshInfo_from_buffers failed");
+        release_MeshInfoBufferViews(&views);
         free(image_objects);
         return NULL;
     }
@@ -341,6 +541,8 @@ PyObject *create_MeshInfo(PyObject *self, PyObject *args) {
     mesh_info_object = PyObject_New(struct MeshInfoObject, &MeshInfoType);
     if (mesh_info_object == NULL) {
         PyErr_SetString(PyExc_MemoryError, "PyObject_New failed");
+        free_create_MeshInfo_from_buffers(mesh);
+        release_MeshInfoBufferViews(&views);
         free(image_objects);
         return NULL;
     }
@@ -358,7 +560,109 @@ PyObject *create_MeshInfo(PyObject *self, PyObject *args) {
 
     mesh_info_object->image_objects = image_objects;
     mesh_info_object->len_image_objects = len_image_objects;
+    mesh_info_object->views = views;
+    Py_XINCREF(builder_object);
+    mesh_info_object->builder = (PyObject *)builder_object;
     mesh_info_object->mesh = mesh;
 
     return (PyObject *)mesh_info_object;
 }
+
+PyObject *create_MeshInfo(PyObject *self, PyObject *args) {
+    char *mesh_name;
+    Py_buffer buf_triangles_loops_view, buf_triangles_material_index_view;
+    // the mesh references these buffers instead of copying them
+    struct MeshInfoBufferViews views;
+    struct MaterialInfoObjectSequenceInfo material_info_objects;
+    PyObject *_default_material_info;
+    struct CornerMaterialInfoObjectSequenceInfo corner_material_info_objects;
+    PyObject *_default_corner_material_info;
+
+    if (!PyArg_ParseTuple(
+            args, "sO&O&O&O&O&O&O&O&O&O&O!O&O!",                         //
+            &mesh_name,                                                  //
+            converter_contiguous_float_buffer, &views.vertices_co,    //
+            converter_contiguous_uint_buffer, &buf_triangles_loops_view, //
+            converter_contiguous_uint_buffer,
+            &buf_triangles_material_index_view,
+            converter_contiguous_uint_buffer, &views.loops_vertex_index, //
+            converter_contiguous_float_buffer, &views.loops_normal,      //
+            converter_contiguous_float_buffer_optional,
+            &views.corners_color, //
+            converter_contiguous_float_buffer_optional,
+            &views.points_color,                                         //
+            converter_contiguous_float_buffer_optional, &views.loops_uv, //
+            converter_contiguous_uint_buffer,
+            &views.corners_material_index, //
+            converter_MaterialInfoObject_or_None_sequence,
+            &material_info_objects,                     //
+            &MaterialInfoType, &_default_material_info, //
+            converter_CornerMaterialInfoObject_or_None_sequence,
+            &corner_material_info_objects,                          //
+            &CornerMaterialInfoType, &_default_corner_material_info //
+            ))
+        return NULL;
+
+    Py_buffer buf_triangles_view;
+    memset(&buf_triangles_view, 0, sizeof(buf_triangles_view));
+
+    return new_MeshInfoObject(
+        mesh_name, views, NULL, buf_triangles_view, buf_triangles_loops_view,
+        buf_triangles_material_index_view, material_info_objects,
+        _default_material_info, corner_material_info_objects,
+        _default_corner_material_info);
+}
+
+PyObject *MeshInfoBuilder_create_MeshInfo(PyObject *_self, PyObject *args) {
+    struct MeshInfoBuilderObject *self = (struct MeshInfoBuilderObject *)_self;
+    char *mesh_name;
+    Py_buffer buf_triangles_view;
+    struct MaterialInfoObjectSequenceInfo material_info_objects;
+    PyObject *_default_material_info;
+    struct CornerMaterialInfoObjectSequenceInfo corner_material_info_objects;
+    PyObject *_default_corner_material_info;
+
+    if (!PyArg_ParseTuple(
+            args, "sO&O&O!O&O!",                                            //
+            &mesh_name,                                                     //
+            converter_contiguous_uint_buffer_optional, &buf_triangles_view, //
+            converter_MaterialInfoObject_or_None_sequence,
+            &material_info_objects,                     //
+            &MaterialInfoType, &_default_material_info, //
+            converter_CornerMaterialInfoObject_or_None_sequence,
+            &corner_material_info_objects,                          //
+            &CornerMaterialInfoType, &_default_corner_material_info //
+            ))
+        return NULL;
+
+    if (!self->initialized || !mesh_info_builder_is_complete(&self->builder))
+        PyErr_SetString(PyExc_ValueError,
+                        "MeshInfoBuilder has not been appended to completely");
+    else if (self->n_exports != 0)
+        // the views could still change the buffers the MeshInfo references
+        PyErr_SetString(PyExc_BufferError,
+                        "MeshInfoBuilder has views from append_view");
+    if (PyErr_Occurred()) {
+        if (buf_triangles_view.buf != NULL)
+            PyBuffer_Release(&buf_triangles_view);
+        free_MaterialInfoSequenceInfo(&material_info_objects);
+        free_CornerMaterialInfoSequenceInfo(&corner_material_info_objects);
+        return NULL;
+    }
+
+    // the MeshInfo references the buffers, which must not change from now on
+    self->frozen = true;
+
+    struct MeshInfoBufferViews views;
+    memset(&views, 0, sizeof(views));
+    Py_buffer buf_triangles_loops_view, buf_triangles_material_index_view;
+    memset(&buf_triangles_loops_view, 0, sizeof(buf_triangles_loops_view));
+    memset(&buf_triangles_material_index_view, 0,
+           sizeof(buf_triangles_material_index_view));
+
+    return new_MeshInfoObject(
+        mesh_name, views, self, buf_triangles_view, buf_triangles_loops_view,
+        buf_triangles_material_index_view, material_info_objects,
+        _default_material_info, corner_material_info_objects,
+        _default_corner_material_info);
+}
@@ -74,11 +74,26 @@ struct CornerMaterialInfoObject {
 
 extern PyTypeObject CornerMaterialInfoType;
 
+// Views on the buffers a MeshInfo references (see struct MeshInfoBuffers)
+struct MeshInfoBufferViews {
+    Py_buffer vertices_co;
+    Py_buffer loops_vertex_index;
+    Py_buffer loops_normal;
+    Py_buffer corners_color; // optional, .buf is NULL if None
+    Py_buffer points_color;  // optional, .buf is NULL if None
+    Py_buffer loops_uv;      // optional, .buf is NULL if None
+    Py_buffer corners_material_index;
+};
+
 struct MeshInfoObject {
     PyObject_HEAD
 
         struct MaterialInfoImageObject **image_objects;
     size_t len_image_objects;
+    // kept until dealloc since mesh points into the buffers
+    struct MeshInfoBufferViews views;
+    // or NULL, the MeshInfoBuilderObject owning the buffers instead of views
+    PyObject *builder;
     struct MeshInfo *mesh;
 };
 
@@ -86,4 +101,57 @@ extern PyTypeObject MeshInfoType;
 
 PyObject *create_MeshInfo(PyObject *self, PyObject *args);
 
+struct MeshInfoBuilderObject {
+    PyObject_HEAD
+
+        struct MeshInfoBuilder builder;
+    bool initialized;
+    // set once a MeshInfo references the buffers, which then can't change
+    bool frozen;
+    // the range append_view is getting a buffer of, see
+    // MeshInfoBuilder_getbuffer
+    void *pending_buf;
+    Py_ssize_t pending_len;
+    bool pending_is_uint;
+    // the buffers gotten by append_view that are not released yet
+    Py_ssize_t n_exports;
+};
+
+extern PyTypeObject MeshInfoBuilderType;
+
+/** Implements MeshInfoBuilder.create_MeshInfo */
+PyObject *MeshInfoBuilder_create_MeshInfo(PyObject *self, PyObject *args);
+
+struct VtxPoolObject {
+    PyObject_HEAD
+
+        struct F3DVtxPool *pool;
+    // set while the pool is used with the GIL released
+    bool in_use;
+};
+
+extern PyTypeObject VtxPoolType;
+
+/**
+ * Mark the pool as in use, to be called with the GIL held.
+ * Sets an exception and returns NULL if it already is.
+ */
+struct F3DVtxPool *VtxPool_acquire(struct VtxPoolObject *self);
+void VtxPool_release(struct VtxPoolObject *self);
+
+struct MaterialRegistryObject {
+    PyObject_HEAD
+
+        struct F3DMatRegistry *reg;
+    // set while the registry is used with the GIL released
+    bool in_use;
+};
+
+extern PyTypeObject MaterialRegistryType;
+
+/** See VtxPool_acquire */
+struct F3DMatRegistry *
+MaterialRegistry_acquire(struct MaterialRegistryObject *self);
+void MaterialRegistry_release(struct MaterialRegistryObject *self);
+
 #endif
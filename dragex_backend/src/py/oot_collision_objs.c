@@ -97,29 +97,39 @@ static PyObject *OoTCollisionMesh_write_c(PyObject *_self, PyObject *args) {
     int fd;
     const char *map_prefix_upper, *vtx_list_name, *poly_list_name,
         *surface_types_name;
+    int weld_epsilon = 0, spatial_sort = 0;
 
-    if (!PyArg_ParseTuple(args, "issss", &fd, &map_prefix_upper, &vtx_list_name,
-                          &poly_list_name, &surface_types_name))
+    if (!PyArg_ParseTuple(args, "issss|ip", &fd, &map_prefix_upper,
+                          &vtx_list_name, &poly_list_name, &surface_types_name,
+                          &weld_epsilon, &spatial_sort))
         return NULL;
 
-    FILE *f = fdopen(dup(fd), "w");
-    if (f == NULL) {
-        PyErr_Format(PyExc_IOError, "Failed to open fd for writing. fdopen: %s",
-                     strerror(errno));
-        return NULL;
-    }
-
     struct OoTCollisionBounds bounds;
-    int res = write_OoTCollisionMesh_to_c(self->mesh, map_prefix_upper,
-                                          vtx_list_name, poly_list_name,
-                                          surface_types_name, f, &bounds);
+    struct TextBuffer b;
+    int res, write_res = 0;
+
+    text_buffer_init(&b);
 
-    fclose(f);
+    // The strings are kept alive by args, and the mesh is only read from.
+    Py_BEGIN_ALLOW_THREADS;
+    res = write_OoTCollisionMesh_to_c(self->mesh, map_prefix_upper,
+                                      vtx_list_name, poly_list_name,
+                                      surface_types_name, weld_epsilon,
+                                      spatial_sort, &b, &bounds);
+    if (res == 0)
+        write_res = text_buffer_write_to_fd(&b, fd);
+    Py_END_ALLOW_THREADS;
+
+    text_buffer_free(&b);
 
     if (res != 0) {
         PyErr_SetString(PyExc_Exception, "write_OoTCollisionMesh_to_c failed");
         return NULL;
     }
+    if (write_res != 0) {
+        PyErr_SetString(PyExc_IOError, "Failed to write to fd");
+        return NULL;
+    }
 
     struct OoTCollisionBoundsObject *bounds_obj =
         PyObject_New(struct OoTCollisionBoundsObject, &OoTCollisionBoundsType);
@@ -239,13 +249,11 @@ PyObject *create_OoTCollisionMesh(PyObject *self, PyObject *args) {
                            : &materials_objects.buffer[i]->mat;
     }
 
-    // This also decreases the reference counts of the strings we keep pointers
-    // to in the materials array, but that's fine as the objects are still
-    // referenced elsewhere due to being passed as arguments.
-    free_OoTCollisionMaterialSequenceInfo(&materials_objects);
-
     struct OoTCollisionMesh *mesh;
 
+    // The materials are kept alive by materials_objects while the GIL is
+    // released.
+    Py_BEGIN_ALLOW_THREADS;
     mesh = create_OoTCollisionMesh_from_buffers(
         buf_vertices_co_view.buf, buf_vertices_co_view.shape[0],         //
         buf_triangles_loops_view.buf, buf_triangles_loops_view.shape[0], //
@@ -254,6 +262,11 @@ PyObject *create_OoTCollisionMesh(PyObject *self, PyObject *args) {
         buf_loops_vertex_index_view.buf, buf_loops_vertex_index_view.shape[0],
         materials, n_materials, //
         &default_material_info->mat);
+    Py_END_ALLOW_THREADS;
+
+    // create_OoTCollisionMesh_from_buffers copied the material names, the
+    // references are not needed anymore.
+    free_OoTCollisionMaterialSequenceInfo(&materials_objects);
 
     PyBuffer_Release(&buf_vertices_co_view);
     PyBuffer_Release(&buf_triangles_loops_view);
@@ -389,6 +402,52 @@ PyObject *join_OoTCollisionMeshes(PyObject *self, PyObject *args) {
     return (PyObject *)mesh_object;
 }
 
+PyObject *simplify_OoTCollisionMesh(PyObject *self, PyObject *args) {
+    struct OoTCollisionMeshObject *mesh_object;
+    float tolerance;
+
+    if (!PyArg_ParseTuple(args, "O!f", &OoTCollisionMeshType, &mesh_object,
+                          &tolerance))
+        return NULL;
+
+    if (!(tolerance >= 0.0f)) {
+        PyErr_SetString(PyExc_ValueError, "tolerance must not be negative");
+        return NULL;
+    }
+
+    struct OoTCollisionMesh *mesh;
+
+    // mesh_object is kept alive by args, and its mesh is only read from.
+    Py_BEGIN_ALLOW_THREADS;
+    mesh = simplify_OoTCollisionMesh_impl(mesh_object->mesh, tolerance);
+    Py_END_ALLOW_THREADS;
+
+    if (mesh == NULL) {
+        PyErr_SetString(PyExc_Exception,
+                        "simplify_OoTCollisionMesh_impl failed");
+        return NULL;
+    }
+
+    struct OoTCollisionMeshObject *simplified_object =
+        PyObject_New(struct OoTCollisionMeshObject, &OoTCollisionMeshType);
+    if (simplified_object == NULL) {
+        free_create_OoTCollisionMesh_from_buffers(mesh);
+        PyErr_SetString(PyExc_MemoryError, "PyObject_New failed");
+        return NULL;
+    }
+    if (PyObject_Init((PyObject *)simplified_object,
+                      Py_TYPE(simplified_object)) == NULL) {
+        free_create_OoTCollisionMesh_from_buffers(mesh);
+        simplified_object->mesh = NULL;
+        Py_DECREF(simplified_object);
+        return NULL;
+    }
+
+    simplified_object->mesh = mesh;
+
+    return (PyObject *)simplified_object;
+}
+
 static PyObject *OoTCollisionBounds_getmin(PyObject *_self, void *closure) {
     struct OoTCollisionBoundsObject *self =
         (struct OoTCollisionBoundsObject *)_self;
@@ -407,9 +466,57 @@ static PyObject *OoTCollisionBounds_getmax(PyObject *_self, void *closure) {
                          self->bounds.max[2]);
 }
 
+static PyObject *OoTCollisionBounds_getsubdivision(PyObject *_self,
+                                                   void *closure) {
+    struct OoTCollisionBoundsObject *self =
+        (struct OoTCollisionBoundsObject *)_self;
+    int *amount =
+        self->bounds.subdivisions[self->bounds.recommended_subdivision].amount;
+    return Py_BuildValue("(iii)", amount[0], amount[1], amount[2]);
+}
+
+static PyObject *OoTCollisionBounds_getdefault_subdivision(PyObject *_self,
+                                                           void *closure) {
+    struct OoTCollisionBoundsObject *self =
+        (struct OoTCollisionBoundsObject *)_self;
+    int *amount =
+        self->bounds.subdivisions[self->bounds.default_subdivision].amount;
+    return Py_BuildValue("(iii)", amount[0], amount[1], amount[2]);
+}
+
+static PyObject *OoTCollisionBounds_getsubdivision_stats(PyObject *_self,
+                                                         void *closure) {
+    struct OoTCollisionBoundsObject *self =
+        (struct OoTCollisionBoundsObject *)_self;
+    PyObject *list = PyList_New(self->bounds.n_subdivisions);
+    if (list == NULL)
+        return NULL;
+    for (int i = 0; i < self->bounds.n_subdivisions; i++) {
+        struct OoTCollisionSubdivisionStats *stats =
+            &self->bounds.subdivisions[i];
+        PyObject *item = Py_BuildValue(
+            "{s(iii)sIsIsfsI}", "amount", stats->amount[0], stats->amount[1],
+            stats->amount[2], "n_nodes", stats->n_nodes, "max_polys",
+            stats->max_polys, "mean_polys", stats->mean_polys, "mem_size",
+            stats->mem_size);
+        if (item == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+}
+
 static PyGetSetDef Custom_getsetters[] = {
     {"min", OoTCollisionBounds_getmin, NULL, "bounds minimum", NULL},
     {"max", OoTCollisionBounds_getmax, NULL, "bounds maximum", NULL},
+    {"subdivision", OoTCollisionBounds_getsubdivision, NULL,
+     "recommended BgCheck subdivision amounts", NULL},
+    {"default_subdivision", OoTCollisionBounds_getdefault_subdivision, NULL,
+     "BgCheck's default subdivision amounts", NULL},
+    {"subdivision_stats", OoTCollisionBounds_getsubdivision_stats, NULL,
+     "poly distribution for each candidate subdivision amounts", NULL},
     {NULL} /* Sentinel */
 };
 
@@ -30,6 +30,8 @@ PyObject *create_OoTCollisionMesh(PyObject *self, PyObject *args);
 
 PyObject *join_OoTCollisionMeshes(PyObject *self, PyObject *args);
 
+PyObject *simplify_OoTCollisionMesh(PyObject *self, PyObject *args);
+
 struct OoTCollisionBoundsObject {
     PyObject_HEAD
 
@@ -0,0 +1,140 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "objs.h"
+
+#include "../logging/logging.h"
+
+#include "../exporter.h"
+
+static void VtxPool_dealloc(PyObject *_self) {
+    struct VtxPoolObject *self = (struct VtxPoolObject *)_self;
+
+    log_trace("entry");
+
+    if (self->pool != NULL) {
+        f3d_vtx_pool_free(self->pool);
+        free(self->pool);
+    }
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *VtxPool_new(PyTypeObject *type, PyObject *args,
+                             PyObject *kwds) {
+    struct VtxPoolObject *self;
+    self = (struct VtxPoolObject *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->pool = NULL;
+        self->in_use = false;
+    }
+    return (PyObject *)self;
+}
+
+static int VtxPool_init(PyObject *_self, PyObject *args, PyObject *kwds) {
+    struct VtxPoolObject *self = (struct VtxPoolObject *)_self;
+    static char *kwlist[] = {
+        "name",
+        NULL,
+    };
+    char *name;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &name))
+        return -1;
+
+    if (self->in_use) {
+        PyErr_SetString(PyExc_RuntimeError, "VtxPool is in use");
+        return -1;
+    }
+
+    struct F3DVtxPool *pool = malloc(sizeof(struct F3DVtxPool));
+    if (pool == NULL || f3d_vtx_pool_init(pool, name) != 0) {
+        free(pool);
+        PyErr_SetString(PyExc_MemoryError, "f3d_vtx_pool_init failed");
+        return -1;
+    }
+
+    if (self->pool != NULL) {
+        f3d_vtx_pool_free(self->pool);
+        free(self->pool);
+    }
+    self->pool = pool;
+
+    return 0;
+}
+
+struct F3DVtxPool *VtxPool_acquire(struct VtxPoolObject *self) {
+    if (self->pool == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "VtxPool is not initialized");
+        return NULL;
+    }
+    if (self->in_use) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "VtxPool is in use by another thread");
+        return NULL;
+    }
+    self->in_use = true;
+    return self->pool;
+}
+
+void VtxPool_release(struct VtxPoolObject *self) { self->in_use = false; }
+
+static PyObject *VtxPool_write_c(PyObject *_self, PyObject *args) {
+    struct VtxPoolObject *self = (struct VtxPoolObject *)_self;
+    int fd;
+
+    if (!PyArg_ParseTuple(args, "i", &fd))
+        return NULL;
+
+    struct F3DVtxPool *pool = VtxPool_acquire(self);
+    if (pool == NULL)
+        return NULL;
+
+    struct TextBuffer b;
+    int res, write_res = 0;
+
+    text_buffer_init(&b);
+
+    Py_BEGIN_ALLOW_THREADS;
+    res = write_f3d_vtx_pool(&b, pool);
+    if (res == 0)
+        write_res = text_buffer_write_to_fd(&b, fd);
+    Py_END_ALLOW_THREADS;
+
+    text_buffer_free(&b);
+    VtxPool_release(self);
+
+    if (res != 0) {
+        PyErr_SetString(PyExc_Exception, "write_f3d_vtx_pool failed");
+        return NULL;
+    }
+    if (write_res != 0) {
+        PyErr_SetString(PyExc_IOError, "Failed to write to fd");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef VtxPool_methods[] = {
+    {"write_c", VtxPool_write_c, METH_VARARGS,
+     "Write the pooled vertices to a .c file"},
+    {NULL} /* Sentinel */
+};
+
+PyTypeObject VtxPoolType = {
+    .ob_base = PyVarObject_HEAD_INIT(NULL, 0)
+
+                   .tp_name = "dragex_backend.VtxPool",
+    .tp_doc = PyDoc_STR("vertices shared by the meshes written to a file"),
+    .tp_basicsize = sizeof(struct VtxPoolObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = VtxPool_new,
+    .tp_init = VtxPool_init,
+    .tp_dealloc = VtxPool_dealloc,
+    .tp_methods = VtxPool_methods,
+};
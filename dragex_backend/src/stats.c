@@ -0,0 +1,79 @@
+#include "stats.h"
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+const char *const export_stage_names[EXPORT_STAGE_COUNT] = {
+    [EXPORT_STAGE_MATERIAL_REMAP] = "material_remap",
+    [EXPORT_STAGE_SPLIT] = "split",
+    [EXPORT_STAGE_VERTEX_REMAP] = "vertex_remap",
+    [EXPORT_STAGE_OPTIMIZE_VERTEX_CACHE] = "optimize_vertex_cache",
+    [EXPORT_STAGE_BATCHING] = "batching",
+    [EXPORT_STAGE_DRAW_ORDER] = "draw_order",
+    [EXPORT_STAGE_TEXT_EMISSION] = "text_emission",
+    [EXPORT_STAGE_COLLISION_BUILD] = "collision_build",
+};
+
+const char *const export_counter_names[EXPORT_COUNTER_COUNT] = {
+    [EXPORT_COUNTER_VERTICES_IN] = "vertices_in",
+    [EXPORT_COUNTER_VERTICES_OUT] = "vertices_out",
+    [EXPORT_COUNTER_VERTEX_LOADS] = "vertex_loads",
+    [EXPORT_COUNTER_TRIANGLES] = "triangles",
+    [EXPORT_COUNTER_BYTES_WRITTEN] = "bytes_written",
+};
+
+static struct ExportStats stats; // protected by stats_lock
+
+#ifdef _WIN32
+static SRWLOCK stats_lock = SRWLOCK_INIT;
+#define STATS_LOCK() AcquireSRWLockExclusive(&stats_lock)
+#define STATS_UNLOCK() ReleaseSRWLockExclusive(&stats_lock)
+#else
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#define STATS_LOCK() pthread_mutex_lock(&stats_lock)
+#define STATS_UNLOCK() pthread_mutex_unlock(&stats_lock)
+#endif
+
+double stats_now(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+void stats_add_stage_time(enum export_stage stage, double start) {
+    double elapsed = stats_now() - start;
+    STATS_LOCK();
+    stats.stage_seconds[stage] += elapsed;
+    STATS_UNLOCK();
+}
+
+void stats_add_counter(enum export_counter counter, unsigned long long n) {
+    STATS_LOCK();
+    stats.counters[counter] += n;
+    STATS_UNLOCK();
+}
+
+void stats_get(struct ExportStats *out) {
+    STATS_LOCK();
+    *out = stats;
+    STATS_UNLOCK();
+}
+
+void stats_reset(void) {
+    STATS_LOCK();
+    memset(&stats, 0, sizeof(stats));
+    STATS_UNLOCK();
+}
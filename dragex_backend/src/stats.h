@@ -0,0 +1,52 @@
+#ifndef DRAGEX_BACKEND_STATS_H
+#define DRAGEX_BACKEND_STATS_H
+
+/**
+ * Process-wide export statistics, for finding where a slow export spends its
+ * time. All functions are thread-safe.
+ *
+ * Stage times are summed over all threads, so with several workers they can
+ * add up to more than the wall-clock time of the export.
+ */
+
+enum export_stage {
+    EXPORT_STAGE_MATERIAL_REMAP,
+    EXPORT_STAGE_SPLIT,
+    EXPORT_STAGE_VERTEX_REMAP,
+    EXPORT_STAGE_OPTIMIZE_VERTEX_CACHE,
+    EXPORT_STAGE_BATCHING,
+    EXPORT_STAGE_DRAW_ORDER,
+    EXPORT_STAGE_TEXT_EMISSION,
+    EXPORT_STAGE_COLLISION_BUILD,
+    EXPORT_STAGE_COUNT
+};
+
+enum export_counter {
+    // display list vertices before and after merging identical ones
+    EXPORT_COUNTER_VERTICES_IN,
+    EXPORT_COUNTER_VERTICES_OUT,
+    EXPORT_COUNTER_VERTEX_LOADS, // gsSPVertex
+    EXPORT_COUNTER_TRIANGLES,
+    EXPORT_COUNTER_BYTES_WRITTEN,
+    EXPORT_COUNTER_COUNT
+};
+
+struct ExportStats {
+    double stage_seconds[EXPORT_STAGE_COUNT];
+    unsigned long long counters[EXPORT_COUNTER_COUNT];
+};
+
+extern const char *const export_stage_names[EXPORT_STAGE_COUNT];
+extern const char *const export_counter_names[EXPORT_COUNTER_COUNT];
+
+/** Monotonic time in seconds, for measuring durations */
+double stats_now(void);
+
+/** Add the time elapsed since start (from stats_now) to stage */
+void stats_add_stage_time(enum export_stage stage, double start);
+void stats_add_counter(enum export_counter counter, unsigned long long n);
+
+void stats_get(struct ExportStats *out);
+void stats_reset(void);
+
+#endif
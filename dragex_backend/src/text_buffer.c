@@ -0,0 +1,160 @@
+#include "text_buffer.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "logging/logging.h"
+#include "stats.h"
+
+void text_buffer_init(struct TextBuffer *tb) {
+    tb->data = NULL;
+    tb->len = 0;
+    tb->capacity = 0;
+    tb->error = false;
+}
+
+void text_buffer_free(struct TextBuffer *tb) {
+    free(tb->data);
+    text_buffer_init(tb);
+}
+
+// Make room for at least n more bytes (plus a terminating '\0')
+static bool text_buffer_reserve(struct TextBuffer *tb, size_t n) {
+    if (tb->error)
+        return false;
+    if (tb->len + n + 1 <= tb->capacity)
+        return true;
+
+    size_t new_capacity = tb->capacity == 0 ? 4096 : tb->capacity;
+    while (tb->len + n + 1 > new_capacity)
+        new_capacity *= 2;
+
+    char *new_data = realloc(tb->data, new_capacity);
+    if (new_data == NULL) {
+        log_error("realloc failed (new_capacity=%zu)", new_capacity);
+        tb->error = true;
+        return false;
+    }
+    tb->data = new_data;
+    tb->capacity = new_capacity;
+    return true;
+}
+
+void text_buffer_append(struct TextBuffer *tb, const char *data, size_t len) {
+    if (!text_buffer_reserve(tb, len))
+        return;
+    memcpy(tb->data + tb->len, data, len);
+    tb->len += len;
+    tb->data[tb->len] = '\0';
+}
+
+void bprintf(struct TextBuffer *tb, const char *format, ...) {
+    if (tb->error)
+        return;
+
+    va_list ap;
+
+    // try printing directly into the free space, if any
+    size_t available = tb->capacity - tb->len;
+    va_start(ap, format);
+    int n = vsnprintf(available == 0 ? NULL : tb->data + tb->len, available,
+                      format, ap);
+    va_end(ap);
+
+    if (n < 0) {
+        log_error("vsnprintf error");
+        tb->error = true;
+        return;
+    }
+
+    if ((size_t)n >= available) {
+        // did not fit, grow and print again
+        if (!text_buffer_reserve(tb, n))
+            return;
+        va_start(ap, format);
+        vsnprintf(tb->data + tb->len, n + 1, format, ap);
+        va_end(ap);
+    }
+
+    tb->len += n;
+}
+
+void bputs(struct TextBuffer *b, const char *s) {
+    text_buffer_append(b, s, strlen(s));
+}
+
+void bput_int(struct TextBuffer *b, long v) {
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    // negate as unsigned to handle LONG_MIN
+    unsigned long u = v < 0 ? 0ul - (unsigned long)v : (unsigned long)v;
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    if (v < 0)
+        *--p = '-';
+    text_buffer_append(b, p, digits + sizeof(digits) - p);
+}
+
+void bput_uint(struct TextBuffer *b, unsigned long v) {
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    do {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    text_buffer_append(b, p, digits + sizeof(digits) - p);
+}
+
+void bput_hex(struct TextBuffer *b, unsigned long v, int min_digits) {
+    static const char hex_digits[] = "0123456789ABCDEF";
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    do {
+        *--p = hex_digits[v & 0xF];
+        v >>= 4;
+        min_digits--;
+    } while (v != 0 || (min_digits > 0 && p > digits));
+    text_buffer_append(b, p, digits + sizeof(digits) - p);
+}
+
+// Limit the size of individual writes, _write takes an unsigned int size
+#define TEXT_BUFFER_WRITE_CHUNK_SIZE (1 << 24)
+
+int text_buffer_write_to_fd(struct TextBuffer *tb, int fd) {
+    if (tb->error) {
+        log_error("buffer is in error");
+        return -1;
+    }
+
+    size_t offset = 0;
+    while (offset < tb->len) {
+        size_t n = tb->len - offset;
+        if (n > TEXT_BUFFER_WRITE_CHUNK_SIZE)
+            n = TEXT_BUFFER_WRITE_CHUNK_SIZE;
+#ifdef _WIN32
+        int res = _write(fd, tb->data + offset, (unsigned int)n);
+#else
+        ssize_t res = write(fd, tb->data + offset, n);
+#endif
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("write failed: %s", strerror(errno));
+            return -2;
+        }
+        offset += (size_t)res;
+    }
+    stats_add_counter(EXPORT_COUNTER_BYTES_WRITTEN, tb->len);
+    return 0;
+}
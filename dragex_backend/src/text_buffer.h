@@ -0,0 +1,49 @@
+#ifndef DRAGEX_BACKEND_TEXT_BUFFER_H
+#define DRAGEX_BACKEND_TEXT_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#if !defined(__GNUC__) && !defined(__attribute__)
+#define __attribute__(x)
+#endif
+
+/**
+ * Growable in-memory text output, used instead of writing directly to a FILE
+ * so output can be produced out of order (e.g. by several threads) and
+ * written later in large blocks.
+ *
+ * bprintf can format anything but parses its format string on every call, hot
+ * loops should prefer bputs and the bput_* integer formatting functions.
+ */
+struct TextBuffer {
+    char *data;
+    size_t len, capacity;
+    // set if an allocation failed, the content is then incomplete
+    bool error;
+};
+
+void text_buffer_init(struct TextBuffer *tb);
+void text_buffer_free(struct TextBuffer *tb);
+
+void text_buffer_append(struct TextBuffer *tb, const char *data, size_t len);
+
+/** fprintf, but to a TextBuffer */
+__attribute__((format(printf, 2, 3))) void bprintf(struct TextBuffer *b,
+                                                   const char *format, ...);
+
+void bputs(struct TextBuffer *b, const char *s);
+/** Same as "%ld" */
+void bput_int(struct TextBuffer *b, long v);
+/** Same as "%lu" */
+void bput_uint(struct TextBuffer *b, unsigned long v);
+/** Same as "%0*lX" with min_digits for the field width */
+void bput_hex(struct TextBuffer *b, unsigned long v, int min_digits);
+
+/**
+ * Write the contents of the buffer to the file descriptor fd.
+ * Returns 0 on success, non-zero if the buffer is in error or writing failed.
+ */
+int text_buffer_write_to_fd(struct TextBuffer *tb, int fd);
+
+#endif
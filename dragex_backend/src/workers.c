@@ -0,0 +1,141 @@
+#include "workers.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "logging/logging.h"
+
+#define WORKERS_MAX_THREADS 64
+
+struct workers_ctx {
+    workers_job_fn job;
+    void *arg;
+    size_t n_jobs;
+    size_t next_job; // protected by mutex
+#ifdef _WIN32
+    CRITICAL_SECTION mutex;
+#else
+    pthread_mutex_t mutex;
+#endif
+};
+
+static bool workers_claim_job(struct workers_ctx *ctx, size_t *i_job) {
+    bool claimed;
+#ifdef _WIN32
+    EnterCriticalSection(&ctx->mutex);
+#else
+    pthread_mutex_lock(&ctx->mutex);
+#endif
+    claimed = ctx->next_job < ctx->n_jobs;
+    if (claimed)
+        *i_job = ctx->next_job++;
+#ifdef _WIN32
+    LeaveCriticalSection(&ctx->mutex);
+#else
+    pthread_mutex_unlock(&ctx->mutex);
+#endif
+    return claimed;
+}
+
+static void workers_work(struct workers_ctx *ctx) {
+    size_t i_job;
+    while (workers_claim_job(ctx, &i_job))
+        ctx->job(ctx->arg, i_job);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI workers_thread_main(LPVOID ctx) {
+    workers_work(ctx);
+    return 0;
+}
+#else
+static void *workers_thread_main(void *ctx) {
+    workers_work(ctx);
+    return NULL;
+}
+#endif
+
+static size_t workers_get_n_processors(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : (size_t)n;
+#endif
+}
+
+void workers_run(size_t n_jobs, workers_job_fn job, void *arg) {
+    size_t n_threads = workers_get_n_processors();
+    if (n_threads > n_jobs)
+        n_threads = n_jobs;
+    if (n_threads > WORKERS_MAX_THREADS)
+        n_threads = WORKERS_MAX_THREADS;
+
+    if (n_threads <= 1) {
+        for (size_t i_job = 0; i_job < n_jobs; i_job++)
+            job(arg, i_job);
+        return;
+    }
+
+    struct workers_ctx ctx;
+    ctx.job = job;
+    ctx.arg = arg;
+    ctx.n_jobs = n_jobs;
+    ctx.next_job = 0;
+
+    // The calling thread also works, and if creating a thread fails the jobs
+    // simply get spread over fewer threads.
+#ifdef _WIN32
+    InitializeCriticalSection(&ctx.mutex);
+
+    HANDLE threads[WORKERS_MAX_THREADS];
+    size_t n_started = 0;
+    for (size_t i = 0; i + 1 < n_threads; i++) {
+        threads[n_started] =
+            CreateThread(NULL, 0, workers_thread_main, &ctx, 0, NULL);
+        if (threads[n_started] == NULL) {
+            log_warn("CreateThread failed");
+            break;
+        }
+        n_started++;
+    }
+
+    workers_work(&ctx);
+
+    for (size_t i = 0; i < n_started; i++) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+
+    DeleteCriticalSection(&ctx.mutex);
+#else
+    pthread_mutex_init(&ctx.mutex, NULL);
+
+    pthread_t threads[WORKERS_MAX_THREADS];
+    size_t n_started = 0;
+    for (size_t i = 0; i + 1 < n_threads; i++) {
+        if (pthread_create(&threads[n_started], NULL, workers_thread_main,
+                           &ctx) != 0) {
+            log_warn("pthread_create failed");
+            break;
+        }
+        n_started++;
+    }
+
+    workers_work(&ctx);
+
+    for (size_t i = 0; i < n_started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&ctx.mutex);
+#endif
+}
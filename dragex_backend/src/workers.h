@@ -0,0 +1,18 @@
+#ifndef DRAGEX_BACKEND_WORKERS_H
+#define DRAGEX_BACKEND_WORKERS_H
+
+#include <stddef.h>
+
+typedef void (*workers_job_fn)(void *arg, size_t i_job);
+
+/**
+ * Run job(arg, i_job) for every i_job in [0, n_jobs), spreading the jobs over
+ * up to one thread per processor (the calling thread included).
+ * Returns once all jobs are done.
+ *
+ * Jobs are started in increasing i_job order but may finish in any order, so
+ * jobs should write their results to per-job storage.
+ */
+void workers_run(size_t n_jobs, workers_job_fn job, void *arg);
+
+#endif